@@ -38,6 +38,10 @@ volatile pid_t mplayer_pid = 0;
 
 char *mplayer_last_file = NULL;
 
+/* Commands are small; collect them in a fixed buffer rather than
+ * allocating on the way of each one. */
+char response_buf[4096];
+
 
 void
 arg_help(char *argv0)
@@ -205,42 +209,45 @@ main(int argc, char *argv[])
 	signal(SIGCHLD, handle_sigchld);
 
 
-	/* Initialize PubNub. */
+	/* Initialize PubNub. Commands come over a context of their own,
+	 * so that the status messages published meanwhile do not get in
+	 * the way of the next subscribe. */
 
 	struct pubnub_sync *sync = pubnub_sync_init();
 	struct pubnub *p = pubnub_init("demo", "demo", &pubnub_sync_callbacks, sync);
 
+	struct pubnub_sync *cmd_sync = pubnub_sync_init();
+	struct pubnub *cmd = pubnub_init("demo", "demo", &pubnub_sync_callbacks, cmd_sync);
+	pubnub_set_response_buffer(cmd, response_buf, sizeof(response_buf));
+
 
 	/* Advertise. */
 
 	send_status(p, sync);
 
 
-	/* Command loop. */
+	/* Command loop. The connection is kept alive and the subscribe
+	 * for the next commands goes out (from within
+	 * pubnub_sync_next_message()) before we get to the current ones,
+	 * so its round trip overlaps with taking care of them. */
+
+	pubnub_subscribe(cmd, "rpi_mplayer_cmd", -1, NULL, NULL);
+	if (pubnub_sync_last_result(cmd_sync) != PNR_OK)
+		exit(EXIT_FAILURE);
 
 	do {
-		pubnub_subscribe(p, "rpi_mplayer_cmd", -1, NULL, NULL);
-		if (pubnub_sync_last_result(sync) != PNR_OK)
+		struct json_object *msg;
+		if (pubnub_sync_next_message(cmd, cmd_sync, -1, NULL, &msg, NULL) != PNR_OK)
 			exit(EXIT_FAILURE);
 
-		struct json_object *msg = pubnub_sync_last_response(sync);
-		if (json_object_array_length(msg) == 0) {
-			printf("pubnub subscribe ok, no news\n");
-		} else {
-			for (int i = 0; i < json_object_array_length(msg); i++) {
-				struct json_object *msg1 = json_object_array_get_idx(msg, i);
-				printf("pubnub subscribe got msg: %s\n", json_object_get_string(msg1));
-				process_message(p, sync, msg1);
-			}
-		}
-
-		json_object_put(msg);
-		sleep(1);
+		printf("pubnub subscribe got msg: %s\n", json_object_get_string(msg));
+		process_message(p, sync, msg);
 	} while (1);
 
 
 	/* We should never reach this. */
 
+	pubnub_done(cmd);
 	pubnub_done(p);
 	return EXIT_SUCCESS;
 }
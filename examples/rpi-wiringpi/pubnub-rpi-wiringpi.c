@@ -25,6 +25,13 @@ int rpi_id;
 enum pin_type { PIN_OFF, PIN_READ, PIN_WRITE } pins[32];
 #define pins_n (sizeof(pins) / sizeof(pins[0]))
 
+/* Commands are small; collect them in a fixed buffer rather than
+ * allocating on the way of each one. */
+char response_buf[4096];
+
+/* When the first byte of the current command arrived. */
+struct timespec cmd_start;
+
 
 void
 arg_help(char *argv0)
@@ -64,6 +71,21 @@ publish(struct pubnub *p, struct pubnub_sync *sync, const char *channel, json_ob
 }
 
 
+void
+first_byte(struct pubnub *p, const char *method, void *cb_data)
+{
+	clock_gettime(CLOCK_MONOTONIC, &cmd_start);
+}
+
+long
+cmd_elapsed_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - cmd_start.tv_sec) * 1000000 + (now.tv_nsec - cmd_start.tv_nsec) / 1000;
+}
+
+
 void
 pong(struct pubnub *p, struct pubnub_sync *sync)
 {
@@ -102,6 +124,7 @@ process_message(struct pubnub *p, struct pubnub_sync *sync, json_object *msg)
 				continue;
 			/* Set the pin, physically! */
 			digitalWrite(pin_num, !!json_object_get_int(pinval));
+			printf("pin %d set %ld us after the command arrived\n", pin_num, cmd_elapsed_us());
 			/* Store in the reply. */
 			json_object_object_add(reply_pins, pin, pinval);
 		}
@@ -175,42 +198,46 @@ main(int argc, char *argv[])
 	}
 
 
-	/* Initialize PubNub. */
+	/* Initialize PubNub. Commands come over a context of their own,
+	 * so that the replies published meanwhile do not get in the way
+	 * of the next subscribe. */
 
 	struct pubnub_sync *sync = pubnub_sync_init();
 	struct pubnub *p = pubnub_init("demo", "demo", &pubnub_sync_callbacks, sync);
 
+	struct pubnub_sync *cmd_sync = pubnub_sync_init();
+	struct pubnub *cmd = pubnub_init("demo", "demo", &pubnub_sync_callbacks, cmd_sync);
+	pubnub_set_response_buffer(cmd, response_buf, sizeof(response_buf));
+	pubnub_set_first_byte_cb(cmd, first_byte, NULL);
+
 
 	/* Advertise. */
 
 	pong(p, sync);
 
 
-	/* Command loop. */
+	/* Command loop. The connection is kept alive and the subscribe
+	 * for the next commands goes out (from within
+	 * pubnub_sync_next_message()) before we get to the current ones,
+	 * so its round trip overlaps with taking care of them. */
+
+	pubnub_subscribe(cmd, "rpi_wiringpi_cmd", 300, NULL, NULL);
+	if (pubnub_sync_last_result(cmd_sync) != PNR_OK)
+		exit(EXIT_FAILURE);
 
 	do {
-		pubnub_subscribe(p, "rpi_wiringpi_cmd", 300, NULL, NULL);
-		if (pubnub_sync_last_result(sync) != PNR_OK)
+		struct json_object *msg;
+		if (pubnub_sync_next_message(cmd, cmd_sync, 300, NULL, &msg, NULL) != PNR_OK)
 			exit(EXIT_FAILURE);
 
-		struct json_object *msg = pubnub_sync_last_response(sync);
-		if (json_object_array_length(msg) == 0) {
-			printf("pubnub subscribe ok, no news\n");
-		} else {
-			for (int i = 0; i < json_object_array_length(msg); i++) {
-				struct json_object *msg1 = json_object_array_get_idx(msg, i);
-				printf("pubnub subscribe got msg: %s\n", json_object_get_string(msg1));
-				process_message(p, sync, msg1);
-			}
-		}
-
-		json_object_put(msg);
-		sleep(1);
+		printf("pubnub subscribe got msg: %s\n", json_object_get_string(msg));
+		process_message(p, sync, msg);
 	} while (1);
 
 
 	/* We should never reach this. */
 
+	pubnub_done(cmd);
 	pubnub_done(p);
 	return EXIT_SUCCESS;
 }
@@ -18,6 +18,52 @@ PubNub_sync_reply::PubNub_sync_reply(enum pubnub_res res_, json_object *resp_, s
 	 * already bumped by pubnub_sync_last_response(). */
 }
 
+PUBNUB_API
+PubNub_sync_reply::PubNub_sync_reply(const PubNub_sync_reply &other)
+	: res(other.res), resp(other.resp), ch(other.ch)
+{
+	if (resp)
+		json_object_get(resp);
+}
+
+PUBNUB_API
+PubNub_sync_reply &
+PubNub_sync_reply::operator=(const PubNub_sync_reply &other)
+{
+	if (other.resp)
+		json_object_get(other.resp);
+	if (resp)
+		json_object_put(resp);
+	res = other.res;
+	resp = other.resp;
+	ch = other.ch;
+	return *this;
+}
+
+#if __cplusplus >= 201103L
+PUBNUB_API
+PubNub_sync_reply::PubNub_sync_reply(PubNub_sync_reply &&other)
+	: res(other.res), resp(other.resp), ch(std::move(other.ch))
+{
+	other.resp = NULL;
+}
+
+PUBNUB_API
+PubNub_sync_reply &
+PubNub_sync_reply::operator=(PubNub_sync_reply &&other)
+{
+	if (this != &other) {
+		if (resp)
+			json_object_put(resp);
+		res = other.res;
+		resp = other.resp;
+		ch = std::move(other.ch);
+		other.resp = NULL;
+	}
+	return *this;
+}
+#endif
+
 PUBNUB_API
 PubNub_sync_reply::~PubNub_sync_reply()
 {
@@ -11,6 +11,13 @@ public:
 	 * this constructor is meant to be used just by the factory
 	 * function pubnub_sync_last_reply(). */
 	PubNub_sync_reply(enum pubnub_res res_, json_object *resp_, std::vector<std::string> &ch_);
+	/* Copies share the response object. */
+	PubNub_sync_reply(const PubNub_sync_reply &other);
+	PubNub_sync_reply &operator=(const PubNub_sync_reply &other);
+#if __cplusplus >= 201103L
+	PubNub_sync_reply(PubNub_sync_reply &&other);
+	PubNub_sync_reply &operator=(PubNub_sync_reply &&other);
+#endif
 	~PubNub_sync_reply();
 
 	/* Return result of the last issued method. Always check whether
@@ -32,8 +39,9 @@ public:
 
 	/* Return names of the channels carrying the messages returned by the last
 	 * subscribe method call. The subscribe call returns array of messages,
-	 * corresponding items in this array are the respective channel names. */
-	std::vector<std::string> channels() const { return ch; };
+	 * corresponding items in this array are the respective channel names.
+	 * The reference is valid as long as the PubNub_sync_reply instance. */
+	const std::vector<std::string> &channels() const { return ch; };
 
 protected:
 	enum pubnub_res res;
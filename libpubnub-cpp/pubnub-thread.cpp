@@ -0,0 +1,273 @@
+#include <string>
+#include <vector>
+
+#include <json.h>
+
+#include "pubnub.hpp"
+#include "pubnub-sync.hpp"
+#include "pubnub-thread.hpp"
+#include "pubnub.h"
+#include "pubnub-epoll.h"
+#include "pubnub-priv.h"
+
+
+/* A request handed over to the I/O thread. */
+struct PubNub_thread::call {
+	enum kind { PUBLISH, HISTORY, HERE_NOW, TIME, SUBSCRIBE, UNSUBSCRIBE, STOP };
+
+	call(PubNub_thread *t_, enum kind kind_)
+		: t(t_), kind(kind_), limit(0), timeout(-1), p(NULL)
+	{ }
+
+	PubNub_thread *t;
+	enum kind kind;
+	std::string channel;
+	int limit;
+	long timeout;
+	subscribe_handler handler;
+	std::promise<PubNub_sync_reply> promise;
+	/* The context running the call, if it is one of the idle ones. */
+	struct pubnub *p;
+};
+
+
+/** PubNub_thread lifetime */
+
+PUBNUB_API
+PubNub_thread::PubNub_thread(const std::string &publish_key, const std::string &subscribe_key)
+	: config_own(true)
+{
+	start(pubnub_config_new(publish_key.c_str(), subscribe_key.c_str()));
+}
+
+PUBNUB_API
+PubNub_thread::PubNub_thread(struct pubnub_config *config_)
+	: config_own(false)
+{
+	start(config_);
+}
+
+PUBNUB_API
+void
+PubNub_thread::start(struct pubnub_config *config_)
+{
+	config = config_;
+	subscribing = false;
+	ep = pubnub_epoll_init();
+	pool = pubnub_pool_init(&pubnub_epoll_callbacks, ep);
+	ctx = pubnub_init_config(config, pool, NULL, NULL);
+	pubnub_submit_init(ctx);
+	thread = std::thread(pubnub_epoll_run, ep);
+}
+
+PUBNUB_API
+PubNub_thread::~PubNub_thread()
+{
+	pubnub_submit_call(ctx, run_call, drop_call, new call(this, call::STOP));
+	thread.join();
+	/* This cancels the calls in progress and those queued after
+	 * the stop (see drop_call()). */
+	pubnub_pool_done(pool);
+	pubnub_epoll_free(ep);
+	if (config_own)
+		pubnub_config_done(config);
+}
+
+
+/** I/O thread side */
+
+PUBNUB_API
+struct pubnub *
+PubNub_thread::take_context()
+{
+	if (idle.empty())
+		return pubnub_init_config(config, pool, NULL, NULL);
+	struct pubnub *p = idle.back();
+	idle.pop_back();
+	return p;
+}
+
+PUBNUB_API
+void
+PubNub_thread::run_call(struct pubnub *p, void *data)
+{
+	call *c = (call *)data;
+	PubNub_thread *t = c->t;
+
+	switch (c->kind) {
+	case call::HISTORY:
+		c->p = t->take_context();
+		pubnub_history(c->p, c->channel.c_str(), c->limit, c->timeout, reply_cb, c);
+		break;
+	case call::HERE_NOW:
+		c->p = t->take_context();
+		pubnub_here_now(c->p, c->channel.c_str(), c->timeout, reply_cb, c);
+		break;
+	case call::TIME:
+		c->p = t->take_context();
+		pubnub_time(c->p, c->timeout, reply_cb, c);
+		break;
+	case call::SUBSCRIBE: {
+		bool known = t->handlers.count(c->channel) > 0;
+		t->handlers[c->channel] = c->handler;
+		if (!known || !t->subscribing) {
+			/* A new channel cancels the ongoing subscribe,
+			 * which then does not resubscribe. */
+			const char *channels[] = { c->channel.c_str() };
+			t->subscribing = true;
+			pubnub_subscribe_const(t->ctx, channels, 1, -1, subscribe_cb, t);
+		}
+		delete c;
+		break;
+	}
+	case call::UNSUBSCRIBE:
+		if (t->handlers.erase(c->channel)) {
+			const char *channels[] = { c->channel.c_str() };
+			pubnub_unsubscribe(t->ctx, channels, 1, -1, NULL, NULL);
+			if (t->handlers.empty())
+				t->subscribing = false;
+		}
+		delete c;
+		break;
+	case call::STOP:
+		pubnub_epoll_break(t->ep);
+		delete c;
+		break;
+	case call::PUBLISH:
+		/* Goes through pubnub_publish_submit() instead. */
+		break;
+	}
+}
+
+/* A call the I/O thread did not get to before stopping. */
+PUBNUB_API
+void
+PubNub_thread::drop_call(void *data)
+{
+	call *c = (call *)data;
+	switch (c->kind) {
+	case call::HISTORY:
+	case call::HERE_NOW:
+	case call::TIME: {
+		std::vector<std::string> ch;
+		c->promise.set_value(PubNub_sync_reply(PNR_CANCELLED, NULL, ch));
+		break;
+	}
+	default:
+		break;
+	}
+	delete c;
+}
+
+PUBNUB_API
+void
+PubNub_thread::reply_cb(struct pubnub *p, enum pubnub_res result, json_object *response, void *ctx_data, void *call_data)
+{
+	call *c = (call *)call_data;
+	/* json-c objects are not thread-safe; the reply gets a copy
+	 * of its own instead of sharing a reference with us. */
+	json_object *copy = response ? json_tokener_parse(json_object_to_json_string(response)) : NULL;
+	std::vector<std::string> ch;
+	c->promise.set_value(PubNub_sync_reply(result, copy, ch));
+	if (c->p)
+		c->t->idle.push_back(c->p);
+	delete c;
+}
+
+PUBNUB_API
+void
+PubNub_thread::subscribe_cb(struct pubnub *p, enum pubnub_res result, const char *const *channels, json_object *response, void *ctx_data, void *call_data)
+{
+	PubNub_thread *t = (PubNub_thread *)call_data;
+
+	if (result == PNR_CANCELLED) {
+		/* Superseded by a subscribe to a new channel, an
+		 * unsubscribe from the last one or the shutdown. */
+		return;
+	}
+	if (result != PNR_OK) {
+		t->subscribing = false;
+		std::map<std::string, subscribe_handler>::iterator i;
+		for (i = t->handlers.begin(); i != t->handlers.end(); ++i)
+			i->second(result, i->first, NULL);
+		return;
+	}
+
+	for (int i = 0; i < (int) json_object_array_length(response); i++) {
+		std::map<std::string, subscribe_handler>::iterator h = t->handlers.find(channels[i]);
+		if (h != t->handlers.end())
+			h->second(PNR_OK, h->first, json_object_array_get_idx(response, i));
+	}
+	pubnub_subscribe_const(t->ctx, NULL, 0, -1, subscribe_cb, t);
+}
+
+
+/** PubNub_thread API */
+
+PUBNUB_API
+std::future<PubNub_sync_reply>
+PubNub_thread::submit(call *c)
+{
+	std::future<PubNub_sync_reply> f = c->promise.get_future();
+	pubnub_submit_call(ctx, run_call, drop_call, c);
+	return f;
+}
+
+PUBNUB_API
+std::future<PubNub_sync_reply>
+PubNub_thread::publish(const std::string &channel, json_object &message, long timeout)
+{
+	call *c = new call(this, call::PUBLISH);
+	std::future<PubNub_sync_reply> f = c->promise.get_future();
+	pubnub_publish_submit(ctx, channel.c_str(), &message, timeout, reply_cb, c);
+	return f;
+}
+
+PUBNUB_API
+std::future<PubNub_sync_reply>
+PubNub_thread::history(const std::string &channel, int limit, long timeout)
+{
+	call *c = new call(this, call::HISTORY);
+	c->channel = channel;
+	c->limit = limit;
+	c->timeout = timeout;
+	return submit(c);
+}
+
+PUBNUB_API
+std::future<PubNub_sync_reply>
+PubNub_thread::here_now(const std::string &channel, long timeout)
+{
+	call *c = new call(this, call::HERE_NOW);
+	c->channel = channel;
+	c->timeout = timeout;
+	return submit(c);
+}
+
+PUBNUB_API
+std::future<PubNub_sync_reply>
+PubNub_thread::time(long timeout)
+{
+	call *c = new call(this, call::TIME);
+	c->timeout = timeout;
+	return submit(c);
+}
+
+PUBNUB_API
+void
+PubNub_thread::subscribe(const std::string &channel, subscribe_handler handler)
+{
+	call *c = new call(this, call::SUBSCRIBE);
+	c->channel = channel;
+	c->handler = handler;
+	pubnub_submit_call(ctx, run_call, drop_call, c);
+}
+
+PUBNUB_API
+void
+PubNub_thread::unsubscribe(const std::string &channel)
+{
+	call *c = new call(this, call::UNSUBSCRIBE);
+	c->channel = channel;
+	pubnub_submit_call(ctx, run_call, drop_call, c);
+}
@@ -0,0 +1,90 @@
+#ifndef PUBNUB__PubNub_thread_hpp
+#define PUBNUB__PubNub_thread_hpp
+
+#include <functional>
+#include <future>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pubnub.hpp>
+#include <pubnub-sync.hpp>
+
+struct pubnub_epoll;
+
+/* A PubNub client with its own I/O thread running a pubnub_epoll event
+ * loop.  Unlike with the other classes, its methods may be called from
+ * any number of threads at once, never block and do not need any
+ * context management: the replies come as futures of the familiar
+ * PubNub_sync_reply, and calls that cannot share a context get one of
+ * their own, taken from a pool growing as needed.  The response in
+ * a reply is owned by the reply alone and may be used on any thread.
+ *
+ * This requires C++11 and the epoll (or kqueue) frontend. */
+class PubNub_thread {
+public:
+	/* Handler of the messages received on a subscribed channel, or of
+	 * a subscribe error (@message is NULL then).  It is called on the
+	 * I/O thread and @message is valid only during the call. */
+	typedef std::function<void(enum pubnub_res result, const std::string &channel, json_object *message)> subscribe_handler;
+
+	/* Start the I/O thread and the context pool; see pubnub_init().
+	 * With @config, the contexts reference that configuration; see
+	 * pubnub_init_config().  It must stay around until the object is
+	 * destroyed. */
+	PubNub_thread(const std::string &publish_key, const std::string &subscribe_key);
+	PubNub_thread(struct pubnub_config *config);
+
+	/* Stop the I/O thread and free the contexts; calls still in
+	 * progress or queued get PNR_CANCELLED.  No other thread may be
+	 * calling a method at that point. */
+	~PubNub_thread();
+
+	/* Publish @message on @channel; see pubnub_publish_submit().
+	 * @message is serialized before the call returns. */
+	std::future<PubNub_sync_reply> publish(const std::string &channel, json_object &message, long timeout = -1);
+
+	/* See pubnub_history(), pubnub_here_now() and pubnub_time(). */
+	std::future<PubNub_sync_reply> history(const std::string &channel, int limit, long timeout = -1);
+	std::future<PubNub_sync_reply> here_now(const std::string &channel, long timeout = -1);
+	std::future<PubNub_sync_reply> time(long timeout = -1);
+
+	/* Subscribe to @channel, feeding its messages to @handler until
+	 * unsubscribe(); subscribing again replaces the handler.  A
+	 * subscribe error is reported to the handlers of all channels and
+	 * ends the stream of messages until the next subscribe(). */
+	void subscribe(const std::string &channel, subscribe_handler handler);
+	void unsubscribe(const std::string &channel);
+
+private:
+	struct call;
+
+	void start(struct pubnub_config *config);
+	struct pubnub *take_context();
+	std::future<PubNub_sync_reply> submit(call *c);
+
+	static void run_call(struct pubnub *p, void *data);
+	static void drop_call(void *data);
+	static void reply_cb(struct pubnub *p, enum pubnub_res result, json_object *response, void *ctx_data, void *call_data);
+	static void subscribe_cb(struct pubnub *p, enum pubnub_res result, const char *const *channels, json_object *response, void *ctx_data, void *call_data);
+
+	struct pubnub_config *config;
+	bool config_own;
+	struct pubnub_epoll *ep;
+	struct pubnub_pool *pool;
+
+	/* Subscribes and publishes go through this one. */
+	struct pubnub *ctx;
+
+	/* Everything below is touched only by the I/O thread. */
+
+	/* The other contexts not running a call right now. */
+	std::vector<struct pubnub *> idle;
+	std::map<std::string, subscribe_handler> handlers;
+	bool subscribing;
+
+	std::thread thread;
+};
+
+#endif
@@ -19,6 +19,22 @@ PubNub::PubNub(const std::string &publish_key, const std::string &subscribe_key,
 	p_autodestroy = true;
 }
 
+PUBNUB_API
+PubNub::PubNub(struct pubnub_pool *pool, const std::string &publish_key,
+	const std::string &subscribe_key)
+{
+	p = pubnub_init_pooled(pool, publish_key.c_str(), subscribe_key.c_str());
+	p_autodestroy = true;
+}
+
+PUBNUB_API
+PubNub::PubNub(struct pubnub_config *config, struct pubnub_pool *pool,
+	const struct pubnub_callbacks *cb, void *cb_data)
+{
+	p = pubnub_init_config(config, pool, cb, cb_data);
+	p_autodestroy = true;
+}
+
 PUBNUB_API
 PubNub::PubNub(struct pubnub *p_, bool p_autodestroy_)
 	: p(p_), p_autodestroy(p_autodestroy_)
@@ -48,6 +64,13 @@ PubNub::set_cipher_key(const std::string &cipher_key)
 	pubnub_set_cipher_key(p, cipher_key.c_str());
 }
 
+PUBNUB_API
+void
+PubNub::set_decrypt_workers(struct pubnub_workers *w, int min_batch)
+{
+	pubnub_set_decrypt_workers(p, w, min_batch);
+}
+
 PUBNUB_API
 void
 PubNub::set_origin(const std::string &origin)
@@ -76,6 +99,62 @@ PubNub::set_nosignal(bool nosignal)
 	pubnub_set_nosignal(p, nosignal);
 }
 
+PUBNUB_API
+void
+PubNub::set_keepalive(bool keepalive)
+{
+	pubnub_set_keepalive(p, keepalive);
+}
+
+PUBNUB_API
+void
+PubNub::set_http2(bool http2)
+{
+	pubnub_set_http2(p, http2);
+}
+
+PUBNUB_API
+void
+PubNub::prewarm(bool connect)
+{
+	pubnub_prewarm(p, connect);
+}
+
+PUBNUB_API
+void
+PubNub::set_incremental_parse(bool incremental)
+{
+	pubnub_set_incremental_parse(p, incremental);
+}
+
+PUBNUB_API
+void
+PubNub::set_compression(bool compress)
+{
+	pubnub_set_compression(p, compress);
+}
+
+PUBNUB_API
+void
+PubNub::set_response_limits(size_t max_size, size_t keep_size)
+{
+	pubnub_set_response_limits(p, max_size, keep_size);
+}
+
+PUBNUB_API
+void
+PubNub::set_response_buffer(char *buf, size_t size)
+{
+	pubnub_set_response_buffer(p, buf, size);
+}
+
+PUBNUB_API
+void
+PubNub::set_first_byte_cb(pubnub_first_byte_cb cb, void *cb_data)
+{
+	pubnub_set_first_byte_cb(p, cb, cb_data);
+}
+
 PUBNUB_API
 void
 PubNub::error_policy(unsigned int retry_mask, bool print)
@@ -83,6 +162,76 @@ PubNub::error_policy(unsigned int retry_mask, bool print)
 	pubnub_error_policy(p, retry_mask, print);
 }
 
+PUBNUB_API
+void
+PubNub::set_retry_backoff(long base_ms, long max_ms, int max_attempts)
+{
+	pubnub_set_retry_backoff(p, base_ms, max_ms, max_attempts);
+}
+
+PUBNUB_API
+void
+PubNub::set_circuit_breaker(int threshold, long cooldown_ms)
+{
+	pubnub_set_circuit_breaker(p, threshold, cooldown_ms);
+}
+
+PUBNUB_API
+void
+PubNub::set_subscribe_batching(long window_ms, int max_msgs)
+{
+	pubnub_set_subscribe_batching(p, window_ms, max_msgs);
+}
+
+PUBNUB_API
+void
+PubNub::set_subscribe_dedupe(int window)
+{
+	pubnub_set_subscribe_dedupe(p, window);
+}
+
+PUBNUB_API
+void
+PubNub::set_subscribe_backlog(int high, int low)
+{
+	pubnub_set_subscribe_backlog(p, high, low);
+}
+
+PUBNUB_API
+void
+PubNub::subscribe_consumed(int n)
+{
+	pubnub_subscribe_consumed(p, n);
+}
+
+PUBNUB_API
+void
+PubNub::set_stats(bool enable, pubnub_stats_cb cb, void *cb_data)
+{
+	pubnub_set_stats(p, enable, cb, cb_data);
+}
+
+PUBNUB_API
+void
+PubNub::get_stats(struct pubnub_stats *stats)
+{
+	pubnub_get_stats(p, stats);
+}
+
+PUBNUB_API
+void
+PubNub::reset_stats()
+{
+	pubnub_reset_stats(p);
+}
+
+PUBNUB_API
+void
+PubNub::set_allocator(const struct pubnub_allocator *alloc, void *alloc_data)
+{
+	pubnub_set_allocator(p, alloc, alloc_data);
+}
+
 
 /** PubNub API */
 
@@ -121,6 +270,80 @@ PubNub::publish(const std::string &channel, json_object &message,
 	}
 }
 
+PUBNUB_API
+void
+PubNub::publish_raw(const std::string &channel, const char *message, size_t message_len,
+		long timeout, PubNub_publish_cb cb, void *cb_data)
+{
+	if (cb) {
+		publish_pair *cb_info = new publish_pair(std::pair<PubNub_publish_cb, PubNub *>(cb, this), cb_data);
+		pubnub_publish_raw(p, channel.c_str(), message, message_len, timeout, pubnub_cpp_publish_cb, cb_info);
+	} else {
+		pubnub_publish_raw(p, channel.c_str(), message, message_len, timeout, NULL, NULL);
+	}
+}
+
+PUBNUB_API
+void
+PubNub::publish_enqueue(const std::string &channel, json_object &message,
+		long timeout, PubNub_publish_cb cb, void *cb_data)
+{
+	if (cb) {
+		publish_pair *cb_info = new publish_pair(std::pair<PubNub_publish_cb, PubNub *>(cb, this), cb_data);
+		pubnub_publish_enqueue(p, channel.c_str(), &message, timeout, pubnub_cpp_publish_cb, cb_info);
+	} else {
+		pubnub_publish_enqueue(p, channel.c_str(), &message, timeout, NULL, NULL);
+	}
+}
+
+PUBNUB_API
+bool
+PubNub::submit_init()
+{
+	return pubnub_submit_init(p);
+}
+
+PUBNUB_API
+void
+PubNub::publish_submit(const std::string &channel, json_object &message,
+		long timeout, PubNub_publish_cb cb, void *cb_data)
+{
+	if (cb) {
+		publish_pair *cb_info = new publish_pair(std::pair<PubNub_publish_cb, PubNub *>(cb, this), cb_data);
+		pubnub_publish_submit(p, channel.c_str(), &message, timeout, pubnub_cpp_publish_cb, cb_info);
+	} else {
+		pubnub_publish_submit(p, channel.c_str(), &message, timeout, NULL, NULL);
+	}
+}
+
+PUBNUB_API
+void
+PubNub::set_publish_concurrency(int max_inflight)
+{
+	pubnub_set_publish_concurrency(p, max_inflight);
+}
+
+PUBNUB_API
+void
+PubNub::set_publish_rate(double rate, int burst)
+{
+	pubnub_set_publish_rate(p, rate, burst);
+}
+
+PUBNUB_API
+int
+PubNub::publish_queue_depth()
+{
+	return pubnub_publish_queue_depth(p);
+}
+
+PUBNUB_API
+void
+PubNub::set_publish_queue_limit(int max_depth)
+{
+	pubnub_set_publish_queue_limit(p, max_depth);
+}
+
 
 /** PubNub API subscribe */
 
@@ -180,6 +403,51 @@ PubNub::subscribe_multi(const std::vector<std::string> &channels,
 	free(ch);
 }
 
+PUBNUB_API
+PubNub_messages::PubNub_messages(const char *const *channels_, json_object *response_)
+	: channels(channels_), resp(response_), n(0)
+{
+	if (channels && resp && json_object_is_type(resp, json_type_array))
+		n = json_object_array_length(resp);
+}
+
+typedef std::pair<std::pair<PubNub_subscribe_const_cb, PubNub *>, void *> subscribe_const_pair;
+
+static void
+pubnub_cpp_subscribe_const_cb(struct pubnub *p, enum pubnub_res result, const char *const *channels, struct json_object *response, void *ctx_data, void *call_data)
+{
+	subscribe_const_pair *cb_info = (subscribe_const_pair *) call_data;
+	PubNub_messages messages(channels, response);
+	cb_info->first.first(*cb_info->first.second, result, messages, ctx_data, cb_info->second);
+	delete cb_info;
+}
+
+PUBNUB_API
+void
+PubNub::subscribe_const(const std::string &channel,
+		long timeout, PubNub_subscribe_const_cb cb, void *cb_data)
+{
+	const char *ch[] = { channel.c_str() };
+	subscribe_const_pair *cb_info = new subscribe_const_pair(std::pair<PubNub_subscribe_const_cb, PubNub *>(cb, this), cb_data);
+	pubnub_subscribe_const(p, ch, 1, timeout, pubnub_cpp_subscribe_const_cb, cb_info);
+}
+
+PUBNUB_API
+void
+PubNub::subscribe_multi_const(const std::vector<std::string> &channels,
+		long timeout, PubNub_subscribe_const_cb cb, void *cb_data)
+{
+	const char **ch = (const char **) malloc(channels.size() * sizeof(ch[0]));
+	for (unsigned int i = 0; i < channels.size(); i++) {
+		ch[i] = channels[i].c_str();
+	}
+
+	subscribe_const_pair *cb_info = new subscribe_const_pair(std::pair<PubNub_subscribe_const_cb, PubNub *>(cb, this), cb_data);
+	pubnub_subscribe_const(p, ch, channels.size(), timeout, pubnub_cpp_subscribe_const_cb, cb_info);
+
+	free(ch);
+}
+
 
 /** PubNub API history */
 
@@ -219,6 +487,25 @@ PubNub::history_ex(const std::string &channel, int limit, bool include_token,
 	}
 }
 
+/* Called for every page; the last call has no page or an error. */
+static void
+pubnub_cpp_history_scan_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+	history_pair *cb_info = (history_pair *) call_data;
+	cb_info->first.first(*cb_info->first.second, result, response, ctx_data, cb_info->second);
+	if (result != PNR_OK || !response)
+		delete cb_info;
+}
+
+PUBNUB_API
+void
+PubNub::history_scan(const std::string &channel, const std::string &start, const std::string &end,
+		int lanes, long timeout, PubNub_history_cb cb, void *cb_data)
+{
+	history_pair *cb_info = new history_pair(std::pair<PubNub_history_cb, PubNub *>(cb, this), cb_data);
+	pubnub_history_scan(p, channel.c_str(), start.c_str(), end.c_str(), lanes, timeout, pubnub_cpp_history_scan_cb, cb_info);
+}
+
 
 /** PubNub API here_now */
 
@@ -245,6 +532,13 @@ PubNub::here_now(const std::string &channel,
 	}
 }
 
+PUBNUB_API
+void
+PubNub::set_presence_cache(long ttl_ms)
+{
+	pubnub_set_presence_cache(p, ttl_ms);
+}
+
 
 /** PubNub API time */
 
@@ -269,3 +563,17 @@ PubNub::time(long timeout, PubNub_time_cb cb, void *cb_data)
 		pubnub_time(p, timeout, NULL, NULL);
 	}
 }
+
+PUBNUB_API
+long long
+PubNub::now()
+{
+	return pubnub_now(p);
+}
+
+PUBNUB_API
+void
+PubNub::set_clock_sync(long refresh_ms)
+{
+	pubnub_set_clock_sync(p, refresh_ms);
+}
@@ -3,6 +3,9 @@
 
 #include <string>
 #include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 #include <json.h>
 
@@ -32,12 +35,42 @@ typedef void (*PubNub_history_cb)(PubNub &p, enum pubnub_res result, json_object
 typedef void (*PubNub_here_now_cb)(PubNub &p, enum pubnub_res result, json_object *response, void *ctx_data, void *call_data);
 typedef void (*PubNub_time_cb)(PubNub &p, enum pubnub_res result, json_object *response, void *ctx_data, void *call_data);
 
+/* The messages of a subscribe response, as passed to the callback of
+ * subscribe_const().  This is a view of the library's own response
+ * and channel names, valid only during the callback; nothing is copied
+ * (use json_object_get() on a message to keep it). */
+class PubNub_messages {
+public:
+	PubNub_messages(const char *const *channels_, json_object *response_);
+
+	/* The number of messages; 0 unless the result is PNR_OK. */
+	size_t size() const { return n; }
+	json_object *message(size_t i) const { return json_object_array_get_idx(resp, i); }
+	/* The channel whose message @i is. */
+	const char *channel(size_t i) const { return channels[i]; }
+#if __cplusplus >= 201703L
+	std::string_view channel_view(size_t i) const { return channels[i]; }
+#endif
+
+	/* The whole response; an array of the messages for PNR_OK,
+	 * otherwise see pubnub.h. */
+	json_object *response() const { return resp; }
+
+protected:
+	const char *const *channels;
+	json_object *resp;
+	size_t n;
+};
+
+typedef void (*PubNub_subscribe_const_cb)(PubNub &p, enum pubnub_res result, const PubNub_messages &messages, void *ctx_data, void *call_data);
+
 
 /* Only one method may operate on a single context at once - this means
  * that if a subscribe is in progress, you cannot publish in the same
  * context; either wait or use multiple contexts. If the same context
  * is used in multiple threads, the application must ensure locking to
- * prevent improper concurrent access. */
+ * prevent improper concurrent access; publish_submit() is the one
+ * method that may be called from any thread. */
 
 class PubNub {
 public:
@@ -68,6 +101,16 @@ public:
 	PubNub(const std::string &publish_key, const std::string &subscribe_key,
 		const struct pubnub_callbacks *cb, void *cb_data);
 
+	/* Initialize the PubNub context as a part of the @pool;
+	 * see pubnub_init_pooled() for details. */
+	PubNub(struct pubnub_pool *pool, const std::string &publish_key,
+		const std::string &subscribe_key);
+
+	/* Initialize the PubNub context referencing the shared @config;
+	 * see pubnub_init_config() for details. */
+	PubNub(struct pubnub_config *config, struct pubnub_pool *pool,
+		const struct pubnub_callbacks *cb = NULL, void *cb_data = NULL);
+
 	/* You can also create a PubNub wrapper class from an existing pubnub
 	 * context. @p_autodestroy determines whether PubNub destructor will
 	 * call pubnub_done(p). */
@@ -87,6 +130,10 @@ public:
 	 * cipher key is optional. */
 	void set_cipher_key(const std::string &cipher_key);
 
+	/* Decrypt batches of at least @min_batch messages with the @w
+	 * worker threads; see pubnub_set_decrypt_workers() for details. */
+	void set_decrypt_workers(struct pubnub_workers *w, int min_batch);
+
 	/* Set the origin server name. By default, http://pubsub.pubnub.com/
 	 * is used. */
 	void set_origin(const std::string &origin);
@@ -113,6 +160,36 @@ public:
 	 * handlers and won't be thread safe */
 	void set_nosignal(bool nosignal);
 
+	/* Select whether the HTTP connection is kept alive across requests
+	 * (DEFAULT true); see pubnub_set_keepalive() for details. */
+	void set_keepalive(bool keepalive);
+
+	/* Select whether requests use HTTP/2 (DEFAULT false); see
+	 * pubnub_set_http2() for details. */
+	void set_http2(bool http2);
+
+	/* Resolve the origin in the background and optionally open
+	 * a connection to it; see pubnub_prewarm() for details. */
+	void prewarm(bool connect = false);
+
+	/* Select whether responses are parsed as they arrive (DEFAULT
+	 * false); see pubnub_set_incremental_parse() for details. */
+	void set_incremental_parse(bool incremental);
+
+	/* Select whether responses may come compressed (DEFAULT false);
+	 * see pubnub_set_compression() for details. */
+	void set_compression(bool compress);
+
+	/* Limit the response size and set the buffer high-water mark;
+	 * see pubnub_set_response_limits(). */
+	void set_response_limits(size_t max_size, size_t keep_size = 64 * 1024);
+
+	/* Collect the responses in a fixed buffer of the caller and get
+	 * called back at their first byte; see pubnub_set_response_buffer()
+	 * and pubnub_set_first_byte_cb(). */
+	void set_response_buffer(char *buf, size_t size);
+	void set_first_byte_cb(pubnub_first_byte_cb cb, void *cb_data = NULL);
+
 	/* Set PubNub error retry policy regarding error handling.
 	 *
 	 * The call may be retried if the error is possibly recoverable
@@ -142,6 +219,33 @@ public:
 	 * retry for whatever reason. */
 	void error_policy(unsigned int retry_mask, bool print);
 
+	/* Set the retry backoff and the circuit breaker; see
+	 * pubnub_set_retry_backoff() and pubnub_set_circuit_breaker(). */
+	void set_retry_backoff(long base_ms, long max_ms, int max_attempts = 0);
+	void set_circuit_breaker(int threshold, long cooldown_ms);
+
+	/* Batch up the subscribe callbacks; see
+	 * pubnub_set_subscribe_batching(). */
+	void set_subscribe_batching(long window_ms, int max_msgs = 0);
+
+	/* Drop duplicate subscribe messages; see
+	 * pubnub_set_subscribe_dedupe(). */
+	void set_subscribe_dedupe(int window);
+
+	/* Hold the subscribe back for a slow consumer; see
+	 * pubnub_set_subscribe_backlog(). */
+	void set_subscribe_backlog(int high, int low);
+	void subscribe_consumed(int n);
+
+	/* Collect request statistics; see pubnub_set_stats(). */
+	void set_stats(bool enable, pubnub_stats_cb cb = NULL, void *cb_data = NULL);
+	void get_stats(struct pubnub_stats *stats);
+	void reset_stats();
+
+	/* Route the context's own allocations through @alloc; see
+	 * pubnub_set_allocator(). */
+	void set_allocator(const struct pubnub_allocator *alloc, void *alloc_data = NULL);
+
 
 	/** PubNub API requests */
 
@@ -166,6 +270,42 @@ public:
 	void publish(const std::string &channel, json_object &message,
 			long timeout = -1, PubNub_publish_cb cb = NULL, void *cb_data = NULL);
 
+	/* Publish the @message_len bytes of already serialized JSON
+	 * @message on @channel; see pubnub_publish_raw() for details. */
+	void publish_raw(const std::string &channel, const char *message, size_t message_len,
+			long timeout = -1, PubNub_publish_cb cb = NULL, void *cb_data = NULL);
+#if __cplusplus >= 201703L
+	void publish_raw(const std::string &channel, std::string_view message,
+			long timeout = -1, PubNub_publish_cb cb = NULL, void *cb_data = NULL)
+		{ publish_raw(channel, message.data(), message.size(), timeout, cb, cb_data); }
+#endif
+
+	/* Queue the @message JSON object for publishing on @channel;
+	 * see pubnub_publish_enqueue() for details. */
+	void publish_enqueue(const std::string &channel, json_object &message,
+			long timeout = -1, PubNub_publish_cb cb = NULL, void *cb_data = NULL);
+
+	/* Prepare for publish_submit(); see pubnub_submit_init()
+	 * for details. */
+	bool submit_init();
+
+	/* Queue the @message JSON object for publishing on @channel from
+	 * any thread; see pubnub_publish_submit() for details. */
+	void publish_submit(const std::string &channel, json_object &message,
+			long timeout = -1, PubNub_publish_cb cb = NULL, void *cb_data = NULL);
+
+	/* Set how many queued messages may be in flight at once;
+	 * see pubnub_set_publish_concurrency() for details. */
+	void set_publish_concurrency(int max_inflight);
+
+	/* Limit the rate of the queued messages, and the depth of the
+	 * queue; see pubnub_set_publish_rate(),
+	 * pubnub_publish_queue_depth() and
+	 * pubnub_set_publish_queue_limit() for details. */
+	void set_publish_rate(double rate, int burst);
+	int publish_queue_depth();
+	void set_publish_queue_limit(int max_depth);
+
 	/* Subscribe to @channel. The response will be a JSON array with
 	 * one received message per item.
 	 *
@@ -183,6 +323,15 @@ public:
 	void subscribe_multi(const std::vector<std::string> &channels,
 			long timeout = -1, PubNub_subscribe_cb cb = NULL, void *cb_data = NULL);
 
+	/* Like subscribe() and subscribe_multi(), but passing the messages
+	 * to @cb as a PubNub_messages view instead of copying the channel
+	 * names; see pubnub_subscribe_const().  There is no frontend
+	 * default callback for these. */
+	void subscribe_const(const std::string &channel,
+			long timeout, PubNub_subscribe_const_cb cb, void *cb_data = NULL);
+	void subscribe_multi_const(const std::vector<std::string> &channels,
+			long timeout, PubNub_subscribe_const_cb cb, void *cb_data = NULL);
+
 	/* List the last @limit messages that appeared on a @channel.
 	 * You do not need to be subscribed to the channel. The response
 	 * will be a JSON array with one message per item. */
@@ -194,18 +343,32 @@ public:
 	void history_ex(const std::string &channel, int limit, bool include_token,
 			long timeout = -1, PubNub_history_cb cb = NULL, void *cb_data = NULL);
 
+	/* Fetch the messages between the @start and @end timetokens page
+	 * by page, @lanes pages at once; see pubnub_history_scan(). */
+	void history_scan(const std::string &channel, const std::string &start, const std::string &end,
+			int lanes, long timeout, PubNub_history_cb cb, void *cb_data = NULL);
+
 	/* List the clients subscribed to @channel. The response will be
 	 * a JSON object with attributes "occupancy" (number of clients)
 	 * and "uuids" (array of client UUIDs). */
 	void here_now(const std::string &channel,
 			long timeout = -1, PubNub_here_now_cb cb = NULL, void *cb_data = NULL);
 
+	/* Answer here_now queries from a presence cache; see
+	 * pubnub_set_presence_cache(). */
+	void set_presence_cache(long ttl_ms);
+
 	/* Retrieve the server timestamp (number of microseconds since
 	 * 1970-01-01), stored as JSON value in the response. You can use
 	 * this as a sort of "ping" message e.g. to estimate network lag,
 	 * or if you do not trust the system time. */
 	void time(long timeout = -1, PubNub_time_cb cb = NULL, void *cb_data = NULL);
 
+	/* Estimated server time in ns; see pubnub_now() and
+	 * pubnub_set_clock_sync(). */
+	long long now();
+	void set_clock_sync(long refresh_ms);
+
 protected:
 	struct pubnub *p;
 	bool p_autodestroy;
@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PUBNUB_BASE64_NEON
+#endif
+
+#include "base64.h"
+
+/* The vector paths are selected at compile time (e.g. -mssse3 or
+ * -march=native on x86, -mfpu=neon on 32-bit ARM; always on AArch64)
+ * and fall back to the scalar code for the tails and on anything that
+ * is not plain base64 alphabet. */
+
+static const char pubnub_base64_alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const signed char pubnub_base64_values[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/* Both vector paths map 6-bit values to the alphabet arithmetically:
+ * 'A' + v, +6 past 'Z', -75 past 'z', and the two odd ones out. */
+
+#if defined(__SSSE3__)
+
+static inline __m128i
+pubnub_base64_sse_chars(__m128i v)
+{
+	__m128i c = _mm_add_epi8(v, _mm_set1_epi8('A'));
+	c = _mm_add_epi8(c, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(25)), _mm_set1_epi8(6)));
+	c = _mm_sub_epi8(c, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(51)), _mm_set1_epi8(75)));
+	c = _mm_sub_epi8(c, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(62)), _mm_set1_epi8(15)));
+	c = _mm_sub_epi8(c, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(63)), _mm_set1_epi8(12)));
+	return c;
+}
+
+/* Encode 12 bytes (reading 16) to 16 characters. */
+static inline void
+pubnub_base64_sse_encode(char *dst, const unsigned char *src)
+{
+	__m128i in = _mm_loadu_si128((const __m128i *) src);
+	/* Each 32-bit lane gets bytes b, a, c, b of one 3-byte group... */
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	/* ...so that the four 6-bit fields can be shifted in place
+	 * by 16-bit multiplications. */
+	__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+	__m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+	_mm_storeu_si128((__m128i *) dst, pubnub_base64_sse_chars(_mm_or_si128(t0, t1)));
+}
+
+static inline __m128i
+pubnub_base64_sse_range(__m128i c, char lo, char hi)
+{
+	return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)), _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), c));
+}
+
+/* Decode 16 characters to 12 bytes (writing 16).  Returns 0 if any of
+ * the characters is not in the alphabet, leaving it to the scalar code. */
+static inline int
+pubnub_base64_sse_decode(unsigned char *dst, const unsigned char *src)
+{
+	__m128i c = _mm_loadu_si128((const __m128i *) src);
+	__m128i upper = pubnub_base64_sse_range(c, 'A', 'Z');
+	__m128i lower = pubnub_base64_sse_range(c, 'a', 'z');
+	__m128i digit = pubnub_base64_sse_range(c, '0', '9');
+	__m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+	__m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+	__m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+	if (_mm_movemask_epi8(valid) != 0xffff)
+		return 0;
+
+	__m128i shift = _mm_or_si128(
+		_mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-65)), _mm_and_si128(lower, _mm_set1_epi8(-71))),
+		_mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(4)),
+			_mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(19)), _mm_and_si128(slash, _mm_set1_epi8(16)))));
+	__m128i v = _mm_add_epi8(c, shift);
+
+	/* Merge pairs of 6-bit values to 12-bit ones, then those to 24-bit
+	 * ones and pick their bytes in big-endian order. */
+	v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+	v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+	v = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	_mm_storeu_si128((__m128i *) dst, v);
+	return 1;
+}
+
+#elif defined(PUBNUB_BASE64_NEON)
+
+static inline uint8x16_t
+pubnub_base64_neon_chars(uint8x16_t v)
+{
+	uint8x16_t c = vaddq_u8(v, vdupq_n_u8('A'));
+	c = vaddq_u8(c, vandq_u8(vcgtq_u8(v, vdupq_n_u8(25)), vdupq_n_u8(6)));
+	c = vsubq_u8(c, vandq_u8(vcgtq_u8(v, vdupq_n_u8(51)), vdupq_n_u8(75)));
+	c = vsubq_u8(c, vandq_u8(vceqq_u8(v, vdupq_n_u8(62)), vdupq_n_u8(15)));
+	c = vsubq_u8(c, vandq_u8(vceqq_u8(v, vdupq_n_u8(63)), vdupq_n_u8(12)));
+	return c;
+}
+
+/* Encode 48 bytes to 64 characters. */
+static inline void
+pubnub_base64_neon_encode(char *dst, const unsigned char *src)
+{
+	uint8x16x3_t in = vld3q_u8(src);
+	uint8x16x4_t out;
+	out.val[0] = vshrq_n_u8(in.val[0], 2);
+	out.val[1] = vorrq_u8(vandq_u8(vshlq_n_u8(in.val[0], 4), vdupq_n_u8(0x30)), vshrq_n_u8(in.val[1], 4));
+	out.val[2] = vorrq_u8(vandq_u8(vshlq_n_u8(in.val[1], 2), vdupq_n_u8(0x3c)), vshrq_n_u8(in.val[2], 6));
+	out.val[3] = vandq_u8(in.val[2], vdupq_n_u8(0x3f));
+	for (int i = 0; i < 4; i++)
+		out.val[i] = pubnub_base64_neon_chars(out.val[i]);
+	vst4q_u8((uint8_t *) dst, out);
+}
+
+/* Translate characters to 6-bit values; characters out of the alphabet
+ * get their lane in @valid cleared. */
+static inline uint8x16_t
+pubnub_base64_neon_values(uint8x16_t c, uint8x16_t *valid)
+{
+	uint8x16_t upper = vandq_u8(vcgeq_u8(c, vdupq_n_u8('A')), vcleq_u8(c, vdupq_n_u8('Z')));
+	uint8x16_t lower = vandq_u8(vcgeq_u8(c, vdupq_n_u8('a')), vcleq_u8(c, vdupq_n_u8('z')));
+	uint8x16_t digit = vandq_u8(vcgeq_u8(c, vdupq_n_u8('0')), vcleq_u8(c, vdupq_n_u8('9')));
+	uint8x16_t plus = vceqq_u8(c, vdupq_n_u8('+'));
+	uint8x16_t slash = vceqq_u8(c, vdupq_n_u8('/'));
+	*valid = vandq_u8(*valid, vorrq_u8(vorrq_u8(upper, lower), vorrq_u8(digit, vorrq_u8(plus, slash))));
+
+	uint8x16_t shift = vorrq_u8(
+		vorrq_u8(vandq_u8(upper, vdupq_n_u8((uint8_t) -65)), vandq_u8(lower, vdupq_n_u8((uint8_t) -71))),
+		vorrq_u8(vandq_u8(digit, vdupq_n_u8(4)),
+			vorrq_u8(vandq_u8(plus, vdupq_n_u8(19)), vandq_u8(slash, vdupq_n_u8(16)))));
+	return vaddq_u8(c, shift);
+}
+
+/* Decode 64 characters to 48 bytes.  Returns 0 if any of the characters
+ * is not in the alphabet, leaving it to the scalar code. */
+static inline int
+pubnub_base64_neon_decode(unsigned char *dst, const unsigned char *src)
+{
+	uint8x16x4_t in = vld4q_u8(src);
+	uint8x16_t valid = vdupq_n_u8(0xff);
+	for (int i = 0; i < 4; i++)
+		in.val[i] = pubnub_base64_neon_values(in.val[i], &valid);
+	uint8x8_t valid8 = vand_u8(vget_low_u8(valid), vget_high_u8(valid));
+	if (vget_lane_u64(vreinterpret_u64_u8(valid8), 0) != ~(uint64_t) 0)
+		return 0;
+
+	uint8x16x3_t out;
+	out.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+	out.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+	out.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+	vst3q_u8(dst, out);
+	return 1;
+}
+
+#endif
+
+size_t
+pubnub_base64_encode(char *dst, const unsigned char *src, size_t len)
+{
+	char *out = dst;
+	size_t i = 0;
+
+#if defined(__SSSE3__)
+	/* The loads are 16 bytes wide. */
+	for (; len - i >= 16; i += 12, out += 16)
+		pubnub_base64_sse_encode(out, src + i);
+#elif defined(PUBNUB_BASE64_NEON)
+	for (; len - i >= 48; i += 48, out += 64)
+		pubnub_base64_neon_encode(out, src + i);
+#endif
+
+	for (; len - i >= 3; i += 3, out += 4) {
+		unsigned v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+		out[0] = pubnub_base64_alphabet[v >> 18];
+		out[1] = pubnub_base64_alphabet[(v >> 12) & 0x3f];
+		out[2] = pubnub_base64_alphabet[(v >> 6) & 0x3f];
+		out[3] = pubnub_base64_alphabet[v & 0x3f];
+	}
+	if (len - i > 0) {
+		unsigned v = src[i] << 16;
+		if (len - i > 1)
+			v |= src[i + 1] << 8;
+		out[0] = pubnub_base64_alphabet[v >> 18];
+		out[1] = pubnub_base64_alphabet[(v >> 12) & 0x3f];
+		out[2] = len - i > 1 ? pubnub_base64_alphabet[(v >> 6) & 0x3f] : '=';
+		out[3] = '=';
+		out += 4;
+	}
+	*out = 0;
+	return out - dst;
+}
+
+long
+pubnub_base64_decode(unsigned char *dst, const char *src_str, size_t len)
+{
+	const unsigned char *src = (const unsigned char *) src_str;
+	unsigned char *out = dst;
+	size_t i = 0;
+
+	/* Strip the padding; we also accept text without it. */
+	if (len >= 4 && len % 4 == 0 && src[len - 1] == '=') {
+		len--;
+		if (src[len - 1] == '=')
+			len--;
+	}
+
+#if defined(__SSSE3__)
+	/* The stores are 16 bytes wide; with at least 24 characters left
+	 * there are at least that many bytes left to decode. */
+	for (; len - i >= 24; i += 16, out += 12) {
+		if (!pubnub_base64_sse_decode(out, src + i))
+			break;
+	}
+#elif defined(PUBNUB_BASE64_NEON)
+	for (; len - i >= 64; i += 64, out += 48) {
+		if (!pubnub_base64_neon_decode(out, src + i))
+			break;
+	}
+#endif
+
+	for (; len - i >= 4; i += 4, out += 3) {
+		int a = pubnub_base64_values[src[i]], b = pubnub_base64_values[src[i + 1]];
+		int c = pubnub_base64_values[src[i + 2]], d = pubnub_base64_values[src[i + 3]];
+		if ((a | b | c | d) < 0)
+			return -1;
+		unsigned v = (a << 18) | (b << 12) | (c << 6) | d;
+		out[0] = v >> 16;
+		out[1] = v >> 8;
+		out[2] = v;
+	}
+	switch (len - i) {
+	case 0:
+		break;
+	case 1:
+		return -1;
+	default: {
+		int a = pubnub_base64_values[src[i]], b = pubnub_base64_values[src[i + 1]];
+		int c = len - i > 2 ? pubnub_base64_values[src[i + 2]] : 0;
+		if ((a | b | c) < 0)
+			return -1;
+		unsigned v = (a << 18) | (b << 12) | (c << 6);
+		*out++ = v >> 16;
+		if (len - i > 2)
+			*out++ = v >> 8;
+		break;
+	}
+	}
+	return out - dst;
+}
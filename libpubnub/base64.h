@@ -0,0 +1,21 @@
+#ifndef PUBNUB__base64_h
+#define PUBNUB__base64_h
+
+#include <stddef.h>
+
+/* Length of the base64 text encoding @len bytes (without the NUL). */
+#define PUBNUB_BASE64_ENCODED_LEN(len) (((len) + 2) / 3 * 4)
+/* Upper bound of the number of bytes decoded from @len characters. */
+#define PUBNUB_BASE64_DECODED_MAX(len) ((len) / 4 * 3 + 3)
+
+/* Encode @len bytes of @src to @dst, which must have room for
+ * PUBNUB_BASE64_ENCODED_LEN(len) + 1 characters; the text is padded
+ * and NUL-terminated.  Returns the text length. */
+size_t pubnub_base64_encode(char *dst, const unsigned char *src, size_t len);
+
+/* Decode @len characters of padded base64 text at @src to @dst, which
+ * must have room for PUBNUB_BASE64_DECODED_MAX(len) bytes.  Returns
+ * the number of decoded bytes, or -1 if @src is not valid base64. */
+long pubnub_base64_decode(unsigned char *dst, const char *src, size_t len);
+
+#endif
@@ -1,46 +1,84 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 #include <json.h>
 
 #include <openssl/evp.h>
-#include <openssl/bio.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
+#include "base64.h"
 #include "crypto.h"
 #include "pubnub-priv.h"
 
-char *
-pubnub_signature(struct pubnub *p, const char *channel, const char *message_str)
+/* MD5 state after hashing the key prefix of the signed string. */
+static void
+pubnub_signature_prefix(struct pubnub *p, MD5_CTX *md5)
 {
-	MD5_CTX md5;
-	MD5_Init(&md5);
-	MD5_Update(&md5, p->publish_key, strlen(p->publish_key));
-	MD5_Update(&md5, "/", 1);
-	MD5_Update(&md5, p->subscribe_key, strlen(p->subscribe_key));
-	MD5_Update(&md5, "/", 1);
-	MD5_Update(&md5, p->secret_key, strlen(p->secret_key));
-	MD5_Update(&md5, "/", 1);
-	MD5_Update(&md5, channel, strlen(channel));
-	MD5_Update(&md5, "/", 1);
-	MD5_Update(&md5, message_str, strlen(message_str));
-	MD5_Update(&md5, "" /* \0 */, 1);
+	MD5_Init(md5);
+	MD5_Update(md5, p->publish_key, strlen(p->publish_key));
+	MD5_Update(md5, "/", 1);
+	MD5_Update(md5, p->subscribe_key, strlen(p->subscribe_key));
+	MD5_Update(md5, "/", 1);
+	MD5_Update(md5, p->secret_key, strlen(p->secret_key));
+	MD5_Update(md5, "/", 1);
+}
+
+static void
+pubnub_signature_finish(MD5_CTX *md5, const char *channel, const char *message, size_t message_len, char signature[33])
+{
+	static const char hex[] = "0123456789abcdef";
+
+	MD5_Update(md5, channel, strlen(channel));
+	MD5_Update(md5, "/", 1);
+	MD5_Update(md5, message, message_len);
+	MD5_Update(md5, "" /* \0 */, 1);
 
 	unsigned char digest[16];
-	MD5_Final(digest, &md5);
+	MD5_Final(digest, md5);
 
-	char *signature = (char*)malloc(33);
 	for (int i = 0; i < 16; i++) {
-		snprintf(&signature[i * 2], 3, "%02x", digest[i]);
+		signature[i * 2] = hex[digest[i] >> 4];
+		signature[i * 2 + 1] = hex[digest[i] & 0xf];
 	}
-	/* The snprintf() in the last iteration implicitly
-	 * NUL-terminates signature[]. */
+	signature[32] = 0;
+}
 
+char *
+pubnub_signature(struct pubnub *p, const char *channel, const char *message_str)
+{
+	MD5_CTX md5;
+	pubnub_signature_prefix(p, &md5);
+
+	char *signature = (char*)malloc(33);
+	pubnub_signature_finish(&md5, channel, message_str, strlen(message_str), signature);
 	return signature;
 }
 
+void
+pubnub_signature_buf(struct pubnub *p, const char *channel, const char *message_str, char signature[33])
+{
+	pubnub_signature_buf_len(p, channel, message_str, strlen(message_str), signature);
+}
+
+void
+pubnub_signature_buf_len(struct pubnub *p, const char *channel, const char *message, size_t message_len, char signature[33])
+{
+	/* The key prefix is hashed just once and its state copied
+	 * for each message; pubnub_set_secret_key() drops it. */
+	if (!p->sig_prefix) {
+		p->sig_prefix = (MD5_CTX *)malloc(sizeof(*p->sig_prefix));
+		pubnub_signature_prefix(p, p->sig_prefix);
+	}
+	MD5_CTX md5 = *p->sig_prefix;
+	pubnub_signature_finish(&md5, channel, message, message_len, signature);
+}
+
 
 /* PubNub follows an *ahem* specific procedure when preprocessing
  * the cipher key. */
@@ -60,129 +98,172 @@ pubnub_sha256_cipher_key(const char *cipher_key, unsigned char cipher_hash[33])
 	return cipher_hash;
 }
 
-struct json_object *
-pubnub_encrypt(const char *cipher_key, const char *message_str)
-{
-	unsigned char iv[] = "0123456789012345";
+/* The cipher state derived from a cipher key, kept for the lifetime of
+ * the key so that we do not re-hash the key and redo the AES key schedule
+ * for each message; only the IV is reset between messages. */
+struct pubnub_cipher {
+	unsigned char cipher_hash[33];
+	EVP_CIPHER_CTX *enc, *dec;
+	/* Scratch buffer for the binary data of a message. */
+	unsigned char *buf;
+	int buf_size;
+};
 
-	/* Pre-process (hash) encryption key */
+static const unsigned char pubnub_cipher_iv[] = "0123456789012345";
+
+static struct pubnub_cipher *
+pubnub_cipher_new_hash(const unsigned char cipher_hash[33])
+{
+	struct pubnub_cipher *c = (struct pubnub_cipher *)calloc(1, sizeof(*c));
+	memcpy(c->cipher_hash, cipher_hash, sizeof(c->cipher_hash));
+
+	c->enc = EVP_CIPHER_CTX_new();
+	c->dec = EVP_CIPHER_CTX_new();
+	if (!c->enc || !c->dec
+	    || !EVP_EncryptInit_ex(c->enc, EVP_aes_256_cbc(), NULL, c->cipher_hash, pubnub_cipher_iv)
+	    || !EVP_DecryptInit_ex(c->dec, EVP_aes_256_cbc(), NULL, c->cipher_hash, pubnub_cipher_iv)) {
+		DBGMSG("CipherInit error\n");
+		pubnub_cipher_free(c);
+		return NULL;
+	}
+	return c;
+}
 
+struct pubnub_cipher *
+pubnub_cipher_new(const char *cipher_key)
+{
 	unsigned char cipher_hash[33];
 	pubnub_sha256_cipher_key(cipher_key, cipher_hash);
+	return pubnub_cipher_new_hash(cipher_hash);
+}
+
+void
+pubnub_cipher_free(struct pubnub_cipher *c)
+{
+	if (!c)
+		return;
+	if (c->enc)
+		EVP_CIPHER_CTX_free(c->enc);
+	if (c->dec)
+		EVP_CIPHER_CTX_free(c->dec);
+	free(c->buf);
+	free(c);
+}
+
+static unsigned char *
+pubnub_cipher_buf(struct pubnub_cipher *c, int size)
+{
+	if (c->buf_size < size) {
+		free(c->buf);
+		c->buf = (unsigned char*)malloc(size);
+		c->buf_size = size;
+	}
+	return c->buf;
+}
+
+const char *
+pubnub_cipher_encrypt_str(struct pubnub_cipher *c, const char *message, size_t message_len, size_t *str_len)
+{
+	if (!c)
+		return NULL;
 
 	/* Encrypt the message */
 
-	EVP_CIPHER_CTX aes256;
-	EVP_CIPHER_CTX_init(&aes256);
-	if (!EVP_EncryptInit_ex(&aes256, EVP_aes_256_cbc(), NULL, cipher_hash, iv)) {
+	if (!EVP_EncryptInit_ex(c->enc, NULL, NULL, NULL, pubnub_cipher_iv)) {
 		DBGMSG("EncryptInit error\n");
 		return NULL;
 	}
 
-	int message_len = strlen(message_str);
-	unsigned char *cipher_data = (unsigned char*)malloc(message_len + EVP_CIPHER_block_size(EVP_aes_256_cbc()));
+	int cipher_max = message_len + EVP_CIPHER_block_size(EVP_aes_256_cbc());
+	/* The quoted base64 text goes to the same buffer, right after
+	 * the cipher data. */
+	unsigned char *cipher_data = pubnub_cipher_buf(c, cipher_max + PUBNUB_BASE64_ENCODED_LEN(cipher_max) + 3);
+	char *b64_str = (char *) cipher_data + cipher_max;
 	int cipher_len = 0;
 
-	if (!EVP_EncryptUpdate(&aes256, cipher_data, &cipher_len, (unsigned char *) message_str, message_len)) {
+	if (!EVP_EncryptUpdate(c->enc, cipher_data, &cipher_len, (const unsigned char *) message, message_len)) {
 		DBGMSG("EncryptUpdate error\n");
 		return NULL;
 	}
 	int cipher_flen;
-	if (!EVP_EncryptFinal_ex(&aes256, cipher_data + cipher_len, &cipher_flen)) {
+	if (!EVP_EncryptFinal_ex(c->enc, cipher_data + cipher_len, &cipher_flen)) {
 		DBGMSG("EncryptFinal error\n");
 		return NULL;
 	}
 	cipher_len += cipher_flen;
-	EVP_CIPHER_CTX_cleanup(&aes256);
-
-	/* Convert to base64 representation */
-
-	BIO *b64f = BIO_new(BIO_f_base64());
-	BIO_set_flags(b64f, BIO_FLAGS_BASE64_NO_NL);
-	BIO *bmem = BIO_new(BIO_s_mem());
-	BIO *b64 = BIO_push(b64f, bmem);
-	if (BIO_write(b64, cipher_data, cipher_len) != cipher_len) {
-		DBGMSG("b64 write error\n");
-		return NULL;
-	}
-	if (BIO_flush(b64) != 1) {
-		DBGMSG("b64 flush error\n");
-		return NULL;
-	}
 
-	/* Conjure up JSON object */
+	/* Convert to base64 representation, which is a JSON string
+	 * just by quoting it: there is nothing to escape in there.
+	 * (json-c would write "\/" for each "/", but that is the same
+	 * string.) */
 
-	unsigned char *b64_str;
-	long b64_len = BIO_get_mem_data(b64, &b64_str);
-	struct json_object *message = json_object_new_string_len((char *) b64_str, b64_len);
-
-	/* Clean up. */
-
-	BIO_free_all(b64);
-	free(cipher_data);
+	size_t b64_len = pubnub_base64_encode(b64_str + 1, cipher_data, cipher_len);
+	b64_str[0] = b64_str[b64_len + 1] = '"';
+	b64_str[b64_len + 2] = 0;
+	*str_len = b64_len + 2;
+	return b64_str;
+}
 
-	return message;
+struct json_object *
+pubnub_cipher_encrypt(struct pubnub_cipher *c, const char *message_str)
+{
+	size_t str_len;
+	const char *str = pubnub_cipher_encrypt_str(c, message_str, strlen(message_str), &str_len);
+	if (!str)
+		return NULL;
+	return json_object_new_string_len(str + 1, str_len - 2);
 }
 
 static struct json_object *
-pubnub_decrypt(const char *cipher_key, const char *b64_str)
+pubnub_cipher_decrypt(struct pubnub_cipher *c, const char *b64_str)
 {
 	int b64_len = strlen(b64_str);
-	unsigned char iv[] = "0123456789012345";
 
-	/* Pre-process (hash) encryption key */
+	/* Convert base64 encrypted text to raw data; the decrypted message
+	 * goes to the same buffer, right after it. */
 
-	unsigned char cipher_hash[33];
-	pubnub_sha256_cipher_key(cipher_key, cipher_hash);
+	int cipher_max = PUBNUB_BASE64_DECODED_MAX(b64_len);
+	unsigned char *cipher_data = pubnub_cipher_buf(c, 2 * cipher_max + EVP_CIPHER_block_size(EVP_aes_256_cbc()) + 1);
+	char *message_str = (char *) cipher_data + cipher_max;
 
-	/* Convert base64 encrypted text to raw data. */
-
-	BIO *b64f = BIO_new(BIO_f_base64());
-	BIO_set_flags(b64f, BIO_FLAGS_BASE64_NO_NL);
-	BIO *bmem = BIO_new_mem_buf((unsigned char *) b64_str, b64_len);
-	BIO *b64 = BIO_push(b64f, bmem);
-	/* b64_len is fine upper bound for raw data length... */
-	unsigned char *cipher_data = (unsigned char*)malloc(b64_len);
-	int cipher_len = BIO_read(b64, cipher_data, b64_len);
-	BIO_free_all(b64);
+	long cipher_len = pubnub_base64_decode(cipher_data, b64_str, b64_len);
+	if (cipher_len < 0) {
+		DBGMSG("b64 decode error\n");
+		return NULL;
+	}
 
 	/* Decrypt the message */
 
-	EVP_CIPHER_CTX aes256;
-	EVP_CIPHER_CTX_init(&aes256);
-	if (!EVP_DecryptInit_ex(&aes256, EVP_aes_256_cbc(), NULL, cipher_hash, iv)) {
+	if (!EVP_DecryptInit_ex(c->dec, NULL, NULL, NULL, pubnub_cipher_iv)) {
 		DBGMSG("DecryptInit error\n");
 		return NULL;
 	}
 
-	char *message_str = (char*)malloc(cipher_len + EVP_CIPHER_block_size(EVP_aes_256_cbc()) + 1);
 	int message_len = 0;
-	if (!EVP_DecryptUpdate(&aes256, (unsigned char *) message_str, &message_len, cipher_data, cipher_len)) {
+	if (!EVP_DecryptUpdate(c->dec, (unsigned char *) message_str, &message_len, cipher_data, cipher_len)) {
 		DBGMSG("DecryptUpdate error\n");
 		return NULL;
 	}
 	int message_flen;
-	if (!EVP_DecryptFinal_ex(&aes256, (unsigned char *) message_str + message_len, &message_flen)) {
+	if (!EVP_DecryptFinal_ex(c->dec, (unsigned char *) message_str + message_len, &message_flen)) {
 		DBGMSG("DecryptFinal error\n");
 		return NULL;
 	}
 	message_len += message_flen;
 
-	EVP_CIPHER_CTX_cleanup(&aes256);
-	free(cipher_data);
-
 	/* Conjure up JSON object */
 
 	message_str[message_len] = 0;
 	DBGMSG("dec inp: <%s>\n", message_str);
-	struct json_object *message = json_tokener_parse(message_str);
-	free(message_str);
-	return message;
+	return json_tokener_parse(message_str);
 }
 
 struct json_object *
-pubnub_decrypt_array(const char *cipher_key, struct json_object *message_list)
+pubnub_cipher_decrypt_array(struct pubnub_cipher *c, struct json_object *message_list)
 {
+	if (!c)
+		return NULL;
+
 	int msg_n = json_object_array_length(message_list);
 	struct json_object *newlist = json_object_new_array();
 
@@ -197,7 +278,7 @@ error:
 		}
 
 		DBGMSG("decrypting %s\n", json_object_get_string(msg));
-		struct json_object *newmsg = pubnub_decrypt(cipher_key, json_object_get_string(msg));
+		struct json_object *newmsg = pubnub_cipher_decrypt(c, json_object_get_string(msg));
 		if (!newmsg) {
 			DBGMSG("decrypt fail: message cannot be decrypted\n");
 			goto error;
@@ -208,3 +289,255 @@ error:
 
 	return newlist;
 }
+
+
+/* Decryption worker threads.  A batch is split to chunks of messages
+ * the workers (and the submitting thread itself) take turns at; each
+ * worker keeps its own cipher state, as the EVP contexts cannot be
+ * shared.  The submitting thread waits for the whole batch, so the
+ * results come back in order and the workers never touch a live
+ * context or the response objects. */
+
+#define PUBNUB_WORKERS_CHUNK 4
+
+struct pubnub_decrypt_batch {
+	unsigned char cipher_hash[33];
+	const char **in;
+	struct json_object **out;
+	int n;
+	/* Index of the next chunk to take. */
+	int next;
+	/* Number of workers busy with the batch. */
+	int active;
+};
+
+#ifndef _WIN32
+
+struct pubnub_workers {
+	pthread_mutex_t lock;
+	/* Signalled when a new batch is posted or on shutdown. */
+	pthread_cond_t work_cond;
+	/* Signalled when a worker leaves the batch or it is finished. */
+	pthread_cond_t done_cond;
+
+	pthread_t *threads;
+	int threads_n;
+	bool quit;
+
+	/* Batch being posted to the workers, if any. */
+	struct pubnub_decrypt_batch *batch;
+	unsigned generation;
+	/* A batch is being processed (we take one at a time). */
+	bool busy;
+};
+
+static void
+pubnub_decrypt_batch_run(struct pubnub_workers *w, struct pubnub_decrypt_batch *b, struct pubnub_cipher *c)
+{
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		int i = b->next;
+		b->next += PUBNUB_WORKERS_CHUNK;
+		pthread_mutex_unlock(&w->lock);
+		if (i >= b->n)
+			return;
+
+		int end = i + PUBNUB_WORKERS_CHUNK < b->n ? i + PUBNUB_WORKERS_CHUNK : b->n;
+		for (; i < end; i++)
+			b->out[i] = c ? pubnub_cipher_decrypt(c, b->in[i]) : NULL;
+	}
+}
+
+static void *
+pubnub_workers_thread(void *data)
+{
+	struct pubnub_workers *w = (struct pubnub_workers *) data;
+	struct pubnub_cipher *c = NULL;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->quit && (!w->batch || w->generation == seen))
+			pthread_cond_wait(&w->work_cond, &w->lock);
+		if (w->quit)
+			break;
+		seen = w->generation;
+		struct pubnub_decrypt_batch *b = w->batch;
+		b->active++;
+		pthread_mutex_unlock(&w->lock);
+
+		if (!c || memcmp(c->cipher_hash, b->cipher_hash, sizeof(c->cipher_hash))) {
+			pubnub_cipher_free(c);
+			c = pubnub_cipher_new_hash(b->cipher_hash);
+		}
+		pubnub_decrypt_batch_run(w, b, c);
+
+		pthread_mutex_lock(&w->lock);
+		b->active--;
+		pthread_cond_broadcast(&w->done_cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	pubnub_cipher_free(c);
+	return NULL;
+}
+
+PUBNUB_API
+struct pubnub_workers *
+pubnub_workers_init(int threads)
+{
+	if (threads <= 0)
+		return NULL;
+
+	struct pubnub_workers *w = (struct pubnub_workers *)calloc(1, sizeof(*w));
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work_cond, NULL);
+	pthread_cond_init(&w->done_cond, NULL);
+	w->threads = (pthread_t *)malloc(threads * sizeof(w->threads[0]));
+	for (; w->threads_n < threads; w->threads_n++) {
+		if (pthread_create(&w->threads[w->threads_n], NULL, pubnub_workers_thread, w)) {
+			DBGMSG("pthread_create error\n");
+			pubnub_workers_done(w);
+			return NULL;
+		}
+	}
+	return w;
+}
+
+PUBNUB_API
+void
+pubnub_workers_done(struct pubnub_workers *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->quit = true;
+	pthread_cond_broadcast(&w->work_cond);
+	pthread_mutex_unlock(&w->lock);
+	for (int i = 0; i < w->threads_n; i++)
+		pthread_join(w->threads[i], NULL);
+
+	pthread_cond_destroy(&w->done_cond);
+	pthread_cond_destroy(&w->work_cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w->threads);
+	free(w);
+}
+
+static void
+pubnub_workers_run(struct pubnub_workers *w, struct pubnub_decrypt_batch *b, struct pubnub_cipher *c)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->busy)
+		pthread_cond_wait(&w->done_cond, &w->lock);
+	w->busy = true;
+	w->batch = b;
+	w->generation++;
+	pthread_cond_broadcast(&w->work_cond);
+	pthread_mutex_unlock(&w->lock);
+
+	pubnub_decrypt_batch_run(w, b, c);
+
+	pthread_mutex_lock(&w->lock);
+	/* No more workers can join now. */
+	w->batch = NULL;
+	while (b->active > 0)
+		pthread_cond_wait(&w->done_cond, &w->lock);
+	w->busy = false;
+	pthread_cond_broadcast(&w->done_cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+#else
+
+/* No threads on Windows (yet); pubnub_workers_init() always fails. */
+
+struct pubnub_workers {
+	int dummy;
+};
+
+PUBNUB_API
+struct pubnub_workers *
+pubnub_workers_init(int threads)
+{
+	return NULL;
+}
+
+PUBNUB_API
+void
+pubnub_workers_done(struct pubnub_workers *w)
+{
+}
+
+static void
+pubnub_workers_run(struct pubnub_workers *w, struct pubnub_decrypt_batch *b, struct pubnub_cipher *c)
+{
+	for (int i = 0; i < b->n; i++)
+		b->out[i] = pubnub_cipher_decrypt(c, b->in[i]);
+}
+
+#endif
+
+struct json_object *
+pubnub_cipher_decrypt_array_mt(struct pubnub_cipher *c, struct pubnub_workers *w, int min_batch,
+		struct json_object *message_list)
+{
+	int msg_n = json_object_array_length(message_list);
+	if (!c || !w || msg_n < min_batch || msg_n <= PUBNUB_WORKERS_CHUNK)
+		return pubnub_cipher_decrypt_array(c, message_list);
+
+	struct pubnub_decrypt_batch b;
+	memset(&b, 0, sizeof(b));
+	memcpy(b.cipher_hash, c->cipher_hash, sizeof(b.cipher_hash));
+	b.n = msg_n;
+	b.in = (const char **)malloc(msg_n * sizeof(b.in[0]));
+	b.out = (struct json_object **)calloc(msg_n, sizeof(b.out[0]));
+
+	struct json_object *newlist = NULL;
+	for (int i = 0; i < msg_n; i++) {
+		struct json_object *msg = json_object_array_get_idx(message_list, i);
+		if (!json_object_is_type(msg, json_type_string)) {
+			DBGMSG("decrypt fail: message not a string\n");
+			goto out;
+		}
+		b.in[i] = json_object_get_string(msg);
+	}
+
+	pubnub_workers_run(w, &b, c);
+
+	newlist = json_object_new_array();
+	for (int i = 0; i < msg_n; i++) {
+		if (!b.out[i]) {
+			DBGMSG("decrypt fail: message cannot be decrypted\n");
+			/* Format error. This is a most stringent approach. */
+			json_object_put(newlist);
+			newlist = NULL;
+			for (; i < msg_n; i++)
+				if (b.out[i])
+					json_object_put(b.out[i]);
+			break;
+		}
+		json_object_array_add(newlist, b.out[i]);
+	}
+
+out:
+	free(b.in);
+	free(b.out);
+	return newlist;
+}
+
+struct json_object *
+pubnub_encrypt(const char *cipher_key, const char *message_str)
+{
+	struct pubnub_cipher *c = pubnub_cipher_new(cipher_key);
+	struct json_object *message = pubnub_cipher_encrypt(c, message_str);
+	pubnub_cipher_free(c);
+	return message;
+}
+
+struct json_object *
+pubnub_decrypt_array(const char *cipher_key, struct json_object *message_list)
+{
+	struct pubnub_cipher *c = pubnub_cipher_new(cipher_key);
+	struct json_object *newlist = pubnub_cipher_decrypt_array(c, message_list);
+	pubnub_cipher_free(c);
+	return newlist;
+}
@@ -1,11 +1,55 @@
 #ifndef PUBNUB__crypto_h
 #define PUBNUB__crypto_h
 
+#include <stddef.h>
+
 struct pubnub;
+struct pubnub_cipher;
+struct pubnub_workers;
 struct json_object;
 
+#ifndef PUBNUB_NO_CRYPTO
+
 char *pubnub_signature(struct pubnub *p, const char *channel, const char *message_str);
+/* Like pubnub_signature(), writing to @signature and reusing the hash
+ * state of the key prefix cached in @p. */
+void pubnub_signature_buf(struct pubnub *p, const char *channel, const char *message_str, char signature[33]);
+/* Like pubnub_signature_buf(), for the @message_len bytes at @message. */
+void pubnub_signature_buf_len(struct pubnub *p, const char *channel, const char *message, size_t message_len, char signature[33]);
+
+/* Cipher state for a given cipher key; NULL on failure. */
+struct pubnub_cipher *pubnub_cipher_new(const char *cipher_key);
+void pubnub_cipher_free(struct pubnub_cipher *c);
+struct json_object *pubnub_cipher_encrypt(struct pubnub_cipher *c, const char *message_str);
+/* Encrypt the @message_len bytes at @message to the JSON string that
+ * is published (the base64 text, in double quotes), setting @str_len.
+ * The string lives in @c until its next use; NULL on failure. */
+const char *pubnub_cipher_encrypt_str(struct pubnub_cipher *c, const char *message, size_t message_len, size_t *str_len);
+/* Decrypt all the messages of @message_list with the same cipher state. */
+struct json_object *pubnub_cipher_decrypt_array(struct pubnub_cipher *c, struct json_object *message_list);
+/* Like pubnub_cipher_decrypt_array(), but fan batches of at least
+ * @min_batch messages out to the @w worker threads (if not NULL). */
+struct json_object *pubnub_cipher_decrypt_array_mt(struct pubnub_cipher *c, struct pubnub_workers *w, int min_batch,
+		struct json_object *message_list);
+
+/* One-shot versions of the above. */
 struct json_object *pubnub_encrypt(const char *cipher_key, const char *message_str);
 struct json_object *pubnub_decrypt_array(const char *cipher_key, struct json_object *message_list);
 
+#else
+
+/* Built without crypto.c: nothing is signed, encrypted or decrypted.
+ * The callers test PUBNUB_SECRET_KEY() and PUBNUB_CIPHER_KEY() before
+ * getting here, so all of this compiles out. */
+
+static inline void pubnub_signature_buf_len(struct pubnub *p, const char *channel, const char *message, size_t message_len, char signature[33]) { }
+static inline struct pubnub_cipher *pubnub_cipher_new(const char *cipher_key) { return NULL; }
+static inline void pubnub_cipher_free(struct pubnub_cipher *c) { }
+static inline const char *pubnub_cipher_encrypt_str(struct pubnub_cipher *c, const char *message, size_t message_len, size_t *str_len) { return NULL; }
+static inline struct json_object *pubnub_cipher_decrypt_array(struct pubnub_cipher *c, struct json_object *message_list) { return NULL; }
+static inline struct json_object *pubnub_cipher_decrypt_array_mt(struct pubnub_cipher *c, struct pubnub_workers *w, int min_batch,
+		struct json_object *message_list) { return NULL; }
+
+#endif
+
 #endif
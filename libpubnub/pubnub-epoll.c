@@ -0,0 +1,590 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#define PUBNUB_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#include "pubnub.h"
+#include "pubnub-epoll.h"
+#include "pubnub-priv.h"
+
+/* Note that we use the kernel event queue in level-triggered mode.
+ * Edge-triggered notification would require draining each socket until
+ * EAGAIN on every event, but libcurl reads at most one buffer per
+ * curl_multi_socket_action() call and expects to be told again if
+ * there is more data pending.  The O(ready) dispatch is all we are
+ * after anyway. */
+
+
+/** Data structures. */
+
+/* A watched file descriptor; ep->socks is indexed by the fd. */
+struct pubnub_epoll_sock {
+	/* 0 if not watched. */
+	int mode;
+	struct pubnub *p;
+	void (*cb)(struct pubnub *p, int fd, int mode, void *cb_data);
+	void *cb_data;
+};
+
+/* The frontend timer of a context (each context, or pool, has
+ * a single one). */
+struct pubnub_epoll_timer {
+	struct pubnub *p;
+	/* Expiry [ms on the wheel clock]. */
+	long long at;
+	void (*cb)(struct pubnub *p, void *cb_data);
+	void *cb_data;
+	/* Linked into a wheel slot (level * PUBNUB_WHEEL_SLOTS + slot),
+	 * or into a list being run (slot -1), if pprev is set. */
+	struct pubnub_epoll_timer *next, **pprev;
+	int slot;
+};
+
+/* What a context has on the loop, kept in p->cb_priv while there is
+ * anything. */
+struct pubnub_epoll_ctx {
+	struct pubnub_epoll_timer timer;
+	/* Sockets watched for a standalone context, so that
+	 * pubnub_epoll_done() knows when to stop looking.  (Pool members
+	 * hand theirs around and are not counted.) */
+	int n_socks;
+};
+
+/* How many events to pick up per wait. */
+#define PUBNUB_EPOLL_EVENTS 64
+
+/* The timers are kept in a hierarchical timing wheel of 1 ms ticks, so
+ * that (re)arming and cancelling costs O(1) no matter how many contexts
+ * share the loop: a slot of level l spans 64^l ticks, the four levels
+ * cover 4.6 hours (later timers wait in the last slot) and the timers
+ * of a slot are moved down a level once the wheel gets to its span. */
+#define PUBNUB_WHEEL_BITS 6
+#define PUBNUB_WHEEL_SLOTS (1 << PUBNUB_WHEEL_BITS)
+#define PUBNUB_WHEEL_LEVELS 4
+
+struct pubnub_epoll {
+	int fd;
+
+	struct pubnub_epoll_sock *socks;
+	int socks_size;
+	int n_socks;
+
+	struct pubnub_epoll_timer *wheel[PUBNUB_WHEEL_LEVELS][PUBNUB_WHEEL_SLOTS];
+	/* Bitmaps of the non-empty slots of each level. */
+	uint64_t wheel_used[PUBNUB_WHEEL_LEVELS];
+	/* The last tick the wheel has been run through. */
+	long long wheel_now;
+	int n_timers;
+
+	bool stop;
+};
+
+
+/** Kernel event queue */
+
+static void
+pubnub_epoll_watch(struct pubnub_epoll *ep, int fd, int oldmode, int mode)
+{
+#ifndef PUBNUB_KQUEUE
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (mode & 1 ? EPOLLIN : 0) | (mode & 2 ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+
+	int op = !mode ? EPOLL_CTL_DEL : (oldmode ? EPOLL_CTL_MOD : EPOLL_CTL_ADD);
+	if (epoll_ctl(ep->fd, op, fd, &ev) < 0) {
+		DBGMSG("epoll_ctl(%d, %d): %s\n", op, fd, strerror(errno));
+		/* The kernel drops closed descriptors from the set on its
+		 * own, so our idea of what is watched may be off if the
+		 * fd number got reused meanwhile. */
+		if (op == EPOLL_CTL_ADD && errno == EEXIST)
+			epoll_ctl(ep->fd, EPOLL_CTL_MOD, fd, &ev);
+		else if (op == EPOLL_CTL_MOD && errno == ENOENT)
+			epoll_ctl(ep->fd, EPOLL_CTL_ADD, fd, &ev);
+	}
+#else
+	struct kevent changes[2];
+	int n = 0;
+	if ((mode ^ oldmode) & 1)
+		EV_SET(&changes[n++], fd, EVFILT_READ, mode & 1 ? EV_ADD : EV_DELETE, 0, 0, NULL);
+	if ((mode ^ oldmode) & 2)
+		EV_SET(&changes[n++], fd, EVFILT_WRITE, mode & 2 ? EV_ADD : EV_DELETE, 0, 0, NULL);
+	if (n > 0 && kevent(ep->fd, changes, n, NULL, 0, NULL) < 0)
+		DBGMSG("kevent(%d): %s\n", fd, strerror(errno));
+#endif
+}
+
+
+/** Timers */
+
+/* Nanoseconds on a monotonic clock.  (The coarse clock would be
+ * cheaper to read, but its resolution of a few milliseconds is too
+ * much for the short libcurl timeouts.) */
+static long long
+pubnub_epoll_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* The current tick. */
+static long long
+pubnub_epoll_now(void)
+{
+	return pubnub_epoll_clock() / 1000000;
+}
+
+static void
+pubnub_epoll_wheel_link(struct pubnub_epoll *ep, struct pubnub_epoll_timer *t)
+{
+	long long d = t->at - ep->wheel_now;
+	int level = 0;
+	long long at = t->at;
+	while (level < PUBNUB_WHEEL_LEVELS - 1 && d >= 1LL << (PUBNUB_WHEEL_BITS * (level + 1)))
+		level++;
+	if (d >= 1LL << (PUBNUB_WHEEL_BITS * PUBNUB_WHEEL_LEVELS)) {
+		/* Beyond the wheel; park it as far as possible. */
+		at = ep->wheel_now + (1LL << (PUBNUB_WHEEL_BITS * PUBNUB_WHEEL_LEVELS)) - 1;
+	}
+	int slot = (at >> (PUBNUB_WHEEL_BITS * level)) & (PUBNUB_WHEEL_SLOTS - 1);
+
+	struct pubnub_epoll_timer **head = &ep->wheel[level][slot];
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+	t->slot = level * PUBNUB_WHEEL_SLOTS + slot;
+	ep->wheel_used[level] |= 1ULL << slot;
+}
+
+static void
+pubnub_epoll_wheel_unlink(struct pubnub_epoll *ep, struct pubnub_epoll_timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	if (t->slot >= 0) {
+		int level = t->slot / PUBNUB_WHEEL_SLOTS, slot = t->slot % PUBNUB_WHEEL_SLOTS;
+		if (!ep->wheel[level][slot])
+			ep->wheel_used[level] &= ~(1ULL << slot);
+	}
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* Take the list of a slot out of the wheel. */
+static void
+pubnub_epoll_wheel_take(struct pubnub_epoll *ep, int level, int slot, struct pubnub_epoll_timer **list)
+{
+	*list = ep->wheel[level][slot];
+	ep->wheel[level][slot] = NULL;
+	ep->wheel_used[level] &= ~(1ULL << slot);
+	struct pubnub_epoll_timer *t;
+	for (t = *list; t; t = t->next)
+		t->slot = -1;
+	if (*list)
+		(*list)->pprev = list;
+}
+
+/* The state of @p on the loop, set up on first use. */
+static struct pubnub_epoll_ctx *
+pubnub_epoll_ctx_get(struct pubnub *p)
+{
+	struct pubnub_epoll_ctx *c = (struct pubnub_epoll_ctx *)p->cb_priv;
+	if (!c) {
+		c = (struct pubnub_epoll_ctx *)calloc(1, sizeof(*c));
+		c->timer.p = p;
+		p->cb_priv = c;
+	}
+	return c;
+}
+
+/* Release the state of @p once there is nothing left in it; pool
+ * members never get pubnub_epoll_done() called on them. */
+static void
+pubnub_epoll_ctx_put(struct pubnub *p)
+{
+	struct pubnub_epoll_ctx *c = (struct pubnub_epoll_ctx *)p->cb_priv;
+	if (c && !c->timer.pprev && !c->n_socks) {
+		free(c);
+		p->cb_priv = NULL;
+	}
+}
+
+/* Arm the timer of @p to expire at @at. */
+static void
+pubnub_epoll_timer_set(struct pubnub_epoll *ep, struct pubnub *p, long long at,
+		void (*cb)(struct pubnub *p, void *cb_data), void *cb_data)
+{
+	struct pubnub_epoll_timer *t = &pubnub_epoll_ctx_get(p)->timer;
+	if (t->pprev)
+		pubnub_epoll_wheel_unlink(ep, t);
+	else
+		ep->n_timers++;
+
+	/* The wheel is never run through the current tick again. */
+	t->at = at > ep->wheel_now ? at : ep->wheel_now + 1;
+	t->cb = cb;
+	t->cb_data = cb_data;
+	pubnub_epoll_wheel_link(ep, t);
+}
+
+static void
+pubnub_epoll_timer_del(struct pubnub_epoll *ep, struct pubnub *p)
+{
+	struct pubnub_epoll_ctx *c = (struct pubnub_epoll_ctx *)p->cb_priv;
+	if (!c || !c->timer.pprev)
+		return;
+	struct pubnub_epoll_timer *t = &c->timer;
+	pubnub_epoll_wheel_unlink(ep, t);
+	ep->n_timers--;
+}
+
+/* Run the wheel through @until, calling the callbacks of the timers
+ * expiring on the way. */
+static void
+pubnub_epoll_wheel_run(struct pubnub_epoll *ep, long long until)
+{
+	const int mask = PUBNUB_WHEEL_SLOTS - 1;
+
+	while (ep->wheel_now < until) {
+		if (!ep->n_timers) {
+			ep->wheel_now = until;
+			break;
+		}
+		int idx = ep->wheel_now & mask;
+		if (idx != mask && !(ep->wheel_used[0] >> (idx + 1))) {
+			/* Nothing more to run at level 0 until the next
+			 * turn; skip to its end. */
+			long long end = ep->wheel_now | mask;
+			ep->wheel_now = end < until ? end : until;
+			if (ep->wheel_now == until)
+				break;
+		}
+		long long tick = ++ep->wheel_now;
+
+		/* Move the timers of the span starting now down. */
+		for (int level = 1; level < PUBNUB_WHEEL_LEVELS; level++) {
+			if (tick & ((1LL << (PUBNUB_WHEEL_BITS * level)) - 1))
+				break;
+			/* (Timers parked beyond the wheel go to the
+			 * slot before this one.) */
+			struct pubnub_epoll_timer *list, *t;
+			pubnub_epoll_wheel_take(ep, level, (tick >> (PUBNUB_WHEEL_BITS * level)) & mask, &list);
+			while ((t = list) != NULL) {
+				pubnub_epoll_wheel_unlink(ep, t);
+				pubnub_epoll_wheel_link(ep, t);
+			}
+		}
+
+		/* Level 0 slots hold the timers of a single tick. */
+		struct pubnub_epoll_timer *list, *t;
+		pubnub_epoll_wheel_take(ep, 0, tick & mask, &list);
+		while ((t = list) != NULL) {
+			/* The callback may change the timers arbitrarily
+			 * (also those still on the list) and will usually
+			 * set up a new one for its context. */
+			pubnub_epoll_wheel_unlink(ep, t);
+			ep->n_timers--;
+			t->cb(t->p, t->cb_data);
+		}
+	}
+}
+
+/* Run the timers that have expired by now. */
+static void
+pubnub_epoll_timers_run(struct pubnub_epoll *ep)
+{
+	pubnub_epoll_wheel_run(ep, pubnub_epoll_now());
+}
+
+/* Return the lowest k >= 0 such that slot (@from + k) of @used
+ * is set, or -1 if there is no such slot. */
+static int
+pubnub_epoll_wheel_next(uint64_t used, int from)
+{
+	if (!used)
+		return -1;
+	for (int k = 0; k < PUBNUB_WHEEL_SLOTS; k++)
+		if (used & (1ULL << ((from + k) & (PUBNUB_WHEEL_SLOTS - 1))))
+			return k;
+	return -1;
+}
+
+/* Return the earliest tick the wheel needs to be run through: the
+ * expiry of the next level 0 timer or the start of the next span
+ * with timers to move down, whichever comes first. */
+static long long
+pubnub_epoll_wheel_due(struct pubnub_epoll *ep)
+{
+	long long due = -1;
+	for (int level = 0; level < PUBNUB_WHEEL_LEVELS; level++) {
+		int shift = PUBNUB_WHEEL_BITS * level;
+		int idx = (ep->wheel_now >> shift) & (PUBNUB_WHEEL_SLOTS - 1);
+		int k = pubnub_epoll_wheel_next(ep->wheel_used[level], idx + 1);
+		if (k < 0)
+			continue;
+		long long at = level == 0
+			? ep->wheel_now + k + 1
+			: ((ep->wheel_now >> shift) + k + 1) << shift;
+		if (due < 0 || at < due)
+			due = at;
+	}
+	return due;
+}
+
+
+/** Public API */
+
+PUBNUB_API
+struct pubnub_epoll *
+pubnub_epoll_init(void)
+{
+	struct pubnub_epoll *ep = (struct pubnub_epoll *)calloc(1, sizeof(*ep));
+	if (!ep) return NULL;
+#ifndef PUBNUB_KQUEUE
+	ep->fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+	ep->fd = kqueue();
+#endif
+	if (ep->fd < 0) {
+		free(ep);
+		return NULL;
+	}
+	ep->wheel_now = pubnub_epoll_now();
+	return ep;
+}
+
+PUBNUB_API
+void
+pubnub_epoll_free(struct pubnub_epoll *ep)
+{
+	close(ep->fd);
+	free(ep->socks);
+	free(ep);
+}
+
+PUBNUB_API
+int
+pubnub_epoll_fd(struct pubnub_epoll *ep)
+{
+	return ep->fd;
+}
+
+PUBNUB_API
+int
+pubnub_epoll_next_timeout(struct pubnub_epoll *ep)
+{
+	if (!ep->n_timers)
+		return -1;
+
+	long long due = pubnub_epoll_wheel_due(ep);
+	if (due < 0)
+		return -1;
+	long long ms = due - pubnub_epoll_now();
+	if (ms < 0)
+		ms = 0;
+	return ms > INT32_MAX ? INT32_MAX : (int) ms;
+}
+
+PUBNUB_API
+int
+pubnub_epoll_run_once(struct pubnub_epoll *ep, int timeout_ms)
+{
+	int next = pubnub_epoll_next_timeout(ep);
+	if (next >= 0 && (timeout_ms < 0 || next < timeout_ms))
+		timeout_ms = next;
+
+#ifndef PUBNUB_KQUEUE
+	struct epoll_event events[PUBNUB_EPOLL_EVENTS];
+	int n = epoll_wait(ep->fd, events, PUBNUB_EPOLL_EVENTS, timeout_ms);
+#else
+	struct kevent events[PUBNUB_EPOLL_EVENTS];
+	struct timespec ts = { SFINIT(.tv_sec, timeout_ms / 1000), SFINIT(.tv_nsec, (timeout_ms % 1000) * 1000000L) };
+	int n = kevent(ep->fd, NULL, 0, events, PUBNUB_EPOLL_EVENTS, timeout_ms >= 0 ? &ts : NULL);
+#endif
+	if (n < 0) {
+		if (errno != EINTR) {
+			DBGMSG("event wait: %s\n", strerror(errno));
+			return -1;
+		}
+		n = 0;
+	}
+
+	for (int i = 0; i < n; i++) {
+#ifndef PUBNUB_KQUEUE
+		int fd = events[i].data.fd;
+		unsigned int ev = events[i].events;
+		int mode = (ev & (EPOLLIN | EPOLLHUP) ? 1 : 0) | (ev & EPOLLOUT ? 2 : 0) | (ev & EPOLLERR ? 4 : 0);
+#else
+		int fd = events[i].ident;
+		int mode = (events[i].filter == EVFILT_READ ? 1 : 0) | (events[i].filter == EVFILT_WRITE ? 2 : 0)
+			| (events[i].flags & EV_ERROR ? 4 : 0);
+#endif
+		/* The socket may have been removed by one of the
+		 * callbacks we have just called. */
+		if (fd >= ep->socks_size || !ep->socks[fd].mode) {
+			DBGMSG("event on unwatched fd %d\n", fd);
+			continue;
+		}
+		struct pubnub_epoll_sock *s = &ep->socks[fd];
+		s->cb(s->p, fd, mode, s->cb_data);
+	}
+
+	pubnub_epoll_timers_run(ep);
+	return n;
+}
+
+PUBNUB_API
+void
+pubnub_epoll_run(struct pubnub_epoll *ep)
+{
+	ep->stop = false;
+	while (!ep->stop && (ep->n_socks > 0 || ep->n_timers > 0)) {
+		if (pubnub_epoll_run_once(ep, -1) < 0)
+			break;
+	}
+	ep->stop = false;
+}
+
+PUBNUB_API
+void
+pubnub_epoll_break(struct pubnub_epoll *ep)
+{
+	ep->stop = true;
+}
+
+
+/** Event callbacks */
+
+void
+pubnub_epoll_add_socket(struct pubnub *p, void *ctx_data, int fd, int mode,
+		void (*cb)(struct pubnub *p, int fd, int mode, void *cb_data), void *cb_data)
+{
+	DBGMSG("+ socket %d\n", fd);
+
+	struct pubnub_epoll *ep = (struct pubnub_epoll *)ctx_data;
+
+	if (fd >= ep->socks_size) {
+		int size = ep->socks_size ? ep->socks_size : 16;
+		while (size <= fd)
+			size *= 2;
+		ep->socks = (struct pubnub_epoll_sock *)realloc(ep->socks, sizeof(*ep->socks) * size);
+		memset(&ep->socks[ep->socks_size], 0, sizeof(*ep->socks) * (size - ep->socks_size));
+		ep->socks_size = size;
+	}
+
+	struct pubnub_epoll_sock *s = &ep->socks[fd];
+	if (!s->mode)
+		ep->n_socks++;
+	if ((!s->mode || s->p != p) && !p->pool)
+		pubnub_epoll_ctx_get(p)->n_socks++;
+	pubnub_epoll_watch(ep, fd, s->mode, mode & 3);
+	s->mode = mode & 3;
+	s->p = p;
+	s->cb = cb;
+	s->cb_data = cb_data;
+
+	DBGMSG("watching %d sockets\n", ep->n_socks);
+}
+
+void
+pubnub_epoll_rem_socket(struct pubnub *p, void *ctx_data, int fd)
+{
+	DBGMSG("- socket %d\n", fd);
+	struct pubnub_epoll *ep = (struct pubnub_epoll *)ctx_data;
+
+	if (fd >= ep->socks_size || !ep->socks[fd].mode) {
+		DBGMSG("! did not find socket %d\n", fd);
+		return;
+	}
+	pubnub_epoll_watch(ep, fd, ep->socks[fd].mode, 0);
+	if (ep->socks[fd].p == p && !p->pool) {
+		((struct pubnub_epoll_ctx *)p->cb_priv)->n_socks--;
+		pubnub_epoll_ctx_put(p);
+	}
+	memset(&ep->socks[fd], 0, sizeof(ep->socks[fd]));
+	ep->n_socks--;
+}
+
+void
+pubnub_epoll_timeout(struct pubnub *p, void *ctx_data, const struct timespec *ts,
+		void (*cb)(struct pubnub *p, void *cb_data), void *cb_data)
+{
+	struct pubnub_epoll *ep = (struct pubnub_epoll *)ctx_data;
+
+	if (!cb) {
+		/* As with libevent, do not keep the timer around; pools
+		 * let go of it this way when the context leaves. */
+		pubnub_epoll_timer_del(ep, p);
+		pubnub_epoll_ctx_put(p);
+		return;
+	}
+
+	/* The timer expires with the tick it falls into, i.e. up to
+	 * a millisecond early; libcurl just asks for the rest. */
+	long long at = pubnub_epoll_clock() + (long long) ts->tv_sec * 1000000000 + ts->tv_nsec;
+	pubnub_epoll_timer_set(ep, p, at / 1000000, cb, cb_data);
+}
+
+void
+pubnub_epoll_wait(struct pubnub *p, void *ctx_data)
+{
+	/* nop, just return to caller immediately, we don't block */
+}
+
+void
+pubnub_epoll_stop_wait(struct pubnub *p, void *ctx_data)
+{
+	struct pubnub_epoll *ep = (struct pubnub_epoll *)ctx_data;
+	pubnub_epoll_timer_del(ep, p);
+	pubnub_epoll_ctx_put(p);
+}
+
+void
+pubnub_epoll_done(struct pubnub *p, void *ctx_data)
+{
+	struct pubnub_epoll *ep = (struct pubnub_epoll *)ctx_data;
+
+	/* The event loop itself is shared; just forget about @p.
+	 * (p is NULL for pools, which leave nothing behind.) */
+	if (!p)
+		return;
+	pubnub_epoll_timer_del(ep, p);
+	pubnub_epoll_ctx_put(p);
+	/* libcurl has usually removed the sockets already, so there is
+	 * rarely anything to look for; the state of @p goes away with
+	 * the last of them. */
+	for (int fd = 0; p->cb_priv && fd < ep->socks_size; fd++)
+		if (ep->socks[fd].mode && ep->socks[fd].p == p)
+			pubnub_epoll_rem_socket(p, ep, fd);
+	/* (Left over if another context took over one of the fds.) */
+	free(p->cb_priv);
+	p->cb_priv = NULL;
+}
+
+
+/** Callback table */
+
+PUBNUB_API
+const struct pubnub_callbacks pubnub_epoll_callbacks = {
+	SFINIT(.add_socket, pubnub_epoll_add_socket),
+	SFINIT(.rem_socket, pubnub_epoll_rem_socket),
+	SFINIT(.timeout, pubnub_epoll_timeout),
+	SFINIT(.wait, pubnub_epoll_wait),
+	SFINIT(.stop_wait, pubnub_epoll_stop_wait),
+	SFINIT(.done, pubnub_epoll_done),
+};
@@ -0,0 +1,63 @@
+#ifndef PUBNUB__PubNub_epoll_h
+#define PUBNUB__PubNub_epoll_h
+
+#include <pubnub.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Opaque objects. */
+struct pubnub_epoll;
+
+/* Callback structure to pass pubnub_init() or pubnub_pool_init(). */
+extern const struct pubnub_callbacks pubnub_epoll_callbacks;
+
+/* Callback data to pass pubnub_init() or pubnub_pool_init().
+ *
+ * Unlike with the other frontends, a single pubnub_epoll object can
+ * (and should) be shared by any number of contexts and pools; it is
+ * an event loop driving all of them from a single thread.  It uses
+ * epoll on Linux and kqueue on BSD and Mac OS X; dispatching events
+ * costs time proportional to the number of ready sockets, not to the
+ * number of watched ones.  Likewise, setting up and cancelling the
+ * timeouts of the contexts takes constant time (they are kept in
+ * a timing wheel of millisecond resolution).
+ *
+ * Returns NULL if the kernel event queue cannot be created. */
+struct pubnub_epoll *pubnub_epoll_init(void);
+
+/* Deinitialize the event loop.  Call this only after pubnub_done()
+ * (or pubnub_pool_done()) of all the contexts using it. */
+void pubnub_epoll_free(struct pubnub_epoll *ep);
+
+/* Wait up to @timeout_ms milliseconds (-1 means until the nearest
+ * timer expires) for events and dispatch them, then also run the
+ * expired timers.  Returns the number of dispatched socket events
+ * or -1 on error (check errno; EINTR is not an error, it just
+ * yields 0). */
+int pubnub_epoll_run_once(struct pubnub_epoll *ep, int timeout_ms);
+
+/* Dispatch events until pubnub_epoll_break() is called or there is
+ * nothing to wait for anymore (no watched sockets and no timers). */
+void pubnub_epoll_run(struct pubnub_epoll *ep);
+
+/* Make pubnub_epoll_run() return after dispatching the current
+ * events.  Typically called from a method callback. */
+void pubnub_epoll_break(struct pubnub_epoll *ep);
+
+/* Return the epoll/kqueue file descriptor. It becomes readable whenever
+ * there are events to dispatch, so it can be watched by another event
+ * loop that calls pubnub_epoll_run_once(ep, 0) when it is readable
+ * and also after pubnub_epoll_next_timeout() milliseconds. */
+int pubnub_epoll_fd(struct pubnub_epoll *ep);
+
+/* Return the number of milliseconds until the nearest timer expires,
+ * or -1 if no timer is set. */
+int pubnub_epoll_next_timeout(struct pubnub_epoll *ep);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
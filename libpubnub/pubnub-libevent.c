@@ -12,23 +12,40 @@
 
 /** Data structures. */
 
+/* A watched socket. This is the argument of its event, so dispatching
+ * does not need any lookup. */
 struct pubnub_cb_info {
+	struct pubnub_libevent *libevent;
+	/* Another watch of the same fd, if any. */
+	struct pubnub_cb_info *next;
+
+	struct event *ev;
+	struct pubnub *p;
 	void (*cb)(struct pubnub *p, int fd, int mode, void *cb_data);
 	void *cb_data;
 };
 
+/* The timer of a context, and the number of sockets watched for it
+ * (standalone contexts only; pool members hand theirs around), kept in
+ * p->cb_priv while there is either. */
+struct pubnub_timer_info {
+	/* NULL unless the timer is set up. */
+	struct event *ev;
+	struct pubnub *p;
+	void (*cb)(struct pubnub *p, void *cb_data);
+	void *cb_data;
+	int n_socks;
+};
+
 struct pubnub_libevent {
-	int n;
-	int *fdset;
 	struct event_base *evbase;
-	struct event **evset;
-	struct pubnub_cb_info *cbset;
+	/* Number of contexts using us. */
+	int refs;
 
-	struct event *timer_event;
-	void (*timer_cb)(struct pubnub *p, void *cb_data);
-	void *timer_cb_data;
-
-	struct pubnub *p;
+	/* Watches indexed by fd. */
+	struct pubnub_cb_info **socks;
+	int socks_size;
+	int n;
 };
 
 
@@ -37,25 +54,40 @@ struct pubnub_libevent {
 static void
 pubnub_libevent_timercb(int fd, short kind, void *userp)
 {
-	struct pubnub_libevent *libevent = (struct pubnub_libevent *)userp;
-	libevent->timer_cb(libevent->p, libevent->timer_cb_data);
+	struct pubnub_timer_info *timer = (struct pubnub_timer_info *)userp;
+	timer->cb(timer->p, timer->cb_data);
 }
 
 static void
 pubnub_libevent_eventcb(int fd, short kind, void *userp)
 {
-	struct pubnub_libevent *libevent = (struct pubnub_libevent *)userp;
+	struct pubnub_cb_info *info = (struct pubnub_cb_info *)userp;
 	int mode = (kind & EV_READ ? 1 : 0) | (kind & EV_WRITE ? 2 : 0);
+	info->cb(info->p, fd, mode, info->cb_data);
+}
 
-	int i;
-	for (i = 0; i < libevent->n; i++)
-		if (libevent->fdset[i] == fd)
-			break;
 
-	if (i < libevent->n) {
-		libevent->cbset[i].cb(libevent->p, fd, mode, libevent->cbset[i].cb_data);
-	} else {
-		DBGMSG("eventcb with unknown fd %d\n", fd);
+/* The state of @p, set up on first use. */
+static struct pubnub_timer_info *
+pubnub_libevent_info_get(struct pubnub *p)
+{
+	struct pubnub_timer_info *timer = (struct pubnub_timer_info *)p->cb_priv;
+	if (!timer) {
+		timer = (struct pubnub_timer_info *)calloc(1, sizeof(*timer));
+		timer->p = p;
+		p->cb_priv = timer;
+	}
+	return timer;
+}
+
+/* Release the state of @p once there is nothing left in it. */
+static void
+pubnub_libevent_info_put(struct pubnub *p)
+{
+	struct pubnub_timer_info *timer = (struct pubnub_timer_info *)p->cb_priv;
+	if (timer && !timer->ev && !timer->n_socks) {
+		free(timer);
+		p->cb_priv = NULL;
 	}
 }
 
@@ -68,7 +100,15 @@ pubnub_libevent_init(struct event_base *evbase)
 {
 	struct pubnub_libevent *libevent = (struct pubnub_libevent *)calloc(1, sizeof(*libevent));
 	libevent->evbase = evbase;
-	libevent->timer_event = evtimer_new(evbase, pubnub_libevent_timercb, libevent);
+	libevent->refs = 1;
+	return libevent;
+}
+
+PUBNUB_API
+struct pubnub_libevent *
+pubnub_libevent_ref(struct pubnub_libevent *libevent)
+{
+	libevent->refs++;
 	return libevent;
 }
 
@@ -82,21 +122,30 @@ pubnub_libevent_add_socket(struct pubnub *p, void *ctx_data, int fd, int mode,
 	DBGMSG("+ socket %d\n", fd);
 
 	struct pubnub_libevent *libevent = (struct pubnub_libevent *)ctx_data;
-	libevent->p = p;
 
-	int i = libevent->n++;
-
-	libevent->fdset = (int*)realloc(libevent->fdset, sizeof(*libevent->fdset) * libevent->n);
-	libevent->fdset[i] = fd;
+	if (fd >= libevent->socks_size) {
+		int size = libevent->socks_size ? libevent->socks_size : 16;
+		while (size <= fd)
+			size *= 2;
+		libevent->socks = (struct pubnub_cb_info **)realloc(libevent->socks, sizeof(*libevent->socks) * size);
+		memset(&libevent->socks[libevent->socks_size], 0, sizeof(*libevent->socks) * (size - libevent->socks_size));
+		libevent->socks_size = size;
+	}
 
-	libevent->cbset = (struct pubnub_cb_info*)realloc(libevent->cbset, sizeof(*libevent->cbset) * libevent->n);
-	libevent->cbset[i].cb = cb;
-	libevent->cbset[i].cb_data = cb_data;
+	struct pubnub_cb_info *info = (struct pubnub_cb_info *)malloc(sizeof(*info));
+	info->libevent = libevent;
+	info->p = p;
+	info->cb = cb;
+	info->cb_data = cb_data;
+	info->next = libevent->socks[fd];
+	libevent->socks[fd] = info;
+	libevent->n++;
+	if (!p->pool)
+		pubnub_libevent_info_get(p)->n_socks++;
 
-	libevent->evset = (struct event **)realloc(libevent->evset, sizeof(*libevent->evset) * libevent->n);
 	int kind = (mode & 1 ? EV_READ : 0) | (mode & 2 ? EV_WRITE : 0) | EV_PERSIST;
-	libevent->evset[i] = event_new(libevent->evbase, fd, kind, pubnub_libevent_eventcb, libevent);
-	event_add(libevent->evset[i], NULL);
+	info->ev = event_new(libevent->evbase, fd, kind, pubnub_libevent_eventcb, info);
+	event_add(info->ev, NULL);
 
 	DBGMSG("watching %d sockets\n", libevent->n);
 }
@@ -107,17 +156,19 @@ pubnub_libevent_rem_socket(struct pubnub *p, void *ctx_data, int fd)
 	DBGMSG("- socket %d\n", fd);
 	struct pubnub_libevent *libevent = (struct pubnub_libevent *)ctx_data;
 
-	for (int i = 0; i < libevent->n; i++) {
-		if (libevent->fdset[i] != fd)
-			continue;
-		event_free(libevent->evset[i]);
-		memmove(&libevent->fdset[i], &libevent->fdset[i + 1], (libevent->n - i - 1) * sizeof(*libevent->fdset));
-		memmove(&libevent->cbset[i], &libevent->cbset[i + 1], (libevent->n - i - 1) * sizeof(*libevent->cbset));
-		memmove(libevent->evset + i, libevent->evset + i + 1, (libevent->n - i - 1) * sizeof(*libevent->evset));
-		libevent->n--;
+	if (fd < 0 || fd >= libevent->socks_size || !libevent->socks[fd]) {
+		DBGMSG("! did not find socket %d\n", fd);
 		return;
 	}
-	DBGMSG("! did not find socket %d\n", fd);
+	struct pubnub_cb_info *info = libevent->socks[fd];
+	libevent->socks[fd] = info->next;
+	libevent->n--;
+	if (info->p == p && !p->pool) {
+		((struct pubnub_timer_info *)p->cb_priv)->n_socks--;
+		pubnub_libevent_info_put(p);
+	}
+	event_free(info->ev);
+	free(info);
 }
 
 void
@@ -125,18 +176,32 @@ pubnub_libevent_timeout(struct pubnub *p, void *ctx_data, const struct timespec
 		void (*cb)(struct pubnub *p, void *cb_data), void *cb_data)
 {
 	struct pubnub_libevent *libevent = (struct pubnub_libevent *)ctx_data;
-	if (evtimer_pending(libevent->timer_event, NULL))
-		evtimer_del(libevent->timer_event);
+	struct pubnub_timer_info *timer = (struct pubnub_timer_info *)p->cb_priv;
+
+	if (!cb) {
+		/* No timeout needed for now; we do not keep the timer
+		 * around as we may not get to see this context again
+		 * (e.g. in case of pools). */
+		if (timer && timer->ev) {
+			event_free(timer->ev);
+			timer->ev = NULL;
+			pubnub_libevent_info_put(p);
+		}
+		return;
+	}
 
-	libevent->p = p;
+	timer = pubnub_libevent_info_get(p);
+	if (!timer->ev) {
+		timer->ev = evtimer_new(libevent->evbase, pubnub_libevent_timercb, timer);
+	} else if (evtimer_pending(timer->ev, NULL)) {
+		evtimer_del(timer->ev);
+	}
 
-	libevent->timer_cb = cb;
-	libevent->timer_cb_data = cb_data;
+	timer->cb = cb;
+	timer->cb_data = cb_data;
 
-	if (libevent->timer_cb) {
-		struct timeval timeout = { SFINIT(.tv_sec, ts->tv_sec), SFINIT(.tv_usec, ts->tv_nsec / 1000) };
-		evtimer_add(libevent->timer_event, &timeout);
-	}
+	struct timeval timeout = { SFINIT(.tv_sec, ts->tv_sec), SFINIT(.tv_usec, ts->tv_nsec / 1000) };
+	evtimer_add(timer->ev, &timeout);
 }
 
 void
@@ -149,11 +214,9 @@ void
 pubnub_libevent_stop_wait(struct pubnub *p, void *ctx_data)
 {
 	/* cancel timer, all other events should be already cancelled */
-	struct pubnub_libevent *libevent = (struct pubnub_libevent *)ctx_data;
-	if (libevent->n > 0)
-		DBGMSG("warning: stop_wait with %d sockets still registered\n", libevent->n);
-	if (evtimer_pending(libevent->timer_event, NULL))
-		evtimer_del(libevent->timer_event);
+	struct pubnub_timer_info *timer = (struct pubnub_timer_info *)p->cb_priv;
+	if (timer && timer->ev && evtimer_pending(timer->ev, NULL))
+		evtimer_del(timer->ev);
 }
 
 void
@@ -161,13 +224,41 @@ pubnub_libevent_done(struct pubnub *p, void *ctx_data)
 {
 	struct pubnub_libevent *libevent = (struct pubnub_libevent *)ctx_data;
 
-	for (int i = 0; i < libevent->n; i++)
-		event_free(libevent->evset[i]);
-	event_free(libevent->timer_event);
+	/* p is NULL for pools. */
+	struct pubnub_timer_info *timer = p ? (struct pubnub_timer_info *)p->cb_priv : NULL;
+	if (timer && timer->ev)
+		event_free(timer->ev);
+
+	/* Unless this is the last user of the loop, only the sockets of
+	 * @p go; libcurl has usually removed those already, so stop as
+	 * soon as there are none left. */
+	bool last = libevent->refs == 1;
+	int left = timer ? timer->n_socks : 0;
+	for (int fd = 0; fd < libevent->socks_size && (last || left > 0); fd++) {
+		struct pubnub_cb_info **infop = &libevent->socks[fd];
+		while (*infop) {
+			struct pubnub_cb_info *info = *infop;
+			if (!last && info->p != p) {
+				infop = &info->next;
+				continue;
+			}
+			if (info->p == p)
+				left--;
+			*infop = info->next;
+			libevent->n--;
+			event_free(info->ev);
+			free(info);
+		}
+	}
+	if (timer) {
+		free(timer);
+		p->cb_priv = NULL;
+	}
+
+	if (--libevent->refs > 0)
+		return;
 
-	if (libevent->fdset) free(libevent->fdset);
-	if (libevent->evset) free(libevent->evset);
-	if (libevent->cbset) free(libevent->cbset);
+	if (libevent->socks) free(libevent->socks);
 	free(libevent);
 }
 
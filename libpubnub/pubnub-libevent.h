@@ -14,9 +14,19 @@ struct json_object;
 /* Callback structure to pass pubnub_init(). */
 extern const struct pubnub_callbacks pubnub_libevent_callbacks;
 
-/* Callback data to pass pubnub_init(). */
+/* Callback data to pass pubnub_init().
+ *
+ * The object is released by pubnub_done() of the context it has been
+ * passed to.  To drive many contexts on the same @evbase, you can share
+ * a single object among them; use pubnub_libevent_ref() to obtain the
+ * callback data for each additional context. */
 struct pubnub_libevent *pubnub_libevent_init(struct event_base *evbase);
 
+/* Take another reference of @libevent for use by one more context
+ * (or pool), returning @libevent. Each pubnub_done() (or
+ * pubnub_pool_done()) releases one reference. */
+struct pubnub_libevent *pubnub_libevent_ref(struct pubnub_libevent *libevent);
+
 #ifdef __cplusplus
 }
 #endif
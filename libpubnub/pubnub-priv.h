@@ -1,6 +1,7 @@
 #ifndef PUBNUB__PubNub_priv_h
 #define PUBNUB__PubNub_priv_h
 
+#include <stdint.h>
 #include <printbuf.h>
 #include <curl/curl.h>
 
@@ -10,23 +11,157 @@ struct json_object;
 
 typedef void (*pubnub_http_cb)(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data);
 
+/* A request running on the multi handle independently of the method
+ * slot of the context; see pubnub_publish_enqueue(). */
+struct pubnub_req {
+	struct pubnub_req *next;
+	struct pubnub *p;
+
+	const char *method;
+	pubnub_http_cb cb;
+	void *cb_data;
+
+	CURL *curl;
+	char curl_error[CURL_ERROR_SIZE];
+	struct printbuf *url;
+	/* NULL until the response starts arriving. */
+	struct printbuf *body;
+	size_t body_len;
+	bool body_too_large;
+	long timeout;
+};
+
+/* A message handed over by pubnub_publish_submit(); the channel and
+ * message strings follow the structure.  With fn set, it is a call of
+ * pubnub_submit_call() instead, taking cb_data (and drop). */
+struct pubnub_submit {
+	struct pubnub_submit *next;
+	void (*fn)(struct pubnub *p, void *data);
+	void (*drop)(void *data);
+	pubnub_publish_cb cb;
+	void *cb_data;
+	long timeout;
+	char *channel;
+	char *message;
+};
+
+/* A set of contexts sharing one multi handle, share handle and frontend;
+ * see pubnub_pool_init(). */
+struct pubnub_pool {
+	const struct pubnub_callbacks *cb;
+	void *cb_data;
+
+	CURLM *curlm;
+	CURLSH *curlsh;
+
+	/* Contexts attached to the pool. */
+	struct pubnub *members;
+	/* The context the frontend timer was last set up through;
+	 * frontends may keep one timer per context. */
+	struct pubnub *timer_p;
+	/* Members with a deadline of their own (a request on hold or
+	 * queued publishes waiting), linked through pool_wake_next; the
+	 * pool timer unlinks those whose deadlines are gone. */
+	struct pubnub *wake;
+
+	/* Decryption worker threads for contexts without their own. */
+	struct pubnub_workers *workers;
+	int workers_min_batch;
+
+	/* Requests of all members go over HTTP/2. */
+	bool http2;
+};
+
+/* Room for a textual IPv6 address in brackets. */
+#define PUBNUB_DNS_ADDR_LEN 48
+
 struct channelset {
 	const char **set;
 	int n;
+
+	/* The rest is maintained only by channelset_add() and friends;
+	 * a channelset constructed just from set and n is a plain view. */
+	int alloc;
+	/* Indices + 1 into set[], 0 means empty slot; NULL for small
+	 * channelsets. */
+	int *hash;
+	int hash_size;
+	/* Cached comma-joined and URL-encoded names. */
+	struct printbuf *str, *str_enc;
+	bool str_valid;
+};
+
+/* Settings shared by contexts; see pubnub_config_new().  Every context
+ * has one, even if just its own. */
+struct pubnub_config {
+	int refs;
+	char *publish_key, *subscribe_key;
+	struct printbuf *publish_key_enc, *subscribe_key_enc;
+	char *secret_key, *cipher_key;
+	char *origin;
+	struct curl_slist *curl_headers;
+	struct pubnub_cacerts *ssl_cacerts;
+};
+
+/* Channel handler registered by pubnub_on_channel(). */
+struct pubnub_demux {
+	pubnub_channel_cb cb;
+	void *cb_data;
+};
+
+/* Number of prefix patterns of the given length. */
+struct pubnub_demux_prefix {
+	int len;
+	int n;
+};
+
+/* Occupants of a channel known to the presence cache. */
+struct pubnub_presence {
+	struct channelset uuids;
+	int occupancy;
+	/* When the last here_now response came in (ms on the monotonic
+	 * clock), 0 if the occupants are not known for sure. */
+	long long fetched_at;
+	/* The here_now response served from the cache, built from the
+	 * above on demand; NULL if not built yet. */
+	struct json_object *response;
 };
 
 struct pubnub {
+	/* The key, origin and header fields below point to those of
+	 * config unless they have been set on the context itself. */
+	struct pubnub_config *config;
 	char *publish_key, *subscribe_key;
+	/* URL-encoded keys, used whenever the keys are URL elements. */
+	struct printbuf *publish_key_enc, *subscribe_key_enc;
 	char *secret_key, *cipher_key;
+	/* MD5 state (MD5_CTX) after the keys prefix of publish
+	 * signatures; NULL until the first signed publish. */
+	struct MD5state_st *sig_prefix;
+	/* Cipher state derived from cipher_key. */
+	struct pubnub_cipher *cipher;
+	/* Decryption worker threads, if any; see also the pool's. */
+	struct pubnub_workers *workers;
+	int workers_min_batch;
 	char *origin;
 	char *uuid;
 
 	char time_token[64];
 	struct channelset channelset;
 	bool resume_on_reconnect;
+	/* Channel changes requested while a join or leave was in
+	 * progress; they are carried out by one join and one leave
+	 * once it finishes, before subscribing again.  Only the latest
+	 * unsubscribe callback is kept. */
+	struct channelset join_queue, leave_queue;
+	pubnub_unsubscribe_cb queue_unsub_cb;
+	void *queue_unsub_call_data;
+	long queue_unsub_timeout;
 
 	const struct pubnub_callbacks *cb;
 	void *cb_data;
+	/* Per-context state of the frontend, if it needs any. */
+	void *cb_priv;
 
 	/* Name of method currently in progress; NULL if there is no
 	 * method in progress currently. */
@@ -46,17 +181,178 @@ struct pubnub {
 	/* Error retry policy. */
 	unsigned int error_retry_mask;
 	bool error_print;
+	long retry_base_ms, retry_max_ms;
+	int retry_max_attempts;
+	/* Retries of the current call so far. */
+	int retry_attempt;
+	unsigned int retry_seed;
+	/* The request on hold (error retry, open circuit breaker or
+	 * subscribe batching) goes out at hold_until [ms], if set. */
+	long long hold_until;
+	/* Circuit breaker; it is open while breaker_failures (consecutive
+	 * failed requests) is at least breaker_threshold and the time
+	 * is before breaker_until [ms]. */
+	int breaker_threshold;
+	long breaker_cooldown_ms;
+	int breaker_failures;
+	long long breaker_until;
+	/* Subscribe batching; the next subscribe request is held back
+	 * until pace_until [ms], if set. */
+	long batch_window_ms;
+	int batch_max;
+	long long pace_until;
+	/* Subscribe backpressure; backlog messages were delivered and are
+	 * not consumed yet, and the next subscribe request is held back
+	 * (backlog_held) while there are backlog_high of them, until the
+	 * backlog is down to backlog_low. */
+	int backlog, backlog_high, backlog_low;
+	bool backlog_held;
+	/* Subscribe duplicate suppression; the hashes of the last
+	 * dedupe_n (up to dedupe_size) messages, the oldest one at
+	 * dedupe_pos once full. */
+	uint64_t *dedupe;
+	int dedupe_size, dedupe_n, dedupe_pos;
+
+	/* Request statistics; NULL unless enabled. */
+	struct pubnub_stats *stats;
+	pubnub_stats_cb stats_cb;
+	void *stats_cb_data;
+	/* Record of the request being finished, if any. */
+	struct pubnub_request_stats *stats_cur;
+	/* Time spent parsing the response as it arrived. */
+	double stats_parse;
+
+	/* NULL for malloc(). */
+	const struct pubnub_allocator *alloc;
+	void *alloc_data;
+	/* Bump arena of transient request allocations, PUBNUB_ARENA_SIZE
+	 * bytes; arena_live of them are still in use, the topmost one
+	 * (if arena_used) at arena_top. */
+	char *arena;
+	size_t arena_used, arena_top;
+	int arena_live;
 
 	bool nosignal;
+	/* Keep the easy handle (and with it the connection and SSL
+	 * session caches) around between requests. */
+	bool keepalive;
+	/* Use HTTP/2, multiplexing the requests over one connection. */
+	bool http2;
 
 	CURL *curl;
+	/* Idle easy handle kept for reuse by the next request
+	 * when keepalive is set; NULL otherwise. */
+	CURL *curl_idle;
+	/* Our own multi handle, or the pool's one if pool is set. */
 	CURLM *curlm;
+	struct pubnub_pool *pool;
+	struct pubnub *pool_next;
+	/* On the pool->wake list. */
+	struct pubnub *pool_wake_next;
+	bool pool_wake;
 	struct curl_slist *curl_headers;
+	/* Use the process-wide DNS cache; see pubnub_prewarm(). */
+	bool dns_cache;
+	char *dns_hostport;
+	/* CURLOPT_RESOLVE entry of the origin at dns_addr, and the
+	 * one before it (handles may still refer to it). */
+	struct curl_slist *dns_resolve, *dns_resolve_old;
+	char dns_addr[PUBNUB_DNS_ADDR_LEN];
 	char curl_error[CURL_ERROR_SIZE];
 	struct printbuf *url;
+	/* Taken from the body pool only while the response arrives. */
 	struct printbuf *body;
+	/* Response bytes received so far; body_too_large is set once
+	 * they go over body_max (if not 0).  A body buffer larger than
+	 * body_keep is freed instead of going back to the pool. */
+	size_t body_len;
+	size_t body_max;
+	size_t body_keep;
+	bool body_too_large;
+	/* The caller's buffer used for body instead, if buf is set;
+	 * see pubnub_set_response_buffer(). */
+	struct printbuf body_fixed;
+	pubnub_first_byte_cb first_byte_cb;
+	void *first_byte_cb_data;
 	long timeout;
-	struct stack_st_X509_INFO *ssl_cacerts;
+	/* Shared with other contexts using the same CA certificates. */
+	struct pubnub_cacerts *ssl_cacerts;
+	/* Process-wide SSL session cache, unless in a pool. */
+	CURLSH *ssl_share;
+
+	/* Parse the response as it arrives instead of collecting it
+	 * in body first. body_tok is set iff the current request is
+	 * parsed this way; body_response is the complete response
+	 * once parsed, body_error is set if it failed to parse. */
+	bool parse_incremental;
+	/* Ask for compressed responses. */
+	bool compress;
+	/* Do not parse the response at all, the finished_cb will
+	 * look at body itself (raw subscribe). */
+	bool body_raw;
+	struct json_tokener *body_tok;
+	struct json_object *body_response;
+	bool body_error;
+
+	/* Channel names array reused by pubnub_subscribe_const()
+	 * callbacks. */
+	const char **batch_channels;
+	int batch_channels_size;
+
+	/* Side requests (queued publishes): waiting to be sent (FIFO),
+	 * in flight (at most reqs_max of them) and recycled ones. */
+	struct pubnub_req *reqs_pending, *reqs_pending_tail;
+	struct pubnub_req *reqs;
+	int reqs_n, reqs_max;
+	struct pubnub_req *reqs_free;
+	int reqs_free_n;
+	int reqs_pending_n, reqs_pending_max;
+
+	/* Publish rate limiter (token bucket); see pubnub_set_publish_rate().
+	 * There were rate_tokens at rate_at [ms]; rate_wake is when the
+	 * publish at the head of the queue gets its token, or when the
+	 * circuit breaker lets a queued request through, if it waits. */
+	double rate, rate_burst, rate_tokens;
+	long long rate_at, rate_wake;
+	/* See pubnub_set_publish_watermark(). */
+	int watermark_high, watermark_low;
+	bool watermark_above;
+	pubnub_watermark_cb watermark_cb;
+	void *watermark_cb_data;
+
+	/* Messages pushed by pubnub_publish_submit(), newest first; the
+	 * pushing threads wake us up through submit_fd (-1 until
+	 * pubnub_submit_init(), the write end is [1]). */
+	struct pubnub_submit *submit_head;
+	int submit_fd[2];
+
+	/* Server clock estimate; see pubnub_now().  All times are ns on
+	 * the local monotonic clock.  clock_sent and clock_recv bound the
+	 * exchange of the request that has just finished.  The estimate
+	 * is the sample with the shortest round trip, taken at clock_at
+	 * (0 if none yet); the drift is measured against the anchor. */
+	long clock_sync_ms;
+	bool clock_syncing;
+	long long clock_sent, clock_recv;
+	long long clock_at, clock_offset, clock_delay, clock_last;
+	long long clock_anchor_at, clock_anchor_offset;
+	double clock_drift;
+
+	/* Presence cache; see pubnub_set_presence_cache().  presence[i]
+	 * belongs to the channel presence_channels.set[i]. */
+	long presence_ttl_ms;
+	struct channelset presence_channels;
+	struct pubnub_presence *presence;
+	int presence_alloc;
+
+	/* Channel handlers; demux[i] belongs to the pattern
+	 * demux_patterns.set[i].  The prefix lengths are kept longest
+	 * first. */
+	struct channelset demux_patterns;
+	struct pubnub_demux *demux;
+	int demux_alloc;
+	struct pubnub_demux_prefix *demux_prefix;
+	int demux_prefix_n;
 };
 
 #ifdef DEBUG
@@ -67,6 +363,29 @@ struct pubnub {
 #define VERBOSE_VAL 0L
 #endif
 
+/* The keys in effect; with PUBNUB_NO_CRYPTO, there is no signing nor
+ * encryption, and the branches taking care of them compile out. */
+#ifndef PUBNUB_NO_CRYPTO
+#define PUBNUB_SECRET_KEY(p) ((p)->secret_key)
+#define PUBNUB_CIPHER_KEY(p) ((p)->cipher_key)
+#else
+#define PUBNUB_SECRET_KEY(p) ((const char *) NULL)
+#define PUBNUB_CIPHER_KEY(p) ((const char *) NULL)
+#endif
+
+/* Does @p have settings the library cannot honour?  Those are the keys
+ * with PUBNUB_NO_CRYPTO, and then also the CA certificates if libcurl
+ * cannot take them from memory.  Rather than going out unsigned, in
+ * the clear or trusting the wrong CAs, the requests fail right away
+ * with PNR_NO_CRYPTO. */
+#ifndef PUBNUB_NO_CRYPTO
+#define PUBNUB_CRYPTO_MISSING(p) false
+#elif LIBCURL_VERSION_NUM >= 0x074d00
+#define PUBNUB_CRYPTO_MISSING(p) ((p)->secret_key || (p)->cipher_key)
+#else
+#define PUBNUB_CRYPTO_MISSING(p) ((p)->secret_key || (p)->cipher_key || (p)->ssl_cacerts)
+#endif
+
 #ifdef _MSC_VER
 #define PUBNUB_API
 #else
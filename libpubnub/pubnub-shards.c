@@ -0,0 +1,299 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* For pthread_setaffinity_np(). */
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pubnub.h"
+#include "pubnub-epoll.h"
+#include "pubnub-shards.h"
+#include "pubnub-priv.h"
+
+
+/** Data structures. */
+
+struct pubnub_shard {
+	struct pubnub_epoll *ep;
+	struct pubnub_pool *pool;
+	/* A context of the pool just for pubnub_submit_call(). */
+	struct pubnub *anchor;
+	pthread_t thread;
+	bool started;
+	bool stop;
+	/* Waiting for events, so it can take work; see pubnub_shards_work(). */
+	bool idle;
+	int cpu;
+};
+
+/* A pubnub_shards_call() or pubnub_shards_work() in flight. */
+struct pubnub_shards_job {
+	struct pubnub_shards_job *next;
+	struct pubnub_shards *s;
+	int i;
+	void (*work)(void *data);
+	void (*fn)(struct pubnub_shards *s, int i, void *data);
+	void *data;
+};
+
+struct pubnub_shards {
+	struct pubnub_shard *shards;
+	int n;
+
+	/* Work shared by all the shards. */
+	pthread_mutex_t work_lock;
+	struct pubnub_shards_job *work_head, *work_tail;
+};
+
+
+/** Work sharing */
+
+static struct pubnub_shards_job *
+pubnub_shards_work_take(struct pubnub_shards *s)
+{
+	pthread_mutex_lock(&s->work_lock);
+	struct pubnub_shards_job *job = s->work_head;
+	if (job) {
+		s->work_head = job->next;
+		if (!s->work_head)
+			s->work_tail = NULL;
+	}
+	pthread_mutex_unlock(&s->work_lock);
+	return job;
+}
+
+static void
+pubnub_shards_call_cb(struct pubnub *p, void *data)
+{
+	struct pubnub_shards_job *job = (struct pubnub_shards_job *)data;
+	if (job->fn)
+		job->fn(job->s, job->i, job->data);
+	free(job);
+}
+
+/* A job still queued at its anchor when the shard went away. */
+static void
+pubnub_shards_call_drop(void *data)
+{
+	free(data);
+}
+
+/* Do the work queued so far, sending each job on to its shard. */
+static void
+pubnub_shards_work_run(struct pubnub_shards *s)
+{
+	struct pubnub_shards_job *job;
+	while ((job = pubnub_shards_work_take(s)) != NULL) {
+		job->work(job->data);
+		pubnub_submit_call(s->shards[job->i].anchor, pubnub_shards_call_cb, pubnub_shards_call_drop, job);
+	}
+}
+
+static void
+pubnub_shards_nop(struct pubnub_shards *s, int i, void *data)
+{
+}
+
+static void
+pubnub_shards_stop(struct pubnub_shards *s, int i, void *data)
+{
+	s->shards[i].stop = true;
+	pubnub_epoll_break(s->shards[i].ep);
+}
+
+
+/** Shard threads */
+
+static void *
+pubnub_shards_thread(void *arg)
+{
+	struct pubnub_shards_job *start = (struct pubnub_shards_job *)arg;
+	struct pubnub_shards *s = start->s;
+	struct pubnub_shard *sh = &s->shards[start->i];
+	free(start);
+
+#ifdef __linux__
+	if (sh->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(sh->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#endif
+
+	while (!sh->stop) {
+		/* Announce ourselves idle before the last look at the
+		 * work queue; pubnub_shards_work() queues first and looks
+		 * for an idle shard to wake up then, so no work is left
+		 * behind while all of us sleep. */
+		__atomic_store_n(&sh->idle, true, __ATOMIC_SEQ_CST);
+		pubnub_shards_work_run(s);
+		if (pubnub_epoll_run_once(sh->ep, -1) < 0)
+			break;
+		__atomic_store_n(&sh->idle, false, __ATOMIC_SEQ_CST);
+		pubnub_shards_work_run(s);
+	}
+	return NULL;
+}
+
+
+/** Public API */
+
+PUBNUB_API
+struct pubnub_shards *
+pubnub_shards_init(int n, bool pin)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (n <= 0)
+		n = cpus;
+
+	struct pubnub_shards *s = (struct pubnub_shards *)calloc(1, sizeof(*s));
+	if (!s) return NULL;
+	s->shards = (struct pubnub_shard *)calloc(n, sizeof(*s->shards));
+	if (!s->shards) {
+		free(s);
+		return NULL;
+	}
+	s->n = n;
+	pthread_mutex_init(&s->work_lock, NULL);
+
+	for (int i = 0; i < n; i++) {
+		struct pubnub_shard *sh = &s->shards[i];
+		sh->cpu = pin ? i % cpus : -1;
+		sh->ep = pubnub_epoll_init();
+		if (!sh->ep)
+			goto fail;
+		sh->pool = pubnub_pool_init(&pubnub_epoll_callbacks, sh->ep);
+		sh->anchor = pubnub_init_pooled(sh->pool, "", "");
+		if (!pubnub_submit_init(sh->anchor))
+			goto fail;
+	}
+	for (int i = 0; i < n; i++) {
+		struct pubnub_shards_job *start = (struct pubnub_shards_job *)calloc(1, sizeof(*start));
+		start->s = s;
+		start->i = i;
+		if (pthread_create(&s->shards[i].thread, NULL, pubnub_shards_thread, start) != 0) {
+			free(start);
+			goto fail;
+		}
+		s->shards[i].started = true;
+	}
+	return s;
+
+fail:
+	pubnub_shards_done(s);
+	return NULL;
+}
+
+PUBNUB_API
+void
+pubnub_shards_done(struct pubnub_shards *s)
+{
+	for (int i = 0; i < s->n; i++)
+		if (s->shards[i].started)
+			pubnub_shards_call(s, i, pubnub_shards_stop, NULL);
+	for (int i = 0; i < s->n; i++)
+		if (s->shards[i].started)
+			pthread_join(s->shards[i].thread, NULL);
+
+	struct pubnub_shards_job *job;
+	while ((job = pubnub_shards_work_take(s)) != NULL)
+		free(job);
+	for (int i = 0; i < s->n; i++) {
+		struct pubnub_shard *sh = &s->shards[i];
+		/* This cancels the calls in progress, and frees the calls
+		 * and finished work still queued at the anchors. */
+		if (sh->pool)
+			pubnub_pool_done(sh->pool);
+		if (sh->ep)
+			pubnub_epoll_free(sh->ep);
+	}
+	pthread_mutex_destroy(&s->work_lock);
+	free(s->shards);
+	free(s);
+}
+
+PUBNUB_API
+int
+pubnub_shards_count(struct pubnub_shards *s)
+{
+	return s->n;
+}
+
+PUBNUB_API
+int
+pubnub_shards_pick(struct pubnub_shards *s, const char *key)
+{
+	/* FNV-1a of the key, then the jump consistent hash of Lamping
+	 * and Veach: a key moves to a new bucket with probability 1/n
+	 * as the n-th bucket is added, and never between the old ones. */
+	uint64_t h = 14695981039346656037ULL;
+	for (const unsigned char *c = (const unsigned char *)key; *c; c++)
+		h = (h ^ *c) * 1099511628211ULL;
+
+	long long b = -1, j = 0;
+	while (j < s->n) {
+		b = j;
+		h = h * 2862933555777941757ULL + 1;
+		j = (long long) ((b + 1) * ((double) (1LL << 31) / (double) ((h >> 33) + 1)));
+	}
+	return (int) b;
+}
+
+PUBNUB_API
+struct pubnub_pool *
+pubnub_shards_pool(struct pubnub_shards *s, int i)
+{
+	return s->shards[i].pool;
+}
+
+PUBNUB_API
+void
+pubnub_shards_call(struct pubnub_shards *s, int i,
+		void (*fn)(struct pubnub_shards *s, int i, void *data), void *data)
+{
+	struct pubnub_shards_job *job = (struct pubnub_shards_job *)calloc(1, sizeof(*job));
+	job->s = s;
+	job->i = i;
+	job->fn = fn;
+	job->data = data;
+	pubnub_submit_call(s->shards[i].anchor, pubnub_shards_call_cb, pubnub_shards_call_drop, job);
+}
+
+PUBNUB_API
+void
+pubnub_shards_work(struct pubnub_shards *s, int i, void (*work)(void *data),
+		void (*done)(struct pubnub_shards *s, int i, void *data), void *data)
+{
+	struct pubnub_shards_job *job = (struct pubnub_shards_job *)calloc(1, sizeof(*job));
+	job->s = s;
+	job->i = i;
+	job->work = work;
+	job->fn = done;
+	job->data = data;
+
+	pthread_mutex_lock(&s->work_lock);
+	if (s->work_tail)
+		s->work_tail->next = job;
+	else
+		s->work_head = job;
+	s->work_tail = job;
+	pthread_mutex_unlock(&s->work_lock);
+
+	/* Wake up an idle shard to take it, the caller's last; if all
+	 * are busy, the first one done with its events takes it. */
+	for (int k = 1; k <= s->n; k++) {
+		int j = (i + k) % s->n;
+		if (__atomic_load_n(&s->shards[j].idle, __ATOMIC_SEQ_CST)) {
+			pubnub_shards_call(s, j, pubnub_shards_nop, NULL);
+			break;
+		}
+	}
+}
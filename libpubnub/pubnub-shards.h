@@ -0,0 +1,61 @@
+#ifndef PUBNUB__PubNub_shards_h
+#define PUBNUB__PubNub_shards_h
+
+#include <pubnub.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Opaque objects. */
+struct pubnub_shards;
+
+/* A sharded runtime: @n event loop threads (0 means one per online
+ * CPU), each running a pubnub_epoll loop with a pool of its own.  With
+ * @pin, shard i is pinned to CPU i (Linux only; elsewhere this is just
+ * a hint ignored).  Each context belongs to a single shard all its life
+ * and is driven by that thread only, so the shards share nothing on
+ * the hot paths and the subscribe throughput scales with the cores.
+ *
+ * Returns NULL if the event loops or threads cannot be set up. */
+struct pubnub_shards *pubnub_shards_init(int n, bool pin);
+
+/* Stop the threads, then deinitialize the pools (and with them the
+ * contexts still attached, cancelling the calls in progress; the
+ * callbacks are called on the calling thread).  Work not taken by any
+ * shard yet is dropped.  No other thread may be using @s by then. */
+void pubnub_shards_done(struct pubnub_shards *s);
+
+/* Return the number of shards. */
+int pubnub_shards_count(struct pubnub_shards *s);
+
+/* Return the shard a context for @key (a channel name or UUID) should
+ * go to.  The keys are spread by consistent hashing: a runtime of one
+ * more shard places just 1/n of the keys differently. */
+int pubnub_shards_pick(struct pubnub_shards *s, const char *key);
+
+/* Return the pool of shard @i.  Contexts of the shard are initialized
+ * with pubnub_init_pooled() or pubnub_init_config() on the thread of
+ * the shard, i.e. from a pubnub_shards_call() function. */
+struct pubnub_pool *pubnub_shards_pool(struct pubnub_shards *s, int i);
+
+/* Have @fn called with @data on the thread of shard @i, from any
+ * thread and without locking; see pubnub_submit_call().  This is the
+ * way to get contexts created on the shard and calls issued with
+ * them. */
+void pubnub_shards_call(struct pubnub_shards *s, int i,
+		void (*fn)(struct pubnub_shards *s, int i, void *data), void *data);
+
+/* Hand CPU-heavy @work (decrypting, parsing large messages and the
+ * like) over to the runtime; it is run with @data on whichever shard
+ * gets to it first, which is an idle one if there is any, and then
+ * @done is called with @data on the thread of shard @i (typically the
+ * caller's own).  @done may be NULL. */
+void pubnub_shards_work(struct pubnub_shards *s, int i, void (*work)(void *data),
+		void (*done)(struct pubnub_shards *s, int i, void *data), void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,12 +9,14 @@
 #include <poll.h>
 #endif
 
+/* The timeouts are measured on a clock that does not jump (with NTP
+ * adjustments, say). */
 #ifdef __MACH__ 
 #include <mach/clock.h>
 #include <mach/mach.h>
 #define GET_CLOCK_NOW clock_serv_t cclock; \
 	mach_timespec_t mts; \
-	host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock); \
+	host_get_clock_service(mach_host_self(), SYSTEM_CLOCK, &cclock); \
 	clock_get_time(cclock, &mts); \
 	mach_port_deallocate(mach_task_self(), cclock); \
 	now.tv_sec = mts.tv_sec; \
@@ -28,7 +30,7 @@
 	 now.tv_sec = int(t/li); \
 	 now.tv_nsec = int((t - now.tv_sec * li) * 1000000000 / li);
 #else
-#define GET_CLOCK_NOW clock_gettime(CLOCK_REALTIME, &now); 
+#define GET_CLOCK_NOW clock_gettime(CLOCK_MONOTONIC, &now);
 #endif
 #endif
 
@@ -62,6 +64,22 @@ struct pubnub_sync {
 	struct json_object *response;
 	/* Channel information from the last subscribe. */
 	char **channels;
+	/* The last method was a subscribe whose messages have not been
+	 * taken over by pubnub_sync_next_message() yet. */
+	bool batch_new;
+
+	/* pubnub_sync_next_message() state: the batch being walked
+	 * through, owned by us alone, and its timetoken. */
+	struct json_object *iter_response;
+	char **iter_channels;
+	int iter_i, iter_n;
+	char iter_time_token[64];
+	/* The next subscribe has been issued and is underway, and
+	 * whether we are waiting for it now. */
+	bool iter_pending, iter_waiting;
+	/* Make the next wait return right away, leaving the request
+	 * to be waited for later. */
+	bool nowait;
 };
 
 static void
@@ -77,6 +95,40 @@ pubnub_sync_reset(struct pubnub_sync *sync)
 		free(sync->channels);
 		sync->channels = NULL;
 	}
+	sync->batch_new = false;
+}
+
+void pubnub_sync_wait(struct pubnub *p, void *ctx_data);
+static void pubnub_sync_poll(struct pubnub *p, struct pubnub_sync *sync, bool block);
+
+static void
+pubnub_sync_iter_reset(struct pubnub_sync *sync)
+{
+	if (sync->iter_response) {
+		json_object_put(sync->iter_response);
+		sync->iter_response = NULL;
+	}
+	if (sync->iter_channels) {
+		for (int i = 0; sync->iter_channels[i]; i++)
+			free(sync->iter_channels[i]);
+		free(sync->iter_channels);
+		sync->iter_channels = NULL;
+	}
+	sync->iter_i = sync->iter_n = 0;
+}
+
+/* Issue the subscribe following the current batch without waiting
+ * for it; it gets waited for once the batch is consumed. */
+static void
+pubnub_sync_iter_prefetch(struct pubnub *p, struct pubnub_sync *sync, long timeout)
+{
+	sync->nowait = true;
+	pubnub_subscribe(p, NULL, timeout, NULL, NULL);
+	/* If wait was not called, the request has already finished. */
+	sync->iter_pending = !sync->nowait;
+	if (!sync->iter_pending)
+		sync->stop = false;
+	sync->nowait = false;
 }
 
 
@@ -114,6 +166,63 @@ pubnub_sync_last_channels(struct pubnub_sync *sync)
 	return sync->channels;
 }
 
+PUBNUB_API
+enum pubnub_res
+pubnub_sync_next_message(struct pubnub *p, struct pubnub_sync *sync, long timeout,
+		const char **channel, struct json_object **msg, const char **time_token)
+{
+	for (;;) {
+		if (sync->iter_i < sync->iter_n) {
+			if (sync->iter_pending) {
+				/* Nobody else drives the prefetched
+				 * subscribe until the batch is consumed;
+				 * get it out and keep it going meanwhile.
+				 * If it finishes, pubnub_sync_subscribe_cb()
+				 * takes care. */
+				pubnub_sync_poll(p, sync, false);
+			}
+			int i = sync->iter_i++;
+			*msg = json_object_array_get_idx(sync->iter_response, i);
+			if (channel)
+				*channel = sync->iter_channels[i];
+			if (time_token)
+				*time_token = sync->iter_time_token;
+			return PNR_OK;
+		}
+
+		/* The batch is consumed, wait for the next one. */
+		pubnub_sync_iter_reset(sync);
+		if (!sync->batch_new) {
+			if (!sync->iter_pending)
+				pubnub_sync_iter_prefetch(p, sync, timeout);
+			if (sync->iter_pending) {
+				sync->iter_waiting = true;
+				pubnub_sync_wait(p, sync);
+				sync->iter_waiting = false;
+				sync->iter_pending = false;
+			}
+			if (!sync->batch_new) {
+				/* An error, or the subscribe did not
+				 * even get through (some other request
+				 * held the context). */
+				*msg = NULL;
+				return sync->result == PNR_OK ? PNR_OCCUPIED : sync->result;
+			}
+		}
+
+		/* Take the batch over, so that the prefetched subscribe
+		 * finishing does not drop it. */
+		sync->iter_response = sync->response;
+		sync->iter_channels = sync->channels;
+		sync->iter_n = json_object_array_length(sync->response);
+		sync->response = NULL;
+		sync->channels = NULL;
+		sync->batch_new = false;
+		strcpy(sync->iter_time_token, p->time_token);
+		pubnub_sync_iter_prefetch(p, sync, timeout);
+	}
+}
+
 
 /** Event callbacks */
 
@@ -167,7 +276,7 @@ pubnub_sync_timeout(struct pubnub *p, void *ctx_data, const struct timespec *ts,
 		GET_CLOCK_NOW
 		sync->timeout_at.tv_sec = now.tv_sec + ts->tv_sec;
 		sync->timeout_at.tv_nsec = now.tv_nsec + ts->tv_nsec;
-		if (sync->timeout_at.tv_nsec > 1000000000L) {
+		if (sync->timeout_at.tv_nsec >= 1000000000L) {
 			sync->timeout_at.tv_sec++;
 			sync->timeout_at.tv_nsec -= 1000000000L;
 		}
@@ -175,73 +284,92 @@ pubnub_sync_timeout(struct pubnub *p, void *ctx_data, const struct timespec *ts,
 	}
 }
 
-void
-pubnub_sync_wait(struct pubnub *p, void *ctx_data)
+/* Poll the sockets once, calling the timeout handler if it is due.
+ * With @block, wait for an event or the timeout; otherwise, just take
+ * care of what is ready already.  That includes a timeout 1ms away:
+ * libcurl asks for that when it wants to be called right away (to
+ * start a new transfer, say) but cannot be reentered. */
+static void
+pubnub_sync_poll(struct pubnub *p, struct pubnub_sync *sync, bool block)
 {
-	struct pubnub_sync *sync = (struct pubnub_sync *)ctx_data;
-	while (!sync->stop) {
-		DBGMSG("=polling= for %d (timeout %p)\n", sync->n, sync->timeout_cb);
-
-		long timeout;
-		if (sync->timeout_cb) {
-			struct timespec now;
-			GET_CLOCK_NOW
-			timeout = (sync->timeout_at.tv_sec - now.tv_sec) * 1000;
-			timeout += (sync->timeout_at.tv_nsec - now.tv_nsec) / 1000000;
-			DBGMSG("timeout in %ld ms\n", timeout);
-			if (timeout < 0) {
-				/* If we missed the timeout moment, just
-				 * spin poll() quickly until we are clear
-				 * to call the timeout handler. */
-				timeout = 0;
-			}
-		} else {
-			timeout = -1;
+	DBGMSG("=polling= for %d (timeout %p)\n", sync->n, sync->timeout_cb);
+
+	long timeout;
+	if (sync->timeout_cb) {
+		struct timespec now;
+		GET_CLOCK_NOW
+		timeout = (sync->timeout_at.tv_sec - now.tv_sec) * 1000;
+		timeout += (sync->timeout_at.tv_nsec - now.tv_nsec) / 1000000;
+		DBGMSG("timeout in %ld ms\n", timeout);
+		if (timeout < 0) {
+			/* If we missed the timeout moment, just
+			 * spin poll() quickly until we are clear
+			 * to call the timeout handler. */
+			timeout = 0;
 		}
+	} else {
+		timeout = -1;
+	}
 
 #ifdef _MSC_VER
-		int n = (sync->n ? WSAPoll(sync->fdset, sync->n, timeout) : 0);
+	int n = (sync->n ? WSAPoll(sync->fdset, sync->n, block ? timeout : 0) : 0);
 #else
-		int n = poll(sync->fdset, sync->n, timeout);
+	int n = poll(sync->fdset, sync->n, block ? timeout : 0);
 #endif
 
-		if (n < 0) {
-			/* poll() errors are ignored, it's not clear what
-			 * we should do. Most likely, we have just received
-			 * a signal and will spin around and restart poll(). */
+	if (n < 0) {
+		/* poll() errors are ignored, it's not clear what
+		 * we should do. Most likely, we have just received
+		 * a signal and will spin around and restart poll(). */
 #ifdef _MSC_VER
-			DBGMSG("WSAPoll error: %d\n", WSAGetLastError());
+		DBGMSG("WSAPoll error: %d\n", WSAGetLastError());
 #else
-			DBGMSG("poll(): %s\n", strerror(errno));
+		DBGMSG("poll(): %s\n", strerror(errno));
 #endif
-			continue;
+		return;
+	}
+
+	if (n == 0) {
+		if (!block && timeout > 1) {
+			/* Nothing ready, nor due. */
+			return;
+		}
+		/* Time out, call the handler and reset
+		 * timeout. */
+		DBGMSG("Timeout, callback and reset\n");
+		/* First, we reset sync->timeout_cb, then we
+		 * call the timeout handler - likely, that will
+		 * cause it to set timeout_cb again, so resetting
+		 * timeout_cb only after the call is bad idea. */
+		void (*timeout_cb)(struct pubnub *p, void *cb_data) = sync->timeout_cb;
+		sync->timeout_cb = NULL;
+		if (timeout_cb) {
+			timeout_cb(p, sync->timeout_cb_data);
 		}
+		return;
+	}
 
-		if (n == 0) {
-			/* Time out, call the handler and reset
-			 * timeout. */
-			DBGMSG("Timeout, callback and reset\n");
-			/* First, we reset sync->timeout_cb, then we
-			 * call the timeout handler - likely, that will
-			 * cause it to set timeout_cb again, so resetting
-			 * timeout_cb only after the call is bad idea. */
-			void (*timeout_cb)(struct pubnub *p, void *cb_data) = sync->timeout_cb;
-			sync->timeout_cb = NULL;
-			if (timeout_cb) {
-				timeout_cb(p, sync->timeout_cb_data);
-			}
+	for (int i = 0; i < sync->n; i++) {
+		short revents = sync->fdset[i].revents;
+		if (!revents)
 			continue;
-		}
+		DBGMSG("event: fd %d ev %d rev %d\n", sync->fdset[i].fd, sync->fdset[i].events, sync->fdset[i].revents);
+		int mode = (revents & POLLIN ? 1 : 0) | (revents & POLLOUT ? 2 : 0) | (revents & POLLERR ? 4 : 0);
+		sync->cbset[i].cb(p, sync->fdset[i].fd, mode, sync->cbset[i].cb_data);
+	}
+}
 
-		for (int i = 0; i < sync->n; i++) {
-			short revents = sync->fdset[i].revents;
-			if (!revents)
-				continue;
-			DBGMSG("event: fd %d ev %d rev %d\n", sync->fdset[i].fd, sync->fdset[i].events, sync->fdset[i].revents);
-			int mode = (revents & POLLIN ? 1 : 0) | (revents & POLLOUT ? 2 : 0) | (revents & POLLERR ? 4 : 0);
-			sync->cbset[i].cb(p, sync->fdset[i].fd, mode, sync->cbset[i].cb_data);
-		}
+void
+pubnub_sync_wait(struct pubnub *p, void *ctx_data)
+{
+	struct pubnub_sync *sync = (struct pubnub_sync *)ctx_data;
+	if (sync->nowait) {
+		/* pubnub_sync_next_message() prefetching. */
+		sync->nowait = false;
+		return;
 	}
+	while (!sync->stop)
+		pubnub_sync_poll(p, sync, true);
 	sync->stop = false;
 }
 
@@ -258,6 +386,7 @@ pubnub_sync_done(struct pubnub *p, void *ctx_data)
 {
 	struct pubnub_sync *sync = (struct pubnub_sync *)ctx_data;
 	pubnub_sync_reset(sync);
+	pubnub_sync_iter_reset(sync);
 	if (sync->fdset) free(sync->fdset);
 	if (sync->cbset) free(sync->cbset);
 	free(sync);
@@ -282,9 +411,17 @@ void
 pubnub_sync_subscribe_cb(struct pubnub *p, enum pubnub_res result, char **channels, struct json_object *response, void *ctx_data, void *call_data)
 {
 	struct pubnub_sync *sync = (struct pubnub_sync *)ctx_data;
+	if (sync->iter_pending && !sync->iter_waiting) {
+		/* The prefetched subscribe got cancelled while nobody
+		 * was waiting for it, so its stop_wait must not stop
+		 * the next wait. */
+		sync->iter_pending = false;
+		sync->stop = false;
+	}
 	pubnub_sync_generic_cb(p, result, response, ctx_data, call_data);
 	if (result == PNR_OK) {
 		sync->channels = channels;
+		sync->batch_new = true;
 	}
 }
 
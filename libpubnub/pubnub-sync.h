@@ -40,6 +40,25 @@ struct json_object *pubnub_sync_last_response(struct pubnub_sync *sync);
  * pubnub context, make a copy if you need it to persist. */
 char **pubnub_sync_last_channels(struct pubnub_sync *sync);
 
+/* Return the messages of the subscribed channels one at a time,
+ * blocking until one arrives.  On PNR_OK, *@msg is the message (valid
+ * until the next call, take json_object_get() to keep it), *@channel
+ * its channel and *@time_token the timetoken of its batch, each
+ * pointer optional.  Otherwise, *@msg is NULL and the result is that
+ * of the failed subscribe; call again to retry.
+ *
+ * The first call picks up the messages of the last pubnub_subscribe()
+ * call if there was one, so join the channels with pubnub_subscribe()
+ * first.  As soon as a batch of messages is taken, the subscribe for
+ * the next one is issued (with @timeout) and left in progress while
+ * you are processing the current batch, so the network round trip is
+ * overlapped with your work.  Each call returning a message of the
+ * batch drives the request on without blocking; it is waited for only
+ * when the batch runs out.  Until then, do not call other methods on
+ * @p; use pubnub_reset_subscribe() to stop iterating. */
+enum pubnub_res pubnub_sync_next_message(struct pubnub *p, struct pubnub_sync *sync, long timeout,
+		const char **channel, struct json_object **msg, const char **time_token);
+
 #ifdef __cplusplus
 }
 #endif
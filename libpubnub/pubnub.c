@@ -1,21 +1,37 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
 
 #include <json.h>
 #include <printbuf.h>
 
 #include <curl/curl.h>
+#ifndef PUBNUB_NO_CRYPTO
+#include <openssl/md5.h>
 #include <openssl/ssl.h>
+#endif
 
 #include "crypto.h"
 #include "pubnub.h"
 #include "pubnub-priv.h"
 
-/* TODO: Use curl shares. */
-
 /* Due to all the callbacks for async safety, things may appear a bit tangled.
  * This diagram might help:
  *
@@ -70,10 +86,335 @@
 
 
 static void pubnub_http_request(struct pubnub *p, pubnub_http_cb cb, void *cb_data, bool cb_internal, bool wait);
+static int pubnub_http_timercb(CURLM *multi, long timeout_ms, void *userp);
+static int pubnub_pool_timercb(CURLM *multi, long timeout_ms, void *userp);
+static void pubnub_req_drain(struct pubnub *p);
+static void pubnub_wake_due(struct pubnub *p);
+static void pubnub_req_finished(struct pubnub *p, CURL *curl, CURLcode res);
+
+/* Process-wide state (pooled buffers, CA certificates, shared
+ * configurations) is guarded by static mutexes.  No threads on
+ * Windows (yet), and so no locking there either. */
+#ifndef _WIN32
+#define PUBNUB_MUTEX(m) static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER
+#define PUBNUB_LOCK(m) pthread_mutex_lock(&(m))
+#define PUBNUB_UNLOCK(m) pthread_mutex_unlock(&(m))
+#else
+#define PUBNUB_MUTEX(m) static int m
+#define PUBNUB_LOCK(m) ((void)(m))
+#define PUBNUB_UNLOCK(m) ((void)(m))
+#endif
+
+/* Memory of the context's own bookkeeping.  Transient per-request
+ * allocations (callback data, channelset copies) are carved from a bump
+ * arena, stacked up behind a header each.  Released allocations on top
+ * of the stack are popped off, so the arena is rewound as the requests
+ * finish; in a subscribe loop that happens once per request, by the
+ * time the response has been dispatched.  An allocation outliving its
+ * request holds on to just the room up to it.  What does not fit in
+ * the arena goes to the context allocator. */
+
+#define PUBNUB_ARENA_SIZE 4096
+/* Alignment of the arena allocations. */
+#define PUBNUB_ARENA_ALIGN 16
+
+struct pubnub_arena_hdr {
+	/* Offset of the allocation below, if any. */
+	size_t prev;
+	bool released;
+};
+
+#define PUBNUB_ARENA_HDR ((sizeof(struct pubnub_arena_hdr) + PUBNUB_ARENA_ALIGN - 1) & ~(size_t)(PUBNUB_ARENA_ALIGN - 1))
+
+static void *
+pubnub_malloc(struct pubnub *p, size_t size)
+{
+	if (p->alloc)
+		return p->alloc->alloc(size, p->alloc_data);
+	return malloc(size);
+}
+
+static void
+pubnub_heap_free(struct pubnub *p, void *ptr)
+{
+	if (p->alloc)
+		p->alloc->release(ptr, p->alloc_data);
+	else
+		free(ptr);
+}
+
+static void *
+pubnub_arena_alloc(struct pubnub *p, size_t size)
+{
+	size = (size + PUBNUB_ARENA_ALIGN - 1) & ~(size_t)(PUBNUB_ARENA_ALIGN - 1);
+	if (!p->arena)
+		p->arena = (char *)pubnub_malloc(p, PUBNUB_ARENA_SIZE);
+	if (p->arena && PUBNUB_ARENA_HDR + size <= PUBNUB_ARENA_SIZE - p->arena_used) {
+		struct pubnub_arena_hdr *hdr = (struct pubnub_arena_hdr *)(p->arena + p->arena_used);
+		hdr->prev = p->arena_top;
+		hdr->released = false;
+		p->arena_top = p->arena_used;
+		p->arena_used += PUBNUB_ARENA_HDR + size;
+		p->arena_live++;
+		return (char *)hdr + PUBNUB_ARENA_HDR;
+	}
+	return pubnub_malloc(p, size);
+}
+
+static void *
+pubnub_arena_calloc(struct pubnub *p, size_t size)
+{
+	void *ptr = pubnub_arena_alloc(p, size);
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+static char *
+pubnub_arena_strdup(struct pubnub *p, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	return (char *)memcpy(pubnub_arena_alloc(p, len), str, len);
+}
+
+/* Release memory from pubnub_arena_alloc() and friends. */
+static void
+pubnub_free(struct pubnub *p, void *ptr)
+{
+	if (!ptr)
+		return;
+	if (p->arena && (char *)ptr >= p->arena && (char *)ptr < p->arena + PUBNUB_ARENA_SIZE) {
+		((struct pubnub_arena_hdr *)((char *)ptr - PUBNUB_ARENA_HDR))->released = true;
+		p->arena_live--;
+		while (p->arena_used) {
+			struct pubnub_arena_hdr *top = (struct pubnub_arena_hdr *)(p->arena + p->arena_top);
+			if (!top->released)
+				break;
+			p->arena_used = p->arena_top;
+			p->arena_top = top->prev;
+		}
+		return;
+	}
+	pubnub_heap_free(p, ptr);
+}
+
+/* Response body buffers of idle contexts are pooled process-wide, so
+ * that tens of thousands of mostly idle contexts do not each pin
+ * a buffer sized for their largest response so far. */
+
+#define PUBNUB_BODY_KEEP (64 * 1024)
+#define PUBNUB_BODY_POOL_MAX 64
+
+static struct printbuf *pubnub_body_pool[PUBNUB_BODY_POOL_MAX];
+static int pubnub_body_pool_n;
+
+PUBNUB_MUTEX(pubnub_body_lock);
+
+static struct printbuf *
+pubnub_body_get(void)
+{
+	struct printbuf *pb = NULL;
+	PUBNUB_LOCK(pubnub_body_lock);
+	if (pubnub_body_pool_n > 0)
+		pb = pubnub_body_pool[--pubnub_body_pool_n];
+	PUBNUB_UNLOCK(pubnub_body_lock);
+	return pb ? pb : printbuf_new();
+}
+
+/* Return @pb to the pool, or free it if it grew over @keep bytes or
+ * the pool is full. */
+static void
+pubnub_body_put_keep(struct printbuf *pb, size_t keep)
+{
+	if (!pb)
+		return;
+	if ((size_t) pb->size <= keep) {
+		printbuf_reset(pb);
+		PUBNUB_LOCK(pubnub_body_lock);
+		if (pubnub_body_pool_n < PUBNUB_BODY_POOL_MAX) {
+			pubnub_body_pool[pubnub_body_pool_n++] = pb;
+			pb = NULL;
+		}
+		PUBNUB_UNLOCK(pubnub_body_lock);
+	}
+	if (pb)
+		printbuf_free(pb);
+}
+
+/* Return @pb to the pool, or free it if it grew over the high-water
+ * mark of @p or the pool is full; the fixed buffer of @p is just
+ * emptied. */
+static void
+pubnub_body_put(struct pubnub *p, struct printbuf *pb)
+{
+	if (pb == &p->body_fixed) {
+		pb->bpos = 0;
+		pb->buf[0] = 0;
+		return;
+	}
+	pubnub_body_put_keep(pb, p->body_keep);
+}
+
+static void
+pubnub_body_release(struct pubnub *p)
+{
+	pubnub_body_put(p, p->body);
+	p->body = NULL;
+}
+
+/* The URL buffer of the method slot comes from the same pool and is
+ * held only until the method finishes (it is needed for retries). */
+static struct printbuf *
+pubnub_url_get(struct pubnub *p)
+{
+	if (!p->url)
+		p->url = pubnub_body_get();
+	return p->url;
+}
+
+static void
+pubnub_url_release(struct pubnub *p)
+{
+	pubnub_body_put(p, p->url);
+	p->url = NULL;
+}
+
+/* Account for @len more bytes of a response; returns false (aborting
+ * the transfer) once that goes over the size limit. */
+static bool
+pubnub_body_account(struct pubnub *p, size_t *body_len, bool *too_large, size_t len)
+{
+	*body_len += len;
+	if (p->body_max && *body_len > p->body_max) {
+		*too_large = true;
+		return false;
+	}
+	return true;
+}
+
+/* Hand the multi handle timer (as due by libcurl, the requests on hold
+ * and the publish rate limiters) to the frontend. */
+static void
+pubnub_timer_rearm(struct pubnub *p)
+{
+	if (p->pool && !p->pool_wake && (p->hold_until || p->rate_wake)) {
+		/* Have the pool timer look after our deadlines. */
+		p->pool_wake_next = p->pool->wake;
+		p->pool->wake = p;
+		p->pool_wake = true;
+	}
+	long timeout_ms = -1;
+	curl_multi_timeout(p->curlm, &timeout_ms);
+	/* Do not let the timer callback recurse into curl
+	 * from here. */
+	if (timeout_ms == 0)
+		timeout_ms = 1;
+	if (p->pool)
+		pubnub_pool_timercb(p->curlm, timeout_ms, p->pool);
+	else
+		pubnub_http_timercb(p->curlm, timeout_ms, p);
+}
+
+/* Call cb->stop_wait. That cancels the timeout too, so if there are other
+ * transfers still in flight on our multi handle (side requests or other
+ * contexts of the same pool), a request on hold or queued publishes
+ * waiting for the rate limiter, hand the multi handle timer back to the
+ * frontend. */
+static void
+pubnub_stop_wait(struct pubnub *p)
+{
+	p->cb->stop_wait(p, p->cb_data);
+
+	if (p->reqs || p->pool || p->hold_until || p->rate_wake)
+		pubnub_timer_rearm(p);
+}
+
+/* Request statistics, collected only after pubnub_set_stats(). */
+
+static double
+pubnub_clock(void)
+{
+#if defined(__MINGW32__) || defined(__MACH__) || defined(_MSC_VER)
+	return (double) clock() / CLOCKS_PER_SEC;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static enum pubnub_stats_method
+pubnub_stats_method(const char *method)
+{
+	static const char *names[] = {
+		SFINIT( [PNS_SUBSCRIBE] , "subscribe"),
+		SFINIT( [PNS_JOIN] ,      "join"),
+		SFINIT( [PNS_LEAVE] ,     "leave"),
+		SFINIT( [PNS_PUBLISH] ,   "publish"),
+		SFINIT( [PNS_HISTORY] ,   "history"),
+		SFINIT( [PNS_HERE_NOW] ,  "here_now"),
+		SFINIT( [PNS_TIME] ,      "time"),
+	};
+	for (int i = 0; i < PNS_OTHER; i++)
+		if (method && !strcmp(method, names[i]))
+			return (enum pubnub_stats_method) i;
+	return PNS_OTHER;
+}
+
+/* Start the record of a request finished on @curl. */
+static void
+pubnub_stats_begin(struct pubnub_request_stats *st, const char *method, CURL *curl)
+{
+	memset(st, 0, sizeof(*st));
+	st->method = method;
+	st->result = PNR_OK;
+
+	double dns = 0, connect = 0, tls = 0, ttfb = 0, total = 0, size = 0;
+	long header_size = 0;
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &dns);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &tls);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &size);
+	curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &header_size);
+	curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &st->bytes_out);
+
+	/* libcurl times are cumulative since the request start. */
+	st->time[PNS_DNS] = dns;
+	st->time[PNS_CONNECT] = connect > dns ? connect - dns : 0;
+	st->time[PNS_TLS] = tls > connect ? tls - connect : 0;
+	st->time[PNS_TTFB] = ttfb;
+	st->time[PNS_TOTAL] = total;
+	st->bytes_in = (long) size + header_size;
+}
+
+static void
+pubnub_stats_record(struct pubnub *p, const struct pubnub_request_stats *st)
+{
+	struct pubnub_method_stats *ms = &p->stats->method[pubnub_stats_method(st->method)];
+	ms->requests++;
+	if (st->result != PNR_OK)
+		ms->errors++;
+	ms->bytes_in += st->bytes_in;
+	ms->bytes_out += st->bytes_out;
+	for (int i = 0; i < PNS_TIMES; i++) {
+		ms->time_sum[i] += st->time[i];
+		int bucket = 0;
+		for (long ms_ = (long) (st->time[i] * 1000); ms_ > 0 && bucket < PUBNUB_STATS_BUCKETS - 1; ms_ >>= 1)
+			bucket++;
+		ms->time_hist[i][bucket]++;
+	}
+
+	if (p->stats_cb)
+		p->stats_cb(p, st, p->stats_cb_data);
+}
 
 static enum pubnub_res
 pubnub_error_report(struct pubnub *p, enum pubnub_res result, json_object *msg, const char *method, bool retry)
 {
+	if (p->stats && result == PNR_OCCUPIED)
+		p->stats->method[pubnub_stats_method(method)].occupied++;
+
 	if (p->error_print) {
 		static const char *pubnub_res_str[] = {
 			SFINIT( [PNR_OK] ,           "Success"),
@@ -82,6 +423,9 @@ pubnub_error_report(struct pubnub *p, enum pubnub_res result, json_object *msg,
 			SFINIT( [PNR_IO_ERROR] ,     "Communication error"),
 			SFINIT( [PNR_HTTP_ERROR] ,   "HTTP error"),
 			SFINIT( [PNR_FORMAT_ERROR] , "Unexpected input in received JSON"),
+			SFINIT( [PNR_CANCELLED] ,    "Cancelled"),
+			SFINIT( [PNR_RESPONSE_TOO_LARGE] , "Response too large"),
+			SFINIT( [PNR_NO_CRYPTO] ,    "Built without crypto"),
 		};
 		if (msg) {
 			fprintf(stderr, "pubnub %s result: %s [%s]%s\n",
@@ -100,9 +444,197 @@ pubnub_error_report(struct pubnub *p, enum pubnub_res result, json_object *msg,
 static void
 pubnub_error_retry(struct pubnub *p, void *cb_data)
 {
+	if (!p->method || p->curl) {
+		/* The held request got cancelled in the meantime. */
+		return;
+	}
 	pubnub_http_request(p, p->finished_cb, p->finished_cb_data, p->finished_cb_internal, false);
 }
 
+/* Nanoseconds on a clock that does not jump. */
+static long long
+pubnub_now_ns(void)
+{
+#if defined(__MINGW32__) || defined(__MACH__) || defined(_MSC_VER)
+	return (long long) time(NULL) * 1000000000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Milliseconds on a clock that does not jump. */
+static long long
+pubnub_now_ms(void)
+{
+	return pubnub_now_ns() / 1000000;
+}
+
+static long
+pubnub_retry_rand(struct pubnub *p, long range)
+{
+	if (range <= 0)
+		return 0;
+#if defined(__MINGW32__) || defined(__MACH__) || defined(_MSC_VER)
+	return rand() % range;
+#else
+	return rand_r(&p->retry_seed) % range;
+#endif
+}
+
+/* Milliseconds left until the circuit breaker closes again, or 0. */
+static long
+pubnub_breaker_left(struct pubnub *p)
+{
+	if (!p->breaker_threshold || p->breaker_failures < p->breaker_threshold)
+		return 0;
+	long long left = p->breaker_until - pubnub_now_ms();
+	return left > 0 ? left : 0;
+}
+
+static void
+pubnub_breaker_fail(struct pubnub *p)
+{
+	if (!p->breaker_threshold)
+		return;
+	/* Each failure past the threshold (i.e. of a probe after
+	 * the cool-down) opens the breaker again. */
+	if (++p->breaker_failures >= p->breaker_threshold)
+		p->breaker_until = pubnub_now_ms() + p->breaker_cooldown_ms;
+}
+
+/* Milliseconds to hold the subscribe request about to go out back
+ * for batching, or 0; the pause is taken just once. */
+static long
+pubnub_pace_take(struct pubnub *p)
+{
+	if (!p->pace_until || !p->method || strcmp(p->method, "subscribe"))
+		return 0;
+	long long left = p->pace_until - pubnub_now_ms();
+	p->pace_until = 0;
+	return left > 0 ? left : 0;
+}
+
+/* A subscribe response with @msg_n messages has just arrived; unless
+ * those were plenty, have the next subscribe wait out the batching
+ * window so that new messages pile up at the server meanwhile.  After
+ * an empty response, there is nothing to wait for.  With backpressure
+ * set up, the messages go on the backlog. */
+static void
+pubnub_pace_set(struct pubnub *p, int msg_n)
+{
+	if (p->backlog_high > 0)
+		p->backlog += msg_n;
+	if (p->batch_window_ms > 0 && msg_n > 0 && (!p->batch_max || msg_n < p->batch_max))
+		p->pace_until = pubnub_now_ms() + p->batch_window_ms;
+	else
+		p->pace_until = 0;
+}
+
+
+/* Server clock estimation, NTP style: the server timestamp of a sample
+ * is taken as of the middle of the HTTP exchange, with half of its
+ * duration as the error bound.  The sample with the tightest bound
+ * wins, its bound loosened with age by PUBNUB_CLOCK_PHI (ppm) so that
+ * fresh samples take over eventually. */
+
+#define PUBNUB_CLOCK_PHI 15
+/* Minimum span of two samples to measure the drift over, and its
+ * maximum believable value (ppm). */
+#define PUBNUB_CLOCK_DRIFT_SPAN 300000000000LL
+#define PUBNUB_CLOCK_DRIFT_MAX 500
+
+/* Bound the exchange of the request just finished on @curl. */
+static void
+pubnub_clock_window(struct pubnub *p, CURL *curl)
+{
+	double pretransfer = 0, ttfb = 0, total = 0;
+	curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+	/* libcurl times are cumulative since the request start. */
+	long long now = pubnub_now_ns();
+	p->clock_sent = now - (long long) ((total - pretransfer) * 1e9);
+	p->clock_recv = now - (long long) ((total - ttfb) * 1e9);
+	if (p->clock_recv < p->clock_sent)
+		p->clock_recv = p->clock_sent;
+}
+
+/* The server said it was @server_ns (since the epoch) during the
+ * exchange of the request just finished. */
+static void
+pubnub_clock_sample(struct pubnub *p, long long server_ns)
+{
+	if (server_ns <= 0 || !p->clock_recv)
+		return;
+	long long at = p->clock_sent + (p->clock_recv - p->clock_sent) / 2;
+	long long delay = p->clock_recv - p->clock_sent;
+	long long offset = server_ns - at;
+	p->clock_last = p->clock_recv;
+
+	if (p->clock_at && delay > p->clock_delay + (at - p->clock_at) / 1000000 * PUBNUB_CLOCK_PHI)
+		return;
+
+	if (!p->clock_anchor_at) {
+		p->clock_anchor_at = at;
+		p->clock_anchor_offset = offset;
+	} else if (at - p->clock_anchor_at >= PUBNUB_CLOCK_DRIFT_SPAN) {
+		double drift = (double) (offset - p->clock_anchor_offset) / (at - p->clock_anchor_at);
+		if (drift > PUBNUB_CLOCK_DRIFT_MAX / 1e6)
+			drift = PUBNUB_CLOCK_DRIFT_MAX / 1e6;
+		else if (drift < -PUBNUB_CLOCK_DRIFT_MAX / 1e6)
+			drift = -PUBNUB_CLOCK_DRIFT_MAX / 1e6;
+		/* Smooth out the noise of the individual samples. */
+		p->clock_drift += (drift - p->clock_drift) / 4;
+		p->clock_anchor_at = at;
+		p->clock_anchor_offset = offset;
+	}
+
+	p->clock_at = at;
+	p->clock_offset = offset;
+	p->clock_delay = delay;
+}
+
+/* Timetokens count 100ns units. */
+static long long
+pubnub_clock_tt(const char *time_token)
+{
+	return strtoll(time_token, NULL, 10) * 100;
+}
+
+/* A request got through, forget about past failures. */
+static void
+pubnub_retry_reset(struct pubnub *p)
+{
+	p->retry_attempt = 0;
+	p->breaker_failures = 0;
+}
+
+/* Delay of the @attempt-th retry: a random time up to the
+ * exponentially growing cap ("full jitter"), past the end of the
+ * circuit breaker cool-down if it is open. */
+static long
+pubnub_retry_delay(struct pubnub *p, int attempt)
+{
+	long cap = p->retry_base_ms;
+	for (int i = 1; i < attempt && cap < p->retry_max_ms; i++)
+		cap *= 2;
+	if (cap > p->retry_max_ms)
+		cap = p->retry_max_ms;
+	return pubnub_breaker_left(p) + pubnub_retry_rand(p, cap);
+}
+
+/* Issue the request on hold in @delay_ms.  The frontend timer is
+ * libcurl's to rearm at will (side requests keep going meanwhile), so
+ * the deadline is folded into it; see pubnub_wake_clamp(). */
+static void
+pubnub_retry_timer(struct pubnub *p, long delay_ms)
+{
+	p->hold_until = pubnub_now_ms() + delay_ms;
+	pubnub_timer_rearm(p);
+}
+
 void
 pubnub_finished_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response)
 {
@@ -131,7 +663,12 @@ pubnub_finished_cb(struct pubnub *p, enum pubnub_res result, struct json_object
 static bool
 pubnub_handle_error(struct pubnub *p, enum pubnub_res result, json_object *msg, const char *method, bool cb)
 {
-	if (p->error_retry_mask & (1 << result)) {
+	pubnub_breaker_fail(p);
+	if (p->stats_cur)
+		p->stats_cur->result = result;
+
+	if ((p->error_retry_mask & (1 << result)) && result != PNR_RESPONSE_TOO_LARGE
+	    && (!p->retry_max_attempts || p->retry_attempt < p->retry_max_attempts)) {
 		/* Retry ... */
 
 		DBGMSG("error retry (%d %s)\n", result, method);
@@ -139,12 +676,12 @@ pubnub_handle_error(struct pubnub *p, enum pubnub_res result, json_object *msg,
 		pubnub_error_report(p, result, msg, method, true);
 		p->method = method; // restore after cleanup
 
-		/* ... after a 250ms delay; this avoids hammering
-		 * the PubNub service in case of a bug. */
-		struct timespec timeout_ts;
-		timeout_ts.tv_nsec = 250*1000*1000;
-		timeout_ts.tv_sec = 0;
-		p->cb->timeout(p, p->cb_data, &timeout_ts, pubnub_error_retry, p);
+		/* ... after a backoff delay; this avoids hammering
+		 * the PubNub service in case of a bug or an outage. */
+		p->retry_attempt++;
+		if (p->stats)
+			p->stats->method[pubnub_stats_method(method)].retries++;
+		pubnub_retry_timer(p, pubnub_retry_delay(p, p->retry_attempt));
 
 		return false;
 
@@ -152,9 +689,11 @@ pubnub_handle_error(struct pubnub *p, enum pubnub_res result, json_object *msg,
 		/* No auto-retry, somehow notify the user. */
 
 		DBGMSG("error terminal fail (%d %s)\n", result, method);
+		p->retry_attempt = 0;
+		pubnub_url_release(p);
 
 		pubnub_error_report(p, result, msg, method, false);
-		p->cb->stop_wait(p, p->cb_data); // unconditional!
+		pubnub_stop_wait(p); // unconditional!
 
 		if (cb && p->finished_cb)
 			pubnub_finished_cb(p, result, msg);
@@ -167,7 +706,7 @@ pubnub_handle_error(struct pubnub *p, enum pubnub_res result, json_object *msg,
 static void pubnub_connection_cleanup(struct pubnub *p, bool stop_wait);
 
 static void
-pubnub_connection_finished(struct pubnub *p, CURLcode res, bool stop_wait)
+pubnub_connection_done(struct pubnub *p, CURLcode res, bool stop_wait)
 {
 	DBGMSG("DONE: (%d) %s\n", res, p->curl_error);
 
@@ -177,7 +716,12 @@ pubnub_connection_finished(struct pubnub *p, CURLcode res, bool stop_wait)
 	/* Check against I/O errors */
 	if (res != CURLE_OK) {
 		pubnub_connection_cleanup(p, stop_wait);
-		if (res == CURLE_OPERATION_TIMEDOUT) {
+		pubnub_body_release(p);
+		if (res == CURLE_WRITE_ERROR && p->body_too_large) {
+			json_object *limit = json_object_new_int64(p->body_max);
+			pubnub_handle_error(p, PNR_RESPONSE_TOO_LARGE, limit, method, true);
+			json_object_put(limit);
+		} else if (res == CURLE_OPERATION_TIMEDOUT) {
 			pubnub_handle_error(p, PNR_TIMEOUT, NULL, method, true);
 		} else {
 			json_object *msgstr = json_object_new_string(curl_easy_strerror(res));
@@ -193,29 +737,82 @@ pubnub_connection_finished(struct pubnub *p, CURLcode res, bool stop_wait)
 	/* At this point, we can tear down the connection. */
 	pubnub_connection_cleanup(p, stop_wait);
 	if (code / 100 != 2) {
+		pubnub_body_release(p);
 		json_object *httpcode = json_object_new_int(code);
 		pubnub_handle_error(p, PNR_HTTP_ERROR, httpcode, method, true);
 		json_object_put(httpcode);
 		return;
 	}
 
+	if (p->body_raw) {
+		/* The callback deals with the body itself. */
+		pubnub_retry_reset(p);
+		pubnub_url_release(p);
+		if (p->finished_cb)
+			pubnub_finished_cb(p, PNR_OK, NULL);
+		return;
+	}
+
 	/* Parse body */
-	json_object *response = json_tokener_parse(p->body->buf);
+	double parse_start = p->stats_cur ? pubnub_clock() : 0;
+	json_object *response;
+	if (p->body_tok) {
+		if (!p->body_response && !p->body_error) {
+			/* Let the tokener see the end of input;
+			 * that completes a top-level number. */
+			p->body_response = json_tokener_parse_ex(p->body_tok, "", 1);
+		}
+		response = p->body_response;
+		p->body_response = NULL;
+	} else {
+		response = json_tokener_parse(p->body ? p->body->buf : "");
+		pubnub_body_release(p);
+	}
+	if (p->stats_cur)
+		p->stats_cur->time[PNS_PARSE] += pubnub_clock() - parse_start;
 	if (!response) {
 		pubnub_handle_error(p, PNR_FORMAT_ERROR, NULL, method, true);
 		return;
 	}
 
 	DBGMSG("DONE: Passed all traps! stop_wait %d\n", p->finished_cb_internal);
+	pubnub_retry_reset(p);
+	pubnub_url_release(p);
 
 	/* The regular callback */
 	if (!p->finished_cb_internal)
-		p->cb->stop_wait(p, p->cb_data);
+		pubnub_stop_wait(p);
 	if (p->finished_cb)
 		pubnub_finished_cb(p, PNR_OK, response);
 	json_object_put(response);
 }
 
+static void
+pubnub_connection_finished(struct pubnub *p, CURLcode res, bool stop_wait)
+{
+	if (p->curl)
+		pubnub_clock_window(p, p->curl);
+	if (!p->stats) {
+		pubnub_connection_done(p, res, stop_wait);
+		return;
+	}
+
+	/* The callbacks may issue (and even finish) other requests. */
+	struct pubnub_request_stats st, *outer = p->stats_cur;
+	pubnub_stats_begin(&st, p->method, p->curl);
+	st.time[PNS_PARSE] = p->stats_parse;
+	st.retries = p->retry_attempt;
+	if (res == CURLE_WRITE_ERROR && p->body_too_large)
+		st.result = PNR_RESPONSE_TOO_LARGE;
+	else if (res != CURLE_OK)
+		st.result = res == CURLE_OPERATION_TIMEDOUT ? PNR_TIMEOUT : PNR_IO_ERROR;
+
+	p->stats_cur = &st;
+	pubnub_connection_done(p, res, stop_wait);
+	p->stats_cur = outer;
+	pubnub_stats_record(p, &st);
+}
+
 static void
 pubnub_connection_cleanup(struct pubnub *p, bool stop_wait)
 {
@@ -223,7 +820,13 @@ pubnub_connection_cleanup(struct pubnub *p, bool stop_wait)
 
 	if (p->curl) {
 		curl_multi_remove_handle(p->curlm, p->curl);
-		curl_easy_cleanup(p->curl);
+		if (p->keepalive && !p->curl_idle) {
+			/* Stash the handle for the next request; live
+			 * connections stay in the connection cache. */
+			p->curl_idle = p->curl;
+		} else {
+			curl_easy_cleanup(p->curl);
+		}
 		p->curl = NULL;
 	}
 }
@@ -233,11 +836,55 @@ pubnub_connection_cleanup(struct pubnub *p, bool stop_wait)
 static void
 pubnub_connection_cancel(struct pubnub *p)
 {
+	p->hold_until = 0;
 	pubnub_connection_cleanup(p, false);
+	pubnub_url_release(p);
 	if (p->finished_cb)
 		pubnub_finished_cb(p, PNR_CANCELLED, NULL);
 }
 
+/* Dispatch the transfers finished on @curlm to their contexts. @p is
+ * the context we were called for and @stop_wait applies to it; any
+ * other context sharing the multi handle has already called cb->wait
+ * for its request. Returns true if the connection of @p has finished. */
+static bool
+pubnub_multi_dispatch(CURLM *curlm, struct pubnub *p, bool stop_wait)
+{
+	CURLMsg *msg;
+	int msgs_left;
+	bool done = false;
+
+	while ((msg = curl_multi_info_read(curlm, &msgs_left))) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		CURL *easy = msg->easy_handle;
+		CURLcode result = msg->data.result;
+		struct pubnub *owner = p;
+		if (!owner || owner->pool) {
+			/* Someone else's transfer, possibly. */
+			char *priv = NULL;
+			curl_easy_getinfo(easy, CURLINFO_PRIVATE, &priv);
+			owner = (struct pubnub *)priv;
+			if (!owner)
+				continue;
+		}
+
+		if (easy != owner->curl) {
+			/* One of the side requests. */
+			pubnub_req_finished(owner, easy, result);
+			continue;
+		}
+
+		/* Done! */
+		pubnub_connection_finished(owner, result, owner == p ? stop_wait : true);
+		if (owner == p)
+			done = true;
+	}
+
+	return done;
+}
+
 /* Let curl take care of the ongoing connections, then check for new events
  * and handle them (call the user callbacks etc.).  If stop_wait == true,
  * we have already called cb->wait and need to call cb->stop_wait if the
@@ -259,20 +906,7 @@ pubnub_connection_check(struct pubnub *p, int fd, int bitmask, bool stop_wait)
 		return true;
 	}
 
-	CURLMsg *msg;
-	int msgs_left;
-	bool done = false;
-
-	while ((msg = curl_multi_info_read(p->curlm, &msgs_left))) {
-		if (msg->msg != CURLMSG_DONE)
-			continue;
-
-		/* Done! */
-		pubnub_connection_finished(p, msg->data.result, stop_wait);
-		done = true;
-	}
-
-	return done;
+	return pubnub_multi_dispatch(p->curlm, p, stop_wait);
 }
 
 /* Socket callback for pubnub_callbacks event notification. */
@@ -291,18 +925,19 @@ static void
 pubnub_event_timeoutcb(struct pubnub *p, void *cb_data)
 {
 	pubnub_connection_check(p, CURL_SOCKET_TIMEOUT, 0, true);
+	pubnub_wake_due(p);
 }
 
-/* Socket callback for libcurl setting up / tearing down watches. */
-static int
-pubnub_http_sockcb(CURL *easy, curl_socket_t s, int action, void *userp, void *socketp)
+/* Set up / tear down the frontend watch of socket @s for libcurl. */
+static void
+pubnub_http_sockwatch(const struct pubnub_callbacks *cb, void *ctx_data, struct pubnub *p,
+		CURLM *curlm, CURL *easy, curl_socket_t s, int action, void *socketp,
+		void (*eventcb)(struct pubnub *p, int fd, int mode, void *cb_data), void *eventcb_data)
 {
-	struct pubnub *p = (struct pubnub *)userp;
-
 	DBGMSG("http_sockcb: fd %d action %d sockdata %p\n", s, action, socketp);
 
 	if (action == CURL_POLL_REMOVE) {
-		p->cb->rem_socket(p, p->cb_data, s);
+		cb->rem_socket(p, ctx_data, s);
 
 	} else if (action == CURL_POLL_NONE) {
 		/* Nothing to do? */
@@ -313,51 +948,309 @@ pubnub_http_sockcb(CURL *easy, curl_socket_t s, int action, void *userp, void *s
 		 * issue rem_socket() first). The particular value does
 		 * not matter, as long as it's not NULL. */
 		if (socketp)
-			p->cb->rem_socket(p, p->cb_data, s);
-		curl_multi_assign(p->curlm, s, /* anything not NULL */ easy);
+			cb->rem_socket(p, ctx_data, s);
+		curl_multi_assign(curlm, s, /* anything not NULL */ easy ? (void *) easy : (void *) curlm);
 		/* add_socket()'s mode uses the same bit pattern as
 		 * libcurl's action. What a coincidence! ;-) */
-		p->cb->add_socket(p, p->cb_data, s, action, pubnub_event_sockcb, easy);
+		cb->add_socket(p, ctx_data, s, action, eventcb, eventcb_data);
 	}
-	return 0;
 }
 
-/* Timer callback for libcurl setting up a timeout notification. */
-static int
-pubnub_http_timercb(CURLM *multi, long timeout_ms, void *userp)
+/* Set up the frontend timeout for libcurl. */
+static void
+pubnub_http_timerset(const struct pubnub_callbacks *cb, void *ctx_data, struct pubnub *p,
+		long timeout_ms, void (*timeoutcb)(struct pubnub *p, void *cb_data), void *timeoutcb_data)
 {
-	struct pubnub *p = (struct pubnub *)userp;
-
 	DBGMSG("http_timercb: %ld ms\n", timeout_ms);
 
+	/* Timeout already reached.  We are called from within libcurl,
+	 * which refuses to be reentered (CURLM_RECURSIVE_API_CALL), so
+	 * let the frontend call cb as soon as possible instead. */
+	if (timeout_ms == 0)
+		timeout_ms = 1;
+
 	struct timespec timeout_ts;
 	if (timeout_ms > 0) {
 		timeout_ts.tv_sec = timeout_ms/1000;
 		timeout_ts.tv_nsec = (timeout_ms%1000)*1000000L;
-		p->cb->timeout(p, p->cb_data, &timeout_ts, pubnub_event_timeoutcb, p);
+		cb->timeout(p, ctx_data, &timeout_ts, timeoutcb, timeoutcb_data);
 	} else {
+		/* No timeout at all. */
 		timeout_ts.tv_sec = 0;
 		timeout_ts.tv_nsec = 0;
-		p->cb->timeout(p, p->cb_data, &timeout_ts, NULL, NULL);
-
-		if (timeout_ms == 0) {
-			/* Timeout already reached. Call cb directly. */
-			pubnub_event_timeoutcb(p, p);
-		} /* else no timeout at all. */
+		cb->timeout(p, ctx_data, &timeout_ts, NULL, NULL);
 	}
+}
+
+/* Socket callback for libcurl setting up / tearing down watches. */
+static int
+pubnub_http_sockcb(CURL *easy, curl_socket_t s, int action, void *userp, void *socketp)
+{
+	struct pubnub *p = (struct pubnub *)userp;
+	pubnub_http_sockwatch(p->cb, p->cb_data, p, p->curlm, easy, s, action, socketp,
+			pubnub_event_sockcb, easy);
 	return 0;
 }
 
-static char *
-pubnub_gen_uuid(void)
+/* Make @timeout_ms expire no later than @at [ms], if set. */
+static long
+pubnub_deadline_clamp(long long at, long long now, long timeout_ms)
 {
-	/* Template for version 4 (random) UUID. */
-	char uuidbuf[] = "xxxxxxxx-xxxx-4xxx-9xxx-xxxxxxxxxxxx";
+	if (!at)
+		return timeout_ms;
+	long long wake_ms = at - now;
+	if (wake_ms < 1)
+		wake_ms = 1;
+	if (timeout_ms < 0 || wake_ms < timeout_ms)
+		timeout_ms = wake_ms;
+	return timeout_ms;
+}
 
-	unsigned int seed;
-#if defined(__MINGW32__) || defined(__MACH__) || defined(_MSC_VER)
-	seed = time(NULL);
-	srand(seed);
+/* Make @timeout_ms expire no later than the request on hold of @p is
+ * to go out or its publish rate limiter wants to send the next queued
+ * message. */
+static long
+pubnub_wake_clamp(struct pubnub *p, long timeout_ms)
+{
+	if (!p->hold_until && !p->rate_wake)
+		return timeout_ms;
+	long long now = pubnub_now_ms();
+	timeout_ms = pubnub_deadline_clamp(p->hold_until, now, timeout_ms);
+	return pubnub_deadline_clamp(p->rate_wake, now, timeout_ms);
+}
+
+/* The frontend timer went off; act on the deadlines of @p that are
+ * due, and keep waiting for the others. */
+static void
+pubnub_wake_due(struct pubnub *p)
+{
+	long long now = pubnub_now_ms();
+	if (p->hold_until && p->hold_until <= now) {
+		p->hold_until = 0;
+		pubnub_error_retry(p, NULL);
+	}
+	/* The rate limiter takes the tokens as they come, and
+	 * rearms (for the hold too) while it waits for more. */
+	if (p->rate_wake)
+		pubnub_req_drain(p);
+	if (p->hold_until && !p->rate_wake)
+		pubnub_timer_rearm(p);
+}
+
+/* Timer callback for libcurl setting up a timeout notification. */
+static int
+pubnub_http_timercb(CURLM *multi, long timeout_ms, void *userp)
+{
+	struct pubnub *p = (struct pubnub *)userp;
+	timeout_ms = pubnub_wake_clamp(p, timeout_ms);
+	pubnub_http_timerset(p->cb, p->cb_data, p, timeout_ms, pubnub_event_timeoutcb, p);
+	return 0;
+}
+
+
+/** Pools */
+
+/* Frontend events of a pool are handled on behalf of the whole pool;
+ * the @p we get from the frontend is just the context the event was
+ * registered through (which might be gone by now), so we pass the pool
+ * around as cb_data and ignore @p. */
+
+static void
+pubnub_pool_check(struct pubnub_pool *pool, int fd, int bitmask)
+{
+	int running_handles = 0;
+	CURLMcode rc = curl_multi_socket_action(pool->curlm, fd, bitmask, &running_handles);
+	if (rc != CURLM_OK) {
+		/* We cannot tell whose transfer broke; fail them all. */
+		json_object *msgstr = json_object_new_string(curl_multi_strerror(rc));
+		struct pubnub *p, *next;
+		for (p = pool->members; p; p = next) {
+			next = p->pool_next;
+			if (!p->curl)
+				continue;
+			const char *method = p->method;
+			pubnub_connection_cleanup(p, true);
+			pubnub_handle_error(p, PNR_IO_ERROR, msgstr, method, true);
+		}
+		json_object_put(msgstr);
+		return;
+	}
+
+	pubnub_multi_dispatch(pool->curlm, NULL, true);
+}
+
+static void
+pubnub_pool_event_sockcb(struct pubnub *p, int fd, int mode, void *cb_data)
+{
+	int ev_bitmask =
+		(mode & 1 ? CURL_CSELECT_IN : 0) |
+		(mode & 2 ? CURL_CSELECT_OUT : 0) |
+		(mode & 4 ? CURL_CSELECT_ERR : 0);
+
+	pubnub_pool_check((struct pubnub_pool *)cb_data, fd, ev_bitmask);
+}
+
+static void
+pubnub_pool_event_timeoutcb(struct pubnub *p, void *cb_data)
+{
+	struct pubnub_pool *pool = (struct pubnub_pool *)cb_data;
+	pubnub_pool_check(pool, CURL_SOCKET_TIMEOUT, 0);
+
+	/* The members woken up may link themselves up again (or even
+	 * leave the pool), so take those due off the list first. */
+	long long now = pubnub_now_ms();
+	struct pubnub *due = NULL, **mp = &pool->wake;
+	while (*mp) {
+		struct pubnub *m = *mp;
+		if ((m->hold_until && m->hold_until <= now) || (m->rate_wake && m->rate_wake <= now)) {
+			*mp = m->pool_wake_next;
+			m->pool_wake_next = due;
+			due = m;
+		} else {
+			mp = &m->pool_wake_next;
+		}
+	}
+	while (due) {
+		struct pubnub *m = due;
+		due = m->pool_wake_next;
+		m->pool_wake_next = NULL;
+		m->pool_wake = false;
+		pubnub_wake_due(m);
+	}
+}
+
+static int
+pubnub_pool_sockcb(CURL *easy, curl_socket_t s, int action, void *userp, void *socketp)
+{
+	struct pubnub_pool *pool = (struct pubnub_pool *)userp;
+	/* Tell the frontend whose transfer the socket is for;
+	 * libcurl's internal handles have no owner. */
+	char *priv = NULL;
+	if (easy)
+		curl_easy_getinfo(easy, CURLINFO_PRIVATE, &priv);
+	struct pubnub *p = priv ? (struct pubnub *)priv : pool->members;
+	if (!p) {
+		/* Connections closing after the last context left;
+		 * there is no one to watch them through. */
+		return 0;
+	}
+	pubnub_http_sockwatch(pool->cb, pool->cb_data, p, pool->curlm, easy, s, action, socketp,
+			pubnub_pool_event_sockcb, pool);
+	return 0;
+}
+
+static int
+pubnub_pool_timercb(CURLM *multi, long timeout_ms, void *userp)
+{
+	struct pubnub_pool *pool = (struct pubnub_pool *)userp;
+	if (!pool->members)
+		return 0;
+	if (!pool->timer_p)
+		pool->timer_p = pool->members;
+	struct pubnub **mp = &pool->wake;
+	while (*mp) {
+		struct pubnub *m = *mp;
+		if (!m->hold_until && !m->rate_wake) {
+			*mp = m->pool_wake_next;
+			m->pool_wake_next = NULL;
+			m->pool_wake = false;
+			continue;
+		}
+		timeout_ms = pubnub_wake_clamp(m, timeout_ms);
+		mp = &m->pool_wake_next;
+	}
+	pubnub_http_timerset(pool->cb, pool->cb_data, pool->timer_p, timeout_ms,
+			pubnub_pool_event_timeoutcb, pool);
+	return 0;
+}
+
+PUBNUB_API
+struct pubnub_pool *
+pubnub_pool_init(const struct pubnub_callbacks *cb, void *cb_data)
+{
+	struct pubnub_pool *pool = (struct pubnub_pool *)calloc(1, sizeof(*pool));
+	if (!pool) return NULL;
+
+	pool->cb = cb;
+	pool->cb_data = cb_data;
+
+	pool->curlm = curl_multi_init();
+	curl_multi_setopt(pool->curlm, CURLMOPT_SOCKETFUNCTION, pubnub_pool_sockcb);
+	curl_multi_setopt(pool->curlm, CURLMOPT_SOCKETDATA, pool);
+	curl_multi_setopt(pool->curlm, CURLMOPT_TIMERFUNCTION, pubnub_pool_timercb);
+	curl_multi_setopt(pool->curlm, CURLMOPT_TIMERDATA, pool);
+
+	/* The multi handle already shares connections and the DNS cache
+	 * among its transfers; the share handle adds SSL sessions (and
+	 * keeps the DNS cache across handle resets). */
+	pool->curlsh = curl_share_init();
+	curl_share_setopt(pool->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(pool->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	return pool;
+}
+
+PUBNUB_API
+void
+pubnub_pool_done(struct pubnub_pool *pool)
+{
+	while (pool->members)
+		pubnub_done(pool->members);
+
+	curl_multi_cleanup(pool->curlm);
+	curl_share_cleanup(pool->curlsh);
+
+	if (pool->cb->done)
+		pool->cb->done(NULL, pool->cb_data);
+
+	free(pool);
+}
+
+static void
+pubnub_pool_detach(struct pubnub *p)
+{
+	struct pubnub **pp;
+	for (pp = &p->pool->members; *pp; pp = &(*pp)->pool_next) {
+		if (*pp == p) {
+			*pp = p->pool_next;
+			break;
+		}
+	}
+	p->pool_next = NULL;
+	if (p->pool_wake) {
+		for (pp = &p->pool->wake; *pp != p; pp = &(*pp)->pool_wake_next)
+			;
+		*pp = p->pool_wake_next;
+		p->pool_wake_next = NULL;
+		p->pool_wake = false;
+	}
+
+	if (p->pool->timer_p == p) {
+		/* Move the pool timer over to another context. */
+		struct pubnub_pool *pool = p->pool;
+		struct timespec ts = { SFINIT(.tv_sec, 0), SFINIT(.tv_nsec, 0) };
+		pool->cb->timeout(p, pool->cb_data, &ts, NULL, NULL);
+		pool->timer_p = NULL;
+
+		long timeout_ms = -1;
+		curl_multi_timeout(pool->curlm, &timeout_ms);
+		if (timeout_ms >= 0 && pool->members)
+			pubnub_pool_timercb(pool->curlm, timeout_ms > 0 ? timeout_ms : 1, pool);
+	}
+	p->pool = NULL;
+}
+
+
+static char *
+pubnub_gen_uuid(void)
+{
+	/* Template for version 4 (random) UUID. */
+	char uuidbuf[] = "xxxxxxxx-xxxx-4xxx-9xxx-xxxxxxxxxxxx";
+
+	unsigned int seed;
+#if defined(__MINGW32__) || defined(__MACH__) || defined(_MSC_VER)
+	seed = time(NULL);
+	srand(seed);
 #else
 	/* About the best world-unique random seed we can manage without
 	 * absurd measures... */
@@ -379,6 +1272,52 @@ pubnub_gen_uuid(void)
 	return strdup(uuidbuf);
 }
 
+/* Characters left alone by URL encoding; the same set as with
+ * curl_easy_escape(). */
+static const unsigned char url_safe[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/* Append the URL-encoded @len bytes at @str to @pb.  Runs of safe
+ * characters (typically the whole string) are copied in one go. */
+static void
+pubnub_url_escape_len(struct printbuf *pb, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const unsigned char *s = (const unsigned char *) str, *end = s + len;
+	while (s < end) {
+		const unsigned char *run = s;
+		while (s < end && url_safe[*s])
+			s++;
+		if (s > run)
+			printbuf_memappend_fast(pb, (const char *) run, s - run);
+
+		char esc[96];
+		int esc_len = 0;
+		for (; s < end && !url_safe[*s] && esc_len < (int) sizeof(esc); s++) {
+			esc[esc_len++] = '%';
+			esc[esc_len++] = hex[*s >> 4];
+			esc[esc_len++] = hex[*s & 0xf];
+		}
+		if (esc_len)
+			printbuf_memappend_fast(pb, esc, esc_len);
+	}
+}
+
+/* Append URL-encoded @str to @pb. */
+static void
+pubnub_url_escape(struct printbuf *pb, const char *str)
+{
+	pubnub_url_escape_len(pb, str, strlen(str));
+}
+
 static struct printbuf *
 channelset_printbuf(const struct channelset *cs)
 {
@@ -393,46 +1332,109 @@ channelset_printbuf(const struct channelset *cs)
 	return pb;
 }
 
+/* Channelsets with more channels than this are also indexed by an open
+ * addressing hash table; scanning a handful of strings is cheaper. */
+#define CHANNELSET_HASH_MIN 16
+
+static unsigned
+channelset_hashfn(const char *channel)
+{
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+	for (; *channel; channel++) {
+		h ^= (unsigned char) *channel;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Return the slot of the hash table holding @channel, or the empty slot
+ * where it would be stored. */
+static unsigned
+channelset_slot(const struct channelset *cs, const char *channel)
+{
+	unsigned mask = cs->hash_size - 1;
+	unsigned i = channelset_hashfn(channel) & mask;
+	while (cs->hash[i] && strcmp(cs->set[cs->hash[i] - 1], channel))
+		i = (i + 1) & mask;
+	return i;
+}
+
+/* (Re)build the hash table, sized for at most 50% load. */
+static void
+channelset_rehash(struct channelset *cs)
+{
+	int size = 2 * CHANNELSET_HASH_MIN;
+	while (size < cs->n * 2)
+		size *= 2;
+	free(cs->hash);
+	cs->hash = (int *)calloc(size, sizeof(cs->hash[0]));
+	cs->hash_size = size;
+	for (int i = 0; i < cs->n; i++)
+		cs->hash[channelset_slot(cs, cs->set[i])] = i + 1;
+}
+
+/* Empty hash slot @i, shifting back the items of the probe sequence
+ * following it so that all of them remain reachable. */
+static void
+channelset_hash_del(struct channelset *cs, unsigned i)
+{
+	unsigned mask = cs->hash_size - 1;
+	unsigned j = i;
+	for (;;) {
+		cs->hash[i] = 0;
+		unsigned k;
+		do {
+			j = (j + 1) & mask;
+			if (!cs->hash[j])
+				return;
+			k = channelset_hashfn(cs->set[cs->hash[j] - 1]) & mask;
+			/* Items whose home slot lies cyclically in (i, j]
+			 * stay where they are. */
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		cs->hash[i] = cs->hash[j];
+		i = j;
+	}
+}
+
+/* Return the index of @channel in |cs|, or -1 if it is not there. */
+static int
+channelset_find(const struct channelset *cs, const char *channel)
+{
+	if (cs->hash)
+		return cs->hash[channelset_slot(cs, channel)] - 1;
+	for (int i = 0; i < cs->n; i++) {
+		if (!strcmp(cs->set[i], channel))
+			return i;
+	}
+	return -1;
+}
+
 /* Add all items from |src| to |dst|, unless they are already in it.
  * Returns the number of channels actually added. */
 static int
 channelset_add(struct channelset *dst, const struct channelset *src)
 {
-#ifdef _MSC_VER
-	bool *src_mask = (bool*)calloc(src->n , sizeof(bool));
-#else
-	bool src_mask[src->n];
-	memset(&src_mask, 0, sizeof(src_mask));
-#endif
-	int src_new_n = src->n;
+	int src_new_n = 0;
 
-	/* We anticipate small |channelset| and small (or singular) |channels|,
-	 * therefore using just a trivial O(MN) algorithm here. */
-	for (int i = 0; i < dst->n; i++) {
-		for (int j = 0; j < src->n; j++) {
-			if (src_mask[j])
-				continue;
-			if (!strcmp(dst->set[i], src->set[j])) {
-				src_mask[j] = true;
-				src_new_n--;
-				break;
-			}
+	for (int j = 0; j < src->n; j++) {
+		if (channelset_find(dst, src->set[j]) >= 0)
+			continue;
+		if (dst->n == dst->alloc) {
+			dst->alloc = dst->alloc ? dst->alloc * 2 : 4;
+			dst->set = (const char**)realloc(dst->set, dst->alloc * sizeof(dst->set[0]));
 		}
-	}
+		dst->set[dst->n++] = strdup(src->set[j]);
+		src_new_n++;
 
-	if (src_new_n != 0) {
-		int i = dst->n;
-		dst->n += src_new_n;
-		dst->set = (const char**)realloc(dst->set, dst->n * sizeof(dst->set[0]));
-		for (int j = 0; j < src->n; j++) {
-			if (src_mask[j])
-				continue;
-			dst->set[i++] = strdup(src->set[j]);
-		}
+		if (dst->hash && dst->n * 2 <= dst->hash_size)
+			dst->hash[channelset_slot(dst, dst->set[dst->n - 1])] = dst->n;
+		else if (dst->hash || dst->n > CHANNELSET_HASH_MIN)
+			channelset_rehash(dst);
 	}
-#ifdef _MSC_VER
-	free(src_mask);
-#endif
+
+	if (src_new_n != 0)
+		dst->str_valid = false;
 	return src_new_n;
 }
 
@@ -443,46 +1445,64 @@ static void channelset_done(struct channelset *cs);
 static int
 channelset_rm(struct channelset *dst, const struct channelset *src)
 {
-#ifdef _MSC_VER
-	bool *src_mask = (bool*)calloc(src->n , sizeof(bool));
-#else
-	bool src_mask[src->n];
-	memset(&src_mask, 0, sizeof(src_mask));
-#endif
-	int src_new_n = src->n;
+	int src_rm_n = 0;
 
-	/* We anticipate small |channelset| and small (or singular) |channels|,
-	 * therefore using just a trivial O(MN) algorithm here. */
-	for (int i = 0; i < dst->n; i++) {
-		for (int j = 0; j < src->n; j++) {
-			if (src_mask[j])
-				continue;
-			if (!strcmp(dst->set[i], src->set[j])) {
-				src_mask[j] = true;
-				src_new_n--;
-
-				free((char *) dst->set[i]);
-				/* Replace the free spot with the last channel
-				 * and revisit the spot in next iteration. */
-				dst->set[i] = dst->set[--dst->n];
-				i--;
-				break;
-			}
+	for (int j = 0; j < src->n; j++) {
+		int i = channelset_find(dst, src->set[j]);
+		if (i < 0)
+			continue;
+		src_rm_n++;
+
+		if (dst->hash)
+			channelset_hash_del(dst, channelset_slot(dst, dst->set[i]));
+		free((char *) dst->set[i]);
+		/* Replace the free spot with the last channel. */
+		dst->set[i] = dst->set[--dst->n];
+		if (dst->hash && i < dst->n) {
+			/* The slot still refers to the old index, whose
+			 * pointer is still in place. */
+			dst->hash[channelset_slot(dst, dst->set[i])] = i + 1;
 		}
 	}
 
-	if (src_new_n != src->n) {
+	if (src_rm_n != 0) {
 		if (dst->n == 0) {
 			/* All channels removed. */
 			channelset_done(dst);
 		} else {
-			dst->set = (const char**)realloc(dst->set, dst->n * sizeof(dst->set[0]));
+			dst->str_valid = false;
 		}
 	}
-#ifdef _MSC_VER
-	free(src_mask);
-#endif
-	return src->n - src_new_n;
+	return src_rm_n;
+}
+
+/* Return the comma-joined channel names and store their URL-encoded
+ * form to @enc.  Both are cached in |cs| until its membership changes,
+ * so that a long-poll cycle does not rebuild them. */
+static const char *
+channelset_str(struct channelset *cs, const char **enc)
+{
+	if (!cs->str_valid) {
+		if (!cs->str) {
+			cs->str = printbuf_new();
+			cs->str_enc = printbuf_new();
+		}
+		printbuf_reset(cs->str);
+		printbuf_reset(cs->str_enc);
+		for (int i = 0; i < cs->n; i++) {
+			if (i > 0) {
+				printbuf_memappend_fast(cs->str, ",", 1);
+				printbuf_memappend_fast(cs->str_enc, "%2C", 3);
+			}
+			printbuf_memappend_fast(cs->str, cs->set[i], strlen(cs->set[i]));
+			pubnub_url_escape(cs->str_enc, cs->set[i]);
+		}
+		printbuf_memappend_fast(cs->str, "" /* \0 */, 1);
+		printbuf_memappend_fast(cs->str_enc, "" /* \0 */, 1);
+		cs->str_valid = true;
+	}
+	*enc = cs->str_enc->buf;
+	return cs->str->buf;
 }
 
 static void
@@ -496,87 +1516,659 @@ channelset_done(struct channelset *cs)
 		free((char *) cs->set[i]);
 	}
 	cs->n = 0;
+	cs->alloc = 0;
 	free(cs->set);
 	cs->set = NULL;
+	free(cs->hash);
+	cs->hash = NULL;
+	cs->hash_size = 0;
+	if (cs->str) {
+		printbuf_free(cs->str);
+		printbuf_free(cs->str_enc);
+		cs->str = cs->str_enc = NULL;
+	}
+	cs->str_valid = false;
+}
+
+
+/* The presence cache keeps the occupants of the channels queried by
+ * pubnub_here_now(), kept up to date by the presence events received on
+ * their -pnpres channels; see pubnub_set_presence_cache(). */
+
+#define PUBNUB_PRESENCE_SUFFIX "-pnpres"
+
+static struct pubnub_presence *
+pubnub_presence_find(struct pubnub *p, const char *channel)
+{
+	int i = channelset_find(&p->presence_channels, channel);
+	return i >= 0 ? &p->presence[i] : NULL;
 }
 
+/* A here_now response for @channel came in; (re)fill its entry. */
 static void
-pubnub_free_ssl_cacerts(struct pubnub *p)
+pubnub_presence_fill(struct pubnub *p, const char *channel, struct json_object *response)
 {
-	if (p->ssl_cacerts)
-	{
-		sk_X509_INFO_pop_free(p->ssl_cacerts, X509_INFO_free);
-		p->ssl_cacerts = NULL;
+	struct pubnub_presence *e = pubnub_presence_find(p, channel);
+	if (!e) {
+		if (p->presence_channels.n == p->presence_alloc) {
+			p->presence_alloc = p->presence_alloc ? p->presence_alloc * 2 : 4;
+			p->presence = (struct pubnub_presence *)realloc(p->presence, p->presence_alloc * sizeof(p->presence[0]));
+		}
+		const struct channelset cs = { SFINIT(.set, &channel), SFINIT(.n, 1) };
+		channelset_add(&p->presence_channels, &cs);
+		e = &p->presence[p->presence_channels.n - 1];
+		memset(e, 0, sizeof(*e));
+	}
+
+	channelset_done(&e->uuids);
+	struct json_object *uuids = json_object_object_get(response, "uuids");
+	int n = uuids && json_object_is_type(uuids, json_type_array) ? json_object_array_length(uuids) : 0;
+	for (int i = 0; i < n; i++) {
+		struct json_object *uuid = json_object_array_get_idx(uuids, i);
+		if (uuid && json_object_is_type(uuid, json_type_object)) {
+			/* With the state included. */
+			uuid = json_object_object_get(uuid, "uuid");
+		}
+		if (!uuid || !json_object_is_type(uuid, json_type_string))
+			continue;
+		const char *s = json_object_get_string(uuid);
+		const struct channelset cs = { SFINIT(.set, &s), SFINIT(.n, 1) };
+		channelset_add(&e->uuids, &cs);
+	}
+	struct json_object *occupancy = json_object_object_get(response, "occupancy");
+	e->occupancy = occupancy ? json_object_get_int(occupancy) : e->uuids.n;
+	e->fetched_at = pubnub_now_ms();
+	if (e->response) {
+		json_object_put(e->response);
+		e->response = NULL;
 	}
 }
 
-PUBNUB_API
-struct pubnub *
-pubnub_init(const char *publish_key, const char *subscribe_key,
-		const struct pubnub_callbacks *cb, void *cb_data)
+/* Apply the @action members listed in @uuids (a string or an array)
+ * to @e. */
+static void
+pubnub_presence_update(struct pubnub_presence *e, const char *action, struct json_object *uuids)
 {
-	struct pubnub *p = (struct pubnub *)calloc(1, sizeof(*p));
-	if (!p) return NULL;
+	int n = json_object_is_type(uuids, json_type_array) ? json_object_array_length(uuids) : 1;
+	for (int i = 0; i < n; i++) {
+		struct json_object *uuid = json_object_is_type(uuids, json_type_array) ? json_object_array_get_idx(uuids, i) : uuids;
+		if (!uuid || !json_object_is_type(uuid, json_type_string))
+			continue;
+		const char *s = json_object_get_string(uuid);
+		const struct channelset cs = { SFINIT(.set, &s), SFINIT(.n, 1) };
+		if (!strcmp(action, "join"))
+			channelset_add(&e->uuids, &cs);
+		else
+			channelset_rm(&e->uuids, &cs);
+	}
+}
 
-	p->publish_key = strdup(publish_key);
-	p->subscribe_key = strdup(subscribe_key);
-	p->origin = strdup("http://pubsub.pubnub.com");
-	p->uuid = pubnub_gen_uuid();
-	strcpy(p->time_token, "0");
-	p->resume_on_reconnect = true;
+static void
+pubnub_presence_event(struct pubnub_presence *e, struct json_object *event)
+{
+	struct json_object *action = json_object_object_get(event, "action");
+	if (!action || !json_object_is_type(action, json_type_string))
+		return;
+	const char *a = json_object_get_string(action);
+
+	struct json_object *uuid = json_object_object_get(event, "uuid");
+	if (!strcmp(a, "join") || !strcmp(a, "leave") || !strcmp(a, "timeout")) {
+		if (uuid)
+			pubnub_presence_update(e, a, uuid);
+	} else if (!strcmp(a, "interval")) {
+		/* Announce mode past the announce_max occupants; the
+		 * changes are listed unless there are too many of them,
+		 * in which case we do not know the occupants anymore. */
+		static const char *actions[] = { "join", "leave", "timeout" };
+		bool listed = false;
+		for (int i = 0; i < 3; i++) {
+			struct json_object *uuids = json_object_object_get(event, actions[i]);
+			if (uuids) {
+				pubnub_presence_update(e, actions[i], uuids);
+				listed = true;
+			}
+		}
+		if (!listed || json_object_object_get(event, "here_now_refresh"))
+			e->fetched_at = 0;
+	} else {
+		/* state-change */
+		return;
+	}
 
-	p->cb = cb;
-	p->cb_data = cb_data;
+	struct json_object *occupancy = json_object_object_get(event, "occupancy");
+	e->occupancy = occupancy ? json_object_get_int(occupancy) : e->uuids.n;
+	if (e->response) {
+		json_object_put(e->response);
+		e->response = NULL;
+	}
+}
 
-	p->url = printbuf_new();
-	p->body = printbuf_new();
+/* Feed the presence events among the @msg_n messages of @msg to the
+ * cache. */
+static void
+pubnub_presence_apply(struct pubnub *p, struct json_object *msg, const char *const *channels, int msg_n)
+{
+	const size_t suffix_len = strlen(PUBNUB_PRESENCE_SUFFIX);
+	char name[256];
+	for (int i = 0; i < msg_n; i++) {
+		size_t len = strlen(channels[i]);
+		if (len <= suffix_len || len - suffix_len >= sizeof(name)
+		    || strcmp(channels[i] + len - suffix_len, PUBNUB_PRESENCE_SUFFIX))
+			continue;
+		memcpy(name, channels[i], len - suffix_len);
+		name[len - suffix_len] = 0;
+		struct pubnub_presence *e = pubnub_presence_find(p, name);
+		struct json_object *event = json_object_array_get_idx(msg, i);
+		if (e && event && json_object_is_type(event, json_type_object))
+			pubnub_presence_event(e, event);
+	}
+}
 
-	p->error_retry_mask = ~0;
-	p->error_print = true;
+/* The here_now response for @e. */
+static struct json_object *
+pubnub_presence_response(struct pubnub_presence *e)
+{
+	if (!e->response) {
+		struct json_object *uuids = json_object_new_array();
+		for (int i = 0; i < e->uuids.n; i++)
+			json_object_array_add(uuids, json_object_new_string(e->uuids.set[i]));
+		e->response = json_object_new_object();
+		json_object_object_add(e->response, "uuids", uuids);
+		json_object_object_add(e->response, "occupancy", json_object_new_int(e->occupancy));
+	}
+	return e->response;
+}
 
-	p->nosignal = true;
+static void
+pubnub_presence_clear(struct pubnub *p)
+{
+	for (int i = 0; i < p->presence_channels.n; i++) {
+		channelset_done(&p->presence[i].uuids);
+		if (p->presence[i].response)
+			json_object_put(p->presence[i].response);
+	}
+	free(p->presence);
+	p->presence = NULL;
+	p->presence_alloc = 0;
+	channelset_done(&p->presence_channels);
+}
 
-	p->curlm = curl_multi_init();
-	curl_multi_setopt(p->curlm, CURLMOPT_SOCKETFUNCTION, pubnub_http_sockcb);
-	curl_multi_setopt(p->curlm, CURLMOPT_SOCKETDATA, p);
-	curl_multi_setopt(p->curlm, CURLMOPT_TIMERFUNCTION, pubnub_http_timercb);
-	curl_multi_setopt(p->curlm, CURLMOPT_TIMERDATA, p);
+/* TLS state shared process-wide: the CA certificates set by
+ * pubnub_set_ssl_cacerts() are parsed once for all contexts passing
+ * the same PEM data, and contexts outside of a pool share an SSL
+ * session cache, so that reconnects resume sessions instead of
+ * going through full handshakes.  Contexts with CA certificates of
+ * their own share the session cache of those instead, so that
+ * a session verified against one CA set is never resumed by
+ * a context trusting another. */
+
+PUBNUB_MUTEX(pubnub_ssl_lock);
+
+struct pubnub_cacerts {
+	struct pubnub_cacerts *next;
+	int refs;
+	/* Identify the PEM data. */
+	size_t len;
+	/* SSL sessions of the contexts using these; NULL on Windows. */
+	CURLSH *share;
+#ifndef PUBNUB_NO_CRYPTO
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	STACK_OF(X509_INFO) *certs;
+#else
+	/* Without OpenSSL, the PEM data is compared as it is and handed
+	 * over to libcurl to parse. */
+	char *pem;
+#endif
+};
 
-	p->curl_headers = curl_slist_append(p->curl_headers, "User-Agent: " SDK_INFO);
-	p->curl_headers = curl_slist_append(p->curl_headers, "V: 3.4");
+static struct pubnub_cacerts *pubnub_cacerts_list;
 
-	return p;
+static CURLSH *pubnub_ssl_share_new(void);
+
+static struct pubnub_cacerts *
+pubnub_cacerts_get(const char *cacerts, size_t len)
+{
+#ifndef PUBNUB_NO_CRYPTO
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	MD5((const unsigned char *)cacerts, len, digest);
+#endif
+
+	PUBNUB_LOCK(pubnub_ssl_lock);
+	struct pubnub_cacerts *c;
+	for (c = pubnub_cacerts_list; c; c = c->next) {
+#ifndef PUBNUB_NO_CRYPTO
+		if (c->len == len && !memcmp(c->digest, digest, sizeof(digest))) {
+#else
+		if (c->len == len && !memcmp(c->pem, cacerts, len)) {
+#endif
+			c->refs++;
+			PUBNUB_UNLOCK(pubnub_ssl_lock);
+			return c;
+		}
+	}
+
+	c = (struct pubnub_cacerts *)calloc(1, sizeof(*c));
+	c->refs = 1;
+	c->len = len;
+#ifndef PUBNUB_NO_CRYPTO
+	memcpy(c->digest, digest, sizeof(digest));
+	BIO *bio = BIO_new_mem_buf((char *)cacerts, len);
+	c->certs = PEM_X509_INFO_read_bio(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+#else
+	c->pem = (char *)malloc(len);
+	memcpy(c->pem, cacerts, len);
+#endif
+	c->share = pubnub_ssl_share_new();
+	c->next = pubnub_cacerts_list;
+	pubnub_cacerts_list = c;
+	PUBNUB_UNLOCK(pubnub_ssl_lock);
+	return c;
 }
 
-PUBNUB_API
-void
-pubnub_done(struct pubnub *p)
+static void
+pubnub_cacerts_put(struct pubnub_cacerts *c)
 {
-	if (p->method) {
-		/* Ongoing request, cancel. */
-		pubnub_connection_cancel(p);
-		p->method = NULL;
+	PUBNUB_LOCK(pubnub_ssl_lock);
+	if (--c->refs == 0) {
+		struct pubnub_cacerts **cp;
+		for (cp = &pubnub_cacerts_list; *cp != c; cp = &(*cp)->next)
+			;
+		*cp = c->next;
+#ifndef PUBNUB_NO_CRYPTO
+		if (c->certs)
+			sk_X509_INFO_pop_free(c->certs, X509_INFO_free);
+#else
+		free(c->pem);
+#endif
+		/* This fails (and leaves the share behind) only if
+		 * a transfer still in progress uses it. */
+		if (c->share)
+			curl_share_cleanup(c->share);
+		free(c);
 	}
-	assert(!p->curl);
+	PUBNUB_UNLOCK(pubnub_ssl_lock);
+}
 
-	curl_multi_cleanup(p->curlm);
-	curl_slist_free_all(p->curl_headers);
+#ifndef _WIN32
 
-	if (p->cb->done)
-		p->cb->done(p, p->cb_data);
+static CURLSH *pubnub_ssl_share;
+static int pubnub_ssl_share_refs;
+static pthread_mutex_t pubnub_ssl_share_locks[CURL_LOCK_DATA_LAST];
 
-	channelset_done(&p->channelset);
+static void
+pubnub_ssl_share_lockcb(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	pthread_mutex_lock(&pubnub_ssl_share_locks[data]);
+}
 
-	pubnub_free_ssl_cacerts(p);
-	printbuf_free(p->body);
-	printbuf_free(p->url);
-	free(p->publish_key);
-	free(p->subscribe_key);
-	free(p->secret_key);
-	free(p->cipher_key);
-	free(p->origin);
-	free(p->uuid);
-	free(p);
+static void
+pubnub_ssl_share_unlockcb(CURL *curl, curl_lock_data data, void *userptr)
+{
+	pthread_mutex_unlock(&pubnub_ssl_share_locks[data]);
+}
+
+/* A new SSL session share; called with pubnub_ssl_lock held. */
+static CURLSH *
+pubnub_ssl_share_new(void)
+{
+	static bool locks_init;
+
+	if (!locks_init) {
+		for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+			pthread_mutex_init(&pubnub_ssl_share_locks[i], NULL);
+		locks_init = true;
+	}
+	CURLSH *share = curl_share_init();
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, pubnub_ssl_share_lockcb);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, pubnub_ssl_share_unlockcb);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	return share;
+}
+
+static CURLSH *
+pubnub_ssl_share_get(void)
+{
+	PUBNUB_LOCK(pubnub_ssl_lock);
+	if (!pubnub_ssl_share)
+		pubnub_ssl_share = pubnub_ssl_share_new();
+	pubnub_ssl_share_refs++;
+	PUBNUB_UNLOCK(pubnub_ssl_lock);
+	return pubnub_ssl_share;
+}
+
+static void
+pubnub_ssl_share_put(void)
+{
+	PUBNUB_LOCK(pubnub_ssl_lock);
+	if (--pubnub_ssl_share_refs == 0) {
+		curl_share_cleanup(pubnub_ssl_share);
+		pubnub_ssl_share = NULL;
+	}
+	PUBNUB_UNLOCK(pubnub_ssl_lock);
+}
+
+#else
+
+/* No locking on Windows (yet); each context keeps its own sessions. */
+
+static CURLSH *
+pubnub_ssl_share_new(void)
+{
+	return NULL;
+}
+
+static CURLSH *
+pubnub_ssl_share_get(void)
+{
+	return NULL;
+}
+
+static void
+pubnub_ssl_share_put(void)
+{
+}
+
+#endif
+
+static void
+pubnub_free_ssl_cacerts(struct pubnub *p)
+{
+	if (p->ssl_cacerts)
+	{
+		/* Let go of the session share of the certificates; the
+		 * handles get attached to the right one when they are
+		 * used again. */
+		if (p->curl_idle)
+			curl_easy_setopt(p->curl_idle, CURLOPT_SHARE, NULL);
+		for (struct pubnub_req *req = p->reqs_free; req; req = req->next)
+			if (req->curl)
+				curl_easy_setopt(req->curl, CURLOPT_SHARE, NULL);
+		pubnub_cacerts_put(p->ssl_cacerts);
+		p->ssl_cacerts = NULL;
+	}
+}
+
+/* Shared configuration.  A context points its key, origin and header
+ * fields at those of its configuration and only frees them if it has
+ * got its own copy via one of the setters in the meantime. */
+
+PUBNUB_MUTEX(pubnub_config_lock);
+
+/* Free @ptr unless it is the @shared value of the configuration. */
+static void
+pubnub_free_unshared(void *ptr, const void *shared)
+{
+	if (ptr != shared)
+		free(ptr);
+}
+
+PUBNUB_API
+struct pubnub_config *
+pubnub_config_new(const char *publish_key, const char *subscribe_key)
+{
+	struct pubnub_config *c = (struct pubnub_config *)calloc(1, sizeof(*c));
+	if (!c) return NULL;
+
+	c->refs = 1;
+	c->publish_key = strdup(publish_key);
+	c->subscribe_key = strdup(subscribe_key);
+	/* The keys are in (almost) every URL and never change. */
+	c->publish_key_enc = printbuf_new();
+	pubnub_url_escape(c->publish_key_enc, publish_key);
+	c->subscribe_key_enc = printbuf_new();
+	pubnub_url_escape(c->subscribe_key_enc, subscribe_key);
+	c->origin = strdup("http://pubsub.pubnub.com");
+
+	c->curl_headers = curl_slist_append(c->curl_headers, "User-Agent: " SDK_INFO);
+	c->curl_headers = curl_slist_append(c->curl_headers, "V: 3.4");
+
+	return c;
+}
+
+PUBNUB_API
+void
+pubnub_config_set_secret_key(struct pubnub_config *c, const char *secret_key)
+{
+	free(c->secret_key);
+	c->secret_key = secret_key ? strdup(secret_key) : NULL;
+}
+
+PUBNUB_API
+void
+pubnub_config_set_cipher_key(struct pubnub_config *c, const char *cipher_key)
+{
+	free(c->cipher_key);
+	c->cipher_key = cipher_key ? strdup(cipher_key) : NULL;
+}
+
+PUBNUB_API
+void
+pubnub_config_set_origin(struct pubnub_config *c, const char *origin)
+{
+	free(c->origin);
+	c->origin = strdup(origin);
+}
+
+PUBNUB_API
+void
+pubnub_config_set_ssl_cacerts(struct pubnub_config *c, const char *cacerts, size_t len)
+{
+	struct pubnub_cacerts *certs = pubnub_cacerts_get(cacerts, len);
+	if (c->ssl_cacerts)
+		pubnub_cacerts_put(c->ssl_cacerts);
+	c->ssl_cacerts = certs;
+}
+
+PUBNUB_API
+void
+pubnub_config_done(struct pubnub_config *c)
+{
+	PUBNUB_LOCK(pubnub_config_lock);
+	bool last = --c->refs == 0;
+	PUBNUB_UNLOCK(pubnub_config_lock);
+	if (!last)
+		return;
+
+	free(c->publish_key);
+	free(c->subscribe_key);
+	printbuf_free(c->publish_key_enc);
+	printbuf_free(c->subscribe_key_enc);
+	free(c->secret_key);
+	free(c->cipher_key);
+	free(c->origin);
+	curl_slist_free_all(c->curl_headers);
+	if (c->ssl_cacerts)
+		pubnub_cacerts_put(c->ssl_cacerts);
+	free(c);
+}
+
+/* Initialize the context except for the multi handle. */
+static struct pubnub *
+pubnub_init_common(struct pubnub_config *c,
+		const struct pubnub_callbacks *cb, void *cb_data)
+{
+	struct pubnub *p = (struct pubnub *)calloc(1, sizeof(*p));
+	if (!p) return NULL;
+
+	PUBNUB_LOCK(pubnub_config_lock);
+	c->refs++;
+	PUBNUB_UNLOCK(pubnub_config_lock);
+	p->config = c;
+	p->publish_key = c->publish_key;
+	p->subscribe_key = c->subscribe_key;
+	p->publish_key_enc = c->publish_key_enc;
+	p->subscribe_key_enc = c->subscribe_key_enc;
+	p->secret_key = c->secret_key;
+	p->cipher_key = c->cipher_key;
+	/* The cipher keeps per-operation state, so it is not shared. */
+	if (PUBNUB_CIPHER_KEY(c))
+		p->cipher = pubnub_cipher_new(c->cipher_key);
+	p->origin = c->origin;
+	p->curl_headers = c->curl_headers;
+	if (c->ssl_cacerts) {
+		PUBNUB_LOCK(pubnub_ssl_lock);
+		c->ssl_cacerts->refs++;
+		PUBNUB_UNLOCK(pubnub_ssl_lock);
+		p->ssl_cacerts = c->ssl_cacerts;
+	}
+
+	p->uuid = pubnub_gen_uuid();
+	strcpy(p->time_token, "0");
+	p->resume_on_reconnect = true;
+
+	p->cb = cb;
+	p->cb_data = cb_data;
+
+	p->body_keep = PUBNUB_BODY_KEEP;
+
+	p->error_retry_mask = ~0;
+	p->error_print = true;
+	p->retry_base_ms = 250;
+	p->retry_max_ms = 30000;
+	/* Each client gets its own sequence of retry delays. */
+	p->retry_seed = 2166136261u;
+	for (const char *c = p->uuid; *c; c++)
+		p->retry_seed = (p->retry_seed ^ *c) * 16777619;
+
+	p->nosignal = true;
+	p->keepalive = true;
+
+	p->reqs_max = 4;
+	p->submit_fd[0] = p->submit_fd[1] = -1;
+
+	return p;
+}
+
+static void
+pubnub_init_multi(struct pubnub *p)
+{
+	p->curlm = curl_multi_init();
+	curl_multi_setopt(p->curlm, CURLMOPT_SOCKETFUNCTION, pubnub_http_sockcb);
+	curl_multi_setopt(p->curlm, CURLMOPT_SOCKETDATA, p);
+	curl_multi_setopt(p->curlm, CURLMOPT_TIMERFUNCTION, pubnub_http_timercb);
+	curl_multi_setopt(p->curlm, CURLMOPT_TIMERDATA, p);
+	p->ssl_share = pubnub_ssl_share_get();
+}
+
+static void
+pubnub_init_pool_member(struct pubnub *p, struct pubnub_pool *pool)
+{
+	p->pool = pool;
+	p->curlm = pool->curlm;
+	p->pool_next = pool->members;
+	pool->members = p;
+}
+
+PUBNUB_API
+struct pubnub *
+pubnub_init(const char *publish_key, const char *subscribe_key,
+		const struct pubnub_callbacks *cb, void *cb_data)
+{
+	struct pubnub_config *c = pubnub_config_new(publish_key, subscribe_key);
+	if (!c) return NULL;
+	struct pubnub *p = pubnub_init_common(c, cb, cb_data);
+	pubnub_config_done(c);
+	if (!p) return NULL;
+
+	pubnub_init_multi(p);
+	return p;
+}
+
+PUBNUB_API
+struct pubnub *
+pubnub_init_pooled(struct pubnub_pool *pool, const char *publish_key, const char *subscribe_key)
+{
+	struct pubnub_config *c = pubnub_config_new(publish_key, subscribe_key);
+	if (!c) return NULL;
+	struct pubnub *p = pubnub_init_common(c, pool->cb, pool->cb_data);
+	pubnub_config_done(c);
+	if (!p) return NULL;
+
+	pubnub_init_pool_member(p, pool);
+	return p;
+}
+
+PUBNUB_API
+struct pubnub *
+pubnub_init_config(struct pubnub_config *c, struct pubnub_pool *pool,
+		const struct pubnub_callbacks *cb, void *cb_data)
+{
+	struct pubnub *p = pubnub_init_common(c, pool ? pool->cb : cb, pool ? pool->cb_data : cb_data);
+	if (!p) return NULL;
+
+	if (pool)
+		pubnub_init_pool_member(p, pool);
+	else
+		pubnub_init_multi(p);
+	return p;
+}
+
+static void pubnub_req_cancel_all(struct pubnub *p);
+static void pubnub_submit_done(struct pubnub *p);
+static void resubscribe_queue_drop(struct pubnub *p);
+
+PUBNUB_API
+void
+pubnub_done(struct pubnub *p)
+{
+	while (p->method) {
+		/* Ongoing request, cancel; a cancelled join or leave
+		 * restarts the subscribe, which goes next. */
+		pubnub_connection_cancel(p);
+	}
+	assert(!p->curl);
+	resubscribe_queue_drop(p);
+	pubnub_submit_done(p);
+	pubnub_req_cancel_all(p);
+	if (p->curl_idle) {
+		curl_easy_cleanup(p->curl_idle);
+		p->curl_idle = NULL;
+	}
+
+	if (p->pool) {
+		/* The multi handle and the frontend belong to the pool. */
+		pubnub_pool_detach(p);
+	} else {
+		curl_multi_cleanup(p->curlm);
+		if (p->ssl_share)
+			pubnub_ssl_share_put();
+		if (p->cb->done)
+			p->cb->done(p, p->cb_data);
+	}
+	if (p->curl_headers != p->config->curl_headers)
+		curl_slist_free_all(p->curl_headers);
+	curl_slist_free_all(p->dns_resolve);
+	curl_slist_free_all(p->dns_resolve_old);
+	free(p->dns_hostport);
+
+	channelset_done(&p->channelset);
+	pubnub_presence_clear(p);
+	channelset_done(&p->demux_patterns);
+	free(p->demux);
+	free(p->demux_prefix);
+
+	pubnub_free_ssl_cacerts(p);
+	if (p->body_response)
+		json_object_put(p->body_response);
+	if (p->body_tok)
+		json_tokener_free(p->body_tok);
+	free(p->batch_channels);
+	free(p->dedupe);
+	free(p->stats);
+	if (p->arena)
+		pubnub_heap_free(p, p->arena);
+	pubnub_body_release(p);
+	pubnub_url_release(p);
+	/* The keys are never set on the context itself. */
+	pubnub_free_unshared(p->secret_key, p->config->secret_key);
+	free(p->sig_prefix);
+	pubnub_free_unshared(p->cipher_key, p->config->cipher_key);
+	pubnub_cipher_free(p->cipher);
+	pubnub_free_unshared(p->origin, p->config->origin);
+	pubnub_config_done(p->config);
+	free(p->uuid);
+	free(p);
 }
 
 PUBNUB_API
@@ -636,228 +2228,1920 @@ pubnub_init_serialized(struct json_object *obj,
 	return p;
 }
 
-PUBNUB_API
-void
-pubnub_set_secret_key(struct pubnub *p, const char *secret_key)
+
+/** Checkpoints */
+
+/* The file starts with a header and a table of offsets of the entries,
+ * one per context:
+ *
+ *   "PNCP" | version | n | 0 | offset[n] (64-bit)
+ *
+ * An entry is the flags, the number of channels and then the strings
+ * (publish key, subscribe key, UUID, origin, secret key, cipher key,
+ * timetoken, channels...), each as its 32-bit length (~0 for NULL)
+ * followed by the NUL-terminated string.  All in host byte order. */
+
+#define PUBNUB_CHECKPOINT_VERSION 1
+#define PUBNUB_CHECKPOINT_HDR 16
+#define PUBNUB_CHECKPOINT_RESUME 1
+
+struct pubnub_checkpoint {
+	const char *base;
+	size_t size;
+	int n;
+};
+
+#ifndef _WIN32
+
+static void
+checkpoint_u32(struct printbuf *pb, uint32_t v)
 {
-	free(p->secret_key);
-	p->secret_key = secret_key ? strdup(secret_key) : NULL;
+	printbuf_memappend_fast(pb, (const char *)&v, sizeof(v));
 }
 
-PUBNUB_API
-void
-pubnub_set_cipher_key(struct pubnub *p, const char *cipher_key)
+static void
+checkpoint_str(struct printbuf *pb, const char *s)
 {
-	free(p->cipher_key);
-	p->cipher_key = cipher_key ? strdup(cipher_key) : NULL;
+	if (!s) {
+		checkpoint_u32(pb, ~(uint32_t)0);
+		return;
+	}
+	uint32_t len = strlen(s);
+	checkpoint_u32(pb, len);
+	printbuf_memappend_fast(pb, s, len + 1);
 }
 
-PUBNUB_API
-void
-pubnub_set_origin(struct pubnub *p, const char *origin)
+/* Read a 32-bit value at *@pos of @cp, advancing *@pos. */
+static bool
+checkpoint_get_u32(const struct pubnub_checkpoint *cp, size_t *pos, uint32_t *v)
 {
-	free(p->origin);
-	p->origin = strdup(origin);
+	if (*pos + sizeof(*v) > cp->size)
+		return false;
+	memcpy(v, cp->base + *pos, sizeof(*v));
+	*pos += sizeof(*v);
+	return true;
+}
+
+/* Point *@s to the string at *@pos of @cp, right in the mapping. */
+static bool
+checkpoint_get_str(const struct pubnub_checkpoint *cp, size_t *pos, const char **s)
+{
+	uint32_t len;
+	if (!checkpoint_get_u32(cp, pos, &len))
+		return false;
+	if (len == ~(uint32_t)0) {
+		*s = NULL;
+		return true;
+	}
+	if (*pos + len + 1 > cp->size || cp->base[*pos + len])
+		return false;
+	*s = cp->base + *pos;
+	*pos += len + 1;
+	return true;
 }
 
 PUBNUB_API
-void
-pubnub_set_nosignal(struct pubnub *p, bool nosignal)
+bool
+pubnub_checkpoint_write(const char *path, struct pubnub *const ps[], int n)
 {
-	p->nosignal = nosignal;
+	struct printbuf *pb = printbuf_new();
+	printbuf_memappend_fast(pb, "PNCP", 4);
+	checkpoint_u32(pb, PUBNUB_CHECKPOINT_VERSION);
+	checkpoint_u32(pb, n);
+	checkpoint_u32(pb, 0);
+	/* The offsets are filled in as we go. */
+	uint64_t offset = 0;
+	for (int i = 0; i < n; i++)
+		printbuf_memappend_fast(pb, (const char *)&offset, sizeof(offset));
+
+	for (int i = 0; i < n; i++) {
+		struct pubnub *p = ps[i];
+		offset = pb->bpos;
+		memcpy(pb->buf + PUBNUB_CHECKPOINT_HDR + i * sizeof(offset), &offset, sizeof(offset));
+		checkpoint_u32(pb, p->resume_on_reconnect ? PUBNUB_CHECKPOINT_RESUME : 0);
+		checkpoint_u32(pb, p->channelset.n);
+		checkpoint_str(pb, p->publish_key);
+		checkpoint_str(pb, p->subscribe_key);
+		checkpoint_str(pb, p->uuid);
+		checkpoint_str(pb, p->origin);
+		checkpoint_str(pb, p->secret_key);
+		checkpoint_str(pb, p->cipher_key);
+		checkpoint_str(pb, p->time_token);
+		for (int j = 0; j < p->channelset.n; j++)
+			checkpoint_str(pb, p->channelset.set[j]);
+	}
+
+	/* Write it aside and rename it over the old one, so that
+	 * there is always a complete checkpoint at @path. */
+	size_t tmp_len = strlen(path) + 5;
+	char *tmp = (char *)malloc(tmp_len);
+	snprintf(tmp, tmp_len, "%s.tmp", path);
+	bool ok = false;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd >= 0) {
+		ssize_t done = 0;
+		while (done < pb->bpos) {
+			ssize_t w = write(fd, pb->buf + done, pb->bpos - done);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w < 0)
+				break;
+			done += w;
+		}
+		ok = done == pb->bpos && !fsync(fd);
+		ok = !close(fd) && ok;
+		ok = ok && !rename(tmp, path);
+		if (!ok) {
+			int err = errno;
+			unlink(tmp);
+			errno = err;
+		}
+	}
+	free(tmp);
+	printbuf_free(pb);
+	return ok;
 }
 
 PUBNUB_API
-const char *
-pubnub_current_uuid(struct pubnub *p)
+struct pubnub_checkpoint *
+pubnub_checkpoint_open(const char *path)
 {
-	return p->uuid;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	size_t size = st.st_size;
+	void *base = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (base == MAP_FAILED) {
+		if (!size)
+			errno = EINVAL;
+		return NULL;
+	}
+
+	struct pubnub_checkpoint *cp = (struct pubnub_checkpoint *)malloc(sizeof(*cp));
+	cp->base = (const char *)base;
+	cp->size = size;
+	cp->n = 0;
+
+	/* Check the header and the offset table; the entries are
+	 * checked as they are read. */
+	size_t pos = 4;
+	uint32_t version, n, pad;
+	if (size < PUBNUB_CHECKPOINT_HDR || memcmp(cp->base, "PNCP", 4)
+	    || !checkpoint_get_u32(cp, &pos, &version) || version != PUBNUB_CHECKPOINT_VERSION
+	    || !checkpoint_get_u32(cp, &pos, &n) || !checkpoint_get_u32(cp, &pos, &pad)
+	    || n > (size - PUBNUB_CHECKPOINT_HDR) / sizeof(uint64_t)) {
+		pubnub_checkpoint_close(cp);
+		errno = EINVAL;
+		return NULL;
+	}
+	cp->n = n;
+	return cp;
 }
 
 PUBNUB_API
-void
-pubnub_set_uuid(struct pubnub *p, const char *uuid)
+int
+pubnub_checkpoint_count(const struct pubnub_checkpoint *cp)
 {
-	free(p->uuid);
-	p->uuid = strdup(uuid);
+	return cp->n;
 }
 
 PUBNUB_API
-void
-pubnub_error_policy(struct pubnub *p, unsigned int retry_mask, bool print)
+struct pubnub *
+pubnub_init_checkpoint(const struct pubnub_checkpoint *cp, int i, struct pubnub_pool *pool,
+		const struct pubnub_callbacks *cb, void *cb_data, bool resume)
 {
-	p->error_retry_mask = retry_mask;
-	p->error_print = print;
+	if (i < 0 || i >= cp->n)
+		return NULL;
+	uint64_t offset;
+	memcpy(&offset, cp->base + PUBNUB_CHECKPOINT_HDR + i * sizeof(offset), sizeof(offset));
+
+	size_t pos = offset;
+	uint32_t flags, channels_n;
+	const char *pub, *sub, *uuid, *origin, *secret_key, *cipher_key, *time_token;
+	if (offset > cp->size
+	    || !checkpoint_get_u32(cp, &pos, &flags) || !checkpoint_get_u32(cp, &pos, &channels_n)
+	    || !checkpoint_get_str(cp, &pos, &pub) || !checkpoint_get_str(cp, &pos, &sub)
+	    || !checkpoint_get_str(cp, &pos, &uuid) || !checkpoint_get_str(cp, &pos, &origin)
+	    || !checkpoint_get_str(cp, &pos, &secret_key) || !checkpoint_get_str(cp, &pos, &cipher_key)
+	    || !checkpoint_get_str(cp, &pos, &time_token)
+	    || !pub || !sub || !uuid || !origin || !time_token
+	    || channels_n > (cp->size - pos) / (sizeof(uint32_t) + 1))
+		return NULL;
+	/* The channel names are used right from the mapping. */
+	const char **channels = (const char **)malloc((channels_n + 1) * sizeof(*channels));
+	for (uint32_t j = 0; j < channels_n; j++) {
+		if (!checkpoint_get_str(cp, &pos, &channels[j]) || !channels[j]) {
+			free(channels);
+			return NULL;
+		}
+	}
+
+	struct pubnub *p = pool ? pubnub_init_pooled(pool, pub, sub) : pubnub_init(pub, sub, cb, cb_data);
+	strncpy(p->time_token, time_token, sizeof(p->time_token));
+	p->time_token[sizeof(p->time_token) - 1] = 0;
+	pubnub_set_uuid(p, uuid);
+	pubnub_set_origin(p, origin);
+	pubnub_set_secret_key(p, secret_key);
+	pubnub_set_cipher_key(p, cipher_key);
+	pubnub_set_resume_on_reconnect(p, flags & PUBNUB_CHECKPOINT_RESUME);
+
+	if (channels_n > 0) {
+		if (resume) {
+			/* Just as if we were subscribed all along; the next
+			 * subscribe carries on at the saved timetoken. */
+			const struct channelset cs = { SFINIT(.set, channels), SFINIT(.n, (int) channels_n) };
+			channelset_add(&p->channelset, &cs);
+		} else {
+			pubnub_subscribe_multi(p, channels, channels_n, -1, NULL, NULL);
+		}
+	}
+	free(channels);
+	return p;
 }
 
 PUBNUB_API
 void
-pubnub_set_ssl_cacerts(struct pubnub *p, const char *cacerts, size_t len)
+pubnub_checkpoint_close(struct pubnub_checkpoint *cp)
 {
-	BIO *bio;
+	munmap((void *)cp->base, cp->size);
+	free(cp);
+}
 
-	pubnub_free_ssl_cacerts(p);
+#else
 
-	bio = BIO_new_mem_buf((char *)cacerts, len);
-	p->ssl_cacerts = PEM_X509_INFO_read_bio(bio, NULL, NULL, NULL);
-	BIO_free(bio);
+/* No mmap() on Windows (yet); checkpoints cannot be written nor opened. */
+
+PUBNUB_API
+bool
+pubnub_checkpoint_write(const char *path, struct pubnub *const ps[], int n)
+{
+	return false;
 }
 
 PUBNUB_API
-void
-pubnub_set_resume_on_reconnect(struct pubnub *p, bool resume_on_reconnect)
+struct pubnub_checkpoint *
+pubnub_checkpoint_open(const char *path)
 {
-	p->resume_on_reconnect = resume_on_reconnect;
+	return NULL;
 }
 
-static size_t
-pubnub_http_inputcb(char *ptr, size_t size, size_t nmemb, void *userdata)
+PUBNUB_API
+int
+pubnub_checkpoint_count(const struct pubnub_checkpoint *cp)
 {
-	struct pubnub *p = (struct pubnub *)userdata;
-	DBGMSG("http input: %zd bytes\n", size * nmemb);
-	printbuf_memappend_fast(p->body, ptr, size * nmemb);
-	return size * nmemb;
+	return 0;
 }
 
-static CURLcode
-pubnub_ssl_contextcb(CURL *curl, void *context, void *userdata)
+PUBNUB_API
+struct pubnub *
+pubnub_init_checkpoint(const struct pubnub_checkpoint *cp, int i, struct pubnub_pool *pool,
+		const struct pubnub_callbacks *cb, void *cb_data, bool resume)
 {
-	SSL_CTX *ssl_context = (SSL_CTX *)context;
-	struct pubnub *p = (struct pubnub *)userdata;
+	return NULL;
+}
 
-	if (p->ssl_cacerts)
-	{
-		X509_STORE *cert_store = SSL_CTX_get_cert_store(ssl_context);
+PUBNUB_API
+void
+pubnub_checkpoint_close(struct pubnub_checkpoint *cp)
+{
+}
+
+#endif
+
+PUBNUB_API
+void
+pubnub_set_secret_key(struct pubnub *p, const char *secret_key)
+{
+	pubnub_free_unshared(p->secret_key, p->config->secret_key);
+	p->secret_key = secret_key ? strdup(secret_key) : NULL;
+	free(p->sig_prefix);
+	p->sig_prefix = NULL;
+}
+
+PUBNUB_API
+void
+pubnub_set_cipher_key(struct pubnub *p, const char *cipher_key)
+{
+	pubnub_free_unshared(p->cipher_key, p->config->cipher_key);
+	p->cipher_key = cipher_key ? strdup(cipher_key) : NULL;
+	pubnub_cipher_free(p->cipher);
+	p->cipher = PUBNUB_CIPHER_KEY(p) ? pubnub_cipher_new(cipher_key) : NULL;
+}
+
+#ifdef PUBNUB_NO_CRYPTO
+/* Nothing to decrypt, and crypto.c is not there. */
+
+PUBNUB_API
+struct pubnub_workers *
+pubnub_workers_init(int threads)
+{
+	return NULL;
+}
+
+PUBNUB_API
+void
+pubnub_workers_done(struct pubnub_workers *w)
+{
+}
+#endif
+
+PUBNUB_API
+void
+pubnub_set_decrypt_workers(struct pubnub *p, struct pubnub_workers *w, int min_batch)
+{
+	p->workers = w;
+	p->workers_min_batch = min_batch;
+}
+
+PUBNUB_API
+void
+pubnub_pool_set_decrypt_workers(struct pubnub_pool *pool, struct pubnub_workers *w, int min_batch)
+{
+	pool->workers = w;
+	pool->workers_min_batch = min_batch;
+}
+
+/* Decrypt the @message_list array of a response. */
+static struct json_object *
+pubnub_decrypt_msgs(struct pubnub *p, struct json_object *message_list)
+{
+	double start = p->stats_cur ? pubnub_clock() : 0;
+	struct json_object *msgs;
+	if (p->workers)
+		msgs = pubnub_cipher_decrypt_array_mt(p->cipher, p->workers, p->workers_min_batch, message_list);
+	else if (p->pool && p->pool->workers)
+		msgs = pubnub_cipher_decrypt_array_mt(p->cipher, p->pool->workers, p->pool->workers_min_batch, message_list);
+	else
+		msgs = pubnub_cipher_decrypt_array(p->cipher, message_list);
+	if (p->stats_cur)
+		p->stats_cur->time[PNS_DECRYPT] += pubnub_clock() - start;
+	return msgs;
+}
+
+PUBNUB_API
+void
+pubnub_set_origin(struct pubnub *p, const char *origin)
+{
+	pubnub_free_unshared(p->origin, p->config->origin);
+	p->origin = strdup(origin);
+	free(p->dns_hostport);
+	p->dns_hostport = NULL;
+	/* The new origin needs an entry of its own, even if it turns
+	 * out to have the same address. */
+	p->dns_addr[0] = 0;
+}
+
+PUBNUB_API
+void
+pubnub_set_nosignal(struct pubnub *p, bool nosignal)
+{
+	p->nosignal = nosignal;
+}
+
+PUBNUB_API
+void
+pubnub_set_keepalive(struct pubnub *p, bool keepalive)
+{
+	p->keepalive = keepalive;
+	if (!keepalive && p->curl_idle) {
+		curl_easy_cleanup(p->curl_idle);
+		p->curl_idle = NULL;
+	}
+}
+
+/* Let the transfers on @curlm share connections (HTTP/2 only). */
+static void
+pubnub_multi_http2(CURLM *curlm, bool http2)
+{
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	curl_multi_setopt(curlm, CURLMOPT_PIPELINING, http2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#endif
+}
+
+PUBNUB_API
+void
+pubnub_set_http2(struct pubnub *p, bool http2)
+{
+	p->http2 = http2;
+	/* The pool decides for its multi handle. */
+	if (!p->pool)
+		pubnub_multi_http2(p->curlm, http2);
+}
+
+PUBNUB_API
+void
+pubnub_pool_set_http2(struct pubnub_pool *pool, bool http2)
+{
+	pool->http2 = http2;
+	pubnub_multi_http2(pool->curlm, http2);
+}
+
+PUBNUB_API
+void
+pubnub_set_incremental_parse(struct pubnub *p, bool incremental)
+{
+	/* Takes effect with the next request. */
+	p->parse_incremental = incremental;
+}
+
+PUBNUB_API
+void
+pubnub_set_compression(struct pubnub *p, bool compress)
+{
+	p->compress = compress;
+}
+
+PUBNUB_API
+void
+pubnub_set_response_limits(struct pubnub *p, size_t max_size, size_t keep_size)
+{
+	p->body_max = max_size;
+	p->body_keep = keep_size;
+}
+
+PUBNUB_API
+void
+pubnub_set_response_buffer(struct pubnub *p, char *buf, size_t size)
+{
+	/* Empty it while pubnub_body_put() still recognizes it. */
+	if (p->body == &p->body_fixed)
+		pubnub_body_release(p);
+	p->body_fixed.buf = size > 0 ? buf : NULL;
+	p->body_fixed.size = p->body_fixed.buf ? (int) size : 0;
+	p->body_fixed.bpos = 0;
+	if (p->body_fixed.buf)
+		p->body_fixed.buf[0] = 0;
+}
+
+PUBNUB_API
+void
+pubnub_set_first_byte_cb(struct pubnub *p, pubnub_first_byte_cb cb, void *cb_data)
+{
+	p->first_byte_cb = cb;
+	p->first_byte_cb_data = cb_data;
+}
+
+PUBNUB_API
+const char *
+pubnub_current_uuid(struct pubnub *p)
+{
+	return p->uuid;
+}
+
+PUBNUB_API
+void
+pubnub_set_uuid(struct pubnub *p, const char *uuid)
+{
+	free(p->uuid);
+	p->uuid = strdup(uuid);
+}
+
+PUBNUB_API
+void
+pubnub_error_policy(struct pubnub *p, unsigned int retry_mask, bool print)
+{
+	p->error_retry_mask = retry_mask;
+	p->error_print = print;
+}
+
+PUBNUB_API
+void
+pubnub_set_stats(struct pubnub *p, bool enable, pubnub_stats_cb cb, void *cb_data)
+{
+	if (enable && !p->stats) {
+		p->stats = (struct pubnub_stats *)calloc(1, sizeof(*p->stats));
+	} else if (!enable) {
+		free(p->stats);
+		p->stats = NULL;
+	}
+	p->stats_cb = enable ? cb : NULL;
+	p->stats_cb_data = cb_data;
+}
+
+PUBNUB_API
+void
+pubnub_get_stats(struct pubnub *p, struct pubnub_stats *stats)
+{
+	if (p->stats)
+		*stats = *p->stats;
+	else
+		memset(stats, 0, sizeof(*stats));
+}
+
+PUBNUB_API
+void
+pubnub_reset_stats(struct pubnub *p)
+{
+	if (p->stats)
+		memset(p->stats, 0, sizeof(*p->stats));
+}
+
+PUBNUB_API
+void
+pubnub_set_allocator(struct pubnub *p, const struct pubnub_allocator *alloc, void *alloc_data)
+{
+	/* The arena is allocated anew by the new allocator. */
+	assert(!p->arena_live);
+	if (p->arena) {
+		pubnub_heap_free(p, p->arena);
+		p->arena = NULL;
+		p->arena_used = 0;
+	}
+	p->alloc = alloc;
+	p->alloc_data = alloc_data;
+}
+
+PUBNUB_API
+void
+pubnub_set_retry_backoff(struct pubnub *p, long base_ms, long max_ms, int max_attempts)
+{
+	p->retry_base_ms = base_ms;
+	p->retry_max_ms = max_ms;
+	p->retry_max_attempts = max_attempts;
+}
+
+PUBNUB_API
+void
+pubnub_set_circuit_breaker(struct pubnub *p, int threshold, long cooldown_ms)
+{
+	p->breaker_threshold = threshold;
+	p->breaker_cooldown_ms = cooldown_ms;
+	p->breaker_failures = 0;
+}
+
+PUBNUB_API
+bool
+pubnub_circuit_open(struct pubnub *p)
+{
+	return pubnub_breaker_left(p) > 0;
+}
+
+PUBNUB_API
+void
+pubnub_set_subscribe_batching(struct pubnub *p, long window_ms, int max_msgs)
+{
+	p->batch_window_ms = window_ms;
+	p->batch_max = max_msgs;
+	p->pace_until = 0;
+}
+
+PUBNUB_API
+void
+pubnub_set_subscribe_backlog(struct pubnub *p, int high, int low)
+{
+	p->backlog_high = high > 0 ? high : 0;
+	p->backlog_low = low < p->backlog_high ? low : p->backlog_high - 1;
+	if (!p->backlog_high)
+		p->backlog = 0;
+	pubnub_subscribe_consumed(p, 0);
+}
+
+PUBNUB_API
+void
+pubnub_subscribe_consumed(struct pubnub *p, int n)
+{
+	p->backlog -= n;
+	if (p->backlog < 0)
+		p->backlog = 0;
+	if (!p->backlog_held || (p->backlog_high && p->backlog > p->backlog_low))
+		return;
+	p->backlog_held = false;
+	if (p->method && !strcmp(p->method, "subscribe"))
+		pubnub_error_retry(p, NULL);
+}
+
+PUBNUB_API
+int
+pubnub_subscribe_backlog(struct pubnub *p)
+{
+	return p->backlog;
+}
+
+PUBNUB_API
+void
+pubnub_set_subscribe_dedupe(struct pubnub *p, int window)
+{
+	free(p->dedupe);
+	p->dedupe = window > 0 ? (uint64_t *)malloc(window * sizeof(p->dedupe[0])) : NULL;
+	p->dedupe_size = window > 0 ? window : 0;
+	p->dedupe_n = p->dedupe_pos = 0;
+}
+
+PUBNUB_API
+void
+pubnub_set_ssl_cacerts(struct pubnub *p, const char *cacerts, size_t len)
+{
+	struct pubnub_cacerts *c = pubnub_cacerts_get(cacerts, len);
+	pubnub_free_ssl_cacerts(p);
+	p->ssl_cacerts = c;
+}
+
+PUBNUB_API
+void
+pubnub_set_resume_on_reconnect(struct pubnub *p, bool resume_on_reconnect)
+{
+	p->resume_on_reconnect = resume_on_reconnect;
+}
+
+/* Prepare for parsing a new response. */
+static void
+pubnub_body_reset(struct pubnub *p)
+{
+	if (p->body_response) {
+		json_object_put(p->body_response);
+		p->body_response = NULL;
+	}
+	p->body_error = false;
+	p->stats_parse = 0;
+
+	/* The tokener keeps the buffer of its longest token. */
+	if (p->body_tok && p->body_len > p->body_keep) {
+		json_tokener_free(p->body_tok);
+		p->body_tok = NULL;
+	}
+	p->body_len = 0;
+	p->body_too_large = false;
+
+	if (p->parse_incremental && !p->body_raw) {
+		if (p->body_tok)
+			json_tokener_reset(p->body_tok);
+		else
+			p->body_tok = json_tokener_new();
+	} else if (p->body_tok) {
+		json_tokener_free(p->body_tok);
+		p->body_tok = NULL;
+	}
+}
+
+static size_t
+pubnub_http_inputcb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct pubnub *p = (struct pubnub *)userdata;
+	DBGMSG("http input: %zd bytes\n", size * nmemb);
+	if (p->body_len == 0 && p->first_byte_cb && size * nmemb > 0)
+		p->first_byte_cb(p, p->method, p->first_byte_cb_data);
+	if (!pubnub_body_account(p, &p->body_len, &p->body_too_large, size * nmemb))
+		return 0;
+	if (p->body_tok) {
+		if (p->body_response || p->body_error) {
+			/* Anything after the response is ignored, just
+			 * like json_tokener_parse() does. */
+			return size * nmemb;
+		}
+		double parse_start = p->stats ? pubnub_clock() : 0;
+		p->body_response = json_tokener_parse_ex(p->body_tok, ptr, size * nmemb);
+		if (!p->body_response && json_tokener_get_error(p->body_tok) != json_tokener_continue)
+			p->body_error = true;
+		if (p->stats)
+			p->stats_parse += pubnub_clock() - parse_start;
+		return size * nmemb;
+	}
+	if (p->body_fixed.buf) {
+		struct printbuf *pb = &p->body_fixed;
+		p->body = pb;
+		if ((size_t) pb->bpos + size * nmemb >= (size_t) pb->size) {
+			p->body_too_large = true;
+			return 0;
+		}
+		memcpy(pb->buf + pb->bpos, ptr, size * nmemb);
+		pb->bpos += size * nmemb;
+		pb->buf[pb->bpos] = 0;
+		return size * nmemb;
+	}
+	if (!p->body)
+		p->body = pubnub_body_get();
+	printbuf_memappend_fast(p->body, ptr, size * nmemb);
+	return size * nmemb;
+}
+
+#ifndef PUBNUB_NO_CRYPTO
+static CURLcode
+pubnub_ssl_contextcb(CURL *curl, void *context, void *userdata)
+{
+	SSL_CTX *ssl_context = (SSL_CTX *)context;
+	struct pubnub *p = (struct pubnub *)userdata;
+
+	if (p->ssl_cacerts && p->ssl_cacerts->certs)
+	{
+		X509_STORE *cert_store = SSL_CTX_get_cert_store(ssl_context);
+		STACK_OF(X509_INFO) *certs = p->ssl_cacerts->certs;
 		int i;
 
-		for (i = 0; i < sk_X509_INFO_num(p->ssl_cacerts); i++)
-		{
-			X509_INFO *cert_info = sk_X509_INFO_value(p->ssl_cacerts, i);
-			if (cert_info->x509)
-				X509_STORE_add_cert(cert_store, cert_info->x509);
-			if (cert_info->crl)
-				X509_STORE_add_crl(cert_store, cert_info->crl);
+		for (i = 0; i < sk_X509_INFO_num(certs); i++)
+		{
+			X509_INFO *cert_info = sk_X509_INFO_value(certs, i);
+			if (cert_info->x509)
+				X509_STORE_add_cert(cert_store, cert_info->x509);
+			if (cert_info->crl)
+				X509_STORE_add_crl(cert_store, cert_info->crl);
+		}
+	}
+
+	return CURLE_OK;
+}
+#endif
+
+/* Build the path of the request URL into @url.  The urlelems whose
+ * bits are set in @verbatim (bit 0 for the first one) are already
+ * URL-encoded. */
+static void
+pubnub_http_url_path(struct pubnub *p, struct printbuf *url, const char *urlelems[], unsigned verbatim)
+{
+	printbuf_reset(url);
+	printbuf_memappend_fast(url, p->origin, strlen(p->origin));
+	for (const char **urlelemp = urlelems; *urlelemp; urlelemp++, verbatim >>= 1) {
+		/* Join urlemes by slashes, e.g.
+		 *   { "v2", "time", NULL }
+		 * means /v2/time */
+		printbuf_memappend_fast(url, "/", 1);
+		if (verbatim & 1) {
+			/* Already URL-encoded. */
+			printbuf_memappend_fast(url, *urlelemp, strlen(*urlelemp));
+			continue;
+		}
+		if (*urlelemp == p->subscribe_key) {
+			printbuf_memappend_fast(url, p->subscribe_key_enc->buf, p->subscribe_key_enc->bpos);
+			continue;
+		}
+		if (*urlelemp == p->publish_key) {
+			printbuf_memappend_fast(url, p->publish_key_enc->buf, p->publish_key_enc->bpos);
+			continue;
+		}
+		pubnub_url_escape(url, *urlelemp);
+	}
+}
+
+/* Append the query of the request URL to the path in @url. */
+static void
+pubnub_http_url_query(struct pubnub *p, struct printbuf *url, const char **qparelems)
+{
+	printbuf_memappend_fast(url, "?pnsdk=", 7);
+	printbuf_memappend_fast(url, SDK_INFO, strlen(SDK_INFO));
+
+	if (qparelems) {
+		/* qparelemp elements are in pairs, e.g.
+		 *   { "x", NULL, "UUID", "abc", "tt, "1", NULL }
+		 * means ?x&UUID=abc&tt=1 */
+		for (const char **qparelemp = qparelems; *qparelemp; qparelemp += 2) {
+			printbuf_memappend_fast(url, "&", 1);
+			printbuf_memappend_fast(url, qparelemp[0], strlen(qparelemp[0]));
+			if (qparelemp[1]) {
+				printbuf_memappend_fast(url, "=", 1);
+				printbuf_memappend_fast(url, qparelemp[1], strlen(qparelemp[1]));
+			}
+		}
+	}
+	printbuf_memappend_fast(url, "" /* \0 */, 1);
+}
+
+/* Build the request URL into @url; see pubnub_http_url_path(). */
+static void
+pubnub_http_url(struct pubnub *p, struct printbuf *url, const char *urlelems[], unsigned verbatim, const char **qparelems)
+{
+	pubnub_http_url_path(p, url, urlelems, verbatim);
+	pubnub_http_url_query(p, url, qparelems);
+}
+
+static void
+pubnub_http_setup(struct pubnub *p, const char *urlelems[], const char **qparelems, long timeout)
+{
+	pubnub_http_url(p, pubnub_url_get(p), urlelems, 0, qparelems);
+	p->timeout = timeout;
+	p->body_raw = false;
+}
+
+/* Process-wide cache of resolved origin addresses, shared by all
+ * contexts that called pubnub_prewarm().  Names are resolved on
+ * a detached thread so that the event loop never waits for DNS;
+ * requests then hand the cached address to libcurl through
+ * CURLOPT_RESOLVE.  An expired entry is still used while it is
+ * being refreshed in the background. */
+
+#define PUBNUB_DNS_TTL 300
+/* Retry delay after a failed resolution. */
+#define PUBNUB_DNS_RETRY 10
+/* Most origins cached at once; the least recently used one makes
+ * room for a new one. */
+#define PUBNUB_DNS_CACHE_MAX 32
+
+struct pubnub_dns_entry {
+	struct pubnub_dns_entry *next;
+	/* "host:port"; never changes while it is being resolved. */
+	char *hostport;
+	/* Resolved address, "" if not known yet. */
+	char addr[PUBNUB_DNS_ADDR_LEN];
+	time_t expires, used;
+	bool resolving;
+};
+
+/* Return "host:port" of the origin of @p. */
+static const char *
+pubnub_dns_hostport(struct pubnub *p)
+{
+	if (p->dns_hostport)
+		return p->dns_hostport;
+
+	int port = 80;
+	const char *host = strstr(p->origin, "://");
+	if (host) {
+		if (!strncmp(p->origin, "https", 5))
+			port = 443;
+		host += 3;
+	} else {
+		host = p->origin;
+	}
+	/* An IPv6 literal keeps its brackets, as in the URL. */
+	int len = host[0] == '[' ? strcspn(host, "]") + 1 : 0;
+	if (host[0] == '[' && host[len - 1] != ']')
+		len--;
+	len += strcspn(host + len, ":/");
+	if (host[len] == ':') {
+		char *end;
+		long n = strtol(host + len + 1, &end, 10);
+		if (n > 0 && n <= 65535 && (!*end || *end == '/'))
+			port = (int) n;
+	}
+
+	size_t size = len + sizeof(":65535");
+	p->dns_hostport = (char *)malloc(size);
+	snprintf(p->dns_hostport, size, "%.*s:%d", len, host, port);
+	return p->dns_hostport;
+}
+
+#ifndef _WIN32
+
+PUBNUB_MUTEX(pubnub_dns_lock);
+/* Entries are never freed, the resolver threads may refer to them. */
+static struct pubnub_dns_entry *pubnub_dns_cache;
+
+static void *
+pubnub_dns_thread(void *arg)
+{
+	struct pubnub_dns_entry *e = (struct pubnub_dns_entry *)arg;
+	char *host = strdup(e->hostport);
+	char *port = strrchr(host, ':');
+	*port++ = 0;
+	char *name = host;
+	if (name[0] == '[') {
+		name++;
+		name[strlen(name) - 1] = 0;
+	}
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	char addr[PUBNUB_DNS_ADDR_LEN] = "";
+	if (!getaddrinfo(name, port, &hints, &res)) {
+		/* Prefer IPv4, older libcurl cannot take IPv6 in
+		 * CURLOPT_RESOLVE. */
+		struct addrinfo *ai = res;
+		while (ai && ai->ai_family != AF_INET)
+			ai = ai->ai_next;
+		if (ai) {
+			inet_ntop(AF_INET, &((struct sockaddr_in *)ai->ai_addr)->sin_addr, addr, sizeof(addr));
+		} else if (res->ai_family == AF_INET6) {
+			addr[0] = '[';
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *)res->ai_addr)->sin6_addr, addr + 1, sizeof(addr) - 2);
+			strcat(addr, "]");
+		}
+		freeaddrinfo(res);
+	}
+	free(host);
+
+	PUBNUB_LOCK(pubnub_dns_lock);
+	if (addr[0]) {
+		strcpy(e->addr, addr);
+		e->expires = time(NULL) + PUBNUB_DNS_TTL;
+	} else {
+		DBGMSG("DNS: cannot resolve %s\n", e->hostport);
+		e->expires = time(NULL) + PUBNUB_DNS_RETRY;
+	}
+	e->resolving = false;
+	PUBNUB_UNLOCK(pubnub_dns_lock);
+	return NULL;
+}
+
+/* Copy the cached address of @hostport to @addr ("" if unknown),
+ * starting its resolution if it is missing or expired. */
+static void
+pubnub_dns_lookup(const char *hostport, char *addr)
+{
+	PUBNUB_LOCK(pubnub_dns_lock);
+	struct pubnub_dns_entry *e, *lru = NULL;
+	int n = 0;
+	for (e = pubnub_dns_cache; e; e = e->next, n++) {
+		if (!strcmp(e->hostport, hostport))
+			break;
+		if (!e->resolving && (!lru || e->used < lru->used))
+			lru = e;
+	}
+	if (!e && n < PUBNUB_DNS_CACHE_MAX) {
+		e = (struct pubnub_dns_entry *)calloc(1, sizeof(*e));
+		e->hostport = strdup(hostport);
+		e->next = pubnub_dns_cache;
+		pubnub_dns_cache = e;
+	} else if (!e && lru) {
+		/* No resolver thread refers to it. */
+		free(lru->hostport);
+		lru->hostport = strdup(hostport);
+		lru->addr[0] = 0;
+		lru->expires = 0;
+		e = lru;
+	} else if (!e) {
+		/* All busy resolving; let libcurl resolve this one. */
+		PUBNUB_UNLOCK(pubnub_dns_lock);
+		addr[0] = 0;
+		return;
+	}
+
+	e->used = time(NULL);
+	strcpy(addr, e->addr);
+	if (!e->resolving && time(NULL) >= e->expires) {
+		pthread_attr_t attr;
+		pthread_t thread;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		e->resolving = !pthread_create(&thread, &attr, pubnub_dns_thread, e);
+		pthread_attr_destroy(&attr);
+	}
+	PUBNUB_UNLOCK(pubnub_dns_lock);
+}
+
+#else
+
+/* No resolver thread on Windows (yet); libcurl resolves as usual. */
+
+static void
+pubnub_dns_lookup(const char *hostport, char *addr)
+{
+	addr[0] = 0;
+}
+
+#endif
+
+/* Point @curl to the cached address of the origin, if any. */
+static void
+pubnub_dns_setup(struct pubnub *p, CURL *curl)
+{
+#if LIBCURL_VERSION_NUM >= 0x071503
+	const char *hostport = pubnub_dns_hostport(p);
+	char addr[PUBNUB_DNS_ADDR_LEN];
+	pubnub_dns_lookup(hostport, addr);
+	if (!addr[0])
+		return;
+
+	if (strcmp(addr, p->dns_addr)) {
+		/* Handles that have not started yet may still refer to
+		 * the current list, so it is only freed along with the
+		 * next change of the address; by then, they are long
+		 * past loading it. */
+		size_t size = strlen(hostport) + strlen(addr) + 2;
+		char *entry = (char *)malloc(size);
+		snprintf(entry, size, "%s:%s", hostport, addr);
+		curl_slist_free_all(p->dns_resolve_old);
+		p->dns_resolve_old = p->dns_resolve;
+		p->dns_resolve = curl_slist_append(NULL, entry);
+		free(entry);
+		strcpy(p->dns_addr, addr);
+	}
+	curl_easy_setopt(curl, CURLOPT_RESOLVE, p->dns_resolve);
+#endif
+}
+
+/* Set up the options common to all requests on an easy handle. */
+static void
+pubnub_http_easy_setup(struct pubnub *p, CURL *curl, const char *url, long timeout,
+		curl_write_callback writecb, void *writedata, char *curl_error)
+{
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, p->curl_headers);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writecb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, writedata);
+	curl_easy_setopt(curl, CURLOPT_VERBOSE, VERBOSE_VAL);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, p);
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, (long) p->nosignal);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+#ifndef PUBNUB_NO_CRYPTO
+	curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, pubnub_ssl_contextcb);
+	curl_easy_setopt(curl, CURLOPT_SSL_CTX_DATA, p);
+#elif LIBCURL_VERSION_NUM >= 0x074d00
+	/* Older versions fail the request instead; see
+	 * PUBNUB_CRYPTO_MISSING(). */
+	if (p->ssl_cacerts) {
+		struct curl_blob blob = { SFINIT(.data, p->ssl_cacerts->pem), SFINIT(.len, p->ssl_cacerts->len), SFINIT(.flags, CURL_BLOB_NOCOPY) };
+		curl_easy_setopt(curl, CURLOPT_CAINFO_BLOB, &blob);
+	}
+#endif
+	/* Set even if NULL: a reused handle stays attached to the share
+	 * it had until told otherwise. */
+	CURLSH *share = p->ssl_share;
+	if (p->ssl_cacerts && p->ssl_cacerts->share)
+		share = p->ssl_cacerts->share;
+	else if (p->pool)
+		share = p->pool->curlsh;
+	curl_easy_setopt(curl, CURLOPT_SHARE, share);
+	if (p->dns_cache)
+		pubnub_dns_setup(p, curl);
+#if LIBCURL_VERSION_NUM >= 0x071900
+	if (p->keepalive)
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	if (p->http2 || (p->pool && p->pool->http2)) {
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	}
+#endif
+	/* An empty string stands for all the supported encodings. */
+#if LIBCURL_VERSION_NUM >= 0x071506
+	if (p->compress)
+		curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+#else
+	if (p->compress)
+		curl_easy_setopt(curl, CURLOPT_ENCODING, "");
+#endif
+}
+
+/* Hold the request back for @delay_ms; it is issued from the timeout
+ * callback of the frontend just like an error retry. */
+static void
+pubnub_http_hold(struct pubnub *p, pubnub_http_cb cb, void *cb_data, bool cb_internal, bool wait, long delay_ms)
+{
+	p->finished_cb = cb;
+	p->finished_cb_data = cb_data;
+	p->finished_cb_internal = cb_internal;
+	pubnub_retry_timer(p, delay_ms);
+	if (wait)
+		p->cb->wait(p, p->cb_data);
+}
+
+static void
+pubnub_http_request(struct pubnub *p, pubnub_http_cb cb, void *cb_data, bool cb_internal, bool wait)
+{
+	p->hold_until = 0;
+	if (PUBNUB_CRYPTO_MISSING(p)) {
+		/* Fail just like early in the connection, but without
+		 * any retrying; the wait (if any) returns right away. */
+		const char *method = p->method;
+		p->method = NULL;
+		pubnub_url_release(p);
+		pubnub_error_report(p, PNR_NO_CRYPTO, NULL, method, false);
+		pubnub_stop_wait(p);
+		p->finished_cb = cb;
+		p->finished_cb_data = cb_data;
+		p->finished_cb_internal = cb_internal;
+		if (cb)
+			pubnub_finished_cb(p, PNR_NO_CRYPTO, NULL);
+		if (wait)
+			p->cb->wait(p, p->cb_data);
+		return;
+	}
+	if (pubnub_breaker_left(p) > 0) {
+		/* The circuit breaker is open; hold the request back
+		 * until it lets a probe through. */
+		pubnub_http_hold(p, cb, cb_data, cb_internal, wait,
+				pubnub_breaker_left(p) + pubnub_retry_rand(p, p->retry_base_ms));
+		return;
+	}
+	if (p->backlog_high > 0 && p->backlog >= p->backlog_high
+	    && p->method && !strcmp(p->method, "subscribe")) {
+		/* Subscribe backpressure; pubnub_subscribe_consumed()
+		 * lets the request go. */
+		p->finished_cb = cb;
+		p->finished_cb_data = cb_data;
+		p->finished_cb_internal = cb_internal;
+		p->backlog_held = true;
+		if (wait)
+			p->cb->wait(p, p->cb_data);
+		return;
+	}
+	p->backlog_held = false;
+	long pace = pubnub_pace_take(p);
+	if (pace > 0) {
+		/* Subscribe batching; see pubnub_set_subscribe_batching(). */
+		pubnub_http_hold(p, cb, cb_data, cb_internal, wait, pace);
+		return;
+	}
+
+	if (p->curl_idle) {
+		/* Reuse the previous handle; curl_easy_reset() drops
+		 * the options but keeps the connection, DNS and SSL
+		 * session caches. */
+		p->curl = p->curl_idle;
+		p->curl_idle = NULL;
+		curl_easy_reset(p->curl);
+	} else {
+		p->curl = curl_easy_init();
+	}
+
+	pubnub_http_easy_setup(p, p->curl, p->url->buf, p->timeout,
+			pubnub_http_inputcb, p, p->curl_error);
+
+	pubnub_body_release(p);
+	pubnub_body_reset(p);
+	p->finished_cb = cb;
+	p->finished_cb_data = cb_data;
+	p->finished_cb_internal = cb_internal;
+
+	DBGMSG("add handle: pre\n");
+	curl_multi_add_handle(p->curlm, p->curl);
+	DBGMSG("add handle: post\n");
+
+	if (!pubnub_connection_check(p, CURL_SOCKET_TIMEOUT, 0, false)) {
+		/* Connection did not fail early, let's call wait and return. */
+		DBGMSG("wait: pre\n");
+		/* Call wait() only if this is not an error retry; wait
+		 * and stop_wait should be paired 1:1 and we did not
+		 * call stop_wait either. */
+		if (wait)
+			p->cb->wait(p, p->cb_data);
+		DBGMSG("wait: post\n");
+	}
+}
+
+
+/* Build the URL publishing the @message_len bytes of serialized
+ * @message on @channel into @url.  The message (or its ciphertext,
+ * which stays in the cipher buffer) is URL-encoded right into @url,
+ * with no copies made on the way. */
+static void
+pubnub_publish_url_str(struct pubnub *p, struct printbuf *url, const char *channel, const char *message, size_t message_len)
+{
+	if (PUBNUB_CIPHER_KEY(p)) {
+		message = pubnub_cipher_encrypt_str(p->cipher, message, message_len, &message_len);
+		if (!message) {
+			message = "null";
+			message_len = 4;
+		}
+	}
+
+	char signature[33] = "0";
+	if (PUBNUB_SECRET_KEY(p))
+		pubnub_signature_buf_len(p, channel, message, message_len, signature);
+
+	const char *urlelems[] = { "publish", p->publish_key, p->subscribe_key, signature, channel, "0", NULL };
+	pubnub_http_url_path(p, url, urlelems, 0);
+	printbuf_memappend_fast(url, "/", 1);
+	pubnub_url_escape_len(url, message, message_len);
+	pubnub_http_url_query(p, url, NULL);
+}
+
+/* Build the URL publishing @message on @channel into @url. */
+static void
+pubnub_publish_url(struct pubnub *p, struct printbuf *url, const char *channel, struct json_object *message)
+{
+	const char *message_str = json_object_to_json_string(message);
+	pubnub_publish_url_str(p, url, channel, message_str, strlen(message_str));
+}
+
+static bool pubnub_side_call_ok(struct pubnub *p);
+static struct pubnub_req *pubnub_side_call(struct pubnub *p, const char *method,
+		long timeout, pubnub_http_cb cb, void *cb_data);
+static void pubnub_req_enqueue(struct pubnub *p, struct pubnub_req *req);
+
+static void
+pubnub_publish_str(struct pubnub *p, const char *channel, const char *message, size_t message_len,
+		long timeout, pubnub_publish_cb cb, void *cb_data)
+{
+	if (!cb) cb = p->cb->publish;
+
+	if (pubnub_side_call_ok(p)) {
+		if (timeout < 0)
+			timeout = 5;
+		struct pubnub_req *req = pubnub_side_call(p, "publish", timeout, (pubnub_http_cb) cb, cb_data);
+		pubnub_publish_url_str(p, req->url, channel, message, message_len);
+		pubnub_req_enqueue(p, req);
+		return;
+	}
+
+	if (p->method) {
+		if (cb)
+			cb(p, pubnub_error_report(p, PNR_OCCUPIED, NULL, "publish", false),
+				NULL, p->cb_data, cb_data);
+		return;
+	}
+	p->method = "publish";
+
+	if (timeout < 0)
+		timeout = 5;
+
+	pubnub_publish_url_str(p, pubnub_url_get(p), channel, message, message_len);
+	p->timeout = timeout;
+	p->body_raw = false;
+
+	pubnub_http_request(p, (pubnub_http_cb) cb, cb_data, false, true);
+}
+
+PUBNUB_API
+void
+pubnub_publish(struct pubnub *p, const char *channel, struct json_object *message,
+		long timeout, pubnub_publish_cb cb, void *cb_data)
+{
+	const char *message_str = json_object_to_json_string(message);
+	pubnub_publish_str(p, channel, message_str, strlen(message_str), timeout, cb, cb_data);
+}
+
+PUBNUB_API
+void
+pubnub_publish_raw(struct pubnub *p, const char *channel, const char *message, size_t len,
+		long timeout, pubnub_publish_cb cb, void *cb_data)
+{
+	pubnub_publish_str(p, channel, message, len, timeout, cb, cb_data);
+}
+
+
+/** Side requests */
+
+/* Requests queued by pubnub_publish_enqueue() do not take the method slot
+ * of the context.  Each runs on its own easy handle on p->curlm, at most
+ * p->reqs_max of them at once, next to whatever method is in progress.
+ * Their completion is picked up by pubnub_connection_check() just like
+ * that of the main request; the handles are told apart by p->curl.
+ *
+ * Side requests never call wait/stop_wait and are not auto-retried;
+ * the final result goes straight to their callback. */
+
+static size_t
+pubnub_req_inputcb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct pubnub_req *req = (struct pubnub_req *)userdata;
+	DBGMSG("req input: %zd bytes\n", size * nmemb);
+	if (req->body_len == 0 && req->p->first_byte_cb && size * nmemb > 0)
+		req->p->first_byte_cb(req->p, req->method, req->p->first_byte_cb_data);
+	if (!pubnub_body_account(req->p, &req->body_len, &req->body_too_large, size * nmemb))
+		return 0;
+	if (!req->body)
+		req->body = pubnub_body_get();
+	printbuf_memappend_fast(req->body, ptr, size * nmemb);
+	return size * nmemb;
+}
+
+static struct pubnub_req *
+pubnub_req_new(struct pubnub *p)
+{
+	struct pubnub_req *req = p->reqs_free;
+	if (req) {
+		p->reqs_free = req->next;
+		p->reqs_free_n--;
+	} else {
+		req = (struct pubnub_req *)calloc(1, sizeof(*req));
+		req->url = printbuf_new();
+	}
+	req->p = p;
+	req->next = NULL;
+	return req;
+}
+
+static void
+pubnub_req_destroy(struct pubnub_req *req)
+{
+	if (req->curl)
+		curl_easy_cleanup(req->curl);
+	printbuf_free(req->url);
+	if (req->body)
+		printbuf_free(req->body);
+	free(req);
+}
+
+/* Recycle a request that is not in flight anymore.  We keep around
+ * at most as many as may be in flight at once. */
+static void
+pubnub_req_release(struct pubnub *p, struct pubnub_req *req)
+{
+	if (p->reqs_free_n >= p->reqs_max) {
+		pubnub_req_destroy(req);
+		return;
+	}
+	if (req->curl && !p->keepalive) {
+		curl_easy_cleanup(req->curl);
+		req->curl = NULL;
+	}
+	req->cb = NULL;
+	req->cb_data = NULL;
+	req->next = p->reqs_free;
+	p->reqs_free = req;
+	p->reqs_free_n++;
+}
+
+static void
+pubnub_req_start(struct pubnub *p, struct pubnub_req *req)
+{
+	if (req->curl)
+		curl_easy_reset(req->curl);
+	else
+		req->curl = curl_easy_init();
+
+	pubnub_http_easy_setup(p, req->curl, req->url->buf, req->timeout,
+			pubnub_req_inputcb, req, req->curl_error);
+	pubnub_body_put(p, req->body);
+	req->body = NULL;
+	req->body_len = 0;
+	req->body_too_large = false;
+
+	req->next = p->reqs;
+	p->reqs = req;
+	p->reqs_n++;
+
+	curl_multi_add_handle(p->curlm, req->curl);
+}
+
+/* Take a token from the publish rate limiter bucket; without one to
+ * spare, note when there will be one and return false. */
+static bool
+pubnub_rate_take(struct pubnub *p)
+{
+	if (p->rate <= 0)
+		return true;
+
+	long long now = pubnub_now_ms();
+	p->rate_tokens += (now - p->rate_at) * p->rate / 1000;
+	if (p->rate_tokens > p->rate_burst)
+		p->rate_tokens = p->rate_burst;
+	p->rate_at = now;
+
+	if (p->rate_tokens < 1) {
+		p->rate_wake = now + (long long) ((1 - p->rate_tokens) * 1000 / p->rate) + 1;
+		return false;
+	}
+	p->rate_tokens -= 1;
+	return true;
+}
+
+/* Tell the watermark callback about the queue depth crossing the
+ * watermarks. */
+static void
+pubnub_watermark_check(struct pubnub *p)
+{
+	if (!p->watermark_cb)
+		return;
+	if (!p->watermark_above && p->reqs_pending_n >= p->watermark_high) {
+		p->watermark_above = true;
+		p->watermark_cb(p, true, p->reqs_pending_n, p->cb_data, p->watermark_cb_data);
+	} else if (p->watermark_above && p->reqs_pending_n <= p->watermark_low) {
+		p->watermark_above = false;
+		p->watermark_cb(p, false, p->reqs_pending_n, p->cb_data, p->watermark_cb_data);
+	}
+}
+
+/* Start as many pending side requests as we are allowed to. */
+static void
+pubnub_req_drain(struct pubnub *p)
+{
+	bool started = false;
+	p->rate_wake = 0;
+	while (p->reqs_pending && p->reqs_n < p->reqs_max) {
+		struct pubnub_req *req = p->reqs_pending;
+		long breaker = pubnub_breaker_left(p);
+		if (breaker > 0) {
+			/* The circuit breaker is open; the queue waits
+			 * for it like for the rate limiter. */
+			p->rate_wake = pubnub_now_ms() + breaker;
+			break;
+		}
+		if (p->breaker_threshold && p->breaker_failures >= p->breaker_threshold && p->reqs_n > 0) {
+			/* A probe is underway already. */
+			break;
 		}
+		/* A publish over the rate holds up the whole queue, so
+		 * that the messages keep their order. */
+		if (!strcmp(req->method, "publish") && !pubnub_rate_take(p))
+			break;
+		p->reqs_pending = req->next;
+		if (!p->reqs_pending)
+			p->reqs_pending_tail = NULL;
+		p->reqs_pending_n--;
+		pubnub_req_start(p, req);
+		started = true;
+	}
+	if (started) {
+		/* Kick off the transfers; if the main request is in
+		 * progress, its wait has already been called. */
+		pubnub_connection_check(p, CURL_SOCKET_TIMEOUT, 0, true);
 	}
+	if (p->rate_wake) {
+		/* Wake up for the next token. */
+		pubnub_timer_rearm(p);
+	}
+	pubnub_watermark_check(p);
+}
 
-	return CURLE_OK;
+static void
+pubnub_req_enqueue(struct pubnub *p, struct pubnub_req *req)
+{
+	if (PUBNUB_CRYPTO_MISSING(p)) {
+		pubnub_error_report(p, PNR_NO_CRYPTO, NULL, req->method, false);
+		pubnub_http_cb cb = req->cb;
+		void *cb_data = req->cb_data;
+		pubnub_req_release(p, req);
+		if (cb)
+			cb(p, PNR_NO_CRYPTO, NULL, p->cb_data, cb_data);
+		return;
+	}
+	req->next = NULL;
+	if (p->reqs_pending_tail)
+		p->reqs_pending_tail->next = req;
+	else
+		p->reqs_pending = req;
+	p->reqs_pending_tail = req;
+	p->reqs_pending_n++;
+	pubnub_req_drain(p);
 }
 
 static void
-pubnub_http_setup(struct pubnub *p, const char *urlelems[], const char **qparelems, long timeout)
+pubnub_req_finished(struct pubnub *p, CURL *curl, CURLcode res)
 {
-	printbuf_reset(p->url);
-	printbuf_memappend_fast(p->url, p->origin, strlen(p->origin));
-	for (const char **urlelemp = urlelems; *urlelemp; urlelemp++) {
-		/* Join urlemes by slashes, e.g.
-		 *   { "v2", "time", NULL }
-		 * means /v2/time */
-		printbuf_memappend_fast(p->url, "/", 1);
-		char *urlenc = curl_easy_escape(p->curl, *urlelemp, strlen(*urlelemp));
-		printbuf_memappend_fast(p->url, urlenc, strlen(urlenc));
-		curl_free(urlenc);
+	struct pubnub_req **reqp;
+	for (reqp = &p->reqs; *reqp; reqp = &(*reqp)->next)
+		if ((*reqp)->curl == curl)
+			break;
+	if (!*reqp) {
+		DBGMSG("finished unknown handle %p\n", curl);
+		return;
 	}
+	struct pubnub_req *req = *reqp;
+	*reqp = req->next;
+	p->reqs_n--;
+	pubnub_clock_window(p, curl);
 
-	printbuf_memappend_fast(p->url, "?pnsdk=", 7);
-	printbuf_memappend_fast(p->url, SDK_INFO, strlen(SDK_INFO));
+	DBGMSG("REQ DONE: (%d) %s\n", res, req->curl_error);
 
-	if (qparelems) {
-		/* qparelemp elements are in pairs, e.g.
-		 *   { "x", NULL, "UUID", "abc", "tt, "1", NULL }
-		 * means ?x&UUID=abc&tt=1 */
-		for (const char **qparelemp = qparelems; *qparelemp; qparelemp += 2) {
-			printbuf_memappend_fast(p->url, "&", 1);
-			printbuf_memappend_fast(p->url, qparelemp[0], strlen(qparelemp[0]));
-			if (qparelemp[1]) {
-				printbuf_memappend_fast(p->url, "=", 1);
-				printbuf_memappend_fast(p->url, qparelemp[1], strlen(qparelemp[1]));
+	struct pubnub_request_stats st, *outer = p->stats_cur;
+	if (p->stats)
+		pubnub_stats_begin(&st, req->method, curl);
+
+	enum pubnub_res result = PNR_OK;
+	json_object *response = NULL;
+	if (res != CURLE_OK) {
+		if (res == CURLE_WRITE_ERROR && req->body_too_large) {
+			result = PNR_RESPONSE_TOO_LARGE;
+			response = json_object_new_int64(p->body_max);
+		} else if (res == CURLE_OPERATION_TIMEDOUT) {
+			result = PNR_TIMEOUT;
+		} else {
+			result = PNR_IO_ERROR;
+			response = json_object_new_string(curl_easy_strerror(res));
+		}
+	} else {
+		long code = 599;
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		if (code / 100 != 2) {
+			result = PNR_HTTP_ERROR;
+			response = json_object_new_int(code);
+			if (code == 429 && !strcmp(req->method, "publish")) {
+				/* Throttled; hold off until the bucket
+				 * refills from scratch. */
+				p->rate_tokens = 0;
+				p->rate_at = pubnub_now_ms();
 			}
+		} else {
+			double parse_start = p->stats ? pubnub_clock() : 0;
+			response = json_tokener_parse(req->body ? req->body->buf : "");
+			if (p->stats)
+				st.time[PNS_PARSE] = pubnub_clock() - parse_start;
+			if (!response)
+				result = PNR_FORMAT_ERROR;
 		}
 	}
-	printbuf_memappend_fast(p->url, "" /* \0 */, 1);
-	p->timeout = timeout;
+	curl_multi_remove_handle(p->curlm, curl);
+	pubnub_body_put(p, req->body);
+	req->body = NULL;
+
+	if (result != PNR_OK) {
+		pubnub_breaker_fail(p);
+		pubnub_error_report(p, result, response, req->method, false);
+	} else {
+		p->breaker_failures = 0;
+	}
+
+	pubnub_http_cb cb = req->cb;
+	void *cb_data = req->cb_data;
+	pubnub_req_release(p, req);
+
+	bool stats = p->stats != NULL;
+	if (stats) {
+		st.result = result;
+		p->stats_cur = &st;
+	}
+	if (cb)
+		cb(p, result, response, p->cb_data, cb_data);
+	if (response)
+		json_object_put(response);
+	if (stats) {
+		p->stats_cur = outer;
+		if (p->stats)
+			pubnub_stats_record(p, &st);
+	}
+
+	pubnub_req_drain(p);
 }
 
+/* Drop all side requests, calling their callbacks with PNR_CANCELLED. */
 static void
-pubnub_http_request(struct pubnub *p, pubnub_http_cb cb, void *cb_data, bool cb_internal, bool wait)
+pubnub_req_cancel_all(struct pubnub *p)
 {
-	p->curl = curl_easy_init();
-
-	curl_easy_setopt(p->curl, CURLOPT_URL, p->url->buf);
-	curl_easy_setopt(p->curl, CURLOPT_HTTPHEADER, p->curl_headers);
-	curl_easy_setopt(p->curl, CURLOPT_WRITEFUNCTION, pubnub_http_inputcb);
-	curl_easy_setopt(p->curl, CURLOPT_WRITEDATA, p);
-	curl_easy_setopt(p->curl, CURLOPT_VERBOSE, VERBOSE_VAL);
-	curl_easy_setopt(p->curl, CURLOPT_ERRORBUFFER, p->curl_error);
-	curl_easy_setopt(p->curl, CURLOPT_PRIVATE, p);
-	curl_easy_setopt(p->curl, CURLOPT_NOPROGRESS, 1L);
-	curl_easy_setopt(p->curl, CURLOPT_NOSIGNAL, (long) p->nosignal);
-	curl_easy_setopt(p->curl, CURLOPT_TIMEOUT, p->timeout);
-	curl_easy_setopt(p->curl, CURLOPT_SSL_CTX_FUNCTION, pubnub_ssl_contextcb);
-	curl_easy_setopt(p->curl, CURLOPT_SSL_CTX_DATA, p);
-
-	printbuf_reset(p->body);
-	p->finished_cb = cb;
-	p->finished_cb_data = cb_data;
-	p->finished_cb_internal = cb_internal;
+	while (p->reqs || p->reqs_pending) {
+		struct pubnub_req *req;
+		if (p->reqs) {
+			req = p->reqs;
+			p->reqs = req->next;
+			p->reqs_n--;
+			curl_multi_remove_handle(p->curlm, req->curl);
+		} else {
+			req = p->reqs_pending;
+			p->reqs_pending = req->next;
+			if (!p->reqs_pending)
+				p->reqs_pending_tail = NULL;
+			p->reqs_pending_n--;
+		}
+		if (req->cb)
+			req->cb(p, PNR_CANCELLED, NULL, p->cb_data, req->cb_data);
+		pubnub_req_destroy(req);
+	}
+	while (p->reqs_free) {
+		struct pubnub_req *req = p->reqs_free;
+		p->reqs_free = req->next;
+		pubnub_req_destroy(req);
+	}
+	p->reqs_free_n = 0;
+}
 
-	DBGMSG("add handle: pre\n");
-	curl_multi_add_handle(p->curlm, p->curl);
-	DBGMSG("add handle: post\n");
+static void
+pubnub_publish_enqueue_str(struct pubnub *p, const char *channel, const char *message, size_t message_len,
+		long timeout, pubnub_publish_cb cb, void *cb_data)
+{
+	if (!cb) cb = p->cb->publish;
 
-	if (!pubnub_connection_check(p, CURL_SOCKET_TIMEOUT, 0, false)) {
-		/* Connection did not fail early, let's call wait and return. */
-		DBGMSG("wait: pre\n");
-		/* Call wait() only if this is not an error retry; wait
-		 * and stop_wait should be paired 1:1 and we did not
-		 * call stop_wait either. */
-		if (wait)
-			p->cb->wait(p, p->cb_data);
-		DBGMSG("wait: post\n");
+	if (timeout < 0)
+		timeout = 5;
+
+	if (p->reqs_pending_max > 0 && p->reqs_pending_n >= p->reqs_pending_max) {
+		/* Shed the load rather than letting the queue grow. */
+		pubnub_error_report(p, PNR_OCCUPIED, NULL, "publish", false);
+		if (cb)
+			cb(p, PNR_OCCUPIED, NULL, p->cb_data, cb_data);
+		return;
 	}
-}
 
+	struct pubnub_req *req = pubnub_req_new(p);
+	req->method = "publish";
+	req->cb = (pubnub_http_cb) cb;
+	req->cb_data = cb_data;
+	req->timeout = timeout;
+	pubnub_publish_url_str(p, req->url, channel, message, message_len);
+
+	pubnub_req_enqueue(p, req);
+}
 
 PUBNUB_API
 void
-pubnub_publish(struct pubnub *p, const char *channel, struct json_object *message,
+pubnub_publish_enqueue(struct pubnub *p, const char *channel, struct json_object *message,
 		long timeout, pubnub_publish_cb cb, void *cb_data)
 {
-	if (!cb) cb = p->cb->publish;
+	const char *message_str = json_object_to_json_string(message);
+	pubnub_publish_enqueue_str(p, channel, message_str, strlen(message_str), timeout, cb, cb_data);
+}
 
-	if (p->method) {
-		if (cb)
-			cb(p, pubnub_error_report(p, PNR_OCCUPIED, NULL, "publish", false),
-				NULL, p->cb_data, cb_data);
+/* pubnub_publish_batch() state; each message has its slot passed as
+ * the side request callback data, pointing back to the batch. */
+struct pubnub_publish_batch;
+
+struct pubnub_publish_batch_slot {
+	struct pubnub_publish_batch *batch;
+	int i;
+};
+
+struct pubnub_publish_batch {
+	pubnub_publish_batch_cb cb;
+	void *call_data;
+	int n, pending;
+	enum pubnub_res *results;
+	struct json_object **responses;
+	struct pubnub_publish_batch_slot *slots;
+};
+
+static void
+pubnub_publish_batch_http_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+	struct pubnub_publish_batch_slot *slot = (struct pubnub_publish_batch_slot *)call_data;
+	struct pubnub_publish_batch *batch = slot->batch;
+	batch->results[slot->i] = result;
+	batch->responses[slot->i] = response ? json_object_get(response) : NULL;
+	if (--batch->pending > 0)
 		return;
+
+	if (batch->cb)
+		batch->cb(p, batch->n, batch->results, batch->responses, ctx_data, batch->call_data);
+	for (int i = 0; i < batch->n; i++) {
+		if (batch->responses[i])
+			json_object_put(batch->responses[i]);
 	}
-	p->method = "publish";
+	pubnub_heap_free(p, batch);
+}
 
+PUBNUB_API
+void
+pubnub_publish_batch(struct pubnub *p, const char *channel, struct json_object *messages[], int n,
+		long timeout, pubnub_publish_batch_cb cb, void *cb_data)
+{
+	if (n <= 0) {
+		if (cb) cb(p, 0, NULL, NULL, p->cb_data, cb_data);
+		return;
+	}
 	if (timeout < 0)
 		timeout = 5;
 
-	bool put_message = false;
-	if (p->cipher_key) {
-		message = pubnub_encrypt(p->cipher_key, json_object_to_json_string(message));
-		put_message = true;
+	/* All the batch state in a single allocation. */
+	struct pubnub_publish_batch *batch = (struct pubnub_publish_batch *)pubnub_malloc(p, sizeof(*batch)
+			+ n * (sizeof(batch->results[0]) + sizeof(batch->responses[0]) + sizeof(batch->slots[0])));
+	batch->cb = cb;
+	batch->call_data = cb_data;
+	batch->n = batch->pending = n;
+	batch->slots = (struct pubnub_publish_batch_slot *)(batch + 1);
+	batch->responses = (struct json_object **)(batch->slots + n);
+	batch->results = (enum pubnub_res *)(batch->responses + n);
+
+	/* Queue all of them first so that the drain below starts as many
+	 * as allowed in one go. */
+	for (int i = 0; i < n; i++) {
+		batch->slots[i].batch = batch;
+		batch->slots[i].i = i;
+
+		struct pubnub_req *req = pubnub_req_new(p);
+		req->method = "publish";
+		req->cb = pubnub_publish_batch_http_cb;
+		req->cb_data = &batch->slots[i];
+		req->timeout = timeout;
+		pubnub_publish_url(p, req->url, channel, messages[i]);
+
+		req->next = NULL;
+		if (p->reqs_pending_tail)
+			p->reqs_pending_tail->next = req;
+		else
+			p->reqs_pending = req;
+		p->reqs_pending_tail = req;
+		p->reqs_pending_n++;
+	}
+	pubnub_req_drain(p);
+}
+
+PUBNUB_API
+void
+pubnub_set_publish_concurrency(struct pubnub *p, int max_inflight)
+{
+	p->reqs_max = max_inflight > 0 ? max_inflight : 1;
+	pubnub_req_drain(p);
+}
+
+PUBNUB_API
+void
+pubnub_set_publish_rate(struct pubnub *p, double rate, int burst)
+{
+	p->rate = rate > 0 ? rate : 0;
+	p->rate_burst = burst > 0 ? burst : 1;
+	p->rate_tokens = p->rate_burst;
+	p->rate_at = pubnub_now_ms();
+	pubnub_req_drain(p);
+}
+
+PUBNUB_API
+int
+pubnub_publish_queue_depth(struct pubnub *p)
+{
+	return p->reqs_pending_n;
+}
+
+PUBNUB_API
+void
+pubnub_set_publish_watermark(struct pubnub *p, int high, int low,
+		pubnub_watermark_cb cb, void *cb_data)
+{
+	p->watermark_high = high > 0 ? high : 1;
+	p->watermark_low = low < p->watermark_high ? low : p->watermark_high - 1;
+	p->watermark_cb = cb;
+	p->watermark_cb_data = cb_data;
+	p->watermark_above = false;
+	pubnub_watermark_check(p);
+}
+
+PUBNUB_API
+void
+pubnub_set_publish_queue_limit(struct pubnub *p, int max_depth)
+{
+	p->reqs_pending_max = max_depth > 0 ? max_depth : 0;
+}
+
+/* Submissions from other threads: a lock-free stack the producers push
+ * to, which the thread driving the context detaches as a whole (so
+ * there is no ABA problem) and replays through the publish queue.
+ * A producer pushing to an empty stack wakes that thread through the
+ * eventfd (or pipe); the wakeup is consumed before the stack is taken,
+ * so it is never lost while messages are waiting. */
+
+#ifndef _WIN32
+
+static void
+pubnub_submit_wake(struct pubnub *p)
+{
+	uint64_t one = 1;
+	ssize_t len = write(p->submit_fd[1], &one, sizeof(one));
+	(void) len; /* A full pipe is readable anyway. */
+}
+
+/* Detach the stack, returning the messages oldest first. */
+static struct pubnub_submit *
+pubnub_submit_take(struct pubnub *p)
+{
+	struct pubnub_submit *s = __atomic_exchange_n(&p->submit_head, NULL, __ATOMIC_ACQUIRE);
+	struct pubnub_submit *list = NULL;
+	while (s) {
+		struct pubnub_submit *next = s->next;
+		s->next = list;
+		list = s;
+		s = next;
+	}
+	return list;
+}
+
+static void
+pubnub_submit_push(struct pubnub *p, struct pubnub_submit *s)
+{
+	struct pubnub_submit *head = __atomic_load_n(&p->submit_head, __ATOMIC_RELAXED);
+	do {
+		s->next = head;
+	} while (!__atomic_compare_exchange_n(&p->submit_head, &head, s, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (!head)
+		pubnub_submit_wake(p);
+}
+
+static void
+pubnub_submit_readcb(struct pubnub *p, int fd, int mode, void *cb_data)
+{
+	char buf[64];
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	struct pubnub_submit *s = pubnub_submit_take(p);
+	while (s) {
+		struct pubnub_submit *next = s->next;
+		if (s->fn)
+			s->fn(p, s->cb_data);
+		else
+			pubnub_publish_enqueue_str(p, s->channel, s->message, strlen(s->message), s->timeout, s->cb, s->cb_data);
+		free(s);
+		s = next;
+	}
+}
+
+PUBNUB_API
+bool
+pubnub_submit_init(struct pubnub *p)
+{
+	if (p->submit_fd[0] >= 0)
+		return true;
+#ifdef __linux__
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		return false;
+	p->submit_fd[0] = p->submit_fd[1] = fd;
+#else
+	int fds[2];
+	if (pipe(fds) < 0)
+		return false;
+	for (int i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
 	}
+	p->submit_fd[0] = fds[0];
+	p->submit_fd[1] = fds[1];
+#endif
+	p->cb->add_socket(p, p->cb_data, p->submit_fd[0], 1, pubnub_submit_readcb, NULL);
+	return true;
+}
 
+PUBNUB_API
+void
+pubnub_publish_submit(struct pubnub *p, const char *channel, struct json_object *message,
+		long timeout, pubnub_publish_cb cb, void *cb_data)
+{
 	const char *message_str = json_object_to_json_string(message);
+	size_t channel_len = strlen(channel) + 1, message_len = strlen(message_str) + 1;
+	/* Not from the context allocator, which is not thread-safe. */
+	struct pubnub_submit *s = (struct pubnub_submit *)malloc(sizeof(*s) + channel_len + message_len);
+	s->fn = NULL;
+	s->cb = cb;
+	s->cb_data = cb_data;
+	s->timeout = timeout;
+	s->channel = (char *)(s + 1);
+	memcpy(s->channel, channel, channel_len);
+	s->message = s->channel + channel_len;
+	memcpy(s->message, message_str, message_len);
+	pubnub_submit_push(p, s);
+}
+
+PUBNUB_API
+void
+pubnub_submit_call(struct pubnub *p, void (*fn)(struct pubnub *p, void *data),
+		void (*drop)(void *data), void *data)
+{
+	struct pubnub_submit *s = (struct pubnub_submit *)calloc(1, sizeof(*s));
+	s->fn = fn;
+	s->drop = drop;
+	s->cb_data = data;
+	pubnub_submit_push(p, s);
+}
+
+/* Stop watching the wakeup and cancel the messages and calls not made
+ * yet. */
+static void
+pubnub_submit_done(struct pubnub *p)
+{
+	if (p->submit_fd[0] < 0)
+		return;
+	p->cb->rem_socket(p, p->cb_data, p->submit_fd[0]);
+	close(p->submit_fd[0]);
+	if (p->submit_fd[1] != p->submit_fd[0])
+		close(p->submit_fd[1]);
+	p->submit_fd[0] = p->submit_fd[1] = -1;
+
+	struct pubnub_submit *s = pubnub_submit_take(p);
+	while (s) {
+		struct pubnub_submit *next = s->next;
+		pubnub_publish_cb cb = s->cb ? s->cb : p->cb->publish;
+		if (s->fn) {
+			if (s->drop)
+				s->drop(s->cb_data);
+		} else if (cb) {
+			cb(p, PNR_CANCELLED, NULL, p->cb_data, s->cb_data);
+		}
+		free(s);
+		s = next;
+	}
+}
+
+#else
+
+/* No atomics on Windows (yet); pubnub_submit_init() always fails. */
+
+PUBNUB_API
+bool
+pubnub_submit_init(struct pubnub *p)
+{
+	return false;
+}
+
+PUBNUB_API
+void
+pubnub_publish_submit(struct pubnub *p, const char *channel, struct json_object *message,
+		long timeout, pubnub_publish_cb cb, void *cb_data)
+{
+}
+
+PUBNUB_API
+void
+pubnub_submit_call(struct pubnub *p, void (*fn)(struct pubnub *p, void *data),
+		void (*drop)(void *data), void *data)
+{
+}
+
+static void
+pubnub_submit_done(struct pubnub *p)
+{
+}
+
+#endif
 
-	char *signature;
-	if (p->secret_key) {
-		signature = pubnub_signature(p, channel, message_str);
-	} else {
-		signature = strdup("0");
-	}
+/* Calls made while the subscribe flow holds the method slot do not fail
+ * with PNR_OCCUPIED nor interrupt the long poll; they go out as side
+ * requests instead, on the same multi handle.  The caller fills in
+ * the URL and calls pubnub_req_enqueue(). */
 
-	const char *urlelems[] = { "publish", p->publish_key, p->subscribe_key, signature, channel, "0", message_str, NULL };
-	pubnub_http_setup(p, urlelems, NULL, timeout);
-	free(signature);
-	if (put_message)
-		json_object_put(message);
+static bool
+pubnub_side_call_ok(struct pubnub *p)
+{
+	return p->method && (!strcmp(p->method, "subscribe")
+			|| !strcmp(p->method, "join") || !strcmp(p->method, "leave"));
+}
 
-	pubnub_http_request(p, (pubnub_http_cb) cb, cb_data, false, true);
+static struct pubnub_req *
+pubnub_side_call(struct pubnub *p, const char *method, long timeout,
+		pubnub_http_cb cb, void *cb_data)
+{
+	struct pubnub_req *req = pubnub_req_new(p);
+	req->method = method;
+	req->cb = cb;
+	req->cb_data = cb_data;
+	req->timeout = timeout;
+	return req;
 }
 
 
@@ -875,9 +4159,12 @@ pubnub_publish(struct pubnub *p, const char *channel, struct json_object *messag
  * in the channelset, we use a resubscribe callback that will re-issue
  * subscribe with the original callback.
  *
- * TODO: Allow subscribe/unsubscribe during join/leave, queuing
- * the changes up (new callback wins, previous callbacks gets
- * PNR_CANCELLED). */
+ * Subscribe/unsubscribe during join/leave edits the channelset right
+ * away and queues the join/leave of the changed channels up in
+ * p->join_queue and p->leave_queue.  When the ongoing join/leave
+ * finishes, all queued removals go in one leave, then all queued
+ * additions in one join, and only then we subscribe again.  The new
+ * callback wins, the previous one gets PNR_CANCELLED. */
 
 struct pubnub_subscribe_cb_http_data {
 	/* XXX: We peek here from unsubscribe as well! */
@@ -899,8 +4186,67 @@ struct resubscribe_cb_http_data {
 	void *sub_call_data;
 	long sub_timeout;
 	char sub_time_token[64];
+	/* False if there was no subscribe ongoing to get back to, i.e.
+	 * we are just finishing a leave with changes queued up. */
+	bool sub_resume;
 };
 
+static void pubnub_join(struct pubnub *p, const char *channelset, long timeout,
+		pubnub_subscribe_cb cb, void *cb_data, bool is_retry);
+static void pubnub_leave(struct pubnub *p, const char *channelset, long timeout,
+		pubnub_unsubscribe_cb cb, void *cb_data, bool cb_internal, bool is_retry);
+static void resubscribe_http_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data);
+static void resubscribe_sub_http_cb(struct pubnub *p, enum pubnub_res result, char **channels, struct json_object *response, void *ctx_data, void *call_data);
+
+/* Forget about queued join/leave, e.g. as the context goes away. */
+static void
+resubscribe_queue_drop(struct pubnub *p)
+{
+	channelset_done(&p->join_queue);
+	channelset_done(&p->leave_queue);
+
+	pubnub_unsubscribe_cb cb = p->queue_unsub_cb;
+	p->queue_unsub_cb = NULL;
+	if (cb)
+		cb(p, PNR_CANCELLED, NULL, p->cb_data, p->queue_unsub_call_data);
+}
+
+/* Issue the queued leave or, if there is none, the queued join; that
+ * will continue towards the subscribe described by @cb_http_data.
+ * Returns false if nothing was queued up. */
+static bool
+resubscribe_queued(struct pubnub *p, const struct resubscribe_cb_http_data *cb_http_data)
+{
+	if (!p->leave_queue.set && !p->queue_unsub_cb && !p->join_queue.set)
+		return false;
+
+	struct resubscribe_cb_http_data *next = (struct resubscribe_cb_http_data *)pubnub_arena_alloc(p, sizeof(*next));
+	*next = *cb_http_data;
+	next->unsub_cb = NULL;
+	next->unsub_call_data = NULL;
+
+	/* The previous call has already waited for us. */
+	if (p->leave_queue.set || p->queue_unsub_cb) {
+		next->unsub_cb = p->queue_unsub_cb;
+		next->unsub_call_data = p->queue_unsub_call_data;
+		p->queue_unsub_cb = NULL;
+		p->queue_unsub_call_data = NULL;
+
+		struct printbuf *channelset = channelset_printbuf(&p->leave_queue);
+		channelset_done(&p->leave_queue);
+		pubnub_leave(p, channelset->buf, p->queue_unsub_timeout,
+				resubscribe_http_cb, next, true, true);
+		printbuf_free(channelset);
+	} else {
+		struct printbuf *channelset = channelset_printbuf(&p->join_queue);
+		channelset_done(&p->join_queue);
+		pubnub_join(p, channelset->buf, next->sub_timeout,
+				resubscribe_sub_http_cb, next, true);
+		printbuf_free(channelset);
+	}
+	return true;
+}
+
 static void
 resubscribe_http_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
 {
@@ -908,113 +4254,814 @@ resubscribe_http_cb(struct pubnub *p, enum pubnub_res result, struct json_object
 	p->finished_cb = NULL;
 	p->finished_cb_data = NULL;
 
+	/* Queued changes do not survive cancellation. */
+	if (result == PNR_CANCELLED)
+		resubscribe_queue_drop(p);
+
 	/* Restart the subscribe first (to be sure the unsub callback
 	 * cannot disturb it). Do it even in case of failed leave()/join(). */
-	if (p->resume_on_reconnect && strcmp(cb_http_data->sub_time_token, "0"))
-		strcpy(p->time_token, cb_http_data->sub_time_token);
-	pubnub_subscribe_internal(p, cb_http_data->sub_timeout,
-			cb_http_data->sub_cb, cb_http_data->sub_call_data,
-			true);
+	if (resubscribe_queued(p, cb_http_data)) {
+		/* The subscribe will be restarted after that. */
+
+	} else if (cb_http_data->sub_resume && p->channelset.set) {
+		if (p->resume_on_reconnect && strcmp(cb_http_data->sub_time_token, "0"))
+			strcpy(p->time_token, cb_http_data->sub_time_token);
+		pubnub_subscribe_internal(p, cb_http_data->sub_timeout,
+				cb_http_data->sub_cb, cb_http_data->sub_call_data,
+				true);
+
+	} else {
+		/* The queued changes left us with nothing to subscribe. */
+		pubnub_stop_wait(p);
+		if (cb_http_data->sub_resume && cb_http_data->sub_cb)
+			cb_http_data->sub_cb(p, PNR_CANCELLED, NULL, NULL, p->cb_data, cb_http_data->sub_call_data);
+	}
 
 	/* Now, re-issue the unsubscribe callback. */
 	/* No stop_wait here, another subscribe ongoing. */
 	if (cb_http_data->unsub_cb)
 		cb_http_data->unsub_cb(p, result, response, ctx_data, cb_http_data->unsub_call_data);
 
-	free(cb_http_data);
+	pubnub_free(p, cb_http_data);
+}
+
+static void
+resubscribe_sub_http_cb(struct pubnub *p, enum pubnub_res result, char **channels, struct json_object *response, void *ctx_data, void *call_data)
+{
+	assert(!(channels != NULL && channels[0] != NULL));
+	free(channels);
+	resubscribe_http_cb(p, result, response, ctx_data, call_data);
+}
+
+static struct resubscribe_cb_http_data *
+resubscribe_http_init(struct pubnub *p)
+{
+	struct resubscribe_cb_http_data *cb_http_data = (struct resubscribe_cb_http_data *)pubnub_arena_calloc(p, sizeof(*cb_http_data));
+
+	struct pubnub_subscribe_cb_http_data *subcb_http_data = (struct pubnub_subscribe_cb_http_data *)p->finished_cb_data;
+	if (subcb_http_data) {
+		cb_http_data->sub_cb = subcb_http_data->cb;
+		cb_http_data->sub_call_data = subcb_http_data->call_data;
+
+		pubnub_free(p, subcb_http_data->channelset);
+		pubnub_free(p, subcb_http_data);
+		p->finished_cb = NULL;
+		p->finished_cb_data = NULL;
+	}
+	cb_http_data->sub_timeout = p->timeout;
+	strcpy(cb_http_data->sub_time_token, p->time_token);
+	cb_http_data->sub_resume = true;
+
+	return cb_http_data;
+}
+
+/* Can subscribe/unsubscribe be queued up for after the ongoing call? */
+static bool
+resubscribe_queue_ok(struct pubnub *p)
+{
+	return p->method && (!strcmp(p->method, "join") || !strcmp(p->method, "leave"));
+}
+
+/* Return the resubscribe data of the ongoing join/leave, setting
+ * it up first if the leave was not going to resubscribe. */
+static struct resubscribe_cb_http_data *
+resubscribe_queue_data(struct pubnub *p)
+{
+	if (!strcmp(p->method, "join")) {
+		/* Always issued with resubscribe_sub_http_cb(). */
+		struct pubnub_subscribe_cb_http_data *subcb_http_data = (struct pubnub_subscribe_cb_http_data *)p->finished_cb_data;
+		return (struct resubscribe_cb_http_data *)subcb_http_data->call_data;
+	}
+
+	if (p->finished_cb != (pubnub_http_cb) resubscribe_http_cb) {
+		struct resubscribe_cb_http_data *cb_http_data = (struct resubscribe_cb_http_data *)pubnub_arena_calloc(p, sizeof(*cb_http_data));
+		cb_http_data->unsub_cb = (pubnub_unsubscribe_cb) p->finished_cb;
+		cb_http_data->unsub_call_data = p->finished_cb_data;
+		cb_http_data->sub_timeout = p->timeout;
+		strcpy(cb_http_data->sub_time_token, p->time_token);
+
+		p->finished_cb = (pubnub_http_cb) resubscribe_http_cb;
+		p->finished_cb_data = cb_http_data;
+		/* The wait of this leave now lasts until the end. */
+		p->finished_cb_internal = true;
+	}
+	return (struct resubscribe_cb_http_data *)p->finished_cb_data;
+}
+
+static void
+resubscribe_queue_subscribe(struct pubnub *p, const char *channels[], int channels_n,
+		long timeout, pubnub_subscribe_cb cb, void *cb_data)
+{
+	for (int i = 0; i < channels_n; i++) {
+		const struct channelset cs = { SFINIT(.set, &channels[i]), SFINIT(.n, 1) };
+		if (channelset_add(&p->channelset, &cs) > 0)
+			channelset_add(&p->join_queue, &cs);
+	}
+
+	if (p->channelset.set == NULL) {
+		/* No channels to listen to. Straight cancel. */
+		if (cb) cb(p, PNR_CANCELLED, NULL, NULL, p->cb_data, cb_data);
+		return;
+	}
+
+	struct resubscribe_cb_http_data *cb_http_data = resubscribe_queue_data(p);
+	pubnub_subscribe_cb old_cb = cb_http_data->sub_resume ? cb_http_data->sub_cb : NULL;
+	void *old_cb_data = cb_http_data->sub_call_data;
+
+	cb_http_data->sub_cb = cb;
+	cb_http_data->sub_call_data = cb_data;
+	cb_http_data->sub_timeout = timeout;
+	cb_http_data->sub_resume = true;
+
+	if (old_cb)
+		old_cb(p, PNR_CANCELLED, NULL, NULL, p->cb_data, old_cb_data);
+}
+
+static void
+resubscribe_queue_unsubscribe(struct pubnub *p, const char *channels[], int channels_n,
+		long timeout, pubnub_unsubscribe_cb cb, void *cb_data)
+{
+	struct resubscribe_cb_http_data *cb_http_data = resubscribe_queue_data(p);
+
+	if (channels != NULL) {
+		const struct channelset cs = { SFINIT(.set, channels), SFINIT(.n, channels_n) };
+		channelset_rm(&p->channelset, &cs);
+		channelset_rm(&p->join_queue, &cs);
+		channelset_add(&p->leave_queue, &cs);
+	} else {
+		channelset_add(&p->leave_queue, &p->channelset);
+		channelset_done(&p->channelset);
+		channelset_done(&p->join_queue);
+	}
+	if (p->channelset.set == NULL) {
+		strcpy(p->time_token, "0");
+		strcpy(cb_http_data->sub_time_token, "0");
+	}
+
+	pubnub_unsubscribe_cb old_cb = p->queue_unsub_cb;
+	void *old_cb_data = p->queue_unsub_call_data;
+
+	p->queue_unsub_cb = cb;
+	p->queue_unsub_call_data = cb_data;
+	p->queue_unsub_timeout = timeout;
+
+	if (old_cb)
+		old_cb(p, PNR_CANCELLED, NULL, p->cb_data, old_cb_data);
+}
+
+static enum pubnub_res
+check_subscribe_response(struct pubnub *p, struct json_object *response)
+{
+	/* Response must be an array, and its first element also an array. */
+	if (!response || !json_object_is_type(response, json_type_array)) {
+		return PNR_FORMAT_ERROR;
+	}
+	json_object *msg = json_object_array_get_idx(response, 0);
+	if (!msg || !json_object_is_type(msg, json_type_array)) {
+		return PNR_FORMAT_ERROR;
+	}
+	if (PUBNUB_CIPHER_KEY(p)) {
+		/* Decrypt array elements, which must be strings. */
+		struct json_object *msg_new = pubnub_decrypt_msgs(p, msg);
+		if (!msg_new) {
+			return PNR_FORMAT_ERROR;
+		}
+		/* Replacing msg in the response[] array will make sure
+		 * the refcounting is correct; this drops old msg and
+		 * will drop msg_new when we drop the whole response. */
+		json_object_array_put_idx(response, 0, msg_new);
+	}
+
+	/* Extract and save time token (mandatory). */
+	json_object *time_token = json_object_array_get_idx(response, 1);
+	if (!time_token || !json_object_is_type(time_token, json_type_string)) {
+		return PNR_FORMAT_ERROR;
+	}
+	/* A join (or a first subscribe) is answered right away with the
+	 * current server time; a later timetoken may be that of an old
+	 * message instead. */
+	bool fresh = !strcmp(p->time_token, "0");
+	strncpy(p->time_token, json_object_get_string(time_token), sizeof(p->time_token));
+	p->time_token[sizeof(p->time_token) - 1] = 0;
+	if (fresh)
+		pubnub_clock_sample(p, pubnub_clock_tt(p->time_token));
+
+	json_object *channelset_json = json_object_array_get_idx(response, 2);
+	if (channelset_json && !json_object_is_type(channelset_json, json_type_string)) {
+		return PNR_FORMAT_ERROR;
+	}
+
+	return PNR_OK;
+}
+
+static void
+parse_channels(char *channelset, int msg_n, char **channels)
+{
+	/* Comma-split the channelset to channels[] array. */
+	char *channelsetp = channelset;
+#ifndef __MINGW32__
+	char *channelsettok = NULL;
+#endif
+	for (int i = 0; i < msg_n; channelsetp = NULL, i++) {
+#if defined __MINGW32__ || defined _MSC_VER
+		char *channelset1 = strtok(channelsetp, ",");
+#else			
+		char *channelset1 = strtok_r(channelsetp, ",", &channelsettok);
+#endif
+		if (!channelset1) {
+			for (; i < msg_n; i++) {
+				/* Fill the rest of the array with
+					* empty strings. */
+				channels[i] = strdup("");
+			}
+			break;
+		}
+		channels[i] = strdup(channelset1);
+	}
+}
+
+/* Raw subscribe: the pubnub_subscribe_cb passed down the regular subscribe
+ * machinery (join, resubscribe etc.) is pubnub_subscribe_raw_adapter with
+ * struct pubnub_subscribe_raw_data as its call data.  When
+ * pubnub_subscribe_do() sees it, the response is left unparsed and
+ * pubnub_subscribe_http_cb() scans it by pubnub_subscribe_raw_deliver(). */
+
+struct pubnub_subscribe_raw_data {
+	pubnub_subscribe_raw_cb cb;
+	void *call_data;
+	/* Set for the subscribe of a relay: its sinks get the messages
+	 * in a batch taking over the response buffer. */
+	struct pubnub_relay *relay;
+};
+
+struct pubnub_relay_batch;
+static struct pubnub_relay_batch *pubnub_relay_batch_new(struct pubnub *p, struct printbuf *body,
+		struct pubnub_raw_msg *msgs, int msgs_n, struct json_object *decrypted, const char *channel);
+static void pubnub_relay_deliver(struct pubnub_relay *r, struct pubnub_relay_batch *b);
+
+/* Called for everything that does not go through
+ * pubnub_subscribe_raw_deliver(), i.e. errors. */
+static void
+pubnub_subscribe_raw_adapter(struct pubnub *p, enum pubnub_res result, char **channels, struct json_object *response, void *ctx_data, void *call_data)
+{
+	struct pubnub_subscribe_raw_data *raw_data = (struct pubnub_subscribe_raw_data *)call_data;
+	pubnub_subscribe_raw_cb cb = raw_data->cb;
+	call_data = raw_data->call_data;
+	pubnub_free(p, raw_data);
+
+	if (result != PNR_OK) {
+		cb(p, result, NULL, 0, NULL, response, ctx_data, call_data);
+		return;
+	}
+
+	/* We got a parsed response after all; just serialize
+	 * the messages again. */
+	int msgs_n = json_object_array_length(response);
+	struct pubnub_raw_msg *msgs = (struct pubnub_raw_msg *)pubnub_arena_alloc(p, (msgs_n + 1) * sizeof(*msgs));
+	for (int i = 0; i < msgs_n; i++) {
+		msgs[i].json = json_object_to_json_string(json_object_array_get_idx(response, i));
+		msgs[i].len = strlen(msgs[i].json);
+		msgs[i].channel = channels[i];
+	}
+	cb(p, result, msgs, msgs_n, p->time_token, NULL, ctx_data, call_data);
+	pubnub_free(p, msgs);
+	for (int i = 0; channels[i]; i++)
+		free(channels[i]);
+	free(channels);
+}
+
+static const char *
+json_raw_ws(const char *s, const char *end)
+{
+	while (s < end && (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n'))
+		s++;
+	return s;
+}
+
+/* Return the end of the JSON value starting at @s, or NULL if it
+ * is obviously malformed.  We only care about finding the value
+ * boundaries; the value itself is not validated. */
+static const char *
+json_raw_skip(const char *s, const char *end)
+{
+	if (s >= end)
+		return NULL;
+
+	if (*s == '"') {
+		for (s++; s < end; s++) {
+			if (*s == '\\')
+				s++;
+			else if (*s == '"')
+				return s + 1;
+		}
+		return NULL;
+	}
+
+	if (*s == '[' || *s == '{') {
+		int depth = 0;
+		while (s < end) {
+			if (*s == '"') {
+				s = json_raw_skip(s, end);
+				if (!s)
+					return NULL;
+				continue;
+			}
+			if (*s == '[' || *s == '{') {
+				depth++;
+			} else if (*s == ']' || *s == '}') {
+				if (--depth == 0)
+					return s + 1;
+			}
+			s++;
+		}
+		return NULL;
+	}
+
+	/* A number or a literal. */
+	const char *start = s;
+	while (s < end && *s != ',' && *s != ']' && *s != '}'
+			&& *s != ' ' && *s != '\t' && *s != '\r' && *s != '\n')
+		s++;
+	return s > start ? s : NULL;
+}
+
+/* Scan the subscribe response in @buf, i.e. [[msg,...],"timetoken"] or
+ * [[msg,...],"timetoken","channelset"], filling @msgs (just json and
+ * len), the time token and the channelset (which is NULL if not present
+ * and otherwise a pointer to the string contents, NUL-terminated in place).
+ * Returns the number of messages, or -1 on malformed input. */
+static int
+pubnub_subscribe_raw_scan(struct pubnub *p, char *buf, size_t len,
+		struct pubnub_raw_msg **msgsp, const char **msgs_arrayp, size_t *msgs_array_lenp,
+		char **channelsetp)
+{
+	const char *end = buf + len;
+	const char *v_end, *tt_end, *cs_end;
+	int msgs_n = 0, msgs_alloc = 0;
+	struct pubnub_raw_msg *msgs = NULL;
+
+	const char *s = json_raw_ws(buf, end);
+	if (s >= end || *s != '[')
+		return -1;
+	s = json_raw_ws(s + 1, end);
+	if (s >= end || *s != '[')
+		return -1;
+	*msgs_arrayp = s;
+
+	s = json_raw_ws(s + 1, end);
+	if (s < end && *s == ']') {
+		s++;
+	} else {
+		while (true) {
+			v_end = json_raw_skip(s, end);
+			if (!v_end)
+				goto fail;
+			if (msgs_n == msgs_alloc) {
+				msgs_alloc = msgs_alloc ? msgs_alloc * 2 : 16;
+				msgs = (struct pubnub_raw_msg *)realloc(msgs, msgs_alloc * sizeof(*msgs));
+			}
+			msgs[msgs_n].json = s;
+			msgs[msgs_n].len = v_end - s;
+			msgs[msgs_n].channel = NULL;
+			msgs_n++;
+
+			s = json_raw_ws(v_end, end);
+			if (s < end && *s == ']') {
+				s++;
+				break;
+			}
+			if (s >= end || *s != ',')
+				goto fail;
+			s = json_raw_ws(s + 1, end);
+		}
+	}
+	*msgs_array_lenp = s - *msgs_arrayp;
+
+	/* Time token (mandatory). */
+	s = json_raw_ws(s, end);
+	if (s >= end || *s != ',')
+		goto fail;
+	s = json_raw_ws(s + 1, end);
+	if (s >= end || *s != '"')
+		goto fail;
+	tt_end = json_raw_skip(s, end);
+	if (!tt_end || (size_t) (tt_end - s - 2) >= sizeof(p->time_token))
+		goto fail;
+	if (!strcmp(p->time_token, "0")) {
+		/* See check_subscribe_response(). */
+		memcpy(p->time_token, s + 1, tt_end - s - 2);
+		p->time_token[tt_end - s - 2] = 0;
+		pubnub_clock_sample(p, pubnub_clock_tt(p->time_token));
+	} else {
+		memcpy(p->time_token, s + 1, tt_end - s - 2);
+		p->time_token[tt_end - s - 2] = 0;
+	}
+
+	/* Channelset (optional). */
+	*channelsetp = NULL;
+	s = json_raw_ws(tt_end, end);
+	if (s < end && *s == ',') {
+		s = json_raw_ws(s + 1, end);
+		if (s >= end || *s != '"')
+			goto fail;
+		cs_end = json_raw_skip(s, end);
+		if (!cs_end)
+			goto fail;
+		/* Channel names are never escaped in any way. */
+		*channelsetp = buf + (s + 1 - buf);
+		buf[cs_end - 1 - buf] = 0;
+		s = json_raw_ws(cs_end, end);
+	}
+	if (s >= end || *s != ']')
+		goto fail;
+
+	*msgsp = msgs;
+	return msgs_n;
+
+fail:
+	free(msgs);
+	return -1;
+}
+
+/* Duplicate suppression; see pubnub_set_subscribe_dedupe().  The subscribe
+ * response carries no per-message timetokens, so a message is known by
+ * the 64-bit FNV-1a hash of its channel and contents.  That is taken from
+ * the parsed value, or from the text in the raw mode, without building
+ * anything either way. */
+
+#define PUBNUB_DEDUPE_FNV_BASIS 14695981039346656037ULL
+
+static uint64_t
+pubnub_dedupe_mix(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)data;
+	for (size_t i = 0; i < len; i++) {
+		h ^= s[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static uint64_t
+pubnub_dedupe_json(uint64_t h, struct json_object *o)
+{
+	unsigned char type = o ? (unsigned char) json_object_get_type(o) : (unsigned char) json_type_null;
+	h = pubnub_dedupe_mix(h, &type, 1);
+	switch (type) {
+	case json_type_boolean: {
+		unsigned char b = json_object_get_boolean(o);
+		return pubnub_dedupe_mix(h, &b, 1);
+	}
+	case json_type_double: {
+		double d = json_object_get_double(o);
+		return pubnub_dedupe_mix(h, &d, sizeof(d));
+	}
+	case json_type_int: {
+		int64_t i = json_object_get_int64(o);
+		return pubnub_dedupe_mix(h, &i, sizeof(i));
+	}
+	case json_type_string: {
+		const char *s = json_object_get_string(o);
+		return pubnub_dedupe_mix(h, s, strlen(s) + 1);
+	}
+	case json_type_object: {
+		struct json_object_iterator it = json_object_iter_begin(o);
+		struct json_object_iterator end = json_object_iter_end(o);
+		for (; !json_object_iter_equal(&it, &end); json_object_iter_next(&it)) {
+			const char *key = json_object_iter_peek_name(&it);
+			h = pubnub_dedupe_mix(h, key, strlen(key) + 1);
+			h = pubnub_dedupe_json(h, json_object_iter_peek_value(&it));
+		}
+		return pubnub_dedupe_mix(h, "}", 1);
+	}
+	case json_type_array: {
+		int n = json_object_array_length(o);
+		for (int i = 0; i < n; i++)
+			h = pubnub_dedupe_json(h, json_object_array_get_idx(o, i));
+		return pubnub_dedupe_mix(h, "]", 1);
+	}
+	default:
+		return h;
+	}
+}
+
+/* Return true if @h is among the recent hashes; if not, remember it,
+ * forgetting the oldest one. */
+static bool
+pubnub_dedupe_seen(struct pubnub *p, uint64_t h)
+{
+	/* A few thousand hashes at most, a linear scan is faster than
+	 * keeping an index in sync with the ring. */
+	for (int i = 0; i < p->dedupe_n; i++)
+		if (p->dedupe[i] == h)
+			return true;
+	if (p->dedupe_n < p->dedupe_size) {
+		p->dedupe[p->dedupe_n++] = h;
+	} else {
+		p->dedupe[p->dedupe_pos] = h;
+		p->dedupe_pos = (p->dedupe_pos + 1) % p->dedupe_size;
+	}
+	return false;
+}
+
+/* Channel handlers; see pubnub_on_channel().  The patterns, prefixes
+ * with their "*", are hashed in a channelset. */
+
+static struct pubnub_demux *
+pubnub_demux_find(struct pubnub *p, const char *channel)
+{
+	int i = channelset_find(&p->demux_patterns, channel);
+	if (i >= 0 || !p->demux_prefix_n)
+		return i >= 0 ? &p->demux[i] : NULL;
+
+	size_t len = strlen(channel);
+	char buf[256];
+	char *key = len + 2 <= sizeof(buf) ? buf : (char *)malloc(len + 2);
+	for (int j = 0; j < p->demux_prefix_n && i < 0; j++) {
+		size_t l = p->demux_prefix[j].len;
+		if (l > len)
+			continue;
+		memcpy(key, channel, l);
+		key[l] = '*';
+		key[l + 1] = 0;
+		i = channelset_find(&p->demux_patterns, key);
+	}
+	if (key != buf)
+		free(key);
+	return i >= 0 ? &p->demux[i] : NULL;
+}
+
+static void
+pubnub_demux_prefix_count(struct pubnub *p, int len, int delta)
+{
+	int j;
+	for (j = 0; j < p->demux_prefix_n && p->demux_prefix[j].len > len; j++)
+		;
+	if (j < p->demux_prefix_n && p->demux_prefix[j].len == len) {
+		p->demux_prefix[j].n += delta;
+		if (!p->demux_prefix[j].n) {
+			memmove(&p->demux_prefix[j], &p->demux_prefix[j + 1],
+				(--p->demux_prefix_n - j) * sizeof(p->demux_prefix[0]));
+		}
+		return;
+	}
+	p->demux_prefix = (struct pubnub_demux_prefix *)realloc(p->demux_prefix,
+			(p->demux_prefix_n + 1) * sizeof(p->demux_prefix[0]));
+	memmove(&p->demux_prefix[j + 1], &p->demux_prefix[j],
+		(p->demux_prefix_n++ - j) * sizeof(p->demux_prefix[0]));
+	p->demux_prefix[j].len = len;
+	p->demux_prefix[j].n = delta;
+}
+
+PUBNUB_API
+void
+pubnub_on_channel(struct pubnub *p, const char *pattern, pubnub_channel_cb cb, void *cb_data)
+{
+	size_t len = strlen(pattern);
+	bool prefix = len > 0 && pattern[len - 1] == '*';
+	int i = channelset_find(&p->demux_patterns, pattern);
+	const struct channelset cs = { SFINIT(.set, &pattern), SFINIT(.n, 1) };
+
+	if (i >= 0 && cb) {
+		p->demux[i].cb = cb;
+		p->demux[i].cb_data = cb_data;
+	} else if (cb) {
+		if (p->demux_patterns.n == p->demux_alloc) {
+			p->demux_alloc = p->demux_alloc ? p->demux_alloc * 2 : 4;
+			p->demux = (struct pubnub_demux *)realloc(p->demux, p->demux_alloc * sizeof(p->demux[0]));
+		}
+		channelset_add(&p->demux_patterns, &cs);
+		p->demux[p->demux_patterns.n - 1].cb = cb;
+		p->demux[p->demux_patterns.n - 1].cb_data = cb_data;
+		if (prefix)
+			pubnub_demux_prefix_count(p, len - 1, 1);
+	} else if (i >= 0) {
+		/* channelset_rm() moves the last pattern in its place. */
+		p->demux[i] = p->demux[p->demux_patterns.n - 1];
+		channelset_rm(&p->demux_patterns, &cs);
+		if (prefix)
+			pubnub_demux_prefix_count(p, len - 1, -1);
+	}
+}
+
+/* Take the duplicates (see pubnub_set_subscribe_dedupe()) and the
+ * messages routed to channel handlers out of the @msg_n messages of
+ * the response, and out of @channels or @cchannels alike; returns the
+ * number of messages left.  Nothing is allocated unless a message is
+ * taken out. */
+static int
+pubnub_filter_msgs(struct pubnub *p, struct json_object *response, struct json_object **msgp,
+		int msg_n, char **channels, const char **cchannels)
+{
+	struct json_object *msg = *msgp, *kept = NULL;
+	int n = 0;
+	for (int i = 0; i < msg_n; i++) {
+		struct json_object *m = json_object_array_get_idx(msg, i);
+		const char *channel = channels ? channels[i] : cchannels[i];
+		bool drop = false;
+		if (p->dedupe_size > 0) {
+			uint64_t h = pubnub_dedupe_mix(PUBNUB_DEDUPE_FNV_BASIS, channel, strlen(channel) + 1);
+			drop = pubnub_dedupe_seen(p, pubnub_dedupe_json(h, m));
+		}
+		struct pubnub_demux *d = !drop && p->demux_patterns.n > 0 ? pubnub_demux_find(p, channel) : NULL;
+		if (d) {
+			/* The handler may change the handlers. */
+			pubnub_channel_cb cb = d->cb;
+			cb(p, channel, m, p->cb_data, d->cb_data);
+			drop = true;
+		}
+
+		if (drop) {
+			if (!kept) {
+				/* All the messages before were kept. */
+				kept = json_object_new_array();
+				for (int j = 0; j < i; j++)
+					json_object_array_add(kept, json_object_get(json_object_array_get_idx(msg, j)));
+			}
+			if (channels)
+				free(channels[i]);
+			continue;
+		}
+		if (kept)
+			json_object_array_add(kept, json_object_get(m));
+		if (channels)
+			channels[n] = channels[i];
+		else
+			cchannels[n] = cchannels[i];
+		n++;
+	}
+	if (channels)
+		channels[n] = NULL;
+	else
+		cchannels[n] = NULL;
+	if (kept) {
+		/* This drops the old array, like in check_subscribe_response(). */
+		json_object_array_put_idx(response, 0, kept);
+		*msgp = kept;
+	}
+	return n;
 }
 
-static void
-resubscribe_sub_http_cb(struct pubnub *p, enum pubnub_res result, char **channels, struct json_object *response, void *ctx_data, void *call_data)
+/* Duplicate suppression for the raw mode. */
+static int
+pubnub_dedupe_raw(struct pubnub *p, struct pubnub_raw_msg *msgs, int msgs_n)
 {
-	assert(!(channels != NULL && channels[0] != NULL));
-	free(channels);
-	resubscribe_http_cb(p, result, response, ctx_data, call_data);
+	int n = 0;
+	for (int i = 0; i < msgs_n; i++) {
+		uint64_t h = pubnub_dedupe_mix(PUBNUB_DEDUPE_FNV_BASIS, msgs[i].channel, strlen(msgs[i].channel) + 1);
+		if (!pubnub_dedupe_seen(p, pubnub_dedupe_mix(h, msgs[i].json, msgs[i].len)))
+			msgs[n++] = msgs[i];
+	}
+	return n;
 }
 
-static struct resubscribe_cb_http_data *
-resubscribe_http_init(struct pubnub *p)
+/* Deliver the messages in p->body to the raw subscribe callback, without
+ * building any JSON objects (unless we need to decrypt them). */
+static void
+pubnub_subscribe_raw_deliver(struct pubnub *p, const char *req_channelset, bool cb_internal,
+		struct pubnub_subscribe_raw_data *raw_data, void *ctx_data)
 {
-	struct resubscribe_cb_http_data *cb_http_data = (struct resubscribe_cb_http_data *)calloc(1, sizeof(*cb_http_data));
+	/* Swap the buffer away so that it stays intact even if the callback
+	 * issues another request right away. */
+	struct printbuf *body = p->body;
+	p->body = NULL;
+	if (!body)
+		body = pubnub_body_get();
+
+	struct pubnub_raw_msg *msgs = NULL;
+	const char *msgs_array;
+	size_t msgs_array_len;
+	char *channelset;
+	int msgs_n = pubnub_subscribe_raw_scan(p, body->buf, body->bpos,
+			&msgs, &msgs_array, &msgs_array_len, &channelset);
+
+	struct json_object *decrypted = NULL;
+	if (msgs_n > 0 && PUBNUB_CIPHER_KEY(p)) {
+		struct pubnub_raw_msg array = { SFINIT(.json, msgs_array), SFINIT(.len, msgs_array_len), SFINIT(.channel, NULL) };
+		struct json_object *encrypted = pubnub_raw_msg_parse(&array);
+		if (encrypted) {
+			decrypted = pubnub_decrypt_msgs(p, encrypted);
+			json_object_put(encrypted);
+		}
+		if (!decrypted) {
+			free(msgs);
+			msgs_n = -1;
+		} else {
+			for (int i = 0; i < msgs_n; i++) {
+				msgs[i].json = json_object_to_json_string(json_object_array_get_idx(decrypted, i));
+				msgs[i].len = strlen(msgs[i].json);
+			}
+		}
+	}
 
-	struct pubnub_subscribe_cb_http_data *subcb_http_data = (struct pubnub_subscribe_cb_http_data *)p->finished_cb_data;
-	if (subcb_http_data) {
-		cb_http_data->sub_cb = subcb_http_data->cb;
-		cb_http_data->sub_call_data = subcb_http_data->call_data;
+	if (msgs_n < 0) {
+		/* Same as check_subscribe_response() failing. */
+		if (pubnub_handle_error(p, PNR_FORMAT_ERROR, NULL, "subscribe", false))
+			raw_data->cb(p, PNR_FORMAT_ERROR, NULL, 0, NULL, NULL, ctx_data, raw_data->call_data);
+		/* On retry, the callback is dropped just like the regular
+		 * one in pubnub_subscribe_http_cb(). */
+		pubnub_free(p, raw_data);
 
-		free(subcb_http_data->channelset);
-		free(subcb_http_data);
-		p->finished_cb = NULL;
-		p->finished_cb_data = NULL;
+	} else {
+		/* Assign channels to messages; the same rules
+		 * as in parse_channels(). */
+		if (channelset) {
+			char *c = channelset;
+			for (int i = 0; i < msgs_n; i++) {
+				if (!c) {
+					msgs[i].channel = "";
+					continue;
+				}
+				char *comma = strchr(c, ',');
+				if (comma)
+					*comma = 0;
+				msgs[i].channel = c;
+				c = comma ? comma + 1 : NULL;
+			}
+		} else {
+			for (int i = 0; i < msgs_n; i++)
+				msgs[i].channel = req_channelset;
+		}
+		if (p->dedupe_size > 0)
+			msgs_n = pubnub_dedupe_raw(p, msgs, msgs_n);
+
+		if (!cb_internal) {
+			pubnub_pace_set(p, msgs_n);
+			pubnub_stop_wait(p);
+		}
+
+		pubnub_subscribe_raw_cb cb = raw_data->cb;
+		void *call_data = raw_data->call_data;
+		struct pubnub_relay *relay = raw_data->relay;
+		pubnub_free(p, raw_data);
+		if (relay) {
+			/* The batch takes it all over. */
+			struct pubnub_relay_batch *b = pubnub_relay_batch_new(p, body, msgs, msgs_n, decrypted, req_channelset);
+			body = NULL;
+			msgs = NULL;
+			decrypted = NULL;
+			pubnub_relay_deliver(relay, b);
+		} else {
+			cb(p, PNR_OK, msgs, msgs_n, p->time_token, NULL, ctx_data, call_data);
+		}
 	}
-	cb_http_data->sub_timeout = p->timeout;
-	strcpy(cb_http_data->sub_time_token, p->time_token);
 
-	return cb_http_data;
+	free(msgs);
+	if (decrypted)
+		json_object_put(decrypted);
+
+	pubnub_body_put(p, body);
 }
 
-static enum pubnub_res
-check_subscribe_response(struct pubnub *p, struct json_object *response)
+/* Split the channelset to @channels[] in place (if @split) or point all
+ * the @msg_n items to it; the same rules as in parse_channels(). */
+static void
+split_channels(char *channelset, bool split, int msg_n, const char **channels)
 {
-	/* Response must be an array, and its first element also an array. */
-	if (!response || !json_object_is_type(response, json_type_array)) {
-		return PNR_FORMAT_ERROR;
-	}
-	json_object *msg = json_object_array_get_idx(response, 0);
-	if (!msg || !json_object_is_type(msg, json_type_array)) {
-		return PNR_FORMAT_ERROR;
-	}
-	if (p->cipher_key) {
-		/* Decrypt array elements, which must be strings. */
-		struct json_object *msg_new = pubnub_decrypt_array(p->cipher_key, msg);
-		if (!msg_new) {
-			return PNR_FORMAT_ERROR;
+	char *c = channelset;
+	for (int i = 0; i < msg_n; i++) {
+		if (!split) {
+			channels[i] = channelset;
+			continue;
 		}
-		/* Replacing msg in the response[] array will make sure
-		 * the refcounting is correct; this drops old msg and
-		 * will drop msg_new when we drop the whole response. */
-		json_object_array_put_idx(response, 0, msg_new);
-	}
-
-	/* Extract and save time token (mandatory). */
-	json_object *time_token = json_object_array_get_idx(response, 1);
-	if (!time_token || !json_object_is_type(time_token, json_type_string)) {
-		return PNR_FORMAT_ERROR;
+		if (!c) {
+			channels[i] = "";
+			continue;
+		}
+		char *comma = strchr(c, ',');
+		if (comma)
+			*comma = 0;
+		channels[i] = c;
+		c = comma ? comma + 1 : NULL;
 	}
-	strncpy(p->time_token, json_object_get_string(time_token), sizeof(p->time_token));
-	p->time_token[sizeof(p->time_token) - 1] = 0;
+	channels[msg_n] = NULL;
+}
 
-	json_object *channelset_json = json_object_array_get_idx(response, 2);
-	if (channelset_json && !json_object_is_type(channelset_json, json_type_string)) {
-		return PNR_FORMAT_ERROR;
-	}
+/* pubnub_subscribe_const(): the pubnub_subscribe_cb passed down the regular
+ * subscribe machinery is pubnub_subscribe_const_adapter with struct
+ * pubnub_subscribe_const_data as its call data.  pubnub_subscribe_http_cb()
+ * recognizes it and calls the user callback directly, with channels
+ * pointing into the batch; only otherwise the adapter gets called. */
 
-	return PNR_OK;
-}
+struct pubnub_subscribe_const_data {
+	pubnub_subscribe_const_cb cb;
+	void *call_data;
+};
 
 static void
-parse_channels(char *channelset, int msg_n, char **channels)
+pubnub_subscribe_const_adapter(struct pubnub *p, enum pubnub_res result, char **channels, struct json_object *response, void *ctx_data, void *call_data)
 {
-	/* Comma-split the channelset to channels[] array. */
-	char *channelsetp = channelset;
-#ifndef __MINGW32__
-	char *channelsettok = NULL;
-#endif
-	for (int i = 0; i < msg_n; channelsetp = NULL, i++) {
-#if defined __MINGW32__ || defined _MSC_VER
-		char *channelset1 = strtok(channelsetp, ",");
-#else			
-		char *channelset1 = strtok_r(channelsetp, ",", &channelsettok);
-#endif
-		if (!channelset1) {
-			for (; i < msg_n; i++) {
-				/* Fill the rest of the array with
-					* empty strings. */
-				channels[i] = strdup("");
-			}
-			break;
-		}
-		channels[i] = strdup(channelset1);
+	struct pubnub_subscribe_const_data *const_data = (struct pubnub_subscribe_const_data *)call_data;
+	pubnub_subscribe_const_cb cb = const_data->cb;
+	call_data = const_data->call_data;
+	pubnub_free(p, const_data);
+
+	cb(p, result, (const char *const *) channels, response, ctx_data, call_data);
+
+	if (channels) {
+		for (int i = 0; channels[i]; i++)
+			free(channels[i]);
+		free(channels);
 	}
 }
 
@@ -1026,13 +5073,22 @@ pubnub_subscribe_http_cb(struct pubnub *p, enum pubnub_res result, struct json_o
 	bool cb_internal = cb_http_data->cb_internal;
 	call_data = cb_http_data->call_data;
 	pubnub_subscribe_cb cb = cb_http_data->cb;
-	free(cb_http_data);
+	pubnub_free(p, cb_http_data);
 	p->finished_cb = NULL;
 	p->finished_cb_data = NULL;
 
+	if (cb == pubnub_subscribe_raw_adapter && result == PNR_OK && !response) {
+		pubnub_subscribe_raw_deliver(p, channelset, cb_internal,
+				(struct pubnub_subscribe_raw_data *)call_data, ctx_data);
+		pubnub_free(p, channelset);
+		return;
+	}
+
 	enum pubnub_res res = (result != PNR_OK ? result : check_subscribe_response(p, response));
 	struct json_object *msg;
 	char **channels = NULL;
+	const char **cchannels = NULL;
+	int cchannels_size = 0;
 	if (res == PNR_OK) {
 		msg = json_object_array_get_idx(response, 0);
 
@@ -1040,56 +5096,107 @@ pubnub_subscribe_http_cb(struct pubnub *p, enum pubnub_res result, struct json_o
 		 * when multiplexing). */
 		json_object *channelset_json = json_object_array_get_idx(response, 2);
 		int msg_n = json_object_array_length(msg);
-		channels = (char**)malloc((msg_n + 1) * sizeof(channels[0]));
 		if (channelset_json) {
-			free(channelset);
-			channelset = strdup(json_object_get_string(channelset_json));
-			parse_channels(channelset, msg_n, channels);
+			pubnub_free(p, channelset);
+			channelset = pubnub_arena_strdup(p, json_object_get_string(channelset_json));
+		}
+		if (cb == pubnub_subscribe_const_adapter) {
+			/* Take the context-owned array for the time of
+			 * the callback, so that a nested callback cannot
+			 * clobber it. */
+			cchannels = p->batch_channels;
+			cchannels_size = p->batch_channels_size;
+			p->batch_channels = NULL;
+			p->batch_channels_size = 0;
+			if (cchannels_size < msg_n + 1) {
+				cchannels_size = msg_n + 1;
+				cchannels = (const char **)realloc(cchannels, cchannels_size * sizeof(cchannels[0]));
+			}
+			split_channels(channelset, channelset_json != NULL, msg_n, cchannels);
 		} else {
-			for (int i = 0; i < msg_n; i++) {
-				channels[i] = strdup(channelset);
+			channels = (char**)malloc((msg_n + 1) * sizeof(channels[0]));
+			if (channelset_json) {
+				parse_channels(channelset, msg_n, channels);
+			} else {
+				for (int i = 0; i < msg_n; i++) {
+					channels[i] = strdup(channelset);
+				}
 			}
+			channels[msg_n] = NULL;
+		}
+		if (p->presence_channels.n > 0)
+			pubnub_presence_apply(p, msg, channels ? (const char *const *) channels : cchannels, msg_n);
+		if (p->dedupe_size > 0 || p->demux_patterns.n > 0)
+			msg_n = pubnub_filter_msgs(p, response, &msg, msg_n, channels, cchannels);
+
+		if (!cb_internal) {
+			pubnub_pace_set(p, msg_n);
+			pubnub_stop_wait(p);
 		}
-		channels[msg_n] = NULL;
-
-		if (!cb_internal)
-			p->cb->stop_wait(p, p->cb_data);
 
 	} else {
 		msg = response;
 		if (result == PNR_OK /* pubnub_handle_error() has not been already called */
 			&& !pubnub_handle_error(p, res, response, "subscribe", false)) {
+			/* The callback is dropped on retry, and so is the
+			 * call data of our adapters. */
+			if (cb == pubnub_subscribe_const_adapter || cb == pubnub_subscribe_raw_adapter)
+				pubnub_free(p, call_data);
 			cb = NULL;
 		}
 	}
-	free(channelset);
+
+	if (cchannels) {
+		struct pubnub_subscribe_const_data *const_data = (struct pubnub_subscribe_const_data *)call_data;
+		pubnub_subscribe_const_cb const_cb = const_data->cb;
+		call_data = const_data->call_data;
+		pubnub_free(p, const_data);
+
+		const_cb(p, res, cchannels, msg, ctx_data, call_data);
+
+		pubnub_free(p, channelset);
+		if (!p->batch_channels) {
+			p->batch_channels = cchannels;
+			p->batch_channels_size = cchannels_size;
+		} else {
+			free(cchannels);
+		}
+		return;
+	}
+
+	pubnub_free(p, channelset);
 	/* Finally call the user callback. */
 	if (cb) {
 		cb(p, res, channels, msg, ctx_data, call_data);
 	}
 }
 
-/* This is the common backend for subscribe HTTP API calls. */
+/* This is the common backend for subscribe HTTP API calls.
+ * @channelset_enc is the URL-encoded @channelset if the caller has it
+ * at hand, or NULL. */
 static void
-pubnub_subscribe_do(struct pubnub *p, const char *channelset, char *time_token,
-		long timeout, pubnub_subscribe_cb cb, void *cb_data, bool cb_internal,
-		bool is_retry)
+pubnub_subscribe_do(struct pubnub *p, const char *channelset, const char *channelset_enc,
+		char *time_token, long timeout, pubnub_subscribe_cb cb, void *cb_data,
+		bool cb_internal, bool is_retry)
 {
-	struct pubnub_subscribe_cb_http_data *cb_http_data = (struct pubnub_subscribe_cb_http_data *)malloc(sizeof(*cb_http_data));
-	cb_http_data->channelset = strdup(channelset);
+	struct pubnub_subscribe_cb_http_data *cb_http_data = (struct pubnub_subscribe_cb_http_data *)pubnub_arena_alloc(p, sizeof(*cb_http_data));
+	cb_http_data->channelset = pubnub_arena_strdup(p, channelset);
 	cb_http_data->cb = cb;
 	cb_http_data->call_data = cb_data;
 	cb_http_data->cb_internal = cb_internal;
 
-	const char *urlelems[] = { "subscribe", p->subscribe_key, channelset, "0", time_token, NULL };
+	const char *urlelems[] = { "subscribe", p->subscribe_key,
+		channelset_enc ? channelset_enc : channelset, "0", time_token, NULL };
 	const char *qparamelems[] = { "uuid", p->uuid, NULL };
-	pubnub_http_setup(p, urlelems, qparamelems, timeout);
+	pubnub_http_url(p, pubnub_url_get(p), urlelems, channelset_enc ? 1 << 2 : 0, qparamelems);
+	p->timeout = timeout;
+	p->body_raw = (cb == pubnub_subscribe_raw_adapter);
 	pubnub_http_request(p, pubnub_subscribe_http_cb, cb_http_data, true, !is_retry);
 }
 
 static void
 pubnub_join(struct pubnub *p, const char *channelset, long timeout,
-		pubnub_subscribe_cb cb, void *cb_data)
+		pubnub_subscribe_cb cb, void *cb_data, bool is_retry)
 {
 	/* As this is an internal API, we don't bother with
 	 * the full-fledged PNR_OCCUPIED check and assume
@@ -1101,7 +5208,7 @@ pubnub_join(struct pubnub *p, const char *channelset, long timeout,
 	if (timeout <= 0)
 		timeout = 5;
 
-	pubnub_subscribe_do(p, channelset, (char*)"0", timeout, cb, cb_data, true, false);
+	pubnub_subscribe_do(p, channelset, NULL, (char*)"0", timeout, cb, cb_data, true, is_retry);
 }
 
 static void
@@ -1112,9 +5219,9 @@ pubnub_subscribe_internal(struct pubnub *p, long timeout,
 	if (timeout < 0)
 		timeout = 310;
 
-	struct printbuf *channelset = channelset_printbuf(&p->channelset);
-	pubnub_subscribe_do(p, channelset->buf, p->time_token, timeout, cb, cb_data, false, is_retry);
-	printbuf_free(channelset);
+	const char *channelset_enc;
+	const char *channelset = channelset_str(&p->channelset, &channelset_enc);
+	pubnub_subscribe_do(p, channelset, channelset_enc, p->time_token, timeout, cb, cb_data, false, is_retry);
 }
 
 PUBNUB_API
@@ -1137,6 +5244,11 @@ pubnub_subscribe_multi(struct pubnub *p, const char *channels[], int channels_n,
 {
 	if (!cb) cb = p->cb->subscribe;
 
+	if (resubscribe_queue_ok(p)) {
+		resubscribe_queue_subscribe(p, channels, channels_n, timeout, cb, cb_data);
+		return;
+	}
+
 	if (p->method && strcmp(p->method, "subscribe")) {
 		if (cb)
 			cb(p, pubnub_error_report(p, PNR_OCCUPIED, NULL, "subscribe", false),
@@ -1176,7 +5288,7 @@ pubnub_subscribe_multi(struct pubnub *p, const char *channels[], int channels_n,
 		cb_data = cb_http_data;
 
 		struct printbuf *channelset = channelset_printbuf(&cs);
-		pubnub_join(p, channelset->buf, timeout, cb, cb_data);
+		pubnub_join(p, channelset->buf, timeout, cb, cb_data, false);
 		printbuf_free(channelset);
 
 	} else {
@@ -1185,6 +5297,44 @@ pubnub_subscribe_multi(struct pubnub *p, const char *channels[], int channels_n,
 }
 
 
+PUBNUB_API
+void
+pubnub_subscribe_const(struct pubnub *p, const char *channels[], int channels_n,
+		long timeout, pubnub_subscribe_const_cb cb, void *cb_data)
+{
+	struct pubnub_subscribe_const_data *const_data = (struct pubnub_subscribe_const_data *)pubnub_arena_alloc(p, sizeof(*const_data));
+	const_data->cb = cb;
+	const_data->call_data = cb_data;
+	pubnub_subscribe_multi(p, channels, channels_n, timeout, pubnub_subscribe_const_adapter, const_data);
+}
+
+PUBNUB_API
+void
+pubnub_subscribe_raw(struct pubnub *p, const char *channels[], int channels_n,
+		long timeout, pubnub_subscribe_raw_cb cb, void *cb_data)
+{
+	struct pubnub_subscribe_raw_data *raw_data = (struct pubnub_subscribe_raw_data *)pubnub_arena_alloc(p, sizeof(*raw_data));
+	raw_data->cb = cb;
+	raw_data->call_data = cb_data;
+	raw_data->relay = NULL;
+	pubnub_subscribe_multi(p, channels, channels_n, timeout, pubnub_subscribe_raw_adapter, raw_data);
+}
+
+PUBNUB_API
+struct json_object *
+pubnub_raw_msg_parse(const struct pubnub_raw_msg *msg)
+{
+	json_tokener *tok = json_tokener_new();
+	json_object *obj = json_tokener_parse_ex(tok, msg->json, msg->len);
+	if (!obj && json_tokener_get_error(tok) == json_tokener_continue) {
+		/* A number at the very end of the input. */
+		obj = json_tokener_parse_ex(tok, "", 1);
+	}
+	json_tokener_free(tok);
+	return obj;
+}
+
+
 PUBNUB_API
 void
 pubnub_reset_subscribe(struct pubnub *p, bool reset_timetoken)
@@ -1204,7 +5354,7 @@ pubnub_reset_subscribe(struct pubnub *p, bool reset_timetoken)
 
 static void
 pubnub_leave(struct pubnub *p, const char *channelset, long timeout,
-		pubnub_unsubscribe_cb cb, void *cb_data, bool cb_internal)
+		pubnub_unsubscribe_cb cb, void *cb_data, bool cb_internal, bool is_retry)
 {
 	/* As this is an internal API, we don't bother with
 	 * the full-fledged PNR_OCCUPIED check. */
@@ -1217,66 +5367,395 @@ pubnub_leave(struct pubnub *p, const char *channelset, long timeout,
 	const char *urlelems[] = { "v2", "presence", "sub-key", p->subscribe_key, "channel", channelset, "leave", NULL };
 	const char *qparamelems[] = { "uuid", p->uuid, NULL };
 	pubnub_http_setup(p, urlelems, qparamelems, timeout);
-	pubnub_http_request(p, (pubnub_http_cb) cb, cb_data, cb_internal, true);
+	pubnub_http_request(p, (pubnub_http_cb) cb, cb_data, cb_internal, !is_retry);
+}
+
+PUBNUB_API
+void
+pubnub_unsubscribe(struct pubnub *p, const char *channels[], int channels_n,
+		long timeout, pubnub_unsubscribe_cb cb, void *cb_data)
+{
+	if (!cb) cb = p->cb->unsubscribe;
+
+	if (resubscribe_queue_ok(p)) {
+		resubscribe_queue_unsubscribe(p, channels, channels_n, timeout, cb, cb_data);
+		return;
+	}
+
+	if (p->method && strcmp(p->method, "subscribe")) {
+		if (cb)
+			cb(p, pubnub_error_report(p, PNR_OCCUPIED, NULL, "unsubscribe", false),
+				NULL, p->cb_data, cb_data);
+		return;
+	}
+
+
+	/* Edit the channelset. */
+	const struct channelset cs = { SFINIT(.set, channels), SFINIT(.n, channels_n) };
+	if (p->channelset.set) {
+		if (channels != NULL) {
+			channelset_rm(&p->channelset, &cs);
+		} else {
+			/* Unsubscribe from all channels. */
+			channelset_done(&p->channelset);
+		}
+		if (p->channelset.set == NULL) {
+			/* A fresh subscribe, restart fresh (we do not care about
+			 * messages received while we were not subscribed anywhere). */
+			strcpy(p->time_token, "0");
+		}
+	}
+
+	bool cb_internal = false;
+	/* If we have an ongoing subscribe... */
+	if (p->method) {
+		if (p->channelset.set) {
+			/* ... we will want to resume it later! */
+			struct resubscribe_cb_http_data *cb_http_data = resubscribe_http_init(p);
+			cb_http_data->unsub_cb = cb;
+			cb_http_data->unsub_call_data = cb_data;
+
+			cb = resubscribe_http_cb;
+			cb_data = cb_http_data;
+			cb_internal = true;
+
+			pubnub_connection_cleanup(p, false);
+		} else {
+			/* ... cancel it! */
+			pubnub_connection_cancel(p);
+		}
+	}
+
+	/* Next thing, we issue the leave() call. */
+	struct printbuf *channelset = channelset_printbuf(&cs);
+	pubnub_leave(p, channelset->buf, timeout, cb, cb_data, cb_internal, false);
+	printbuf_free(channelset);
+}
+
+
+/** Relays */
+
+struct pubnub_relay_sink {
+	pubnub_relay_cb cb;
+	void *data;
+};
+
+struct pubnub_relay_sinks {
+	struct pubnub_relay_sink *set;
+	int n, alloc;
+};
+
+struct pubnub_relay {
+	struct pubnub *p;
+	/* sinks[i] are the sinks of channels.set[i], in the order added;
+	 * all are those of every channel. */
+	struct channelset channels;
+	struct pubnub_relay_sinks *sinks;
+	int sinks_alloc;
+	struct pubnub_relay_sinks all;
+
+	/* Scratch space of pubnub_relay_deliver(), kept for the next
+	 * batch: the messages grouped by channel, and for each message
+	 * its group, the first message of each group and where each
+	 * group starts in order[]. */
+	const struct pubnub_raw_msg **order;
+	int *group, *group_first, *group_start;
+	int order_alloc;
+
+	/* Subscribes failed in a row; see pubnub_relay_raw_cb(). */
+	int failures;
+};
+
+/* The messages of a batch point into the response buffer (or into
+ * the decrypted messages); the channel name is copied if it was not
+ * in the response. */
+struct pubnub_relay_batch {
+	int refs;
+	struct printbuf *body;
+	size_t body_keep;
+	struct pubnub_raw_msg *msgs;
+	int msgs_n;
+	struct json_object *decrypted;
+	char *channel;
+	char time_token[64];
+};
+
+static struct pubnub_relay_batch *
+pubnub_relay_batch_new(struct pubnub *p, struct printbuf *body,
+		struct pubnub_raw_msg *msgs, int msgs_n, struct json_object *decrypted, const char *channel)
+{
+	struct pubnub_relay_batch *b = (struct pubnub_relay_batch *)calloc(1, sizeof(*b));
+	b->refs = 1;
+	b->body = body;
+	b->body_keep = p->body_keep;
+	b->msgs = msgs;
+	b->msgs_n = msgs_n;
+	b->decrypted = decrypted;
+	if (channel) {
+		b->channel = strdup(channel);
+		for (int i = 0; i < msgs_n; i++)
+			if (msgs[i].channel == channel)
+				msgs[i].channel = b->channel;
+	}
+	strcpy(b->time_token, p->time_token);
+	return b;
+}
+
+static void pubnub_relay_raw_cb(struct pubnub *p, enum pubnub_res result,
+		const struct pubnub_raw_msg *msgs, int msgs_n, const char *time_token,
+		struct json_object *response, void *ctx_data, void *call_data);
+
+static void
+pubnub_relay_subscribe(struct pubnub_relay *r, const char *channels[], int channels_n)
+{
+	struct pubnub_subscribe_raw_data *raw_data = (struct pubnub_subscribe_raw_data *)pubnub_arena_alloc(r->p, sizeof(*raw_data));
+	raw_data->cb = pubnub_relay_raw_cb;
+	raw_data->call_data = r;
+	raw_data->relay = r;
+	pubnub_subscribe_multi(r->p, channels, channels_n, -1, pubnub_subscribe_raw_adapter, raw_data);
+}
+
+/* Fan @b out to the sinks, then go on subscribing. */
+static void
+pubnub_relay_deliver(struct pubnub_relay *r, struct pubnub_relay_batch *b)
+{
+	r->failures = 0;
+	int n = b->msgs_n;
+	if (n > r->order_alloc || !r->group) {
+		/* Even an empty batch needs group_start[0]. */
+		r->order_alloc = n;
+		r->order = (const struct pubnub_raw_msg **)realloc(r->order, n * sizeof(*r->order));
+		r->group = (int *)realloc(r->group, 3 * (n + 1) * sizeof(*r->group));
+		r->group_first = r->group + n + 1;
+		r->group_start = r->group_first + n + 1;
+	}
+
+	/* Group the messages by channel, keeping their order; a batch
+	 * comes from a few channels, so a linear search does. */
+	int groups = 0;
+	for (int i = 0; i < n; i++) {
+		const char *channel = b->msgs[i].channel;
+		int g;
+		for (g = 0; g < groups; g++) {
+			const char *c = b->msgs[r->group_first[g]].channel;
+			if (c == channel || !strcmp(c, channel))
+				break;
+		}
+		if (g == groups) {
+			r->group_first[g] = i;
+			r->group_start[g] = 0;
+			groups++;
+		}
+		r->group[i] = g;
+		r->group_start[g]++;
+	}
+	for (int g = 0, start = 0; g <= groups; g++) {
+		int count = g < groups ? r->group_start[g] : 0;
+		r->group_start[g] = start;
+		start += count;
+	}
+	for (int i = 0; i < n; i++)
+		r->order[r->group_start[r->group[i]]++] = &b->msgs[i];
+	/* Each group_start[] is now the start of the next group. */
+
+	for (int g = 0; g < groups; g++) {
+		int i = channelset_find(&r->channels, b->msgs[r->group_first[g]].channel);
+		if (i < 0)
+			continue;
+		int start = g > 0 ? r->group_start[g - 1] : 0;
+		const struct pubnub_relay_sinks *ss = &r->sinks[i];
+		for (int k = 0; k < ss->n; k++)
+			ss->set[k].cb(r, b, &r->order[start], r->group_start[g] - start, ss->set[k].data);
+	}
+	if (n > 0 && r->all.n > 0) {
+		for (int i = 0; i < n; i++)
+			r->order[i] = &b->msgs[i];
+		for (int k = 0; k < r->all.n; k++)
+			r->all.set[k].cb(r, b, r->order, n, r->all.set[k].data);
+	}
+
+	pubnub_relay_batch_unref(b);
+	pubnub_relay_subscribe(r, NULL, 0);
+}
+
+static void
+pubnub_relay_raw_cb(struct pubnub *p, enum pubnub_res result,
+		const struct pubnub_raw_msg *msgs, int msgs_n, const char *time_token,
+		struct json_object *response, void *ctx_data, void *call_data)
+{
+	struct pubnub_relay *r = (struct pubnub_relay *)call_data;
+
+	if (result == PNR_OK) {
+		/* A parsed response after all, see
+		 * pubnub_subscribe_raw_adapter(); the messages are ours
+		 * only during the call, so copy them to a batch. */
+		struct printbuf *body = pubnub_body_get();
+		struct pubnub_raw_msg *copy = (struct pubnub_raw_msg *)malloc((msgs_n + 1) * sizeof(*copy));
+		for (int i = 0; i < msgs_n; i++) {
+			printbuf_memappend_fast(body, msgs[i].json, msgs[i].len);
+			printbuf_memappend_fast(body, msgs[i].channel, strlen(msgs[i].channel) + 1);
+		}
+		size_t pos = 0;
+		for (int i = 0; i < msgs_n; i++) {
+			copy[i].json = body->buf + pos;
+			copy[i].len = msgs[i].len;
+			pos += msgs[i].len;
+			copy[i].channel = body->buf + pos;
+			pos += strlen(msgs[i].channel) + 1;
+		}
+		pubnub_relay_deliver(r, pubnub_relay_batch_new(p, body, copy, msgs_n, NULL, NULL));
+		return;
+	}
+
+	/* Cancelled by a change of the channels or by pubnub_relay_done(),
+	 * and there is a subscribe going on instead or none is due. */
+	if (result == PNR_CANCELLED || result == PNR_OCCUPIED)
+		return;
+	/* Otherwise, the error policy said not to try again, but the
+	 * relay has to keep going; it does so after the retry backoff
+	 * (held back like for subscribe batching), so that a failing
+	 * origin is not hammered. */
+	r->failures++;
+	p->pace_until = pubnub_now_ms() + pubnub_retry_delay(p, r->failures);
+	pubnub_relay_subscribe(r, NULL, 0);
+}
+
+static void
+pubnub_relay_unsubscribe_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+}
+
+PUBNUB_API
+struct pubnub_relay *
+pubnub_relay_init(struct pubnub *p)
+{
+	struct pubnub_relay *r = (struct pubnub_relay *)calloc(1, sizeof(*r));
+	r->p = p;
+	/* The batches outlive the response, they need buffers of their
+	 * own. */
+	pubnub_set_response_buffer(p, NULL, 0);
+	return r;
 }
 
 PUBNUB_API
 void
-pubnub_unsubscribe(struct pubnub *p, const char *channels[], int channels_n,
-		long timeout, pubnub_unsubscribe_cb cb, void *cb_data)
+pubnub_relay_done(struct pubnub_relay *r)
 {
-	if (!cb) cb = p->cb->unsubscribe;
+	/* This cancels the subscribe, which the relay takes quietly. */
+	pubnub_done(r->p);
+
+	for (int i = 0; i < r->channels.n; i++)
+		free(r->sinks[i].set);
+	free(r->sinks);
+	free(r->all.set);
+	channelset_done(&r->channels);
+	free(r->order);
+	free(r->group);
+	free(r);
+}
 
-	if (p->method && strcmp(p->method, "subscribe")) {
-		if (cb)
-			cb(p, pubnub_error_report(p, PNR_OCCUPIED, NULL, "unsubscribe", false),
-				NULL, p->cb_data, cb_data);
-		return;
+PUBNUB_API
+void
+pubnub_relay_add_sink(struct pubnub_relay *r, const char *channel, pubnub_relay_cb cb, void *sink_data)
+{
+	struct pubnub_relay_sinks *ss = &r->all;
+	bool subscribe = false;
+	if (channel) {
+		int i = channelset_find(&r->channels, channel);
+		if (i < 0) {
+			if (r->channels.n == r->sinks_alloc) {
+				r->sinks_alloc = r->sinks_alloc ? r->sinks_alloc * 2 : 4;
+				r->sinks = (struct pubnub_relay_sinks *)realloc(r->sinks, r->sinks_alloc * sizeof(r->sinks[0]));
+			}
+			const struct channelset cs = { SFINIT(.set, &channel), SFINIT(.n, 1) };
+			channelset_add(&r->channels, &cs);
+			i = r->channels.n - 1;
+			memset(&r->sinks[i], 0, sizeof(r->sinks[i]));
+			subscribe = true;
+		}
+		ss = &r->sinks[i];
 	}
 
-
-	/* Edit the channelset. */
-	const struct channelset cs = { SFINIT(.set, channels), SFINIT(.n, channels_n) };
-	if (p->channelset.set) {
-		if (channels != NULL) {
-			channelset_rm(&p->channelset, &cs);
-		} else {
-			/* Unsubscribe from all channels. */
-			channelset_done(&p->channelset);
-		}
-		if (p->channelset.set == NULL) {
-			/* A fresh subscribe, restart fresh (we do not care about
-			 * messages received while we were not subscribed anywhere). */
-			strcpy(p->time_token, "0");
-		}
+	if (ss->n == ss->alloc) {
+		ss->alloc = ss->alloc ? ss->alloc * 2 : 4;
+		ss->set = (struct pubnub_relay_sink *)realloc(ss->set, ss->alloc * sizeof(ss->set[0]));
 	}
+	ss->set[ss->n].cb = cb;
+	ss->set[ss->n].data = sink_data;
+	ss->n++;
 
-	bool cb_internal = false;
-	/* If we have an ongoing subscribe... */
-	if (p->method) {
-		if (p->channelset.set) {
-			/* ... we will want to resume it later! */
-			struct resubscribe_cb_http_data *cb_http_data = resubscribe_http_init(p);
-			cb_http_data->unsub_cb = cb;
-			cb_http_data->unsub_call_data = cb_data;
+	if (subscribe)
+		pubnub_relay_subscribe(r, &channel, 1);
+}
 
-			cb = resubscribe_http_cb;
-			cb_data = cb_http_data;
-			cb_internal = true;
+PUBNUB_API
+void
+pubnub_relay_remove_sink(struct pubnub_relay *r, const char *channel, pubnub_relay_cb cb, void *sink_data)
+{
+	struct pubnub_relay_sinks *ss = &r->all;
+	int i = -1;
+	if (channel) {
+		i = channelset_find(&r->channels, channel);
+		if (i < 0)
+			return;
+		ss = &r->sinks[i];
+	}
 
-			pubnub_connection_cleanup(p, false);
-		} else {
-			/* ... cancel it! */
-			pubnub_connection_cancel(p);
-		}
+	int k;
+	for (k = 0; k < ss->n; k++)
+		if (ss->set[k].cb == cb && ss->set[k].data == sink_data)
+			break;
+	if (k == ss->n)
+		return;
+	memmove(&ss->set[k], &ss->set[k + 1], (ss->n - k - 1) * sizeof(ss->set[0]));
+	ss->n--;
+
+	if (i >= 0 && ss->n == 0) {
+		free(ss->set);
+		/* channelset_rm() moves the last channel in its place. */
+		r->sinks[i] = r->sinks[r->channels.n - 1];
+		const struct channelset cs = { SFINIT(.set, &channel), SFINIT(.n, 1) };
+		channelset_rm(&r->channels, &cs);
+		pubnub_unsubscribe(r->p, &channel, 1, -1, pubnub_relay_unsubscribe_cb, NULL);
 	}
+}
 
-	/* Next thing, we issue the leave() call. */
-	struct printbuf *channelset = channelset_printbuf(&cs);
-	pubnub_leave(p, channelset->buf, timeout, cb, cb_data, cb_internal);
-	printbuf_free(channelset);
+PUBNUB_API
+const char *
+pubnub_relay_batch_time_token(const struct pubnub_relay_batch *batch)
+{
+	return batch->time_token;
+}
+
+PUBNUB_API
+void
+pubnub_relay_batch_ref(struct pubnub_relay_batch *batch)
+{
+#ifndef _WIN32
+	__atomic_add_fetch(&batch->refs, 1, __ATOMIC_RELAXED);
+#else
+	batch->refs++;
+#endif
 }
 
+PUBNUB_API
+void
+pubnub_relay_batch_unref(struct pubnub_relay_batch *batch)
+{
+#ifndef _WIN32
+	if (__atomic_sub_fetch(&batch->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+#else
+	if (--batch->refs > 0)
+		return;
+#endif
+	free(batch->msgs);
+	if (batch->decrypted)
+		json_object_put(batch->decrypted);
+	pubnub_body_put_keep(batch->body, batch->body_keep);
+	free(batch->channel);
+	free(batch);
+}
 
 struct pubnub_history_http_cb {
 	pubnub_history_cb cb;
@@ -1289,7 +5768,7 @@ pubnub_history_http_cb(struct pubnub *p, enum pubnub_res result, struct json_obj
 	struct pubnub_history_http_cb *cb_http_data = (struct pubnub_history_http_cb *)call_data;
 	call_data = cb_http_data->call_data;
 	pubnub_history_cb cb = cb_http_data->cb;
-	free(cb_http_data);
+	pubnub_free(p, cb_http_data);
 	p->finished_cb = NULL;
 	p->finished_cb_data = NULL;
 
@@ -1310,9 +5789,9 @@ error:
 	}
 
 	bool put_response = false;
-	if (p->cipher_key) {
+	if (PUBNUB_CIPHER_KEY(p)) {
 		/* Decrypt array elements, which must be strings. */
-		struct json_object *response_new = pubnub_decrypt_array(p->cipher_key, response);
+		struct json_object *response_new = pubnub_decrypt_msgs(p, response);
 		if (!response_new) {
 			result = PNR_FORMAT_ERROR;
 			goto error;
@@ -1322,13 +5801,67 @@ error:
 	}
 
 	/* Finally call the user callback. */
-	p->cb->stop_wait(p, p->cb_data);
+	pubnub_stop_wait(p);
 	if (cb) cb(p, result, response, ctx_data, call_data);
 
 	if (put_response)
 		json_object_put(response);
 }
 
+/* pubnub_history_http_cb() for side requests: no retries and no
+ * touching the method slot. */
+static void
+pubnub_history_req_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+	struct pubnub_history_http_cb *cb_http_data = (struct pubnub_history_http_cb *)call_data;
+	call_data = cb_http_data->call_data;
+	pubnub_history_cb cb = cb_http_data->cb;
+	pubnub_free(p, cb_http_data);
+
+	struct json_object *response_new = NULL;
+	if (result == PNR_OK) {
+		/* Response must be an array. */
+		if (!response || !json_object_is_type(response, json_type_array)) {
+			result = PNR_FORMAT_ERROR;
+		} else if (PUBNUB_CIPHER_KEY(p)) {
+			/* Decrypt array elements, which must be strings. */
+			response_new = pubnub_decrypt_msgs(p, response);
+			if (!response_new)
+				result = PNR_FORMAT_ERROR;
+			else
+				response = response_new;
+		}
+		if (result != PNR_OK)
+			pubnub_error_report(p, result, response, "history", false);
+	}
+
+	if (cb) cb(p, result, response, ctx_data, call_data);
+
+	if (response_new)
+		json_object_put(response_new);
+}
+
+/* Start history call with @urlelems and @qparelems. */
+static void
+pubnub_history_do(struct pubnub *p, const char *urlelems[], const char **qparelems,
+		long timeout, pubnub_history_cb cb, void *cb_data)
+{
+	struct pubnub_history_http_cb *cb_http_data = (struct pubnub_history_http_cb *)pubnub_arena_alloc(p, sizeof(*cb_http_data));
+	cb_http_data->cb = cb;
+	cb_http_data->call_data = cb_data;
+
+	if (pubnub_side_call_ok(p)) {
+		struct pubnub_req *req = pubnub_side_call(p, "history", timeout, pubnub_history_req_cb, cb_http_data);
+		pubnub_http_url(p, req->url, urlelems, 0, qparelems);
+		pubnub_req_enqueue(p, req);
+		return;
+	}
+
+	p->method = "history";
+	pubnub_http_setup(p, urlelems, qparelems, timeout);
+	pubnub_http_request(p, pubnub_history_http_cb, cb_http_data, true, true);
+}
+
 PUBNUB_API
 void
 pubnub_history(struct pubnub *p, const char *channel, int limit,
@@ -1336,25 +5869,19 @@ pubnub_history(struct pubnub *p, const char *channel, int limit,
 {
 	if (!cb) cb = p->cb->history;
 
-	if (p->method) {
+	if (p->method && !pubnub_side_call_ok(p)) {
 		if (cb)
 			cb(p, pubnub_error_report(p, PNR_OCCUPIED, NULL, "history", false),
 				NULL, p->cb_data, cb_data);
 		return;
 	}
-	p->method = "history";
 
 	if (timeout < 0)
 		timeout = 5;
 
-	struct pubnub_history_http_cb *cb_http_data = (struct pubnub_history_http_cb *)malloc(sizeof(*cb_http_data));
-	cb_http_data->cb = cb;
-	cb_http_data->call_data = cb_data;
-
 	char strlimit[64]; snprintf(strlimit, sizeof(strlimit), "%d", limit);
 	const char *urlelems[] = { "history", p->subscribe_key, channel, "0", strlimit, NULL };
-	pubnub_http_setup(p, urlelems, NULL, timeout);
-	pubnub_http_request(p, pubnub_history_http_cb, cb_http_data, true, true);
+	pubnub_history_do(p, urlelems, NULL, timeout, cb, cb_data);
 }
 
 PUBNUB_API
@@ -1364,21 +5891,16 @@ pubnub_history_ex(struct pubnub *p, const char *channel, int limit,
 {
 	if (!cb) cb = p->cb->history;
 
-	if (p->method) {
+	if (p->method && !pubnub_side_call_ok(p)) {
 		if (cb)
 			cb(p, pubnub_error_report(p, PNR_OCCUPIED, NULL, "history", false),
 				NULL, p->cb_data, cb_data);
 		return;
 	}
-	p->method = "history";
 
 	if (timeout < 0)
 		timeout = 5;
 
-	struct pubnub_history_http_cb *cb_http_data = (struct pubnub_history_http_cb *)malloc(sizeof(*cb_http_data));
-	cb_http_data->cb = cb;
-	cb_http_data->call_data = cb_data;
-
 	const char *urlelems[] = { "v2", "history", "sub-key", p->subscribe_key, "channel", channel, NULL };
 	char strlimit[64]; snprintf(strlimit, sizeof(strlimit), "%d", limit);
 	char *str_include_token = include_token ? "true" : "false";
@@ -1386,10 +5908,272 @@ pubnub_history_ex(struct pubnub *p, const char *channel, int limit,
 	  "count", strlimit, 
 	  "include_token", str_include_token, 
 	  NULL };
-	pubnub_http_setup(p, urlelems, qparamelems, timeout);
-	pubnub_http_request(p, pubnub_history_http_cb, cb_http_data, true, true);
+	pubnub_history_do(p, urlelems, qparamelems, timeout, cb, cb_data);
+}
+
+
+/* pubnub_history_scan() state.  Each lane pages through its part of
+ * the range on its own; the pages are handed out in order. */
+
+/* Messages per page; the most the PubNub server returns at once. */
+#define PUBNUB_HISTORY_PAGE 100
+
+struct pubnub_history_scan;
+
+struct pubnub_history_lane {
+	struct pubnub_history_scan *scan;
+	/* The next page starts after cursor; the lane covers the
+	 * timetokens up to hi. */
+	long long cursor, hi;
+	bool busy, done;
+	/* A page waiting for the earlier lanes. */
+	struct json_object *page;
+};
+
+struct pubnub_history_scan {
+	pubnub_history_cb cb;
+	void *call_data;
+	char *channel;
+	long timeout;
+
+	struct pubnub_history_lane *lanes;
+	int lanes_n;
+	/* The lane whose pages are handed out now. */
+	int cur;
+	/* Requests in flight. */
+	int busy;
+	/* The final cb call was made. */
+	bool finished;
+	/* Guards against reentering pubnub_history_scan_step(). */
+	bool stepping, again;
+};
+
+static void pubnub_history_scan_http_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data);
+
+static void
+pubnub_history_scan_free(struct pubnub_history_scan *scan)
+{
+	for (int i = 0; i < scan->lanes_n; i++) {
+		if (scan->lanes[i].page)
+			json_object_put(scan->lanes[i].page);
+	}
+	free(scan->lanes);
+	free(scan->channel);
+	free(scan);
+}
+
+static void
+pubnub_history_scan_finish(struct pubnub *p, struct pubnub_history_scan *scan,
+		enum pubnub_res result, struct json_object *response)
+{
+	if (scan->finished)
+		return;
+	scan->finished = true;
+	scan->cb(p, result, response, p->cb_data, scan->call_data);
+}
+
+static void
+pubnub_history_scan_fetch(struct pubnub *p, struct pubnub_history_lane *lane)
+{
+	struct pubnub_history_scan *scan = lane->scan;
+	char strlimit[16], strstart[32];
+	snprintf(strlimit, sizeof(strlimit), "%d", PUBNUB_HISTORY_PAGE);
+	snprintf(strstart, sizeof(strstart), "%lld", lane->cursor);
+	const char *urlelems[] = { "v2", "history", "sub-key", p->subscribe_key, "channel", scan->channel, NULL };
+	/* Oldest first, after the start timetoken. */
+	const char *qparamelems[] = {
+		"count", strlimit,
+		"include_token", "true",
+		"reverse", "true",
+		"start", strstart,
+		NULL };
+
+	lane->busy = true;
+	scan->busy++;
+	struct pubnub_req *req = pubnub_side_call(p, "history", scan->timeout, pubnub_history_scan_http_cb, lane);
+	pubnub_http_url(p, req->url, urlelems, 0, qparamelems);
+	pubnub_req_enqueue(p, req);
+}
+
+/* Hand out the pages that are next in order and keep the idle lanes
+ * busy. */
+static void
+pubnub_history_scan_step(struct pubnub *p, struct pubnub_history_scan *scan)
+{
+	if (scan->stepping) {
+		scan->again = true;
+		return;
+	}
+	scan->stepping = true;
+	do {
+		scan->again = false;
+		while (!scan->finished && scan->cur < scan->lanes_n) {
+			struct pubnub_history_lane *lane = &scan->lanes[scan->cur];
+			if (lane->page) {
+				struct json_object *page = lane->page;
+				lane->page = NULL;
+				scan->cb(p, PNR_OK, page, p->cb_data, scan->call_data);
+				json_object_put(page);
+			} else if (lane->done) {
+				scan->cur++;
+			} else {
+				break;
+			}
+		}
+		if (!scan->finished && scan->cur == scan->lanes_n)
+			pubnub_history_scan_finish(p, scan, PNR_OK, NULL);
+		for (int i = scan->cur; !scan->finished && i < scan->lanes_n; i++) {
+			struct pubnub_history_lane *lane = &scan->lanes[i];
+			if (!lane->done && !lane->busy && !lane->page)
+				pubnub_history_scan_fetch(p, lane);
+		}
+	} while (scan->again);
+	scan->stepping = false;
+
+	if (scan->finished && !scan->busy)
+		pubnub_history_scan_free(scan);
+}
+
+/* Take the part of the @msgs page that belongs to @lane. */
+static struct json_object *
+pubnub_history_scan_page(struct pubnub *p, struct pubnub_history_lane *lane, struct json_object *msgs)
+{
+	int msgs_n = json_object_array_length(msgs);
+	struct json_object *page = json_object_new_array();
+	for (int i = 0; i < msgs_n; i++) {
+		struct json_object *msg = json_object_array_get_idx(msgs, i);
+		struct json_object *tt = json_object_object_get(msg, "timetoken");
+		if (!tt || !json_object_object_get(msg, "message")) {
+			json_object_put(page);
+			return NULL;
+		}
+		long long t = json_object_get_int64(tt);
+		if (t > lane->hi) {
+			/* Into the next lane already. */
+			lane->done = true;
+			break;
+		}
+		json_object_array_add(page, json_object_get(msg));
+		lane->cursor = t;
+	}
+	if (msgs_n < PUBNUB_HISTORY_PAGE || lane->cursor >= lane->hi)
+		lane->done = true;
+
+	if (PUBNUB_CIPHER_KEY(p) && json_object_array_length(page) > 0) {
+		/* Decrypt all the messages of the page at once. */
+		int page_n = json_object_array_length(page);
+		struct json_object *encrypted = json_object_new_array();
+		for (int i = 0; i < page_n; i++)
+			json_object_array_add(encrypted, json_object_get(json_object_object_get(json_object_array_get_idx(page, i), "message")));
+		struct json_object *decrypted = pubnub_decrypt_msgs(p, encrypted);
+		json_object_put(encrypted);
+		if (!decrypted) {
+			json_object_put(page);
+			return NULL;
+		}
+		for (int i = 0; i < page_n; i++)
+			json_object_object_add(json_object_array_get_idx(page, i), "message", json_object_get(json_object_array_get_idx(decrypted, i)));
+		json_object_put(decrypted);
+	}
+	return page;
+}
+
+static void
+pubnub_history_scan_http_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+	struct pubnub_history_lane *lane = (struct pubnub_history_lane *)call_data;
+	struct pubnub_history_scan *scan = lane->scan;
+	lane->busy = false;
+	scan->busy--;
+
+	if (scan->finished) {
+		/* Failed or cancelled already; just winding down. */
+		if (!scan->busy && !scan->stepping)
+			pubnub_history_scan_free(scan);
+		return;
+	}
+
+	if (result == PNR_OK) {
+		/* [[{message, timetoken}, ...], first, last] */
+		struct json_object *msgs = response && json_object_is_type(response, json_type_array)
+			? json_object_array_get_idx(response, 0) : NULL;
+		if (msgs && json_object_is_type(msgs, json_type_array))
+			lane->page = pubnub_history_scan_page(p, lane, msgs);
+		if (!lane->page) {
+			result = PNR_FORMAT_ERROR;
+			pubnub_error_report(p, result, response, "history", false);
+		} else if (json_object_array_length(lane->page) == 0) {
+			json_object_put(lane->page);
+			lane->page = NULL;
+		}
+	}
+	if (result != PNR_OK)
+		pubnub_history_scan_finish(p, scan, result, response);
+
+	pubnub_history_scan_step(p, scan);
+}
+
+PUBNUB_API
+void
+pubnub_history_scan(struct pubnub *p, const char *channel,
+		const char *start, const char *end, int lanes,
+		long timeout, pubnub_history_cb cb, void *cb_data)
+{
+	if (timeout < 0)
+		timeout = 5;
+	if (lanes < 1)
+		lanes = 1;
+
+	long long lo = strtoll(start, NULL, 10), hi = strtoll(end, NULL, 10);
+	struct pubnub_history_scan *scan = (struct pubnub_history_scan *)calloc(1, sizeof(*scan));
+	scan->cb = cb;
+	scan->call_data = cb_data;
+	scan->channel = strdup(channel);
+	scan->timeout = timeout;
+	if (hi - lo < lanes)
+		lanes = 1;
+	scan->lanes_n = lanes;
+	scan->lanes = (struct pubnub_history_lane *)calloc(lanes, sizeof(*scan->lanes));
+	for (int i = 0; i < lanes; i++) {
+		struct pubnub_history_lane *lane = &scan->lanes[i];
+		lane->scan = scan;
+		lane->cursor = lo + (hi - lo) / lanes * i;
+		lane->hi = i == lanes - 1 ? hi : lo + (hi - lo) / lanes * (i + 1);
+		lane->done = lane->cursor >= lane->hi;
+	}
+	pubnub_history_scan_step(p, scan);
+}
+
+
+struct pubnub_here_now_http_cb {
+	pubnub_here_now_cb cb;
+	void *call_data;
+	char *channel;
+};
+
+/* Passes the here_now response through the presence cache. */
+static void
+pubnub_here_now_http_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+	struct pubnub_here_now_http_cb *cb_http_data = (struct pubnub_here_now_http_cb *)call_data;
+	call_data = cb_http_data->call_data;
+	pubnub_here_now_cb cb = cb_http_data->cb;
+	if (result == PNR_OK && response && json_object_is_type(response, json_type_object) && p->presence_ttl_ms > 0)
+		pubnub_presence_fill(p, cb_http_data->channel, response);
+	pubnub_free(p, cb_http_data->channel);
+	pubnub_free(p, cb_http_data);
+
+	if (cb) cb(p, result, response, ctx_data, call_data);
 }
 
+PUBNUB_API
+void
+pubnub_set_presence_cache(struct pubnub *p, long ttl_ms)
+{
+	p->presence_ttl_ms = ttl_ms;
+	if (ttl_ms <= 0)
+		pubnub_presence_clear(p);
+}
 
 PUBNUB_API
 void
@@ -1398,6 +6182,36 @@ pubnub_here_now(struct pubnub *p, const char *channel,
 {
 	if (!cb) cb = p->cb->here_now;
 
+	pubnub_http_cb http_cb = (pubnub_http_cb) cb;
+	void *http_cb_data = cb_data;
+	if (p->presence_ttl_ms > 0) {
+		struct pubnub_presence *e = pubnub_presence_find(p, channel);
+		if (e && e->fetched_at && pubnub_now_ms() - e->fetched_at < p->presence_ttl_ms) {
+			if (cb) cb(p, PNR_OK, pubnub_presence_response(e), p->cb_data, cb_data);
+			return;
+		}
+		if (!p->method || pubnub_side_call_ok(p)) {
+			struct pubnub_here_now_http_cb *cb_http_data = (struct pubnub_here_now_http_cb *)pubnub_arena_alloc(p, sizeof(*cb_http_data));
+			cb_http_data->cb = cb;
+			cb_http_data->call_data = cb_data;
+			cb_http_data->channel = pubnub_arena_strdup(p, channel);
+			http_cb = pubnub_here_now_http_cb;
+			http_cb_data = cb_http_data;
+		}
+	}
+
+	if (timeout < 0)
+		timeout = 5;
+
+	const char *urlelems[] = { "v2", "presence", "sub-key", p->subscribe_key, "channel", channel, NULL };
+
+	if (pubnub_side_call_ok(p)) {
+		struct pubnub_req *req = pubnub_side_call(p, "here_now", timeout, http_cb, http_cb_data);
+		pubnub_http_url(p, req->url, urlelems, 0, NULL);
+		pubnub_req_enqueue(p, req);
+		return;
+	}
+
 	if (p->method) {
 		if (cb)
 			cb(p, pubnub_error_report(p, PNR_OCCUPIED, NULL, "here_now", false),
@@ -1406,12 +6220,8 @@ pubnub_here_now(struct pubnub *p, const char *channel,
 	}
 	p->method = "here_now";
 
-	if (timeout < 0)
-		timeout = 5;
-
-	const char *urlelems[] = { "v2", "presence", "sub-key", p->subscribe_key, "channel", channel, NULL };
 	pubnub_http_setup(p, urlelems, NULL, timeout);
-	pubnub_http_request(p, (pubnub_http_cb) cb, cb_data, false, true);
+	pubnub_http_request(p, http_cb, http_cb_data, false, true);
 }
 
 
@@ -1426,7 +6236,7 @@ pubnub_time_http_cb(struct pubnub *p, enum pubnub_res result, struct json_object
 	struct pubnub_time_http_cb *cb_http_data = (struct pubnub_time_http_cb *)call_data;
 	call_data = cb_http_data->call_data;
 	pubnub_history_cb cb = cb_http_data->cb;
-	free(cb_http_data);
+	pubnub_free(p, cb_http_data);
 	p->finished_cb = NULL;
 	p->finished_cb_data = NULL;
 
@@ -1448,36 +6258,121 @@ pubnub_time_http_cb(struct pubnub *p, enum pubnub_res result, struct json_object
 	/* Extract the first element. */
 	json_object *ts = json_object_array_get_idx(response, 0);
 	json_object_get(ts);
+	pubnub_clock_sample(p, json_object_get_int64(ts) * 100);
 
 	/* Finally call the user callback. */
-	p->cb->stop_wait(p, p->cb_data);
+	pubnub_stop_wait(p);
 	if (cb) cb(p, result, ts, ctx_data, call_data);
 
 	json_object_put(ts);
 }
 
+/* pubnub_time_http_cb() for side requests. */
+static void
+pubnub_time_req_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+	struct pubnub_time_http_cb *cb_http_data = (struct pubnub_time_http_cb *)call_data;
+	call_data = cb_http_data->call_data;
+	pubnub_time_cb cb = cb_http_data->cb;
+	pubnub_free(p, cb_http_data);
+
+	if (result == PNR_OK) {
+		/* Response must be an array; extract the first element. */
+		if (!response || !json_object_is_type(response, json_type_array)) {
+			result = PNR_FORMAT_ERROR;
+			pubnub_error_report(p, result, response, "time", false);
+		} else {
+			response = json_object_array_get_idx(response, 0);
+			pubnub_clock_sample(p, json_object_get_int64(response) * 100);
+		}
+	}
+
+	if (cb) cb(p, result, response, ctx_data, call_data);
+}
+
 PUBNUB_API
 void
 pubnub_time(struct pubnub *p, long timeout, pubnub_time_cb cb, void *cb_data)
 {
 	if (!cb) cb = p->cb->time;
 
-	if (p->method) {
+	if (p->method && !pubnub_side_call_ok(p)) {
 		if (cb)
 			cb(p, pubnub_error_report(p, PNR_OCCUPIED, NULL, "time", false),
 				NULL, p->cb_data, cb_data);
 		return;
 	}
-	p->method = "time";
 
 	if (timeout < 0)
 		timeout = 5;
 
-	struct pubnub_time_http_cb *cb_http_data = (struct pubnub_time_http_cb *)malloc(sizeof(*cb_http_data));
+	struct pubnub_time_http_cb *cb_http_data = (struct pubnub_time_http_cb *)pubnub_arena_alloc(p, sizeof(*cb_http_data));
 	cb_http_data->cb = cb;
 	cb_http_data->call_data = cb_data;
 
 	const char *urlelems[] = { "time", "0", NULL };
+	if (pubnub_side_call_ok(p)) {
+		struct pubnub_req *req = pubnub_side_call(p, "time", timeout, pubnub_time_req_cb, cb_http_data);
+		pubnub_http_url(p, req->url, urlelems, 0, NULL);
+		pubnub_req_enqueue(p, req);
+		return;
+	}
+
+	p->method = "time";
 	pubnub_http_setup(p, urlelems, NULL, timeout);
 	pubnub_http_request(p, pubnub_time_http_cb, cb_http_data, true, true);
 }
+
+/* Background time request of pubnub_now(). */
+static void
+pubnub_clock_sync_cb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+	p->clock_syncing = false;
+	if (result == PNR_OK && response && json_object_is_type(response, json_type_array))
+		pubnub_clock_sample(p, json_object_get_int64(json_object_array_get_idx(response, 0)) * 100);
+}
+
+PUBNUB_API
+void
+pubnub_set_clock_sync(struct pubnub *p, long refresh_ms)
+{
+	p->clock_sync_ms = refresh_ms;
+}
+
+PUBNUB_API
+long long
+pubnub_now(struct pubnub *p)
+{
+	long long now = pubnub_now_ns();
+	if (p->clock_sync_ms > 0 && !p->clock_syncing
+	    && (!p->clock_at || now - p->clock_last >= (long long) p->clock_sync_ms * 1000000)) {
+		/* Time for a new sample; this one is answered from the
+		 * old estimate still. */
+		const char *urlelems[] = { "time", "0", NULL };
+		struct pubnub_req *req = pubnub_side_call(p, "time", 5, pubnub_clock_sync_cb, NULL);
+		pubnub_http_url(p, req->url, urlelems, 0, NULL);
+		p->clock_syncing = true;
+		pubnub_req_enqueue(p, req);
+	}
+	if (!p->clock_at)
+		return 0;
+	return now + p->clock_offset + (long long) ((now - p->clock_at) * p->clock_drift);
+}
+
+PUBNUB_API
+void
+pubnub_prewarm(struct pubnub *p, bool connect)
+{
+	p->dns_cache = true;
+	char addr[PUBNUB_DNS_ADDR_LEN];
+	pubnub_dns_lookup(pubnub_dns_hostport(p), addr);
+
+	if (connect) {
+		/* Any request will do; the connection stays in the
+		 * connection cache of the multi handle. */
+		const char *urlelems[] = { "time", "0", NULL };
+		struct pubnub_req *req = pubnub_side_call(p, "time", 5, NULL, NULL);
+		pubnub_http_url(p, req->url, urlelems, 0, NULL);
+		pubnub_req_enqueue(p, req);
+	}
+}
@@ -29,10 +29,14 @@ extern "C" {
  * by the application.
  *
  * Only one method may operate on a single context at once - this means
- * that if a subscribe is in progress, you cannot publish in the same
- * context; either wait or use multiple contexts. If the same context
- * is used in multiple threads, the application must ensure locking to
- * prevent improper concurrent access. */
+ * that if e.g. a history call is in progress, you cannot publish in the
+ * same context; either wait or use multiple contexts.  The exception is
+ * subscribe: while it is in progress, publish, history, here_now and
+ * time calls are sent alongside on their own connections (like with
+ * pubnub_publish_enqueue(), without retrying on errors), leaving the
+ * long poll undisturbed.  If the same context is used in multiple
+ * threads, the application must ensure locking to prevent improper
+ * concurrent access; the one exception is pubnub_publish_submit(). */
 struct pubnub;
 
 #if defined __MINGW32__ || defined _MSC_VER
@@ -69,6 +73,14 @@ enum pubnub_res {
 	/* Cancellation by user request. A chance to free resources associated
 	 * with an ongoing subscribe. (Will not retry.) */
 	PNR_CANCELLED,
+	/* The response went over the size limit set by
+	 * pubnub_set_response_limits(); response is number object with
+	 * the limit. (Will not retry.) */
+	PNR_RESPONSE_TOO_LARGE,
+	/* The library was built with PUBNUB_NO_CRYPTO, and the context has
+	 * a secret or cipher key (or CA certificates libcurl cannot load)
+	 * set; no request is made. (Will not retry.) */
+	PNR_NO_CRYPTO,
 };
 
 /* ctx_data is callbacks data passed to pubnub_init().
@@ -83,12 +95,47 @@ enum pubnub_res {
  * be as many elements as there are messages in the channels list, and
  * an extra NULL pointer at the end of the array. */
 typedef void (*pubnub_publish_cb)(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data);
+/* Callback of pubnub_publish_batch(); @results[i] and @responses[i]
+ * (NULL if there is none) belong to the i-th of the @n messages. */
+typedef void (*pubnub_publish_batch_cb)(struct pubnub *p, int n, const enum pubnub_res *results, struct json_object *const *responses, void *ctx_data, void *call_data);
 typedef void (*pubnub_subscribe_cb)(struct pubnub *p, enum pubnub_res result, char **channels, struct json_object *response, void *ctx_data, void *call_data);
+/* Like pubnub_subscribe_cb, but channels[] are owned by the library and
+ * valid only until the callback returns; used by pubnub_subscribe_const(). */
+typedef void (*pubnub_subscribe_const_cb)(struct pubnub *p, enum pubnub_res result, const char *const *channels, struct json_object *response, void *ctx_data, void *call_data);
+/* Handler of the messages on a channel; see pubnub_on_channel(). */
+typedef void (*pubnub_channel_cb)(struct pubnub *p, const char *channel, struct json_object *msg, void *ctx_data, void *call_data);
+/* Callback of pubnub_set_publish_watermark(). */
+typedef void (*pubnub_watermark_cb)(struct pubnub *p, bool high, int depth, void *ctx_data, void *call_data);
 typedef void (*pubnub_unsubscribe_cb)(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data);
 typedef void (*pubnub_history_cb)(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data);
 typedef void (*pubnub_here_now_cb)(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data);
 typedef void (*pubnub_time_cb)(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data);
 
+/* A message delivered by pubnub_subscribe_raw(): @json points to @len
+ * bytes of the message's JSON text (not NUL-terminated), @channel is
+ * the name of the originating channel.  Both point to library-owned
+ * memory valid only until the callback returns. */
+struct pubnub_raw_msg {
+	const char *json;
+	size_t len;
+	const char *channel;
+};
+/* In case of PNR_OK, @msgs has @msgs_n items and @time_token is the
+ * time token of the batch; otherwise, @msgs is NULL and @response may
+ * describe the error like for the other callbacks. */
+typedef void (*pubnub_subscribe_raw_cb)(struct pubnub *p, enum pubnub_res result,
+		const struct pubnub_raw_msg *msgs, int msgs_n, const char *time_token,
+		struct json_object *response, void *ctx_data, void *call_data);
+
+/* Opaque objects; see pubnub_relay_init(). */
+struct pubnub_relay;
+struct pubnub_relay_batch;
+/* A sink of a relay gets the @msgs_n messages of @batch on its
+ * channel; @msgs[] is valid only until the callback returns, the
+ * messages it points to as long as @batch is referenced. */
+typedef void (*pubnub_relay_cb)(struct pubnub_relay *r, struct pubnub_relay_batch *batch,
+		const struct pubnub_raw_msg *const *msgs, int msgs_n, void *sink_data);
+
 /* struct pubnub_callbacks describes the way PubNub calls coordinate
  * with the rest of the application; they tell what happens on pubnub
  * methods calls, enabling the application to either use the API
@@ -128,7 +175,8 @@ struct pubnub_callbacks {
 	 * callback, maybe after unregistering socket events. */
 	void (*stop_wait)(struct pubnub *p, void *ctx_data);
 	/* Deinitialize. Called from pubnub_done(), should remove
-	 * all event listeners associated with this context. */
+	 * all event listeners associated with this context. For
+	 * pools, called from pubnub_pool_done() with NULL @p. */
 	void (*done)(struct pubnub *p, void *ctx_data);
 
 	/* Default method callbacks. */
@@ -149,6 +197,87 @@ struct pubnub_callbacks {
 	void *unused;
 };
 
+/* Request statistics; see pubnub_set_stats(). */
+
+/* The times measured for each request. */
+enum pubnub_stats_time {
+	/* Name resolution. */
+	PNS_DNS,
+	/* TCP connect, after the name was resolved. */
+	PNS_CONNECT,
+	/* TLS handshake, after the TCP connect. */
+	PNS_TLS,
+	/* From the start of the request until the first byte of
+	 * the response. */
+	PNS_TTFB,
+	/* From the start of the request until the complete response. */
+	PNS_TOTAL,
+	/* Parsing the JSON response. */
+	PNS_PARSE,
+	/* Decrypting the received messages. */
+	PNS_DECRYPT,
+	PNS_TIMES
+};
+
+/* The methods statistics are kept for. */
+enum pubnub_stats_method {
+	PNS_SUBSCRIBE,
+	PNS_JOIN,
+	PNS_LEAVE,
+	PNS_PUBLISH,
+	PNS_HISTORY,
+	PNS_HERE_NOW,
+	PNS_TIME,
+	PNS_OTHER,
+	PNS_METHODS
+};
+
+struct pubnub_request_stats {
+	const char *method;
+	enum pubnub_res result;
+	/* In seconds, indexed by enum pubnub_stats_time. */
+	double time[PNS_TIMES];
+	/* Including the HTTP headers. */
+	long bytes_in, bytes_out;
+	/* Automatic retries of the call before this request. */
+	int retries;
+};
+
+#define PUBNUB_STATS_BUCKETS 16
+
+struct pubnub_method_stats {
+	unsigned long requests;
+	/* Requests that failed, whether retried or not. */
+	unsigned long errors;
+	unsigned long retries;
+	/* Calls rejected with PNR_OCCUPIED. */
+	unsigned long occupied;
+	unsigned long long bytes_in, bytes_out;
+	/* Sum over all requests, in seconds. */
+	double time_sum[PNS_TIMES];
+	/* Bucket 0 counts requests with the time under 1ms, bucket i
+	 * those with [2^(i-1), 2^i) ms; the last bucket counts all
+	 * the longer ones as well. */
+	unsigned long time_hist[PNS_TIMES][PUBNUB_STATS_BUCKETS];
+};
+
+struct pubnub_stats {
+	struct pubnub_method_stats method[PNS_METHODS];
+};
+
+typedef void (*pubnub_stats_cb)(struct pubnub *p, const struct pubnub_request_stats *stats, void *cb_data);
+
+/* Called as the first byte of a response arrives; see
+ * pubnub_set_first_byte_cb(). */
+typedef void (*pubnub_first_byte_cb)(struct pubnub *p, const char *method, void *cb_data);
+
+/* Memory allocator for the context's own bookkeeping; see
+ * pubnub_set_allocator(). */
+struct pubnub_allocator {
+	void *(*alloc)(size_t size, void *alloc_data);
+	void (*release)(void *ptr, void *alloc_data);
+};
+
 
 /** PubNub context methods */
 
@@ -185,6 +314,59 @@ struct pubnub *pubnub_init(const char *publish_key, const char *subscribe_key,
  * will not be called (this may change in the future). */
 void pubnub_done(struct pubnub *p);
 
+/* Create a pool of PubNub contexts sharing a single libcurl multi handle
+ * (and with it the connection and DNS caches), an SSL session cache and
+ * the @cb frontend with @cb_data.  This is meant for applications running
+ * many contexts at once; instead of one set of sockets, timers and caches
+ * per context, the frontend only deals with one for the whole pool.
+ *
+ * Since the frontend is shared, it must be an asynchronous one (like
+ * pubnub_libevent); pubnub_sync cannot be used with pools.  The frontend
+ * callbacks get called with the context whose transfer the event is
+ * related to, though for the pool-wide timer that is just any of the
+ * contexts in the pool. */
+struct pubnub_pool *pubnub_pool_init(const struct pubnub_callbacks *cb, void *cb_data);
+
+/* Deinitialize the pool, calling pubnub_done() on the contexts still
+ * attached to it.  Then, the done callback of the frontend is called
+ * with NULL in place of the context. */
+void pubnub_pool_done(struct pubnub_pool *pool);
+
+/* Initialize a PubNub context like pubnub_init(), attaching it to @pool;
+ * the context uses the callbacks the pool was initialized with.
+ * pubnub_done() detaches the context from the pool again. */
+struct pubnub *pubnub_init_pooled(struct pubnub_pool *pool,
+			const char *publish_key, const char *subscribe_key);
+
+/* Create a configuration to be shared by many contexts.  The keys,
+ * origin, HTTP headers and CA certificates are then kept just once
+ * instead of in each context initialized by pubnub_init_config();
+ * combined with a pool sharing the multi handle as well, a context
+ * is left with little more than its UUID and subscription state.
+ *
+ * Do the pubnub_config_set_*() calls before initializing any context
+ * with the configuration.  Calling a setter like pubnub_set_origin()
+ * on a context gives the context its own copy of that setting. */
+struct pubnub_config *pubnub_config_new(const char *publish_key, const char *subscribe_key);
+
+/* The same as pubnub_set_secret_key(), pubnub_set_cipher_key(),
+ * pubnub_set_origin() and pubnub_set_ssl_cacerts(), for all contexts
+ * using @config. */
+void pubnub_config_set_secret_key(struct pubnub_config *config, const char *secret_key);
+void pubnub_config_set_cipher_key(struct pubnub_config *config, const char *cipher_key);
+void pubnub_config_set_origin(struct pubnub_config *config, const char *origin);
+void pubnub_config_set_ssl_cacerts(struct pubnub_config *config, const char *cacerts, size_t len);
+
+/* Release the configuration; it is freed once the last context using
+ * it is done as well. */
+void pubnub_config_done(struct pubnub_config *config);
+
+/* Initialize a PubNub context like pubnub_init() or pubnub_init_pooled()
+ * (if @pool is not NULL, in which case @cb and @cb_data are ignored),
+ * referencing @config for its settings. */
+struct pubnub *pubnub_init_config(struct pubnub_config *config, struct pubnub_pool *pool,
+			const struct pubnub_callbacks *cb, void *cb_data);
+
 /* Serialize the PubNub context to a json object.  Use this e.g. if you
  * need to restart your app and do not want to miss any messages on the
  * subscribed channel.
@@ -210,15 +392,83 @@ struct json_object *pubnub_serialize(struct pubnub *p);
 struct pubnub *pubnub_init_serialized(struct json_object *obj,
                         const struct pubnub_callbacks *cb, void *cb_data);
 
+/* Opaque object. */
+struct pubnub_checkpoint;
+
+/* Write a checkpoint of the @n contexts in @ps[] to the file @path,
+ * covering the same state as pubnub_serialize() in a compact binary
+ * form.  The file is written aside and then renamed over @path, so
+ * that a crash midway leaves the previous checkpoint intact.  Returns
+ * false (with errno set) on error.
+ *
+ * The same caveats as with pubnub_serialize() apply; moreover, the
+ * format depends on the machine architecture. */
+bool pubnub_checkpoint_write(const char *path, struct pubnub *const ps[], int n);
+
+/* Map the checkpoint at @path into memory with a single mmap().
+ * Returns NULL (with errno set, EINVAL if it is not a checkpoint) on
+ * error.  Unlike with pubnub_init_serialized(), the data are checked
+ * as they are read; a corrupt entry just fails to load. */
+struct pubnub_checkpoint *pubnub_checkpoint_open(const char *path);
+
+/* Return the number of contexts in the checkpoint. */
+int pubnub_checkpoint_count(const struct pubnub_checkpoint *cp);
+
+/* Initialize a PubNub context from the @i-th entry of @cp, like
+ * pubnub_init_serialized() (or attached to @pool, whose callbacks are
+ * used then).  Returns NULL if the entry is corrupt.
+ *
+ * If @resume is true, the saved channels and timetoken are restored
+ * and nothing is sent: the next pubnub_subscribe() (with NULL @channel)
+ * carries on right at the saved timetoken, skipping the join request.
+ * This makes restarting many contexts a lot faster.  If false, the
+ * channels are joined right away, just like by pubnub_init_serialized(). */
+struct pubnub *pubnub_init_checkpoint(const struct pubnub_checkpoint *cp, int i, struct pubnub_pool *pool,
+		const struct pubnub_callbacks *cb, void *cb_data, bool resume);
+
+/* Unmap the checkpoint; the contexts initialized from it stay. */
+void pubnub_checkpoint_close(struct pubnub_checkpoint *cp);
+
 /* Set the secret key that is used for signing published messages
- * to confirm they are genuine. Using the secret key is optional. */
+ * to confirm they are genuine. Using the secret key is optional.
+ * (In a library built with PUBNUB_NO_CRYPTO, every call on a context
+ * with the key set fails with PNR_NO_CRYPTO.) */
 void pubnub_set_secret_key(struct pubnub *p, const char *secret_key);
 
 /* Set the cipher key that is used for symmetric encryption of messages
  * passed over the network (publish, subscribe, history). Using the
- * cipher key is optional. */
+ * cipher key is optional.  (In a library built with PUBNUB_NO_CRYPTO,
+ * every call on a context with the key set fails with PNR_NO_CRYPTO.) */
 void pubnub_set_cipher_key(struct pubnub *p, const char *cipher_key);
 
+/* Create a set of @threads worker threads for decrypting messages.
+ * Returns NULL if @threads is not positive or the threads cannot be
+ * created (they are not supported on Windows yet).
+ *
+ * Decrypting is done on the thread that processes the response, so big
+ * batches of encrypted messages (like a history call with a large
+ * limit, or a subscribe catching up) can hold up the event loop for
+ * a while.  Contexts set up with pubnub_set_decrypt_workers() instead
+ * split such batches between the workers and the event loop thread,
+ * which waits for all of them; the callback still gets the messages in
+ * order.  A single worker set can be shared by any number of contexts
+ * and threads (but processes one batch at a time). */
+struct pubnub_workers *pubnub_workers_init(int threads);
+
+/* Stop and free the worker threads.  Call this only after the contexts
+ * using them were deinitialized or switched away from them. */
+void pubnub_workers_done(struct pubnub_workers *w);
+
+/* Decrypt batches of at least @min_batch messages received by the
+ * context with the @w worker threads; NULL @w (DEFAULT) means no
+ * worker threads are used.  Smaller batches are decrypted right away,
+ * since waking up the workers costs more than it saves there. */
+void pubnub_set_decrypt_workers(struct pubnub *p, struct pubnub_workers *w, int min_batch);
+
+/* Like pubnub_set_decrypt_workers(), for all the contexts in @pool
+ * that do not have decrypt workers set on their own. */
+void pubnub_pool_set_decrypt_workers(struct pubnub_pool *pool, struct pubnub_workers *w, int min_batch);
+
 /* Set the origin server name. By default, http://pubsub.pubnub.com/
  * is used. */
 void pubnub_set_origin(struct pubnub *p, const char *origin);
@@ -245,14 +495,127 @@ void pubnub_set_uuid(struct pubnub *p, const char *uuid);
  * handlers and won't be thread safe */
 void pubnub_set_nosignal(struct pubnub *p, bool nosignal);
 
+/* Select whether the HTTP connection is kept alive across requests.
+ *
+ * If true (DEFAULT), the libcurl handle is reused by the next call on
+ * the context instead of being torn down after each request, so that
+ * subsequent publish or subscribe calls can reuse the established TCP
+ * connection (and SSL session) instead of going through a full
+ * handshake again.  TCP keepalive probes are enabled on the connection
+ * as well.
+ *
+ * If false, a fresh handle is set up for every request. */
+void pubnub_set_keepalive(struct pubnub *p, bool keepalive);
+
+/* Select whether requests use HTTP/2 where the origin supports it.
+ *
+ * If true, the requests of the context (the subscribe as well as
+ * the publishes, history and here_now calls running alongside it) are
+ * multiplexed as HTTP/2 streams over a single connection to the
+ * origin, instead of each running on a connection of its own; a new
+ * request rather waits for that connection to come up than opens
+ * another one.  HTTP/2 is negotiated through TLS, so this needs
+ * an https:// origin and libcurl built with nghttp2; the requests
+ * fall back to HTTP/1.1 otherwise.
+ *
+ * If false (DEFAULT), HTTP/1.1 is used.  The setting takes effect
+ * with the next request. */
+void pubnub_set_http2(struct pubnub *p, bool http2);
+
+/* Like pubnub_set_http2(), for all the contexts in @pool, which then
+ * share the connection; tens of thousands of contexts can run over
+ * just a few sockets this way.  Contexts that have HTTP/2 set on
+ * their own use it regardless of this setting. */
+void pubnub_pool_set_http2(struct pubnub_pool *pool, bool http2);
+
+/* Resolve the origin host in the background and use the result for
+ * the requests of the context from now on, so that the event loop
+ * does not block on DNS (see also pubnub_set_nosignal()).  The resolved
+ * address is cached process-wide for a few minutes and shared by all
+ * contexts that called pubnub_prewarm(); when it expires, the old
+ * address stays in use until it has been resolved again.  Until the
+ * first resolution finishes, libcurl resolves the name as usual.
+ *
+ * If @connect is true, a connection to the origin is opened right
+ * away (using a time request on the side) so that the first real
+ * call can reuse it; this needs keepalive (see pubnub_set_keepalive()).
+ *
+ * On Windows, the name is not resolved in the background (yet) and
+ * only @connect has any effect. */
+void pubnub_prewarm(struct pubnub *p, bool connect);
+
+/* Select whether HTTP responses are parsed as they arrive.
+ *
+ * If false (DEFAULT), the whole response is collected first and then
+ * parsed at once when the transfer completes.  If true, each chunk of
+ * data is fed to the JSON parser as soon as it is received, so parsing
+ * overlaps with the network transfer and the raw response text is never
+ * kept in memory as a whole; this pays off with large responses like
+ * a subscribe catching up on many messages.
+ *
+ * The setting takes effect with the next request. */
+void pubnub_set_incremental_parse(struct pubnub *p, bool incremental);
+
+/* Select whether responses may come compressed.
+ *
+ * If true, the requests advertise all the content encodings libcurl
+ * supports (typically gzip and deflate) and compressed responses are
+ * decoded on the fly as they arrive, before they reach the parser;
+ * with pubnub_set_incremental_parse(), the decoded chunks go straight
+ * to the parser.  This cuts the traffic of subscribes catching up and
+ * of history several times over, at some CPU cost.  Response limits
+ * apply to the decoded size.
+ *
+ * If false (DEFAULT), responses are transferred as they are.  The
+ * setting takes effect with the next request and needs libcurl built
+ * with zlib; it does nothing otherwise. */
+void pubnub_set_compression(struct pubnub *p, bool compress);
+
+/* Limit the size of responses to @max_size bytes; a request whose
+ * response is any longer is aborted and fails with
+ * PNR_RESPONSE_TOO_LARGE.  0 means no limit (the DEFAULT).
+ *
+ * A context holds a response buffer only while a response is arriving;
+ * afterwards, the buffer goes to a pool shared by all contexts, unless
+ * it grew over @keep_size bytes, in which case it is freed so that one
+ * large response does not pin the memory.  The DEFAULT @keep_size
+ * is 64 KiB. */
+void pubnub_set_response_limits(struct pubnub *p, size_t max_size, size_t keep_size);
+
+/* Collect the responses of the context in the caller's buffer @buf of
+ * @size bytes instead of growing one from the response buffer pool,
+ * for devices that should not allocate on the way of each message.
+ * A response that does not fit (with a terminating NUL) fails with
+ * PNR_RESPONSE_TOO_LARGE.  The buffer is overwritten by every
+ * request of the context, so it must stay around until the context
+ * is done or the buffer is unset with a NULL @buf (the DEFAULT); set
+ * it while no call is in progress.
+ *
+ * Responses parsed incrementally (see pubnub_set_incremental_parse())
+ * never come to a buffer, and the publishes running alongside (see
+ * pubnub_publish_enqueue()) and relays (see pubnub_relay_init()) keep
+ * using the pool. */
+void pubnub_set_response_buffer(struct pubnub *p, char *buf, size_t size);
+
+/* Have @cb called with @cb_data as soon as the first byte of the body
+ * of a response arrives, with the name of the method ("subscribe",
+ * "publish", ...) the response is for; NULL @cb (the DEFAULT) turns
+ * it off.  An actuator can get ready for the command (wake up a motor
+ * driver, say) while the rest of the response is still on its way and
+ * the message is being parsed.  This covers the calls running
+ * alongside (see pubnub_publish_enqueue()) too.  The callback runs in
+ * the middle of receiving the response, so it may not call any methods
+ * on @p. */
+void pubnub_set_first_byte_cb(struct pubnub *p, pubnub_first_byte_cb cb, void *cb_data);
+
 /* Set PubNub error retry policy regarding error handling.
  *
  * The call may be retried if the error is possibly recoverable
  * and retry is enabled for that error. This is controlled by
  * @retry_mask; if PNR_xxx-th bit is set, the call is retried in case
  * of the PNR_xxx result; this is the case for recoverable errors,
- * specifically PNR_OK, PNR_OCCUPIED and PNR_CANCELLED bits are always
- * ignored (this may be further extended in the future). For example,
+ * specifically PNR_OK, PNR_OCCUPIED, PNR_CANCELLED and PNR_RESPONSE_TOO_LARGE
+ * bits are always ignored (this may be further extended in the future). For example,
  *
  * 	pubnub_error_policy(p, 0, ...);
  * will turn off automatic error retry for all errors,
@@ -274,8 +637,116 @@ void pubnub_set_nosignal(struct pubnub *p, bool nosignal);
  * retry for whatever reason. */
 void pubnub_error_policy(struct pubnub *p, unsigned int retry_mask, bool print);
 
+/* Set the delays of automatic error retries.  The n-th retry of a call
+ * waits for a random time between zero and min(@max_ms, @base_ms * 2^(n-1))
+ * ("full jitter"), so that clients hit by the same failure do not retry
+ * in lockstep.  After @max_attempts retries of a call, the error is
+ * reported as if it was not to be retried; 0 means no limit.
+ *
+ * The DEFAULT is 250ms base, 30s max and no attempts limit. */
+void pubnub_set_retry_backoff(struct pubnub *p, long base_ms, long max_ms, int max_attempts);
+
+/* Set up a circuit breaker: after @threshold consecutive failed requests
+ * (retried or not), the breaker opens and no request is sent for
+ * @cooldown_ms.  Retries and new calls are held back (through the timeout
+ * callback of the frontend) until then, when a single request goes out
+ * to probe the origin; its success closes the breaker, another failure
+ * opens it again.  Calls alongside a subscribe and queued publishes
+ * count alike; they stay queued while the breaker is open, and only one
+ * of them goes out as the probe.
+ *
+ * @threshold of 0 disables the circuit breaker (the DEFAULT). */
+void pubnub_set_circuit_breaker(struct pubnub *p, int threshold, long cooldown_ms);
+
+/* Return true if the circuit breaker is open at the moment. */
+bool pubnub_circuit_open(struct pubnub *p);
+
+/* Batch up the subscribe callbacks: after a subscribe response, the
+ * next subscribe request is held back (through the timeout callback
+ * of the frontend) until @window_ms have passed.  The messages
+ * published meanwhile wait at the PubNub server and come in a single
+ * response, so the callback is called at most once per window, with
+ * larger batches, instead of once per message at low traffic.  A
+ * response of at least @max_msgs messages means we are behind and the
+ * next subscribe goes out right away; 0 means no such limit.  The
+ * latency of a message thus grows by up to @window_ms.
+ *
+ * @window_ms of 0 disables the batching (the DEFAULT). */
+void pubnub_set_subscribe_batching(struct pubnub *p, long window_ms, int max_msgs);
+
+/* Bound the backlog of a slow subscriber: each message handed to the
+ * subscribe callback counts as outstanding until the application
+ * reports it processed by pubnub_subscribe_consumed().  Once @high
+ * messages are outstanding, the next subscribe request is held back
+ * (without any timeout) until the backlog is down to @low again.  The
+ * messages published meanwhile wait at the PubNub server, so overload
+ * shows as a lag of the time token behind the server time instead of
+ * as an event loop stalled by a callback that cannot keep up.
+ *
+ * This is meant for callbacks queueing the messages for processing
+ * elsewhere (e.g. on another thread; see pubnub_submit_call()).  With
+ * a blocking frontend, the subscribe would wait for a
+ * pubnub_subscribe_consumed() that cannot come.
+ *
+ * @high of 0 disables the accounting (the DEFAULT). */
+void pubnub_set_subscribe_backlog(struct pubnub *p, int high, int low);
+
+/* Report @n of the subscribed messages processed, releasing the held
+ * subscribe request once the backlog is down to the low watermark. */
+void pubnub_subscribe_consumed(struct pubnub *p, int n);
+
+/* Return the number of subscribed messages not consumed yet. */
+int pubnub_subscribe_backlog(struct pubnub *p);
+
+/* Drop the subscribe messages identical to (and on the same channel as)
+ * one of the last @window messages received, before they reach the
+ * callback.  A retry after an error, or a reconnect with
+ * pubnub_set_resume_on_reconnect(), may fetch again messages delivered
+ * already; this catches them in constant memory, with no work per
+ * message beyond hashing it.  The catch is that a message repeated by
+ * the publisher within the window is dropped too; include a sequence
+ * number or the like in the messages if that matters.  Messages received
+ * by pubnub_subscribe_raw() are compared by their text rather than their
+ * value, so they do not match the ones received otherwise.
+ *
+ * A window of a few hundred messages is plenty for a single retry;
+ * @window of 0 disables the filter (the DEFAULT). */
+void pubnub_set_subscribe_dedupe(struct pubnub *p, int window);
+
+/* Collect statistics of the requests made through the context (the
+ * DEFAULT is not to).  If @cb is not NULL, it is also called with
+ * the record of each request as it finishes, after the method callback.
+ * Disabling the statistics drops all of them. */
+void pubnub_set_stats(struct pubnub *p, bool enable, pubnub_stats_cb cb, void *cb_data);
+
+/* Copy the statistics collected so far to @stats (all zero if they
+ * are not enabled). */
+void pubnub_get_stats(struct pubnub *p, struct pubnub_stats *stats);
+
+/* Start collecting the statistics from scratch. */
+void pubnub_reset_stats(struct pubnub *p);
+
+/* Route the allocations the context makes for its requests (callback
+ * data, the request arena and the like) through @alloc, e.g. to
+ * a per-thread pool of jemalloc or mimalloc, instead of malloc().
+ * NULL @alloc restores malloc().  Call this before any request is
+ * made through the context.
+ *
+ * Memory handed over to the user (like the subscribe channel list)
+ * is always allocated by malloc(), as are the internals of libcurl
+ * and json-c. */
+void pubnub_set_allocator(struct pubnub *p, const struct pubnub_allocator *alloc, void *alloc_data);
+
 /* Set CA certificate data (PEM format) used for SSL certificate validation
  * (multiple certificates are ok)
+ *
+ * The data is parsed just once for all contexts setting the same
+ * certificates.  (SSL sessions are shared by all contexts as well,
+ * so that reconnects do not need a full TLS handshake; contexts in
+ * a pool share them within the pool.)  A library built with
+ * PUBNUB_NO_CRYPTO has libcurl parse the data, which needs libcurl
+ * 7.77 or newer; with an older one, every call on the context fails
+ * with PNR_NO_CRYPTO.
  */
 void pubnub_set_ssl_cacerts(struct pubnub *p, const char *cacerts, size_t len);
 
@@ -326,6 +797,109 @@ void pubnub_publish(struct pubnub *p, const char *channel,
 		struct json_object *message,
 		long timeout, pubnub_publish_cb cb, void *cb_data);
 
+/* Publish the message already serialized to the @len bytes of JSON
+ * text at @message on @channel, like pubnub_publish().  The text is
+ * sent (or encrypted) as it is, so there is no json_object to build
+ * for it; it is not checked to be valid JSON. */
+void pubnub_publish_raw(struct pubnub *p, const char *channel,
+		const char *message, size_t len,
+		long timeout, pubnub_publish_cb cb, void *cb_data);
+
+/* Queue the @message JSON object for publishing on @channel, without
+ * waiting for the previous publishes to complete.
+ *
+ * Unlike the other API requests, this does not occupy the context:
+ * it may be called any number of times and also while another request
+ * (e.g. a subscribe) is in progress.  The queued messages are sent
+ * in order, up to pubnub_set_publish_concurrency() of them at once,
+ * each on its own connection; @cb is called with @cb_data once each
+ * message is done.  Failed messages are not retried regardless of
+ * the error policy; pubnub_done() cancels the messages still queued,
+ * calling their @cb with PNR_CANCELLED.
+ *
+ * The call never blocks, so this needs an asynchronous frontend like
+ * pubnub_libevent; with pubnub_sync, the queue only makes progress
+ * while some other request is being waited for. */
+void pubnub_publish_enqueue(struct pubnub *p, const char *channel,
+		struct json_object *message,
+		long timeout, pubnub_publish_cb cb, void *cb_data);
+
+/* Publish @n messages from @messages[] on @channel like a series of
+ * pubnub_publish_enqueue() calls, but with a single @cb call once all
+ * of them are done, reporting the result of each message.
+ *
+ * The PubNub publish API carries a single message per request, so the
+ * messages still go out one request each; they share the publish queue
+ * (and its concurrency limit and kept-alive connections) with
+ * pubnub_publish_enqueue().  The @messages objects are not referenced
+ * after the call returns.  @cb may be NULL if the results are not
+ * interesting; there is no frontend default for it. */
+void pubnub_publish_batch(struct pubnub *p, const char *channel,
+		struct json_object *messages[], int n,
+		long timeout, pubnub_publish_batch_cb cb, void *cb_data);
+
+/* Prepare the context for pubnub_publish_submit().  Call this on the
+ * thread driving the context, before any other thread submits.  It
+ * registers a wakeup file descriptor with the frontend (so it needs
+ * one watching sockets, like pubnub_libevent).  Returns false if that
+ * cannot be done (e.g. on Windows, which is not supported yet). */
+bool pubnub_submit_init(struct pubnub *p);
+
+/* Queue the @message JSON object for publishing on @channel from any
+ * thread, without locking; it is then sent just like with
+ * pubnub_publish_enqueue() once the thread driving the context gets
+ * to it, and @cb is called on that thread.
+ *
+ * The message is serialized right away, so @message may be reused by
+ * the caller after the call (but must not be shared with other threads
+ * during it).  pubnub_done() cancels the messages still queued, so
+ * all submitting threads have to be finished by then. */
+void pubnub_publish_submit(struct pubnub *p, const char *channel,
+		struct json_object *message,
+		long timeout, pubnub_publish_cb cb, void *cb_data);
+
+/* Have @fn called with @data on the thread driving the context, from
+ * any thread; just like messages of pubnub_publish_submit() (and in
+ * order with them).  This is the way to get other calls issued from
+ * other threads.  For calls still queued at pubnub_done(), @drop is
+ * called with @data instead (on the thread calling pubnub_done()), so
+ * that @data can be released; @drop may be NULL. */
+void pubnub_submit_call(struct pubnub *p, void (*fn)(struct pubnub *p, void *data),
+		void (*drop)(void *data), void *data);
+
+/* Set how many messages queued by pubnub_publish_enqueue() may be
+ * in flight at once. The default is 4. */
+void pubnub_set_publish_concurrency(struct pubnub *p, int max_inflight);
+
+/* Limit the queued publishes to @rate messages per second on average,
+ * with bursts of up to @burst messages (a token bucket); the messages
+ * over the limit wait in the queue, in order, and go out as the bucket
+ * refills.  A 429 (Too Many Requests) response to a queued publish
+ * empties the bucket, so that a throttling origin is not hammered
+ * further.  @rate of 0 means no limit (the DEFAULT).
+ *
+ * The limit applies to the messages of pubnub_publish_enqueue(),
+ * pubnub_publish_submit() and pubnub_publish_batch(); other requests
+ * queued behind them (see pubnub_set_publish_concurrency()) wait their
+ * turn. */
+void pubnub_set_publish_rate(struct pubnub *p, double rate, int burst);
+
+/* Return the number of queued requests not sent yet. */
+int pubnub_publish_queue_depth(struct pubnub *p);
+
+/* Call @cb with @high true as soon as @high requests are waiting in the
+ * queue, so that the producers can slow down, and with @high false once
+ * the queue is down to @low again.  A NULL @cb (the DEFAULT) turns the
+ * notifications off. */
+void pubnub_set_publish_watermark(struct pubnub *p, int high, int low,
+		pubnub_watermark_cb cb, void *cb_data);
+
+/* Shed the load past @max_depth waiting requests: a message given to
+ * pubnub_publish_enqueue() (or pubnub_publish_submit()) while the queue
+ * is that long fails right away with PNR_OCCUPIED instead of piling
+ * up.  0 means no limit (the DEFAULT). */
+void pubnub_set_publish_queue_limit(struct pubnub *p, int max_depth);
+
 /* Subscribe to @channel, in addition to the currently subscribed channels.
  *
  * The response will be a JSON array with one received message per item.
@@ -348,10 +922,100 @@ void pubnub_subscribe(struct pubnub *p, const char *channel,
 		long timeout, pubnub_subscribe_cb cb, void *cb_data);
 
 /* Subscribe to a set of @channels (in addition to already subscribed
- * channels) all at once. */
+ * channels) all at once.
+ *
+ * While the join or leave of an earlier call is still in progress,
+ * subscribe and unsubscribe calls are queued up: the changes are
+ * carried out by a single join and a single leave once it finishes,
+ * followed by one subscribe.  Only the latest callback of each kind
+ * is kept; a replaced callback is invoked with PNR_CANCELLED. */
 void pubnub_subscribe_multi(struct pubnub *p, const char *channels[], int channels_n,
 		long timeout, pubnub_subscribe_cb cb, void *cb_data);
 
+/* Like pubnub_subscribe_multi(), but the callback gets channels[]
+ * owned by the library instead of dynamically allocated copies; the
+ * names are not copied per message (if only a single channel is
+ * subscribed, all the items point to the same string).  Make a copy
+ * of any name you need after the callback returns.  @cb is compulsory
+ * here. */
+void pubnub_subscribe_const(struct pubnub *p, const char *channels[], int channels_n,
+		long timeout, pubnub_subscribe_const_cb cb, void *cb_data);
+
+/* Like pubnub_subscribe_multi(), but deliver the received messages as
+ * slices of the raw response text instead of building JSON objects;
+ * this saves a lot of work if you just pass the messages on as they
+ * are.  Use pubnub_raw_msg_parse() to get a JSON object of a message
+ * when you need one.  @cb is compulsory here.
+ *
+ * If a cipher key is set, the messages are decrypted; this does
+ * require building JSON objects of the encrypted messages. */
+void pubnub_subscribe_raw(struct pubnub *p, const char *channels[], int channels_n,
+		long timeout, pubnub_subscribe_raw_cb cb, void *cb_data);
+
+/* Parse the raw message @msg, returning a new JSON object reference
+ * or NULL if the message is not valid JSON. */
+struct json_object *pubnub_raw_msg_parse(const struct pubnub_raw_msg *msg);
+
+/* Route the messages received on the channels matching @pattern to
+ * @cb instead of the subscribe callback.  @pattern is a channel name,
+ * or a prefix followed by "*" matching all the channels starting with
+ * it ("orders.*" matches "orders.eu.1"); "*" alone matches everything.
+ * An exact name wins over the prefixes and a longer prefix over
+ * a shorter one.  The lookup takes a hash table probe per distinct
+ * prefix length, however many patterns there are.
+ *
+ * The handlers are called one message at a time, in order, right
+ * before the subscribe callback, which then gets the batch of the
+ * other messages (possibly empty); @msg is valid only during the
+ * call.  Do not subscribe or unsubscribe from a handler, leave that to
+ * the subscribe callback.  pubnub_subscribe_raw() does not route its
+ * messages.
+ *
+ * Registering @pattern again replaces its handler; a NULL @cb removes
+ * it. */
+void pubnub_on_channel(struct pubnub *p, const char *pattern, pubnub_channel_cb cb, void *cb_data);
+
+/* Relay the messages received by @p to any number of sinks, e.g. the
+ * rooms of a chat gateway.  The relay takes @p over: it subscribes the
+ * channels of its sinks with pubnub_subscribe_raw() and keeps the
+ * subscribe going, so do not subscribe with @p yourself (or publish,
+ * which waits behind the long poll; use a context of its own for that).
+ * Failed subscribes are tried again past the retry policy, after the
+ * backoff of pubnub_set_retry_backoff() growing with each failure in
+ * a row.
+ *
+ * Each batch that comes in is split by channel once, then each sink
+ * is called with the messages on its channel.  The messages are
+ * slices of the response; no sink gets a copy of them, they share the
+ * batch.  A sink may take a reference to the batch to keep the
+ * messages after its callback returns, e.g. to pass them on to another
+ * thread.
+ *
+ * Needs an asynchronous frontend, like pubnub_libevent. */
+struct pubnub_relay *pubnub_relay_init(struct pubnub *p);
+
+/* Stop relaying and deinitialize the relay and its context (see
+ * pubnub_done()).  Batches still referenced stay valid. */
+void pubnub_relay_done(struct pubnub_relay *r);
+
+/* Add a sink calling @cb with @sink_data for the messages on @channel,
+ * subscribing to it if it is new to the relay.  A NULL @channel gets
+ * the messages on all the channels (that other sinks subscribed to).
+ * Do not add or remove sinks from a sink callback. */
+void pubnub_relay_add_sink(struct pubnub_relay *r, const char *channel, pubnub_relay_cb cb, void *sink_data);
+
+/* Remove the sink added with the same arguments, unsubscribing the
+ * channel if that was the last sink on it. */
+void pubnub_relay_remove_sink(struct pubnub_relay *r, const char *channel, pubnub_relay_cb cb, void *sink_data);
+
+/* Return the time token of @batch. */
+const char *pubnub_relay_batch_time_token(const struct pubnub_relay_batch *batch);
+
+/* Take and drop a reference to @batch; it is freed with the last one.
+ * This may be done from any thread. */
+void pubnub_relay_batch_ref(struct pubnub_relay_batch *batch);
+void pubnub_relay_batch_unref(struct pubnub_relay_batch *batch);
+
 /* Reset an ongoing subscription.  If a subscribe request is underway,
  * it is cancelled.  (Callbacks are invoked with the PNR_CANCELLED
  * status.)  Note that no new subscribe is called automatically, call
@@ -426,18 +1090,72 @@ void pubnub_history(struct pubnub *p, const char *channel, int limit,
 void pubnub_history_ex(struct pubnub *p, const char *channel, int limit,
 		long timeout, pubnub_history_cb cb, void *cb_data, int include_token);
 
+/* Fetch all the messages published on @channel with timetokens after
+ * @start up to and including @end, oldest first.  The range is split
+ * into @lanes parts paged through at the same time, so up to @lanes
+ * page requests are in flight at once (within the limit set by
+ * pubnub_set_publish_concurrency()) over the multi handle of the
+ * context, or of its pool.  Encrypted pages are decrypted with the
+ * decrypt workers, if set.
+ *
+ * @cb is called with each page in order, with @response being an array
+ * of objects with the `message` and `timetoken` keys like with
+ * pubnub_history_ex(); the page is valid only until @cb returns.  Pages
+ * of later parts are held back until the earlier parts are through,
+ * at most one page per part, so the range is never kept in memory as
+ * a whole.  At the end, @cb is called once more with PNR_OK and NULL
+ * @response.  An error ends the scan with a @cb call with the failed
+ * result; pubnub_done() ends it with PNR_CANCELLED.
+ *
+ * Like pubnub_publish_enqueue(), this does not occupy the context and
+ * needs an asynchronous frontend; @cb is compulsory. */
+void pubnub_history_scan(struct pubnub *p, const char *channel,
+		const char *start, const char *end, int lanes,
+		long timeout, pubnub_history_cb cb, void *cb_data);
+
 /* List the clients subscribed to @channel. The response will be
  * a JSON object with attributes "occupancy" (number of clients)
  * and "uuids" (array of client UUIDs). */
 void pubnub_here_now(struct pubnub *p, const char *channel,
 		long timeout, pubnub_here_now_cb cb, void *cb_data);
 
+/* Keep the occupants of the channels queried by pubnub_here_now() in
+ * a cache and answer further queries of the same channels right away
+ * from there, until @ttl_ms milliseconds pass since the last here_now
+ * request of the channel; 0 means no cache (the DEFAULT).  The response
+ * from the cache holds just "occupancy" and "uuids".
+ *
+ * In the meantime, the occupants are kept up to date by the presence
+ * events received on the "<channel>-pnpres" channels, if you subscribe
+ * to those (not with pubnub_subscribe_raw(), whose messages are not
+ * parsed).  Without the events, the cache just cuts the polling down
+ * to once per @ttl_ms. */
+void pubnub_set_presence_cache(struct pubnub *p, long ttl_ms);
+
 /* Retrieve the server timestamp (number of microseconds since
  * 1970-01-01), stored as JSON value in the response. You can use
  * this as a sort of "ping" message e.g. to estimate network lag,
  * or if you do not trust the system time. */
 void pubnub_time(struct pubnub *p, long timeout, pubnub_time_cb cb, void *cb_data);
 
+/* Return the current server time in nanoseconds since 1970-01-01,
+ * answered locally from an estimate of the offset (and drift) of the
+ * server clock, or 0 if there is no estimate yet.  It is refined from
+ * every pubnub_time() response and every join, each sample weighted
+ * by its round trip time; the local monotonic clock counts the time in
+ * between, so changes of the system time do not matter.
+ *
+ * With pubnub_set_clock_sync(), pubnub_now() itself keeps the estimate
+ * fresh; otherwise, it never touches the network. */
+long long pubnub_now(struct pubnub *p);
+
+/* Have pubnub_now() send a time request in the background (as a side
+ * request, see pubnub_set_publish_concurrency()) whenever the last
+ * sample is over @refresh_ms milliseconds old.  0 means no such
+ * requests (the DEFAULT).  The first pubnub_now() returns 0 then;
+ * sample pubnub_time() first if you care. */
+void pubnub_set_clock_sync(struct pubnub *p, long refresh_ms);
+
 #ifdef __cplusplus
 }
 #endif
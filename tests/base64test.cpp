@@ -0,0 +1,76 @@
+#include "gtest.h"
+
+#include <openssl/evp.h>
+
+namespace Test {
+
+#include "../libpubnub/base64.c"
+
+static std::string
+encode(const std::string &s)
+{
+	char buf[PUBNUB_BASE64_ENCODED_LEN(s.size()) + 1];
+	size_t len = pubnub_base64_encode(buf, (const unsigned char *) s.data(), s.size());
+	EXPECT_EQ(strlen(buf), len);
+	return std::string(buf, len);
+}
+
+static long
+decode(const char *s, std::string &out)
+{
+	unsigned char buf[PUBNUB_BASE64_DECODED_MAX(strlen(s))];
+	long len = pubnub_base64_decode(buf, s, strlen(s));
+	if (len >= 0)
+		out.assign((char *) buf, len);
+	return len;
+}
+
+TEST(Base64Test, Vectors) {
+	/* RFC 4648 */
+	EXPECT_EQ("", encode(""));
+	EXPECT_EQ("Zg==", encode("f"));
+	EXPECT_EQ("Zm8=", encode("fo"));
+	EXPECT_EQ("Zm9v", encode("foo"));
+	EXPECT_EQ("Zm9vYg==", encode("foob"));
+	EXPECT_EQ("Zm9vYmE=", encode("fooba"));
+	EXPECT_EQ("Zm9vYmFy", encode("foobar"));
+
+	std::string out;
+	EXPECT_EQ(6, decode("Zm9vYmFy", out));
+	EXPECT_EQ("foobar", out);
+	EXPECT_EQ(4, decode("Zm9vYg==", out));
+	EXPECT_EQ("foob", out);
+	/* Missing padding is fine. */
+	EXPECT_EQ(5, decode("Zm9vYmE", out));
+	EXPECT_EQ("fooba", out);
+}
+
+TEST(Base64Test, Invalid) {
+	std::string out;
+	EXPECT_EQ(-1, decode("Zm9vY", out));
+	EXPECT_EQ(-1, decode("Zm9v\nYmFy", out));
+	EXPECT_EQ(-1, decode("Zm=vYmFy", out));
+	/* Long enough for the vector paths. */
+	EXPECT_EQ(-1, decode("Zm9vYmFyZm9vYmFyZm9vYmFyZm9vYmFyZm9vYmFyZm9vYmFyZm9vYmFyZm9vYmFyZm9v*mFy", out));
+	EXPECT_EQ(-1, decode("Zm9vYmFyZm9vYmFyZm9vYmFy\xc3\xa9m9vYmFyZm9vYmFyZm9vYmFyZm9vYmFyZm9vYmFyZm9v", out));
+}
+
+TEST(Base64Test, RoundTrip) {
+	srand(1);
+	for (int len = 0; len < 300; len++) {
+		std::string s;
+		for (int i = 0; i < len; i++)
+			s += (char) rand();
+
+		std::string enc = encode(s);
+		unsigned char ref[PUBNUB_BASE64_ENCODED_LEN(len) + 1];
+		EVP_EncodeBlock(ref, (const unsigned char *) s.data(), len);
+		EXPECT_STREQ((char *) ref, enc.c_str());
+
+		std::string dec;
+		EXPECT_EQ(len, decode(enc.c_str(), dec));
+		EXPECT_TRUE(s == dec);
+	}
+}
+
+}
@@ -0,0 +1,255 @@
+/* Microbenchmarks of the libpubnub hot paths.
+ *
+ * The library sources are included directly so that the static helpers
+ * can be timed in isolation, without any network communication.
+ * Pass benchmark names on the commandline to run only some of them. */
+
+#include "../../libpubnub/pubnub.c"
+#include "../../libpubnub/crypto.c"
+#include "../../libpubnub/base64.c"
+
+#include <time.h>
+
+#define BENCH_CHANNELS 64
+#define BENCH_MSGS 100
+#define BENCH_CIPHERTEXTS 16
+
+static void bench_nop_socket(struct pubnub *p, void *ctx_data, int fd, int mode,
+		void (*cb)(struct pubnub *p, int fd, int mode, void *cb_data), void *cb_data) {}
+static void bench_nop_rem_socket(struct pubnub *p, void *ctx_data, int fd) {}
+static void bench_nop_timeout(struct pubnub *p, void *ctx_data, const struct timespec *ts,
+		void (*cb)(struct pubnub *p, void *cb_data), void *cb_data) {}
+static void bench_nop(struct pubnub *p, void *ctx_data) {}
+
+static const struct pubnub_callbacks bench_callbacks = {
+	SFINIT(.add_socket, bench_nop_socket),
+	SFINIT(.rem_socket, bench_nop_rem_socket),
+	SFINIT(.timeout, bench_nop_timeout),
+	SFINIT(.wait, bench_nop),
+	SFINIT(.stop_wait, bench_nop),
+	SFINIT(.done, bench_nop),
+};
+
+static struct pubnub *p;
+static struct channelset bench_cs;
+static const char *bench_names[BENCH_CHANNELS];
+static char *bench_message;
+static char *bench_sub_response;
+static char *bench_channelset;
+static struct json_object *bench_ciphertexts;
+static struct pubnub_cipher *bench_cipher;
+/* Sink defeating dead code elimination. */
+static volatile long bench_sink;
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void
+bench_http_setup(long n)
+{
+	const char *urlelems[] = { "publish", p->publish_key, p->subscribe_key,
+		"0", "bench_channel", "0", bench_message, NULL };
+	const char *qparamelems[] = { "uuid", p->uuid, NULL };
+	for (long i = 0; i < n; i++)
+		pubnub_http_setup(p, urlelems, qparamelems, 5);
+	bench_sink += p->url->bpos;
+}
+
+static void
+bench_channelset_add_rm(long n)
+{
+	struct channelset cs = { NULL, 0 };
+	for (long i = 0; i < n; i++) {
+		channelset_add(&cs, &bench_cs);
+		channelset_rm(&cs, &bench_cs);
+	}
+	channelset_done(&cs);
+}
+
+static void
+bench_channelset_printbuf(long n)
+{
+	for (long i = 0; i < n; i++) {
+		struct printbuf *pb = channelset_printbuf(&bench_cs);
+		bench_sink += pb->bpos;
+		printbuf_free(pb);
+	}
+}
+
+static void
+bench_channelset_str(long n)
+{
+	struct channelset cs = { NULL, 0 };
+	channelset_add(&cs, &bench_cs);
+	for (long i = 0; i < n; i++) {
+		const char *enc;
+		/* Membership change forces a rebuild. */
+		cs.str_valid = false;
+		bench_sink += (long) channelset_str(&cs, &enc);
+	}
+	channelset_done(&cs);
+}
+
+static void
+bench_signature(long n)
+{
+	char sig[33];
+	for (long i = 0; i < n; i++)
+		pubnub_signature_buf(p, "bench_channel", bench_message, sig);
+	bench_sink += sig[0];
+}
+
+static void
+bench_encrypt(long n)
+{
+	for (long i = 0; i < n; i++)
+		json_object_put(pubnub_encrypt("enigma", bench_message));
+}
+
+static void
+bench_cipher_encrypt(long n)
+{
+	for (long i = 0; i < n; i++)
+		json_object_put(pubnub_cipher_encrypt(bench_cipher, bench_message));
+}
+
+static void
+bench_decrypt_array(long n)
+{
+	for (long i = 0; i < n; i++)
+		json_object_put(pubnub_decrypt_array("enigma", bench_ciphertexts));
+}
+
+static void
+bench_cipher_decrypt_array(long n)
+{
+	for (long i = 0; i < n; i++)
+		json_object_put(pubnub_cipher_decrypt_array(bench_cipher, bench_ciphertexts));
+}
+
+static void
+bench_subscribe_cb(struct pubnub *p, enum pubnub_res result, char **channels, struct json_object *msg, void *ctx_data, void *call_data)
+{
+	for (int i = 0; channels[i]; i++)
+		free(channels[i]);
+	free(channels);
+	bench_sink += json_object_array_length(msg);
+}
+
+static void
+bench_subscribe_parse(long n)
+{
+	for (long i = 0; i < n; i++) {
+		struct json_object *response = json_tokener_parse(bench_sub_response);
+		struct pubnub_subscribe_cb_http_data *cb_http_data = (struct pubnub_subscribe_cb_http_data *)pubnub_arena_alloc(p, sizeof(*cb_http_data));
+		cb_http_data->channelset = pubnub_arena_strdup(p, bench_channelset);
+		cb_http_data->cb = bench_subscribe_cb;
+		cb_http_data->call_data = NULL;
+		cb_http_data->cb_internal = false;
+		pubnub_subscribe_http_cb(p, PNR_OK, response, NULL, cb_http_data);
+		json_object_put(response);
+	}
+}
+
+
+static void
+bench_setup(void)
+{
+	p = pubnub_init("demo", "demo", &bench_callbacks, NULL);
+	pubnub_set_secret_key(p, "sec-demo");
+
+	for (int i = 0; i < BENCH_CHANNELS; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "bench_channel_%d", i);
+		bench_names[i] = strdup(name);
+	}
+	bench_cs.set = bench_names;
+	bench_cs.n = BENCH_CHANNELS;
+	struct printbuf *cpb = channelset_printbuf(&bench_cs);
+	bench_channelset = strdup(cpb->buf);
+	printbuf_free(cpb);
+
+	bench_message = strdup("{\"text\":\"\\\"Hello, world!\\\" she said.\",\"num\":42,\"list\":[1,2,3]}");
+
+	/* Subscribe response of BENCH_MSGS messages spread over
+	 * the channels. */
+	struct printbuf *pb = printbuf_new();
+	sprintbuf(pb, "[[");
+	for (int i = 0; i < BENCH_MSGS; i++)
+		sprintbuf(pb, "%s%s", i ? "," : "", bench_message);
+	sprintbuf(pb, "],\"13983273523470477\",\"");
+	for (int i = 0; i < BENCH_MSGS; i++)
+		sprintbuf(pb, "%s%s", i ? "," : "", bench_names[i % BENCH_CHANNELS]);
+	sprintbuf(pb, "\"]");
+	bench_sub_response = strdup(pb->buf);
+	printbuf_free(pb);
+
+	bench_cipher = pubnub_cipher_new("enigma");
+	bench_ciphertexts = json_object_new_array();
+	for (int i = 0; i < BENCH_CIPHERTEXTS; i++)
+		json_object_array_add(bench_ciphertexts, pubnub_cipher_encrypt(bench_cipher, bench_message));
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(long n);
+} benches[] = {
+	{ "http_setup", bench_http_setup },
+	{ "channelset_add_rm", bench_channelset_add_rm },
+	{ "channelset_printbuf", bench_channelset_printbuf },
+	{ "channelset_str", bench_channelset_str },
+	{ "signature", bench_signature },
+	{ "encrypt", bench_encrypt },
+	{ "cipher_encrypt", bench_cipher_encrypt },
+	{ "decrypt_array", bench_decrypt_array },
+	{ "cipher_decrypt_array", bench_cipher_decrypt_array },
+	{ "subscribe_parse", bench_subscribe_parse },
+};
+
+static bool
+bench_selected(const char *name, int argc, char *argv[])
+{
+	if (argc < 2)
+		return true;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], name))
+			return true;
+	}
+	return false;
+}
+
+int
+main(int argc, char *argv[])
+{
+	bench_setup();
+
+	printf("%-24s %12s %12s\n", "benchmark", "iterations", "ns/op");
+	for (unsigned b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+		if (!bench_selected(benches[b].name, argc, argv))
+			continue;
+		/* Double the iteration count until a run takes long
+		 * enough to be measured reliably. */
+		long n = 1;
+		double t;
+		for (;;) {
+			double t0 = bench_now();
+			benches[b].fn(n);
+			t = bench_now() - t0;
+			if (t >= 0.5 || n >= 1L << 30)
+				break;
+			n *= 2;
+		}
+		printf("%-24s %12ld %12.1f\n", benches[b].name, n, t * 1e9 / n);
+	}
+
+	pubnub_done(p);
+	pubnub_cipher_free(bench_cipher);
+	json_object_put(bench_ciphertexts);
+	return 0;
+}
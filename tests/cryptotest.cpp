@@ -41,6 +41,72 @@ TEST_F(CryptoTest, ArrayTest) {
 	EXPECT_STREQ("[ ]", json_object_get_string(json_object_array_get_idx(newa, 0)));
 }
 
+TEST_F(CryptoTest, CipherReuse) {
+	struct pubnub_cipher *c = pubnub_cipher_new("enigma");
+	ASSERT_TRUE(c != NULL);
+	for (int i = 0; i < 2; i++) {
+		msg = pubnub_cipher_encrypt(c, "[]");
+		ASSERT_TRUE(msg);
+		EXPECT_STREQ("Ns4TB41JjT2NCXaGLWSPAQ==", json_object_get_string(msg));
+		json_object_put(msg);
+	}
+
+	msg = json_object_new_array();
+	json_object_array_add(msg, json_object_new_string("Ns4TB41JjT2NCXaGLWSPAQ=="));
+	json_object_array_add(msg, json_object_new_string("f42pIQcWZ9zbTbH8cyLwByD/GsviOE0vcREIEVPARR0="));
+	json_object_array_add(msg, json_object_new_string("IDjZE9BHSjcX67RddfCYYg=="));
+	struct json_object *newa = pubnub_cipher_decrypt_array(c, msg);
+	ASSERT_TRUE(newa);
+	EXPECT_EQ(3, json_object_array_length(newa));
+	EXPECT_STREQ("Pubnub Messaging API 1", json_object_get_string(json_object_array_get_idx(newa, 1)));
+	EXPECT_STREQ("{ }", json_object_get_string(json_object_array_get_idx(newa, 2)));
+	json_object_put(newa);
+
+	/* A broken message fails the whole batch, but not the cipher. */
+	json_object_array_add(msg, json_object_new_string("garbage"));
+	EXPECT_TRUE(pubnub_cipher_decrypt_array(c, msg) == NULL);
+	json_object_put(msg);
+	msg = pubnub_cipher_encrypt(c, "{}");
+	EXPECT_STREQ("IDjZE9BHSjcX67RddfCYYg==", json_object_get_string(msg));
+	json_object_put(msg);
+	pubnub_cipher_free(c);
+}
+
+TEST_F(CryptoTest, Workers) {
+	struct pubnub_cipher *c = pubnub_cipher_new("enigma");
+	struct pubnub_workers *w = pubnub_workers_init(3);
+	ASSERT_TRUE(w != NULL);
+
+	msg = json_object_new_array();
+	for (int i = 0; i < 50; i++) {
+		char str[32];
+		sprintf(str, "[%d]", i);
+		json_object_array_add(msg, pubnub_cipher_encrypt(c, str));
+	}
+	for (int round = 0; round < 3; round++) {
+		struct json_object *newa = pubnub_cipher_decrypt_array_mt(c, w, 10, msg);
+		ASSERT_TRUE(newa);
+		ASSERT_EQ(50, json_object_array_length(newa));
+		for (int i = 0; i < 50; i++) {
+			struct json_object *m = json_object_array_get_idx(newa, i);
+			EXPECT_EQ(i, json_object_get_int(json_object_array_get_idx(m, 0)));
+		}
+		json_object_put(newa);
+	}
+
+	/* A different key is picked up by the workers. */
+	struct pubnub_cipher *c2 = pubnub_cipher_new("other");
+	EXPECT_TRUE(pubnub_cipher_decrypt_array_mt(c2, w, 10, msg) == NULL);
+	pubnub_cipher_free(c2);
+
+	json_object_array_add(msg, json_object_new_int(1));
+	EXPECT_TRUE(pubnub_cipher_decrypt_array_mt(c, w, 10, msg) == NULL);
+	json_object_put(msg);
+
+	pubnub_workers_done(w);
+	pubnub_cipher_free(c);
+}
+
 class SignatureTest : public ::testing::Test
 {
 protected:
@@ -66,6 +132,17 @@ TEST_F(SignatureTest, Sample1) {
 	EXPECT_STREQ(signature, "7d40b6468716629f53828b2054c51198");
 }
 
+TEST_F(SignatureTest, Cached) {
+	char buf[33];
+	p.sig_prefix = NULL;
+	pubnub_signature_buf(&p, "enigma", "{message:\"Message\"}", buf);
+	EXPECT_STREQ("7d40b6468716629f53828b2054c51198", buf);
+	EXPECT_TRUE(p.sig_prefix != NULL);
+	pubnub_signature_buf(&p, "enigma", "{message:\"Message\"}", buf);
+	EXPECT_STREQ("7d40b6468716629f53828b2054c51198", buf);
+	free(p.sig_prefix);
+}
+
 TEST_F(SignatureTest, Sample2) {
 	p.secret_key[0] = 0;
 	signature = pubnub_signature(&p, "enigma", "{number1:10, number2: 20}");
@@ -0,0 +1,205 @@
+
+#include "gtest.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+namespace Test {
+
+#include "../libpubnub/pubnub.h"
+#include "../libpubnub/pubnub-priv.h"
+
+#undef PUBNUB_API
+#define PUBNUB_API
+
+#include "../libpubnub/pubnub-epoll.c"
+
+class EpollTest : public ::testing::Test
+{
+public:
+	pubnub *p;
+	struct pubnub_epoll *ep;
+	int sv[2];
+
+	static int sockCalled, sockMode;
+	static int timerCalled;
+
+	static void sockCb(struct pubnub *p, int fd, int mode, void *cb_data)
+	{
+		sockCalled++;
+		sockMode = mode;
+		char c;
+		if (mode & 1)
+			read(fd, &c, 1);
+	}
+
+	static void timerCb(struct pubnub *p, void *cb_data)
+	{
+		timerCalled++;
+	}
+
+	virtual void SetUp() {
+		ep = pubnub_epoll_init();
+		p = pubnub_init("demo", "demo", &pubnub_epoll_callbacks, ep);
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+		sockCalled = sockMode = timerCalled = 0;
+	}
+	virtual void TearDown() {
+		pubnub_done(p);
+		pubnub_epoll_free(ep);
+		close(sv[0]);
+		close(sv[1]);
+	}
+};
+
+int EpollTest::sockCalled, EpollTest::sockMode, EpollTest::timerCalled;
+
+TEST_F(EpollTest, ReadEvent) {
+	ASSERT_TRUE(ep != NULL);
+	pubnub_epoll_add_socket(p, ep, sv[0], 1, sockCb, NULL);
+	EXPECT_EQ(1, ep->n_socks);
+	EXPECT_EQ(0, pubnub_epoll_run_once(ep, 0));
+	EXPECT_EQ(0, sockCalled);
+
+	write(sv[1], "x", 1);
+	EXPECT_EQ(1, pubnub_epoll_run_once(ep, 1000));
+	EXPECT_EQ(1, sockCalled);
+	EXPECT_EQ(1, sockMode);
+
+	pubnub_epoll_rem_socket(p, ep, sv[0]);
+	EXPECT_EQ(0, ep->n_socks);
+	write(sv[1], "x", 1);
+	EXPECT_EQ(0, pubnub_epoll_run_once(ep, 0));
+	EXPECT_EQ(1, sockCalled);
+}
+
+TEST_F(EpollTest, ModeChange) {
+	pubnub_epoll_add_socket(p, ep, sv[0], 1, sockCb, NULL);
+	pubnub_epoll_rem_socket(p, ep, sv[0]);
+	pubnub_epoll_add_socket(p, ep, sv[0], 2, sockCb, NULL);
+	EXPECT_EQ(1, pubnub_epoll_run_once(ep, 1000));
+	EXPECT_EQ(2, sockMode);
+}
+
+TEST_F(EpollTest, Timer) {
+	struct timespec ts = { 0, 1000000 };
+	pubnub_epoll_timeout(p, ep, &ts, timerCb, NULL);
+	EXPECT_EQ(1, ep->n_timers);
+	EXPECT_GE(1, pubnub_epoll_next_timeout(ep));
+	pubnub_epoll_run(ep);
+	EXPECT_EQ(1, timerCalled);
+	EXPECT_EQ(0, ep->n_timers);
+	EXPECT_EQ(-1, pubnub_epoll_next_timeout(ep));
+}
+
+TEST_F(EpollTest, StopWait) {
+	struct timespec ts = { 10, 0 };
+	pubnub_epoll_timeout(p, ep, &ts, timerCb, NULL);
+	pubnub_epoll_stop_wait(p, ep);
+	EXPECT_EQ(0, ep->n_timers);
+}
+
+TEST_F(EpollTest, Done) {
+	/* Another context sharing the same loop. */
+	struct pubnub *p2 = pubnub_init("demo", "demo", &pubnub_epoll_callbacks, ep);
+	struct timespec ts = { 10, 0 };
+	pubnub_epoll_add_socket(p2, ep, sv[0], 1, sockCb, NULL);
+	pubnub_epoll_timeout(p2, ep, &ts, timerCb, NULL);
+	pubnub_epoll_timeout(p, ep, &ts, timerCb, NULL);
+	ASSERT_TRUE(p2->cb_priv != NULL);
+	EXPECT_EQ(1, ((struct pubnub_epoll_ctx *)p2->cb_priv)->n_socks);
+	pubnub_done(p2);
+	EXPECT_EQ(0, ep->n_socks);
+	EXPECT_EQ(1, ep->n_timers);
+	ASSERT_TRUE(p->cb_priv != NULL);
+	EXPECT_TRUE(((struct pubnub_epoll_ctx *)p->cb_priv)->timer.pprev != NULL);
+
+	/* The state of a context goes with its last socket and timer. */
+	pubnub_epoll_add_socket(p, ep, sv[0], 1, sockCb, NULL);
+	pubnub_epoll_stop_wait(p, ep);
+	EXPECT_EQ(1, ((struct pubnub_epoll_ctx *)p->cb_priv)->n_socks);
+	pubnub_epoll_rem_socket(p, ep, sv[0]);
+	EXPECT_TRUE(p->cb_priv == NULL);
+}
+
+TEST_F(EpollTest, PoolDone) {
+	/* Pool members never get the done callback; their timer has to
+	 * go away when disarmed. */
+	struct pubnub_pool *pool = pubnub_pool_init(&pubnub_epoll_callbacks, ep);
+	struct pubnub *m1 = pubnub_init_pooled(pool, "demo", "demo");
+	struct pubnub *m2 = pubnub_init_pooled(pool, "demo", "demo");
+	struct timespec ts = { 10, 0 };
+	pool->timer_p = m2;
+	pubnub_epoll_timeout(m2, ep, &ts, timerCb, NULL);
+	EXPECT_EQ(1, ep->n_timers);
+	pubnub_done(m2);
+	EXPECT_EQ(0, ep->n_timers);
+	EXPECT_TRUE(m1->cb_priv == NULL);
+	pubnub_pool_done(pool);
+
+	pubnub_epoll_timeout(p, ep, &ts, timerCb, NULL);
+	ts.tv_sec = 0;
+	pubnub_epoll_timeout(p, ep, &ts, NULL, NULL);
+	EXPECT_TRUE(p->cb_priv == NULL);
+}
+
+static std::vector<int> wheelFired;
+
+static void
+wheelCb(struct pubnub *p, void *cb_data)
+{
+	wheelFired.push_back((int)(long) cb_data);
+}
+
+TEST_F(EpollTest, TimerWheel) {
+	/* Timers on each level of the wheel and one beyond it. */
+	long long delays[] = { 10, 100, 5000, 400000, 20000000 };
+	const int n = sizeof(delays) / sizeof(delays[0]);
+	struct pubnub *ps[n];
+	long long base = ep->wheel_now;
+	wheelFired.clear();
+	for (int i = 0; i < n; i++) {
+		ps[i] = pubnub_init("demo", "demo", &pubnub_epoll_callbacks, ep);
+		pubnub_epoll_timer_set(ep, ps[i], base + delays[i], wheelCb, (void *)(long) i);
+	}
+	EXPECT_EQ(n, ep->n_timers);
+	EXPECT_EQ(base + 10, pubnub_epoll_wheel_due(ep));
+
+	/* Re-arming moves the timer. */
+	delays[0] = 20;
+	pubnub_epoll_timer_set(ep, ps[0], base + delays[0], wheelCb, (void *) 0L);
+	EXPECT_EQ(n, ep->n_timers);
+	EXPECT_EQ(base + 20, pubnub_epoll_wheel_due(ep));
+
+	for (int i = 0; i < 3; i++) {
+		pubnub_epoll_wheel_run(ep, base + delays[i] - 1);
+		EXPECT_EQ(i, (int) wheelFired.size());
+		pubnub_epoll_wheel_run(ep, base + delays[i]);
+		ASSERT_EQ(i + 1, (int) wheelFired.size());
+		EXPECT_EQ(i, wheelFired[i]);
+		EXPECT_EQ(n - i - 1, ep->n_timers);
+	}
+
+	/* Cancelling is just as cheap. */
+	pubnub_epoll_stop_wait(ps[3], ep);
+	EXPECT_EQ(1, ep->n_timers);
+	pubnub_epoll_wheel_run(ep, base + delays[4] - 1);
+	EXPECT_EQ(3, (int) wheelFired.size());
+	pubnub_epoll_wheel_run(ep, base + delays[4]);
+	ASSERT_EQ(4, (int) wheelFired.size());
+	EXPECT_EQ(4, wheelFired[3]);
+	EXPECT_EQ(0, ep->n_timers);
+	EXPECT_EQ(-1, pubnub_epoll_next_timeout(ep));
+	for (int i = 0; i < n; i++)
+		pubnub_done(ps[i]);
+}
+
+}
@@ -0,0 +1,158 @@
+/* End-to-end load harness: a local HTTP server replays canned subscribe
+ * batches to a number of contexts sharing one libevent loop, and the
+ * message throughput and delivery latency are reported at the end.
+ *
+ * Usage: load [-c contexts] [-b batch] [-m messages] [-p port]
+ *
+ * Each message carries the server's send time, so the latency covers
+ * the whole path through libcurl, the response parser and a callback. */
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/buffer.h>
+
+#include <json.h>
+
+#include "pubnub.hpp"
+#include "pubnub-libevent.h"
+
+#define ADDR "127.0.0.1"
+
+static event_base *evbase;
+static int batch = 10;
+static long messages = 100000;
+static long received;
+static long errors;
+static std::vector<double> latencies;
+
+static long long
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+router(struct evhttp_request *r, void *arg)
+{
+	const char *uri = evhttp_request_get_uri(r);
+	struct evbuffer *evb = evbuffer_new();
+	evhttp_add_header(evhttp_request_get_output_headers(r),
+		"Content-Type", "text/javascript");
+	long long t = now_us();
+	if (strstr(uri, "/0/0?") || !strstr(uri, "/subscribe/")) {
+		/* Join, or anything else: just hand out a time token. */
+		evbuffer_add_printf(evb, "[[],\"%lld\"]", t);
+	} else {
+		/* The canned batch, stamped with the send time. */
+		evbuffer_add_printf(evb, "[[");
+		for (int i = 0; i < batch; i++)
+			evbuffer_add_printf(evb, "%s{\"t\":%lld,\"seq\":%d,\"text\":\"\\\"Hello, world!\\\" she said.\"}",
+					i ? "," : "", t, i);
+		evbuffer_add_printf(evb, "],\"%lld\"]", t);
+	}
+	evhttp_send_reply(r, 200, "OK", evb);
+	evbuffer_free(evb);
+}
+
+static void
+subscribed(PubNub &p, enum pubnub_res result, std::vector<std::string> &channels, json_object *response, void *ctx_data, void *call_data)
+{
+	if (result != PNR_OK) {
+		errors++;
+	} else {
+		long long t = now_us();
+		for (int i = 0; i < (int) json_object_array_length(response); i++) {
+			json_object *msg = json_object_array_get_idx(response, i);
+			json_object *sent = json_object_object_get(msg, "t");
+			latencies.push_back((t - json_object_get_int64(sent)) / 1000.0);
+			received++;
+		}
+	}
+	if (received >= messages) {
+		event_base_loopexit(evbase, NULL);
+		return;
+	}
+	p.subscribe(*(std::string *)call_data, -1, subscribed, call_data);
+}
+
+static double
+percentile(double q)
+{
+	if (latencies.empty())
+		return 0;
+	size_t i = (size_t)(q * (latencies.size() - 1));
+	return latencies[i];
+}
+
+int
+main(int argc, char *argv[])
+{
+	int contexts = 16;
+	int port = 4001;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:b:m:p:")) != -1) {
+		switch (opt) {
+			case 'c': contexts = atoi(optarg); break;
+			case 'b': batch = atoi(optarg); break;
+			case 'm': messages = atol(optarg); break;
+			case 'p': port = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-c contexts] [-b batch] [-m messages] [-p port]\n", argv[0]);
+				return 1;
+		}
+	}
+	latencies.reserve(messages + batch * contexts);
+
+	evbase = event_base_new();
+	evhttp *libsrv = evhttp_new(evbase);
+	if (evhttp_bind_socket(libsrv, ADDR, port) < 0) {
+		fprintf(stderr, "cannot bind to %s:%d\n", ADDR, port);
+		return 1;
+	}
+	evhttp_set_gencb(libsrv, router, NULL);
+
+	char origin[64];
+	snprintf(origin, sizeof(origin), "http://" ADDR ":%d/", port);
+	/* All the contexts share one configuration. */
+	struct pubnub_config *config = pubnub_config_new("demo", "demo");
+	pubnub_config_set_origin(config, origin);
+	std::vector<PubNub *> ps;
+	std::vector<std::string> channels;
+	channels.reserve(contexts);
+	for (int i = 0; i < contexts; i++) {
+		char channel[32];
+		snprintf(channel, sizeof(channel), "load_channel_%d", i);
+		channels.push_back(channel);
+		PubNub *p = new PubNub(config, NULL, &pubnub_libevent_callbacks, pubnub_libevent_init(evbase));
+		ps.push_back(p);
+	}
+
+	long long t0 = now_us();
+	for (int i = 0; i < contexts; i++)
+		ps[i]->subscribe(channels[i], -1, subscribed, &channels[i]);
+	event_base_dispatch(evbase);
+	double elapsed = (now_us() - t0) / 1e6;
+
+	std::sort(latencies.begin(), latencies.end());
+	printf("contexts %d, batch %d: %ld messages in %.3f s, %ld errors\n",
+			contexts, batch, received, elapsed, errors);
+	printf("%.0f msgs/s, latency p50 %.3f ms, p99 %.3f ms\n",
+			received / elapsed, percentile(0.50), percentile(0.99));
+
+	for (int i = 0; i < contexts; i++)
+		delete ps[i];
+	pubnub_config_done(config);
+	evhttp_free(libsrv);
+	event_base_free(evbase);
+	return 0;
+}
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "itesting.h"
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/buffer.h>
+
+#include <json.h>
+
+#include "pubnub-thread.hpp"
+
+#define ADDR "127.0.0.1"
+#define PORT "4002"
+
+/* The server runs on a thread of its own, so that the test threads
+ * can block on the futures. */
+class ThreadTest : public ::testing::Test
+{
+public:
+	event_base *evbase;
+	evhttp *libsrv;
+	std::thread server;
+
+	virtual void SetUp() {
+		evbase = event_base_new();
+		libsrv = evhttp_new(evbase);
+		evhttp_bind_socket(libsrv, ADDR, atoi(PORT));
+		evhttp_set_gencb(libsrv, thread_router, this);
+		server = std::thread(event_base_loop, evbase, EVLOOP_NO_EXIT_ON_EMPTY);
+	}
+
+	virtual void TearDown() {
+		event_base_loopbreak(evbase);
+		server.join();
+		evhttp_free(libsrv);
+		event_base_free(evbase);
+	}
+
+	static void thread_router(struct evhttp_request *r, void *arg) {
+		const char *uri = evhttp_request_get_uri(r);
+		struct evbuffer *evb = evbuffer_new();
+		if (strstr(uri, "/subscribe/") && strstr(uri, "/0/0?"))
+			evbuffer_add_printf(evb, "[[],\"1\"]");
+		else if (strstr(uri, "/subscribe/"))
+			evbuffer_add_printf(evb, "[[{\"n\":1}],\"2\",\"thread_channel\"]");
+		else if (strstr(uri, "/time/"))
+			evbuffer_add_printf(evb, "[13983273523470477]");
+		else
+			evbuffer_add_printf(evb, "[1,\"Sent\",\"13983273523470477\"]");
+		evhttp_send_reply(r, 200, "OK", evb);
+		evbuffer_free(evb);
+	}
+};
+
+TEST_F(ThreadTest, ConcurrentCalls) {
+	struct pubnub_config *config = pubnub_config_new("demo", "demo");
+	pubnub_config_set_origin(config, "http://" ADDR ":" PORT "/");
+	PubNub_thread *t = new PubNub_thread(config);
+
+	std::vector<std::thread> threads;
+	std::vector<int> ok(4);
+	for (int i = 0; i < 4; i++) {
+		threads.push_back(std::thread([t, &ok, i]() {
+			json_object *msg = json_object_new_int(i);
+			std::vector<std::future<PubNub_sync_reply> > f;
+			for (int j = 0; j < 25; j++) {
+				f.push_back(t->publish("thread_channel", *msg));
+				f.push_back(t->time());
+				f.push_back(t->history("thread_channel", 10));
+			}
+			json_object_put(msg);
+			for (size_t j = 0; j < f.size(); j++)
+				if (f[j].get().result() == PNR_OK)
+					ok[i]++;
+		}));
+	}
+	for (int i = 0; i < 4; i++)
+		threads[i].join();
+	for (int i = 0; i < 4; i++)
+		EXPECT_EQ(75, ok[i]);
+
+	PubNub_sync_reply reply = t->time().get();
+	ASSERT_EQ(PNR_OK, reply.result());
+	EXPECT_EQ(13983273523470477LL, json_object_get_int64(reply.response()));
+
+	/* The handler runs on the I/O thread, one message at a time. */
+	std::promise<int> received;
+	bool first = true;
+	t->subscribe("thread_channel", [&received, &first](enum pubnub_res result, const std::string &channel, json_object *msg) {
+		if (result == PNR_OK && first) {
+			first = false;
+			received.set_value(json_object_get_int(json_object_object_get(msg, "n")));
+		}
+	});
+	std::future<int> f = received.get_future();
+	ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::seconds(5)));
+	EXPECT_EQ(1, f.get());
+	t->unsubscribe("thread_channel");
+
+	delete t;
+	pubnub_config_done(config);
+}
@@ -99,7 +99,14 @@ void LibEventTest::TearDown() {
 	pubnub_done(p);
 }
 
+static void
+timerCb(struct pubnub *p, void *cb_data)
+{
+}
+
 TEST_F(LibEventTest, StopWait) {
+	struct timespec ts = { 1, 0 };
+	pubnub_libevent_timeout(p, p->cb_data, &ts, timerCb, NULL);
 	pubnub_libevent_stop_wait(p, p->cb_data);
 	ASSERT_TRUE(isPendingCalled);
 }
@@ -119,5 +126,32 @@ TEST_F(LibEventTest, TryDelWrongSocket) {
 	ASSERT_EQ(0, delEventCnt);
 }
 
+TEST_F(LibEventTest, SharedContexts) {
+	struct pubnub *p2 = pubnub_init("demo", "demo", &pubnub_libevent_callbacks, pubnub_libevent_ref(libevent));
+	EXPECT_EQ(2, libevent->refs);
+	pubnub_libevent_add_socket(p, p->cb_data, 10, 1, NULL, NULL);
+	pubnub_libevent_add_socket(p2, p2->cb_data, 11, 1, NULL, NULL);
+	EXPECT_TRUE(libevent->socks[10]->p == p);
+	EXPECT_TRUE(libevent->socks[11]->p == p2);
+
+	struct timespec ts = { 1, 0 };
+	pubnub_libevent_timeout(p2, p2->cb_data, &ts, timerCb, NULL);
+	ASSERT_TRUE(p2->cb_priv != NULL);
+	ASSERT_TRUE(p->cb_priv != NULL);
+	EXPECT_TRUE(((struct pubnub_timer_info *)p->cb_priv)->ev == NULL);
+	EXPECT_EQ(1, ((struct pubnub_timer_info *)p2->cb_priv)->n_socks);
+
+	/* Only the sockets of p2 go away. */
+	pubnub_done(p2);
+	EXPECT_EQ(1, libevent->refs);
+	EXPECT_EQ(1, libevent->n);
+	EXPECT_TRUE(libevent->socks[10] != NULL);
+	EXPECT_TRUE(libevent->socks[11] == NULL);
+
+	/* The state of p goes with its last socket. */
+	pubnub_libevent_rem_socket(p, p->cb_data, 10);
+	EXPECT_TRUE(p->cb_priv == NULL);
+}
+
 
 }
@@ -7,6 +7,7 @@
 #define PUBNUB_API
 
 class PubNub;
+class PubNub_messages;
 
 class PubNubCppTest : public ::testing::Test
 {
@@ -47,6 +48,10 @@ protected:
 		_pn = &p;
 		cb_funCalled = true;
 	}
+	static const char *_channel;
+	static json_object *_message;
+	static size_t _messages;
+	static void cb_fun3(PubNub &p, enum pubnub_res result, const PubNub_messages &messages, void *ctx_data, void *call_data);
 };
 
 bool PubNubCppTest::initCalled;
@@ -59,6 +64,9 @@ bool PubNubCppTest::herenowCalled;
 bool PubNubCppTest::timeCalled;
 bool PubNubCppTest::cb_funCalled;
 PubNub *PubNubCppTest::_pn;
+const char *PubNubCppTest::_channel;
+json_object *PubNubCppTest::_message;
+size_t PubNubCppTest::_messages;
 void *PubNubCppTest::_data;
 
 struct pubnub *test_pubnub_init(const char *publish_key, const char *subscribe_key,
@@ -111,6 +119,16 @@ void test_pubnub_subscribe_multi(struct pubnub *p, const char *channels[], int c
 	}
 }
 
+static const char *const_channels[] = { "ch1", "ch2", NULL };
+static json_object *const_response;
+
+void test_pubnub_subscribe_const(struct pubnub *p, const char *channels[], int channels_n,
+		long timeout, pubnub_subscribe_const_cb cb, void *cb_data)
+{
+	PubNubCppTest::subscribeCalled = true;
+	cb(NULL, PNR_OK, const_channels, const_response, NULL, cb_data);
+}
+
 void test_pubnub_history(struct pubnub *p, const char *channel, int limit,
 		long timeout, pubnub_history_cb cb, void *cb_data)
 {
@@ -142,6 +160,7 @@ void test_pubnub_time(struct pubnub *p, long timeout, pubnub_time_cb cb, void *c
 #define pubnub_publish test_pubnub_publish
 #define pubnub_subscribe test_pubnub_subscribe
 #define pubnub_subscribe_multi test_pubnub_subscribe_multi
+#define pubnub_subscribe_const test_pubnub_subscribe_const
 #define pubnub_history test_pubnub_history
 #define pubnub_here_now test_pubnub_here_now
 #define pubnub_time test_pubnub_time
@@ -153,10 +172,22 @@ void test_pubnub_time(struct pubnub *p, long timeout, pubnub_time_cb cb, void *c
 #undef pubnub_publish
 #undef pubnub_subscribe
 #undef pubnub_subscribe_multi
+#undef pubnub_subscribe_const
 #undef pubnub_history
 #undef pubnub_here_now
 #undef pubnub_time
 
+void
+PubNubCppTest::cb_fun3(PubNub &p, enum pubnub_res result, const PubNub_messages &messages, void *ctx_data, void *call_data)
+{
+	_pn = &p;
+	_data = call_data;
+	_messages = messages.size();
+	_channel = messages.size() ? messages.channel(0) : NULL;
+	_message = messages.size() ? messages.message(0) : NULL;
+	cb_funCalled = true;
+}
+
 TEST_F(PubNubCppTest, PubNubInitDone) {
 	{
 		PubNub pn("demo", "demo", &cb, NULL);
@@ -240,6 +271,27 @@ TEST_F(PubNubCppTest, PubNubSubscribeMulti) {
 	ASSERT_TRUE(this == _data);
 }
 
+TEST_F(PubNubCppTest, PubNubSubscribeConst) {
+	PubNub pn("demo", "demo", &cb, NULL);
+	const_response = json_tokener_parse("[1,2]");
+	pn.subscribe_const("channel", -1, cb_fun3, this);
+	ASSERT_TRUE(subscribeCalled);
+	ASSERT_TRUE(cb_funCalled);
+	ASSERT_TRUE(&pn == _pn);
+	ASSERT_TRUE(this == _data);
+	EXPECT_EQ(2, _messages);
+	/* The names are passed through, not copied. */
+	EXPECT_TRUE(const_channels[0] == _channel);
+	EXPECT_TRUE(json_object_array_get_idx(const_response, 0) == _message);
+	json_object_put(const_response);
+
+	/* No messages for errors. */
+	const_response = json_object_new_int(404);
+	pn.subscribe_const("channel", -1, cb_fun3, this);
+	EXPECT_EQ(0, _messages);
+	json_object_put(const_response);
+}
+
 TEST_F(PubNubCppTest, PubNubHistory) {
 	PubNub pn("demo", "demo", &cb, NULL);
 	pn.history("channel", 10, -1);
@@ -46,10 +46,12 @@ CURLMcode curl_multi_add_handle(CURLM *multi_handle, CURL *easy_handle)
 	return CURLM_OK;
 }
 
+long curlResponseCode = 200;
+
 CURLcode curl_easy_getinfo(CURL *curl, CURLINFO info, long *t)
 {
 	if (info == CURLINFO_RESPONSE_CODE) {
-		*t = 200;
+		*t = curlResponseCode;
 		return CURLE_OK;
 	}
 	return CURLE_UNKNOWN_OPTION;
@@ -93,8 +95,17 @@ protected:
 	pubnub_test_timeout(struct pubnub *p, void *ctx_data, const struct timespec *ts,
 			void (*cb)(struct pubnub *p, void *cb_data), void *cb_data)
 	{
+		timeoutCalled++;
+		timeoutMs = ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+		timeoutCb = cb;
+		timeoutCbData = cb_data;
 	}
 
+	static int timeoutCalled;
+	static long timeoutMs;
+	static void (*timeoutCb)(struct pubnub *p, void *cb_data);
+	static void *timeoutCbData;
+
 	static void
 	pubnub_test_wait(struct pubnub *p, void *ctx_data)
 	{
@@ -117,6 +128,15 @@ protected:
 		cbChannels = channels;
 	}
 
+	static int pubCbCalled;
+	static pubnub_res pubCbResult;
+
+	static void pubCb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+	{
+		pubCbCalled++;
+		pubCbResult = result;
+	}
+
 	virtual void SetUp() {
 		memset(&cb, 0, sizeof(cb));
 		cb.add_socket = pubnub_test_add_socket;
@@ -153,6 +173,7 @@ protected:
 		addSockMode = 0;
 
 		cbCalled = false;
+		pubCbCalled = 0;
 	}
 
 	virtual void TearDown() {
@@ -208,6 +229,12 @@ protected:
 };
 
 int PubnubTest::addSock, PubnubTest::addSockMode, PubnubTest::remSock, PubnubTest::waitCalled;
+int PubnubTest::timeoutCalled;
+long PubnubTest::timeoutMs;
+void (*PubnubTest::timeoutCb)(struct pubnub *p, void *cb_data);
+void *PubnubTest::timeoutCbData;
+int PubnubTest::pubCbCalled;
+pubnub_res PubnubTest::pubCbResult;
 bool PubnubTest::cbCalled;
 pubnub_res PubnubTest::cbResult;
 char **PubnubTest::cbChannels;
@@ -222,6 +249,1707 @@ TEST_F(PubnubTest, Publish) {
 	EXPECT_STREQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/channel/0/%7B%20%22str%22%3A%20%22test%22%20%7D?pnsdk=c-generic/1.0", curlRequests.back().c_str());
 }
 
+TEST_F(PubnubTest, PublishSigned) {
+	ASSERT_TRUE(curlInit);
+	json_object *msg = json_object_new_int(1);
+	pubnub_set_secret_key(p, "secret1");
+	for (int i = 0; i < 2; i++) {
+		char *sig = pubnub_signature(p, "channel", "1");
+		std::string url = std::string("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/") + sig + "/channel/0/1?pnsdk=c-generic/1.0";
+		free(sig);
+		pubnub_publish(p, "channel", msg, -1, NULL, NULL);
+		EXPECT_STREQ(url.c_str(), curlRequests.back().c_str());
+		pubnub_connection_cancel(p);
+		/* The cached key prefix follows the secret key. */
+		pubnub_set_secret_key(p, "secret2");
+	}
+	json_object_put(msg);
+}
+
+TEST_F(PubnubTest, PublishRaw) {
+	ASSERT_TRUE(curlInit);
+	/* Just the @len bytes go out. */
+	const char *msg = "[1,\"a b\"]garbage";
+	pubnub_publish_raw(p, "channel", msg, 9, -1, NULL, NULL);
+	EXPECT_STREQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/channel/0/%5B1%2C%22a%20b%22%5D?pnsdk=c-generic/1.0", curlRequests.back().c_str());
+	pubnub_connection_cancel(p);
+
+	pubnub_set_secret_key(p, "secret");
+	char *sig = pubnub_signature(p, "channel", "[1,\"a b\"]");
+	std::string url = std::string("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/") + sig + "/channel/0/%5B1%2C%22a%20b%22%5D?pnsdk=c-generic/1.0";
+	free(sig);
+	pubnub_publish_raw(p, "channel", msg, 9, -1, NULL, NULL);
+	EXPECT_STREQ(url.c_str(), curlRequests.back().c_str());
+	pubnub_connection_cancel(p);
+	pubnub_set_secret_key(p, NULL);
+
+	/* The ciphertext is quoted and URL-encoded as it is. */
+	pubnub_set_cipher_key(p, "enigma");
+	json_object *encrypted = pubnub_encrypt("enigma", "[1,\"a b\"]");
+	std::string enc = "%22";
+	for (const char *c = json_object_get_string(encrypted); *c; c++) {
+		char esc[4];
+		snprintf(esc, sizeof(esc), "%%%02X", *c);
+		enc += isalnum(*c) ? std::string(1, *c) : std::string(esc);
+	}
+	enc += "%22";
+	json_object_put(encrypted);
+	pubnub_publish_raw(p, "channel", msg, 9, -1, NULL, NULL);
+	EXPECT_EQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/channel/0/" + enc + "?pnsdk=c-generic/1.0", curlRequests.back());
+}
+
+TEST_F(PubnubTest, KeepAlive) {
+	ASSERT_TRUE(curlInit);
+	pubnub_time(p, -1, NULL, NULL);
+	CURL *curl = p->curl;
+	char resp[] = "[1]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_TRUE(p->curl == NULL);
+	EXPECT_TRUE(p->curl_idle == curl);
+	pubnub_time(p, -1, NULL, NULL);
+	EXPECT_TRUE(p->curl == curl);
+	EXPECT_STREQ("http://pubsub.pubnub.com/time/0?pnsdk=c-generic/1.0", curlRequests.back().c_str());
+	pubnub_connection_cancel(p);
+
+	pubnub_set_keepalive(p, false);
+	EXPECT_TRUE(p->curl_idle == NULL);
+	pubnub_time(p, -1, NULL, NULL);
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_TRUE(p->curl_idle == NULL);
+}
+
+TEST_F(PubnubTest, IncrementalParse) {
+	pubnub_set_incremental_parse(p, true);
+	pubnub_history(p, "channel", 10, -1, pubCb, NULL);
+	ASSERT_TRUE(p->body_tok != NULL);
+	/* Chunks split in the middle of tokens. */
+	const char *chunks[] = { "[{\"a\":", "\"te", "st\"},13", "45]  ", NULL };
+	for (int i = 0; chunks[i]; i++)
+		pubnub_http_inputcb((char *) chunks[i], strlen(chunks[i]), 1, p);
+	/* No body buffer is taken from the pool at all. */
+	EXPECT_TRUE(p->body == NULL);
+	ASSERT_TRUE(p->body_response != NULL);
+	EXPECT_STREQ("[ { \"a\": \"test\" }, 1345 ]", json_object_to_json_string(p->body_response));
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(1, pubCbCalled);
+	EXPECT_EQ(PNR_OK, pubCbResult);
+	EXPECT_TRUE(p->body_response == NULL);
+}
+
+TEST_F(PubnubTest, ResponseLimits) {
+	pubnub_set_response_limits(p, 1024, 256);
+	pubnub_time(p, -1, pubCb, NULL);
+	char resp[] = "[1234]";
+	EXPECT_EQ(strlen(resp), pubnub_http_inputcb(resp, strlen(resp), 1, p));
+	ASSERT_TRUE(p->body != NULL);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(1, pubCbCalled);
+	EXPECT_EQ(PNR_OK, pubCbResult);
+	/* The buffer went back to the pool. */
+	EXPECT_TRUE(p->body == NULL);
+	int pooled = pubnub_body_pool_n;
+	EXPECT_LT(0, pooled);
+
+	/* Over the high-water mark, the buffer is freed; only the URL
+	 * buffer goes back. */
+	pubnub_time(p, -1, pubCb, NULL);
+	std::string resp2 = "[\"" + std::string(400, 'x') + "\"]";
+	pubnub_http_inputcb((char *) resp2.c_str(), resp2.size(), 1, p);
+	pooled = pubnub_body_pool_n;
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(2, pubCbCalled);
+	EXPECT_EQ(PNR_OK, pubCbResult);
+	EXPECT_EQ(pooled + 1, pubnub_body_pool_n);
+
+	/* Over the size limit, the transfer is aborted and not retried. */
+	pubnub_time(p, -1, pubCb, NULL);
+	size_t requests = curlRequests.size();
+	std::string resp3 = "[\"" + std::string(1200, 'x') + "\"]";
+	EXPECT_EQ(0, pubnub_http_inputcb((char *) resp3.c_str(), resp3.size(), 1, p));
+	pubnub_connection_finished(p, CURLE_WRITE_ERROR, false);
+	EXPECT_EQ(3, pubCbCalled);
+	EXPECT_EQ(PNR_RESPONSE_TOO_LARGE, pubCbResult);
+	EXPECT_EQ(requests, curlRequests.size());
+	EXPECT_TRUE(p->method == NULL);
+}
+
+static std::vector<std::string> firstBytes;
+
+static void
+firstByteCb(struct pubnub *p, const char *method, void *cb_data)
+{
+	firstBytes.push_back(method);
+}
+
+static void
+firstByteRawCb(struct pubnub *p, enum pubnub_res result, const struct pubnub_raw_msg *msgs, int msgs_n,
+		const char *time_token, struct json_object *response, void *ctx_data, void *call_data)
+{
+	ASSERT_EQ(1, msgs_n);
+	firstBytes.push_back(std::string(msgs[0].json, msgs[0].len));
+}
+
+TEST_F(PubnubTest, ResponseBuffer) {
+	static char buf[16];
+	pubnub_set_response_buffer(p, buf, sizeof(buf));
+	firstBytes.clear();
+	pubnub_set_first_byte_cb(p, firstByteCb, NULL);
+
+	/* Collected in the buffer, across chunks. */
+	pubnub_time(p, -1, pubCb, NULL);
+	int pooled = pubnub_body_pool_n;
+	char resp[] = "[12";
+	char resp2[] = "34]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	ASSERT_EQ(1u, firstBytes.size());
+	EXPECT_EQ("time", firstBytes[0]);
+	pubnub_http_inputcb(resp2, strlen(resp2), 1, p);
+	EXPECT_EQ(1u, firstBytes.size());
+	EXPECT_TRUE(p->body == &p->body_fixed);
+	EXPECT_STREQ("[1234]", buf);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(1, pubCbCalled);
+	EXPECT_EQ(PNR_OK, pubCbResult);
+	EXPECT_TRUE(p->body == NULL);
+	/* Just the URL buffer went back to the pool. */
+	EXPECT_EQ(pooled + 1, pubnub_body_pool_n);
+
+	/* It does not grow. */
+	pubnub_time(p, -1, pubCb, NULL);
+	char resp3[] = "[\"0123456789abcdef\"]";
+	EXPECT_EQ(0, pubnub_http_inputcb(resp3, strlen(resp3), 1, p));
+	EXPECT_EQ(2u, firstBytes.size());
+	pubnub_connection_finished(p, CURLE_WRITE_ERROR, false);
+	EXPECT_EQ(2, pubCbCalled);
+	EXPECT_EQ(PNR_RESPONSE_TOO_LARGE, pubCbResult);
+
+	/* The raw subscribe slices it in place. */
+	const char *channels[] = { "ch" };
+	const struct channelset cs = { channels, 1 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+	pubnub_subscribe_raw(p, NULL, 0, -1, firstByteRawCb, NULL);
+	char resp4[] = "[[7],\"5\"]";
+	pubnub_http_inputcb(resp4, strlen(resp4), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	ASSERT_EQ(4u, firstBytes.size());
+	EXPECT_EQ("subscribe", firstBytes[2]);
+	EXPECT_EQ("7", firstBytes[3]);
+	EXPECT_STREQ("5", p->time_token);
+	EXPECT_EQ(0, buf[0]);
+	pubnub_connection_cancel(p);
+
+	/* So do the calls alongside. */
+	json_object *msg = json_object_new_int(1);
+	pubnub_publish_enqueue(p, "ch", msg, -1, pubCb, NULL);
+	json_object_put(msg);
+	char resp5[] = "[1,\"Sent\",\"6\"]";
+	pubnub_req_inputcb(resp5, 3, 1, p->reqs);
+	pubnub_req_inputcb(resp5 + 3, strlen(resp5) - 3, 1, p->reqs);
+	ASSERT_EQ(5u, firstBytes.size());
+	EXPECT_EQ("publish", firstBytes[4]);
+	firstBytes.pop_back();
+
+	pubnub_set_first_byte_cb(p, NULL, NULL);
+	pubnub_set_response_buffer(p, NULL, 0);
+	pubnub_time(p, -1, pubCb, NULL);
+	pubnub_http_inputcb(resp3, strlen(resp3), 1, p);
+	EXPECT_TRUE(p->body != &p->body_fixed);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(PNR_OK, pubCbResult);
+	EXPECT_EQ(4u, firstBytes.size());
+}
+
+TEST_F(PubnubTest, IncrementalParseError) {
+	pubnub_set_incremental_parse(p, true);
+	pubnub_error_policy(p, 0, false);
+	pubnub_time(p, -1, pubCb, NULL);
+	char resp[] = "[1,}";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	EXPECT_TRUE(p->body_error);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(1, pubCbCalled);
+	EXPECT_EQ(PNR_FORMAT_ERROR, pubCbResult);
+
+	/* Switching back takes effect with the next request. */
+	pubnub_set_incremental_parse(p, false);
+	pubnub_time(p, -1, pubCb, NULL);
+	EXPECT_TRUE(p->body_tok == NULL);
+	char resp2[] = "[1]";
+	pubnub_http_inputcb(resp2, strlen(resp2), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(2, pubCbCalled);
+	EXPECT_EQ(PNR_OK, pubCbResult);
+}
+
+static std::vector<std::string> rawMsgs, rawChannels;
+static pubnub_res rawResult;
+
+static void
+rawCb(struct pubnub *p, enum pubnub_res result, const struct pubnub_raw_msg *msgs, int msgs_n,
+		const char *time_token, struct json_object *response, void *ctx_data, void *call_data)
+{
+	rawResult = result;
+	rawMsgs.clear();
+	rawChannels.clear();
+	for (int i = 0; i < msgs_n; i++) {
+		rawMsgs.push_back(std::string(msgs[i].json, msgs[i].len));
+		rawChannels.push_back(msgs[i].channel);
+	}
+}
+
+TEST_F(PubnubTest, SubscribeRaw) {
+	const char *channels[] = { "ch1", "ch2" };
+	const struct channelset cs = { channels, 2 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+
+	pubnub_subscribe_raw(p, NULL, 0, -1, rawCb, NULL);
+	EXPECT_TRUE(p->body_raw);
+	char *s = GetSubUrl();
+	EXPECT_STREQ("http://pubsub.pubnub.com/subscribe/subscribe_key/ch1%2Cch2/0/1", s);
+	free(s);
+
+	char resp[] = "[[\"a,]\", {\"b\": [1, \"]\\\"\"]}, 3 ], \"1345\", \"ch2,ch1\"]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(PNR_OK, rawResult);
+	ASSERT_EQ(3, rawMsgs.size());
+	EXPECT_EQ("\"a,]\"", rawMsgs[0]);
+	EXPECT_EQ("{\"b\": [1, \"]\\\"\"]}", rawMsgs[1]);
+	EXPECT_EQ("3", rawMsgs[2]);
+	EXPECT_EQ("ch2", rawChannels[0]);
+	EXPECT_EQ("ch1", rawChannels[1]);
+	EXPECT_EQ("", rawChannels[2]);
+	EXPECT_STREQ("1345", p->time_token);
+
+	struct pubnub_raw_msg msg = { "3", 1, "ch1" };
+	json_object *obj = pubnub_raw_msg_parse(&msg);
+	ASSERT_TRUE(obj != NULL);
+	EXPECT_EQ(3, json_object_get_int(obj));
+	json_object_put(obj);
+}
+
+TEST_F(PubnubTest, SubscribeRawError) {
+	const char *channels[] = { "ch1" };
+	const struct channelset cs = { channels, 1 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+	pubnub_error_policy(p, 0, false);
+
+	pubnub_subscribe_raw(p, NULL, 0, -1, rawCb, NULL);
+	char resp[] = "[[1, 2], 1345]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(PNR_FORMAT_ERROR, rawResult);
+	EXPECT_STREQ("1", p->time_token);
+
+	/* No channelset, empty message list. */
+	pubnub_subscribe_raw(p, NULL, 0, -1, rawCb, NULL);
+	char resp2[] = "[[],\"1346\"]";
+	pubnub_http_inputcb(resp2, strlen(resp2), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(PNR_OK, rawResult);
+	EXPECT_EQ(0, rawMsgs.size());
+	EXPECT_STREQ("1346", p->time_token);
+
+	pubnub_time(p, -1, NULL, NULL);
+	EXPECT_FALSE(p->body_raw);
+	pubnub_connection_cancel(p);
+}
+
+static std::vector<std::string> relayMsgs;
+static struct pubnub_relay_batch *relayKept;
+static const struct pubnub_raw_msg *relayKeptMsg;
+
+static void
+relayCb(struct pubnub_relay *r, struct pubnub_relay_batch *batch,
+		const struct pubnub_raw_msg *const *msgs, int msgs_n, void *sink_data)
+{
+	std::string s = (const char *) sink_data;
+	for (int i = 0; i < msgs_n; i++)
+		s += " " + std::string(msgs[i]->channel) + ":" + std::string(msgs[i]->json, msgs[i]->len);
+	relayMsgs.push_back(s);
+	if (!strcmp((const char *) sink_data, "keep") && !relayKept) {
+		pubnub_relay_batch_ref(batch);
+		relayKept = batch;
+		relayKeptMsg = msgs[0];
+	}
+}
+
+TEST_F(PubnubTest, Relay) {
+	struct pubnub *q = pubnub_init("publish_key", "subscribe_key", &cb, NULL);
+	struct pubnub_relay *r = pubnub_relay_init(q);
+	relayMsgs.clear();
+	relayKept = NULL;
+
+	pubnub_relay_add_sink(r, "room1", relayCb, (void *) "a");
+	char *s = GetSubUrl();
+	EXPECT_STREQ("http://pubsub.pubnub.com/subscribe/subscribe_key/room1/0/0", s);
+	free(s);
+	char resp[] = "[[],\"1\"]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, q);
+	pubnub_connection_finished(q, CURLE_OK, false);
+	curlRequests.clear();
+
+	/* The known channel is not subscribed again, the new one is. */
+	pubnub_relay_add_sink(r, "room1", relayCb, (void *) "keep");
+	EXPECT_EQ(0, curlRequests.size());
+	pubnub_relay_add_sink(r, "room2", relayCb, (void *) "c");
+	pubnub_relay_add_sink(r, NULL, relayCb, (void *) "all");
+	EXPECT_STREQ("join", q->method);
+	pubnub_http_inputcb(resp, strlen(resp), 1, q);
+	pubnub_connection_finished(q, CURLE_OK, false);
+	EXPECT_STREQ("subscribe", q->method);
+	EXPECT_TRUE(q->body_raw);
+	EXPECT_EQ(0, relayMsgs.size());
+
+	/* Each sink gets the messages of its channel, in order. */
+	char resp2[] = "[[1,\"two\",{\"n\":3},4],\"2\",\"room1,room2,room1,other\"]";
+	pubnub_http_inputcb(resp2, strlen(resp2), 1, q);
+	pubnub_connection_finished(q, CURLE_OK, false);
+	ASSERT_EQ(4, relayMsgs.size());
+	EXPECT_EQ("a room1:1 room1:{\"n\":3}", relayMsgs[0]);
+	EXPECT_EQ("keep room1:1 room1:{\"n\":3}", relayMsgs[1]);
+	EXPECT_EQ("c room2:\"two\"", relayMsgs[2]);
+	EXPECT_EQ("all room1:1 room2:\"two\" room1:{\"n\":3} other:4", relayMsgs[3]);
+	ASSERT_TRUE(relayKept != NULL);
+	EXPECT_STREQ("2", pubnub_relay_batch_time_token(relayKept));
+	s = GetSubUrl();
+	EXPECT_STREQ("http://pubsub.pubnub.com/subscribe/subscribe_key/room1%2Croom2/0/2", s);
+	free(s);
+
+	/* The kept batch outlives the next one. */
+	relayMsgs.clear();
+	pubnub_relay_remove_sink(r, "room1", relayCb, (void *) "a");
+	pubnub_relay_remove_sink(r, NULL, relayCb, (void *) "all");
+	char resp3[] = "[[5],\"3\",\"room1\"]";
+	pubnub_http_inputcb(resp3, strlen(resp3), 1, q);
+	pubnub_connection_finished(q, CURLE_OK, false);
+	ASSERT_EQ(1, relayMsgs.size());
+	EXPECT_EQ("keep room1:5", relayMsgs[0]);
+	EXPECT_EQ("1", std::string(relayKeptMsg->json, relayKeptMsg->len));
+	EXPECT_STREQ("room1", relayKeptMsg->channel);
+	pubnub_relay_batch_unref(relayKept);
+
+	pubnub_relay_done(r);
+}
+
+TEST_F(PubnubTest, RelayBackoff) {
+	struct pubnub *q = pubnub_init("publish_key", "subscribe_key", &cb, NULL);
+	pubnub_error_policy(q, 0, false);
+	pubnub_set_retry_backoff(q, 1000, 60000, 0);
+	struct pubnub_relay *r = pubnub_relay_init(q);
+	pubnub_relay_add_sink(r, "room1", relayCb, (void *) "a");
+	char resp[] = "[[],\"1\"]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, q);
+	pubnub_connection_finished(q, CURLE_OK, false);
+	curlRequests.clear();
+
+	/* A failed subscribe is not reissued right away, but held back
+	 * for the backoff, which grows with the failures. */
+	long long start = pubnub_now_ms();
+	pubnub_connection_finished(q, CURLE_COULDNT_CONNECT, false);
+	EXPECT_EQ(0, curlRequests.size());
+	EXPECT_STREQ("subscribe", q->method);
+	EXPECT_TRUE(q->hold_until > 0);
+	EXPECT_GE(start + 1000 + 10, q->hold_until);
+	pubnub_error_retry(q, NULL);
+	ASSERT_EQ(1, curlRequests.size());
+	char *s = GetSubUrl();
+	EXPECT_STREQ("http://pubsub.pubnub.com/subscribe/subscribe_key/room1/0/1", s);
+	free(s);
+	EXPECT_EQ(1, r->failures);
+	pubnub_connection_finished(q, CURLE_COULDNT_CONNECT, false);
+	EXPECT_EQ(2, r->failures);
+	EXPECT_GE(pubnub_now_ms() + 2000 + 10, q->hold_until);
+	pubnub_error_retry(q, NULL);
+
+	/* A response resets the backoff. */
+	pubnub_http_inputcb(resp, strlen(resp), 1, q);
+	pubnub_connection_finished(q, CURLE_OK, false);
+	EXPECT_EQ(0, r->failures);
+	EXPECT_EQ(0, q->hold_until);
+
+	pubnub_relay_done(r);
+}
+
+static std::vector<std::string> constChannels;
+static const char *const *constChannelsPtr;
+
+static void
+constCb(struct pubnub *p, enum pubnub_res result, const char *const *channels,
+		struct json_object *response, void *ctx_data, void *call_data)
+{
+	rawResult = result;
+	constChannelsPtr = channels;
+	constChannels.clear();
+	for (int i = 0; channels && channels[i]; i++)
+		constChannels.push_back(channels[i]);
+}
+
+TEST_F(PubnubTest, SubscribeConst) {
+	const char *channels[] = { "ch1" };
+	const struct channelset cs = { channels, 1 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	char resp[] = "[[1,2,3],\"1345\"]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(PNR_OK, rawResult);
+	ASSERT_EQ(3, constChannels.size());
+	EXPECT_EQ("ch1", constChannels[2]);
+	/* The array is kept for the next batch. */
+	EXPECT_TRUE(p->batch_channels == (const char **) constChannelsPtr);
+
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	char resp2[] = "[[1,2,3],\"1346\",\"a,b\"]";
+	pubnub_http_inputcb(resp2, strlen(resp2), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	ASSERT_EQ(3, constChannels.size());
+	EXPECT_EQ("a", constChannels[0]);
+	EXPECT_EQ("b", constChannels[1]);
+	EXPECT_EQ("", constChannels[2]);
+
+	/* Errors go through the adapter. */
+	pubnub_error_policy(p, 0, false);
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	pubnub_connection_finished(p, CURLE_COULDNT_CONNECT, false);
+	EXPECT_EQ(PNR_IO_ERROR, rawResult);
+	EXPECT_TRUE(constChannelsPtr == NULL);
+}
+
+TEST_F(PubnubTest, SubscribeConstRetry) {
+	const char *channels[] = { "ch1" };
+	const struct channelset cs = { channels, 1 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+	pubnub_error_policy(p, ~0, false);
+
+	/* The format error is retried without the callback, and its
+	 * call data does not stay behind in the arena. */
+	rawResult = PNR_OCCUPIED;
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	char resp[] = "[1]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(PNR_OCCUPIED, rawResult);
+	EXPECT_EQ(0, p->arena_live);
+	pubnub_connection_cancel(p);
+}
+
+TEST_F(PubnubTest, SubscribeBatching) {
+	const char *channels[] = { "ch1" };
+	const struct channelset cs = { channels, 1 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+	pubnub_set_subscribe_batching(p, 500, 10);
+
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	char resp[] = "[[1],\"1345\"]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(PNR_OK, rawResult);
+
+	/* The next subscribe waits out the window. */
+	size_t n = curlRequests.size();
+	timeoutCalled = 0;
+	waitCalled = 0;
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	EXPECT_EQ(n, curlRequests.size());
+	EXPECT_EQ(1, timeoutCalled);
+	EXPECT_GT(timeoutMs, 400);
+	EXPECT_EQ(1, waitCalled);
+	EXPECT_TRUE(p->curl == NULL);
+	EXPECT_STREQ("subscribe", p->method);
+
+	/* Then it goes out with the timetoken of the last response. */
+	pubnub_error_retry(p, NULL);
+	ASSERT_EQ(n + 1, curlRequests.size());
+	EXPECT_EQ(0, strncmp("http://pubsub.pubnub.com/subscribe/subscribe_key/ch1/0/1345?", curlRequests.back().c_str(), 60));
+	char resp2[] = "[[1,2,3,4,5,6,7,8,9,10],\"1346\"]";
+	pubnub_http_inputcb(resp2, strlen(resp2), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	ASSERT_EQ(10, constChannels.size());
+
+	/* A full batch means we are behind, no waiting. */
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	EXPECT_EQ(n + 2, curlRequests.size());
+
+	/* The window does not apply after an empty response either. */
+	char resp3[] = "[[],\"1346\"]";
+	pubnub_http_inputcb(resp3, strlen(resp3), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	EXPECT_EQ(n + 3, curlRequests.size());
+
+	/* Cancelling a held subscribe drops it for good. */
+	char resp4[] = "[[1],\"1347\"]";
+	pubnub_http_inputcb(resp4, strlen(resp4), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	EXPECT_EQ(n + 3, curlRequests.size());
+	pubnub_reset_subscribe(p, false);
+	EXPECT_EQ(PNR_CANCELLED, rawResult);
+	pubnub_error_retry(p, NULL);
+	EXPECT_EQ(n + 3, curlRequests.size());
+}
+
+TEST_F(PubnubTest, SubscribeBacklog) {
+	const char *channels[] = { "ch1" };
+	const struct channelset cs = { channels, 1 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+	pubnub_set_subscribe_backlog(p, 4, 1);
+
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	char resp[] = "[[1,2,3],\"1345\"]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(3, pubnub_subscribe_backlog(p));
+
+	/* Below the high watermark, the next subscribe goes out. */
+	size_t n = curlRequests.size();
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	EXPECT_EQ(n + 1, curlRequests.size());
+	char resp2[] = "[[4,5],\"1346\"]";
+	pubnub_http_inputcb(resp2, strlen(resp2), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(5, pubnub_subscribe_backlog(p));
+
+	/* Above it, the subscribe is held back without a timeout. */
+	timeoutCalled = 0;
+	waitCalled = 0;
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	EXPECT_EQ(n + 1, curlRequests.size());
+	EXPECT_EQ(0, timeoutCalled);
+	EXPECT_EQ(1, waitCalled);
+	EXPECT_TRUE(p->curl == NULL);
+	EXPECT_STREQ("subscribe", p->method);
+
+	/* Not before the backlog is down to the low watermark. */
+	pubnub_subscribe_consumed(p, 3);
+	EXPECT_EQ(n + 1, curlRequests.size());
+	pubnub_subscribe_consumed(p, 1);
+	ASSERT_EQ(n + 2, curlRequests.size());
+	EXPECT_EQ(1, pubnub_subscribe_backlog(p));
+	EXPECT_EQ(0, strncmp("http://pubsub.pubnub.com/subscribe/subscribe_key/ch1/0/1346?", curlRequests.back().c_str(), 60));
+	EXPECT_FALSE(p->backlog_held);
+
+	/* Turning backpressure off forgets the backlog. */
+	pubnub_set_subscribe_backlog(p, 0, 0);
+	EXPECT_EQ(0, pubnub_subscribe_backlog(p));
+}
+
+static std::vector<std::string> dedupeMsgs, dedupeChannels;
+
+static void
+dedupeCb(struct pubnub *p, enum pubnub_res result, char **channels, struct json_object *response, void *ctx_data, void *call_data)
+{
+	dedupeMsgs.clear();
+	dedupeChannels.clear();
+	for (int i = 0; channels[i]; i++) {
+		dedupeMsgs.push_back(json_object_to_json_string(json_object_array_get_idx(response, i)));
+		dedupeChannels.push_back(channels[i]);
+		free(channels[i]);
+	}
+	EXPECT_EQ(dedupeMsgs.size(), json_object_array_length(response));
+	free(channels);
+}
+
+TEST_F(PubnubTest, SubscribeDedupe) {
+	const char *channels[] = { "a" };
+	const struct channelset cs = { channels, 1 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+	pubnub_set_subscribe_dedupe(p, 4);
+
+	pubnub_subscribe(p, NULL, -1, dedupeCb, NULL);
+	char resp[] = "[[1,{\"a\":[1,\"x\"]},1],\"2\",\"a,a,b\"]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	ASSERT_EQ(3u, dedupeMsgs.size());
+
+	/* Redelivered after a retry with the old timetoken. */
+	pubnub_subscribe(p, NULL, -1, dedupeCb, NULL);
+	char resp2[] = "[[{\"a\":[1,\"x\"]},2,1,{\"a\":[1,\"y\"]}],\"3\",\"a,a,a,a\"]";
+	pubnub_http_inputcb(resp2, strlen(resp2), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	ASSERT_EQ(2u, dedupeMsgs.size());
+	EXPECT_EQ("2", dedupeMsgs[0]);
+	EXPECT_EQ("a", dedupeChannels[1]);
+
+	/* The raw mode compares the message texts. */
+	pubnub_subscribe_raw(p, NULL, 0, -1, rawCb, NULL);
+	char resp3[] = "[[1, 1],\"4\",\"b,a\"]";
+	pubnub_http_inputcb(resp3, strlen(resp3), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(2u, rawMsgs.size());
+	pubnub_subscribe_raw(p, NULL, 0, -1, rawCb, NULL);
+	char resp4[] = "[[1, 3],\"5\",\"a,a\"]";
+	pubnub_http_inputcb(resp4, strlen(resp4), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(PNR_OK, rawResult);
+	ASSERT_EQ(1u, rawMsgs.size());
+	EXPECT_EQ("3", rawMsgs[0]);
+}
+
+static std::vector<std::string> demuxA, demuxB;
+
+static void
+demuxCb(struct pubnub *p, const char *channel, struct json_object *msg, void *ctx_data, void *call_data)
+{
+	std::vector<std::string> *v = (std::vector<std::string> *)call_data;
+	v->push_back(std::string(channel) + "=" + json_object_to_json_string(msg));
+}
+
+TEST_F(PubnubTest, ChannelHandlers) {
+	const char *channels[] = { "orders.*", "alerts" };
+	const struct channelset cs = { channels, 2 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+	pubnub_on_channel(p, "orders.*", demuxCb, &demuxA);
+	pubnub_on_channel(p, "orders.eu.*", demuxCb, &demuxB);
+	pubnub_on_channel(p, "alerts", demuxCb, &demuxB);
+	pubnub_on_channel(p, "alerts.*", demuxCb, &demuxA);
+
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	char resp[] = "[[1,2,3,4,5,6],\"2\",\"orders.eu.1,orders.us,misc,alerts,orders.,orders\"]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(PNR_OK, rawResult);
+	ASSERT_EQ(2u, demuxA.size());
+	EXPECT_EQ("orders.us=2", demuxA[0]);
+	EXPECT_EQ("orders.=5", demuxA[1]);
+	ASSERT_EQ(2u, demuxB.size());
+	EXPECT_EQ("orders.eu.1=1", demuxB[0]);
+	EXPECT_EQ("alerts=4", demuxB[1]);
+	ASSERT_EQ(2u, constChannels.size());
+	EXPECT_EQ("misc", constChannels[0]);
+	EXPECT_EQ("orders", constChannels[1]);
+
+	/* Removing a pattern falls back to the others. */
+	demuxA.clear();
+	demuxB.clear();
+	pubnub_on_channel(p, "orders.eu.*", NULL, NULL);
+	pubnub_on_channel(p, "alerts", NULL, NULL);
+	pubnub_subscribe(p, NULL, -1, dedupeCb, NULL);
+	char resp2[] = "[[1,2],\"3\",\"orders.eu.1,alerts\"]";
+	pubnub_http_inputcb(resp2, strlen(resp2), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	ASSERT_EQ(1u, demuxA.size());
+	EXPECT_EQ("orders.eu.1=1", demuxA[0]);
+	EXPECT_EQ(0u, demuxB.size());
+	ASSERT_EQ(1u, dedupeChannels.size());
+	EXPECT_EQ("alerts", dedupeChannels[0]);
+	/* "orders.*" and "alerts.*" are left, of the same length. */
+	ASSERT_EQ(1, p->demux_prefix_n);
+	EXPECT_EQ(2, p->demux_prefix[0].n);
+}
+
+static int batchCbCalled;
+static std::vector<enum pubnub_res> batchResults;
+
+static void
+batchCb(struct pubnub *p, int n, const enum pubnub_res *results,
+		struct json_object *const *responses, void *ctx_data, void *call_data)
+{
+	batchCbCalled++;
+	batchResults.assign(results, results + n);
+	if (results[0] == PNR_OK)
+		EXPECT_TRUE(responses[0] != NULL);
+}
+
+TEST_F(PubnubTest, PublishBatch) {
+	ASSERT_TRUE(curlInit);
+	batchCbCalled = 0;
+	pubnub_set_publish_concurrency(p, 2);
+	json_object *msgs[3];
+	for (int i = 0; i < 3; i++)
+		msgs[i] = json_object_new_int(i);
+	pubnub_publish_batch(p, "ch", msgs, 3, -1, batchCb, NULL);
+	for (int i = 0; i < 3; i++)
+		json_object_put(msgs[i]);
+	EXPECT_TRUE(p->method == NULL);
+	ASSERT_EQ(2, curlRequests.size());
+	EXPECT_STREQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/ch/0/0?pnsdk=c-generic/1.0", curlRequests[0].c_str());
+	EXPECT_STREQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/ch/0/1?pnsdk=c-generic/1.0", curlRequests[1].c_str());
+
+	char resp[] = "[1,\"Sent\",\"1\"]";
+	/* p->reqs has the most recently started request first. */
+	struct pubnub_req *req = p->reqs->next;
+	pubnub_req_inputcb(resp, strlen(resp), 1, req);
+	pubnub_req_finished(p, req->curl, CURLE_OK);
+	ASSERT_EQ(3, curlRequests.size());
+	EXPECT_STREQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/ch/0/2?pnsdk=c-generic/1.0", curlRequests[2].c_str());
+
+	pubnub_req_inputcb(resp, strlen(resp), 1, p->reqs);
+	pubnub_req_finished(p, p->reqs->curl, CURLE_OK);
+	EXPECT_EQ(0, batchCbCalled);
+	pubnub_req_finished(p, p->reqs->curl, CURLE_OPERATION_TIMEDOUT);
+	EXPECT_EQ(1, batchCbCalled);
+	ASSERT_EQ(3, batchResults.size());
+	EXPECT_EQ(PNR_OK, batchResults[0]);
+	EXPECT_EQ(PNR_TIMEOUT, batchResults[1]);
+	EXPECT_EQ(PNR_OK, batchResults[2]);
+	GetErr();
+
+	/* Cancelled on pubnub_done() (in TearDown). */
+	msgs[0] = json_object_new_int(3);
+	pubnub_publish_batch(p, "ch", msgs, 1, -1, batchCb, NULL);
+	json_object_put(msgs[0]);
+}
+
+static int timeCbCalled;
+static int timeCbValue;
+
+static void
+timeCb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+	timeCbCalled++;
+	timeCbValue = result == PNR_OK ? json_object_get_int(response) : -result;
+}
+
+TEST_F(PubnubTest, CallsAlongsideSubscribe) {
+	ASSERT_TRUE(curlInit);
+	const char *channels[] = { "ch1" };
+	const struct channelset cs = { channels, 1 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+	pubnub_subscribe(p, NULL, -1, NULL, NULL);
+	CURL *sub_curl = p->curl;
+	timeCbCalled = 0;
+
+	pubnub_time(p, -1, timeCb, NULL);
+	EXPECT_EQ(0, timeCbCalled);
+	EXPECT_EQ(1, p->reqs_n);
+	EXPECT_STREQ("http://pubsub.pubnub.com/time/0?pnsdk=c-generic/1.0", curlRequests.back().c_str());
+	json_object *msg = json_object_new_int(1);
+	pubnub_publish(p, "ch2", msg, -1, pubCb, NULL);
+	json_object_put(msg);
+	EXPECT_EQ(2, p->reqs_n);
+	EXPECT_STREQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/ch2/0/1?pnsdk=c-generic/1.0", curlRequests.back().c_str());
+
+	char resp[] = "[1234]";
+	struct pubnub_req *req = p->reqs->next;
+	pubnub_req_inputcb(resp, strlen(resp), 1, req);
+	pubnub_req_finished(p, req->curl, CURLE_OK);
+	EXPECT_EQ(1, timeCbCalled);
+	EXPECT_EQ(1234, timeCbValue);
+
+	/* The long poll is still the same one. */
+	EXPECT_STREQ("subscribe", p->method);
+	EXPECT_TRUE(p->curl == sub_curl);
+	pubnub_connection_cancel(p);
+}
+
+TEST_F(PubnubTest, SubscribeHoldSideRequest) {
+	const char *channels[] = { "ch1" };
+	const struct channelset cs = { channels, 1 };
+	channelset_add(&p->channelset, &cs);
+	strcpy(p->time_token, "1");
+	pubnub_set_subscribe_batching(p, 500, 10);
+
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	char resp[] = "[[1],\"1345\"]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	size_t n = curlRequests.size();
+	pubnub_subscribe_const(p, NULL, 0, -1, constCb, NULL);
+	EXPECT_EQ(n, curlRequests.size());
+	EXPECT_TRUE(p->curl == NULL);
+
+	/* A call meanwhile has libcurl rearm the timer, for the
+	 * transfer and after it; the hold keeps its deadline. */
+	timeCbCalled = 0;
+	pubnub_time(p, -1, timeCb, NULL);
+	ASSERT_EQ(n + 1, curlRequests.size());
+	pubnub_http_timercb(p->curlm, 30000, p);
+	EXPECT_TRUE(timeoutCb == pubnub_event_timeoutcb);
+	EXPECT_GE(500, timeoutMs);
+	char resp2[] = "[1234]";
+	pubnub_req_inputcb(resp2, strlen(resp2), 1, p->reqs);
+	pubnub_req_finished(p, p->reqs->curl, CURLE_OK);
+	EXPECT_EQ(1, timeCbCalled);
+	pubnub_http_timercb(p->curlm, -1, p);
+	EXPECT_TRUE(timeoutCb == pubnub_event_timeoutcb);
+	EXPECT_LT(0, timeoutMs);
+	EXPECT_GE(500, timeoutMs);
+
+	/* The subscribe goes out once the timer goes off. */
+	p->hold_until = pubnub_now_ms();
+	timeoutCb(p, timeoutCbData);
+	ASSERT_EQ(n + 2, curlRequests.size());
+	EXPECT_EQ(0, strncmp("http://pubsub.pubnub.com/subscribe/subscribe_key/ch1/0/1345?", curlRequests.back().c_str(), 60));
+	EXPECT_TRUE(p->curl != NULL);
+	EXPECT_EQ(0, p->hold_until);
+	pubnub_connection_cancel(p);
+}
+
+TEST_F(PubnubTest, QueuedDuringJoin) {
+	ASSERT_TRUE(curlInit);
+	int waits = waitCalled;
+	pubnub_subscribe(p, "CH_A", -1, subCb, NULL);
+	EXPECT_STREQ("join", p->method);
+	char *s = GetSubUrl();
+	EXPECT_STREQ("http://pubsub.pubnub.com/subscribe/subscribe_key/CH_A/0/0", s);
+	free(s);
+
+	/* Changes during the join are queued; the new callback wins. */
+	const char *channels[] = { "CH_B", "CH_C" };
+	cbCalled = false;
+	pubnub_subscribe_multi(p, channels, 2, -1, subCb, NULL);
+	EXPECT_TRUE(cbCalled);
+	EXPECT_EQ(PNR_CANCELLED, cbResult);
+	pubnub_unsubscribe(p, &channels[1], 1, -1, pubCb, NULL);
+	EXPECT_STREQ("join", p->method);
+	EXPECT_EQ(2, p->channelset.n);
+	EXPECT_EQ(0, curlRequests.size());
+
+	/* One leave, one join, then the subscribe. */
+	cbCalled = false;
+	char resp[] = "[[],'T1']";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_STREQ("leave", p->method);
+	s = GetSubUrl();
+	EXPECT_STREQ("http://pubsub.pubnub.com/v2/presence/sub-key/subscribe_key/channel/CH_C/leave", s);
+	free(s);
+
+	char resp1[] = "{\"status\":200}";
+	pubnub_http_inputcb(resp1, strlen(resp1), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(1, pubCbCalled);
+	EXPECT_EQ(PNR_OK, pubCbResult);
+	EXPECT_STREQ("join", p->method);
+	s = GetSubUrl();
+	EXPECT_STREQ("http://pubsub.pubnub.com/subscribe/subscribe_key/CH_B/0/0", s);
+	free(s);
+
+	char resp2[] = "[[],'T2']";
+	pubnub_http_inputcb(resp2, strlen(resp2), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_FALSE(cbCalled);
+	EXPECT_STREQ("subscribe", p->method);
+	s = GetSubUrl();
+	EXPECT_STREQ("http://pubsub.pubnub.com/subscribe/subscribe_key/CH_A%2CCH_B/0/T2", s);
+	free(s);
+	EXPECT_EQ(0, curlRequests.size());
+	EXPECT_EQ(waits + 1, waitCalled);
+	pubnub_connection_cancel(p);
+}
+
+TEST_F(PubnubTest, QueuedDuringLeave) {
+	ASSERT_TRUE(curlInit);
+	const char *channels[] = { "CH_A" };
+	pubnub_unsubscribe(p, channels, 1, -1, pubCb, NULL);
+	EXPECT_STREQ("leave", p->method);
+	curlRequests.clear();
+
+	/* A subscribe following a plain leave. */
+	pubnub_subscribe(p, "CH_B", -1, subCb, NULL);
+	EXPECT_EQ(1, p->channelset.n);
+	char resp[] = "{\"status\":200}";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(1, pubCbCalled);
+	EXPECT_STREQ("join", p->method);
+	char *s = GetSubUrl();
+	EXPECT_STREQ("http://pubsub.pubnub.com/subscribe/subscribe_key/CH_B/0/0", s);
+	free(s);
+
+	/* Unsubscribing everything leaves nothing to subscribe to. */
+	cbCalled = false;
+	pubnub_unsubscribe(p, NULL, 0, -1, pubCb, NULL);
+	char resp1[] = "[[],'T1']";
+	pubnub_http_inputcb(resp1, strlen(resp1), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	s = GetSubUrl();
+	EXPECT_STREQ("http://pubsub.pubnub.com/v2/presence/sub-key/subscribe_key/channel/CH_B/leave", s);
+	free(s);
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(2, pubCbCalled);
+	EXPECT_TRUE(cbCalled);
+	EXPECT_EQ(PNR_CANCELLED, cbResult);
+	EXPECT_TRUE(p->method == NULL);
+	EXPECT_EQ(0, curlRequests.size());
+}
+
+TEST_F(PubnubTest, DnsHostport) {
+	EXPECT_STREQ("pubsub.pubnub.com:80", pubnub_dns_hostport(p));
+	pubnub_set_origin(p, "https://test.origin");
+	EXPECT_STREQ("test.origin:443", pubnub_dns_hostport(p));
+	pubnub_set_origin(p, "http://localhost:8080/x");
+	EXPECT_STREQ("localhost:8080", pubnub_dns_hostport(p));
+	pubnub_set_origin(p, "http://[::1]:8080/x");
+	EXPECT_STREQ("[::1]:8080", pubnub_dns_hostport(p));
+	pubnub_set_origin(p, "https://[2001:db8::1]");
+	EXPECT_STREQ("[2001:db8::1]:443", pubnub_dns_hostport(p));
+	/* Bogus ports are not taken. */
+	pubnub_set_origin(p, "http://localhost:-2147483648");
+	EXPECT_STREQ("localhost:80", pubnub_dns_hostport(p));
+	pubnub_set_origin(p, "http://localhost:99999999999");
+	EXPECT_STREQ("localhost:80", pubnub_dns_hostport(p));
+}
+
+#ifndef _WIN32
+TEST_F(PubnubTest, DnsCacheBounds) {
+	/* Fill the cache with resolved entries up to its size. */
+	pthread_mutex_lock(&pubnub_dns_lock);
+	int n = 0;
+	struct pubnub_dns_entry *e;
+	for (e = pubnub_dns_cache; e; e = e->next)
+		n++;
+	for (; n < PUBNUB_DNS_CACHE_MAX; n++) {
+		e = (struct pubnub_dns_entry *)calloc(1, sizeof(*e));
+		char hostport[32];
+		snprintf(hostport, sizeof(hostport), "host%d:80", n);
+		e->hostport = strdup(hostport);
+		strcpy(e->addr, "10.0.0.1");
+		e->expires = time(NULL) + 3600;
+		e->used = n;
+		e->next = pubnub_dns_cache;
+		pubnub_dns_cache = e;
+	}
+	pthread_mutex_unlock(&pubnub_dns_lock);
+
+	/* The context keeps one entry for its origin as the address
+	 * changes, and the one before. */
+	pubnub_set_origin(p, "http://host1");
+	CURL *curl = curl_easy_init();
+	for (int i = 0; i < 5; i++) {
+		pthread_mutex_lock(&pubnub_dns_lock);
+		for (e = pubnub_dns_cache; e; e = e->next)
+			if (!strcmp(e->hostport, "host1:80"))
+				snprintf(e->addr, sizeof(e->addr), "10.0.0.%d", i + 2);
+		pthread_mutex_unlock(&pubnub_dns_lock);
+		pubnub_dns_setup(p, curl);
+	}
+	curl_easy_cleanup(curl);
+	ASSERT_TRUE(p->dns_resolve != NULL);
+	EXPECT_STREQ("host1:80:10.0.0.6", p->dns_resolve->data);
+	EXPECT_TRUE(p->dns_resolve->next == NULL);
+	EXPECT_STREQ("host1:80:10.0.0.5", p->dns_resolve_old->data);
+
+	/* A new origin takes the place of the least recently used one. */
+	char addr[PUBNUB_DNS_ADDR_LEN];
+	pubnub_dns_lookup("newhost.invalid:80", addr);
+	EXPECT_STREQ("", addr);
+	pthread_mutex_lock(&pubnub_dns_lock);
+	n = 0;
+	bool found = false;
+	for (e = pubnub_dns_cache; e; e = e->next, n++)
+		found = found || !strcmp(e->hostport, "newhost.invalid:80");
+	pthread_mutex_unlock(&pubnub_dns_lock);
+	EXPECT_EQ(PUBNUB_DNS_CACHE_MAX, n);
+	EXPECT_TRUE(found);
+}
+#endif
+
+TEST_F(PubnubTest, Prewarm) {
+	ASSERT_TRUE(curlInit);
+	pubnub_set_origin(p, "http://127.0.0.1:8080");
+	pubnub_prewarm(p, true);
+	EXPECT_TRUE(p->method == NULL);
+	EXPECT_EQ(1, p->reqs_n);
+	EXPECT_STREQ("http://127.0.0.1:8080/time/0?pnsdk=c-generic/1.0", curlRequests.back().c_str());
+
+	/* Wait for the resolver thread. */
+	char addr[PUBNUB_DNS_ADDR_LEN] = "";
+	for (int i = 0; i < 200 && !addr[0]; i++) {
+		usleep(10000);
+		pubnub_dns_lookup("127.0.0.1:8080", addr);
+	}
+	EXPECT_STREQ("127.0.0.1", addr);
+
+	/* Later requests are pointed to the cached address. */
+	pubnub_time(p, -1, NULL, NULL);
+	ASSERT_TRUE(p->dns_resolve != NULL);
+	EXPECT_STREQ("127.0.0.1:8080:127.0.0.1", p->dns_resolve->data);
+	EXPECT_TRUE(p->dns_resolve->next == NULL);
+	pubnub_connection_cancel(p);
+}
+
+static int timerCbCalled;
+
+static void
+timerCb(struct pubnub *p, void *cb_data)
+{
+	timerCbCalled++;
+}
+
+TEST_F(PubnubTest, TimerDue) {
+	/* A timeout due right away is left to the frontend; libcurl
+	 * calling us refuses to be reentered. */
+	timerCbCalled = 0;
+	timeoutCalled = 0;
+	pubnub_http_timerset(&cb, NULL, p, 0, timerCb, NULL);
+	EXPECT_EQ(0, timerCbCalled);
+	EXPECT_EQ(1, timeoutCalled);
+	EXPECT_EQ(1, timeoutMs);
+	EXPECT_TRUE(timeoutCb == timerCb);
+
+	pubnub_http_timercb(p->curlm, 0, p);
+	EXPECT_EQ(1, timeoutMs);
+	EXPECT_TRUE(timeoutCb == pubnub_event_timeoutcb);
+
+	/* No timeout at all. */
+	pubnub_http_timerset(&cb, NULL, p, -1, timerCb, NULL);
+	EXPECT_EQ(0, timerCbCalled);
+	EXPECT_EQ(0, timeoutMs);
+	EXPECT_TRUE(timeoutCb == NULL);
+}
+
+TEST_F(PubnubTest, RetryBackoff) {
+	ASSERT_TRUE(curlInit);
+	pubnub_error_policy(p, ~0, false);
+	pubnub_set_retry_backoff(p, 100, 1000, 5);
+	pubnub_time(p, -1, timeCb, NULL);
+	timeCbCalled = 0;
+
+	/* The delay cap doubles with each retry, up to the max. */
+	long caps[] = { 100, 200, 400, 800, 1000 };
+	for (int i = 0; i < 5; i++) {
+		timeoutCalled = 0;
+		pubnub_connection_finished(p, CURLE_OPERATION_TIMEDOUT, false);
+		EXPECT_EQ(1, timeoutCalled);
+		EXPECT_LT(timeoutMs, caps[i]);
+		EXPECT_EQ(i + 1, p->retry_attempt);
+		EXPECT_EQ(0, timeCbCalled);
+		pubnub_error_retry(p, NULL);
+	}
+
+	/* Out of attempts. */
+	timeoutCalled = 0;
+	pubnub_connection_finished(p, CURLE_OPERATION_TIMEDOUT, false);
+	EXPECT_EQ(0, timeoutCalled);
+	EXPECT_EQ(1, timeCbCalled);
+	EXPECT_EQ(0, p->retry_attempt);
+}
+
+TEST_F(PubnubTest, CircuitBreaker) {
+	ASSERT_TRUE(curlInit);
+	pubnub_error_policy(p, 0, false);
+	pubnub_set_circuit_breaker(p, 2, 60000);
+	timeCbCalled = 0;
+	pubnub_time(p, -1, timeCb, NULL);
+	pubnub_connection_finished(p, CURLE_OPERATION_TIMEDOUT, false);
+	EXPECT_FALSE(pubnub_circuit_open(p));
+	pubnub_time(p, -1, timeCb, NULL);
+	pubnub_connection_finished(p, CURLE_OPERATION_TIMEDOUT, false);
+	EXPECT_EQ(2, timeCbCalled);
+	EXPECT_TRUE(pubnub_circuit_open(p));
+
+	/* Calls are held back until the cool-down ends. */
+	size_t n = curlRequests.size();
+	timeoutCalled = 0;
+	pubnub_time(p, -1, timeCb, NULL);
+	EXPECT_EQ(n, curlRequests.size());
+	EXPECT_EQ(1, timeoutCalled);
+	EXPECT_GT(timeoutMs, 59000);
+	EXPECT_TRUE(p->curl == NULL);
+
+	/* The probe gets through and its success closes the breaker. */
+	p->breaker_until = pubnub_now_ms();
+	pubnub_error_retry(p, NULL);
+	EXPECT_EQ(n + 1, curlRequests.size());
+	char resp[] = "[1234]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(3, timeCbCalled);
+	EXPECT_EQ(1234, timeCbValue);
+	EXPECT_EQ(0, p->breaker_failures);
+	EXPECT_FALSE(pubnub_circuit_open(p));
+}
+
+TEST_F(PubnubTest, CircuitBreakerSideRequests) {
+	ASSERT_TRUE(curlInit);
+	pubnub_set_circuit_breaker(p, 2, 60000);
+	json_object *msg = json_object_new_int(1);
+	pubnub_publish_enqueue(p, "ch", msg, -1, pubCb, NULL);
+	pubnub_publish_enqueue(p, "ch", msg, -1, pubCb, NULL);
+	ASSERT_EQ(2, p->reqs_n);
+	pubnub_req_finished(p, p->reqs->curl, CURLE_OPERATION_TIMEDOUT);
+	pubnub_req_finished(p, p->reqs->curl, CURLE_OPERATION_TIMEDOUT);
+	EXPECT_EQ(2, pubCbCalled);
+	EXPECT_TRUE(pubnub_circuit_open(p));
+	GetErr();
+
+	/* Queued while the breaker is open, with the timer set
+	 * for the end of the cool-down. */
+	size_t n = curlRequests.size();
+	timeoutCalled = 0;
+	pubnub_publish_enqueue(p, "ch", msg, -1, pubCb, NULL);
+	pubnub_publish_enqueue(p, "ch", msg, -1, pubCb, NULL);
+	EXPECT_EQ(n, curlRequests.size());
+	EXPECT_EQ(2, pubnub_publish_queue_depth(p));
+	EXPECT_LT(0, timeoutCalled);
+	EXPECT_GT(timeoutMs, 59000);
+
+	/* Then one of them probes the origin... */
+	p->breaker_until = pubnub_now_ms();
+	pubnub_event_timeoutcb(p, NULL);
+	EXPECT_EQ(n + 1, curlRequests.size());
+	EXPECT_EQ(1, pubnub_publish_queue_depth(p));
+
+	/* ... and its success lets the other go. */
+	char resp[] = "[1,\"Sent\",\"1\"]";
+	pubnub_req_inputcb(resp, strlen(resp), 1, p->reqs);
+	pubnub_req_finished(p, p->reqs->curl, CURLE_OK);
+	EXPECT_EQ(0, p->breaker_failures);
+	EXPECT_EQ(n + 2, curlRequests.size());
+	EXPECT_EQ(0, pubnub_publish_queue_depth(p));
+	json_object_put(msg);
+}
+
+static int statsCbCalled;
+static struct pubnub_request_stats statsCbLast;
+
+static void
+statsCb(struct pubnub *p, const struct pubnub_request_stats *stats, void *cb_data)
+{
+	statsCbCalled++;
+	statsCbLast = *stats;
+}
+
+TEST_F(PubnubTest, Stats) {
+	ASSERT_TRUE(curlInit);
+	pubnub_set_stats(p, true, statsCb, NULL);
+	statsCbCalled = 0;
+	timeCbCalled = 0;
+
+	pubnub_time(p, -1, timeCb, NULL);
+	char resp[] = "[1234]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_EQ(1, timeCbCalled);
+	EXPECT_EQ(1, statsCbCalled);
+	EXPECT_STREQ("time", statsCbLast.method);
+	EXPECT_EQ(PNR_OK, statsCbLast.result);
+
+	/* A failed request, and a rejected one. */
+	pubnub_error_policy(p, 0, false);
+	pubnub_time(p, -1, timeCb, NULL);
+	pubnub_history(p, "ch", 10, -1, timeCb, NULL);
+	pubnub_connection_finished(p, CURLE_OPERATION_TIMEDOUT, false);
+	EXPECT_EQ(3, timeCbCalled);
+	EXPECT_EQ(2, statsCbCalled);
+	EXPECT_EQ(PNR_TIMEOUT, statsCbLast.result);
+
+	struct pubnub_stats stats;
+	pubnub_get_stats(p, &stats);
+	EXPECT_EQ(2, stats.method[PNS_TIME].requests);
+	EXPECT_EQ(1, stats.method[PNS_TIME].errors);
+	EXPECT_EQ(1, stats.method[PNS_HISTORY].occupied);
+	EXPECT_EQ(0, stats.method[PNS_HISTORY].requests);
+	unsigned long total = 0;
+	for (int i = 0; i < PUBNUB_STATS_BUCKETS; i++)
+		total += stats.method[PNS_TIME].time_hist[PNS_TOTAL][i];
+	EXPECT_EQ(2, total);
+
+	pubnub_reset_stats(p);
+	pubnub_get_stats(p, &stats);
+	EXPECT_EQ(0, stats.method[PNS_TIME].requests);
+	pubnub_set_stats(p, false, NULL, NULL);
+	EXPECT_TRUE(p->stats == NULL);
+}
+
+static int allocCalled, releaseCalled;
+
+static void *
+countingAlloc(size_t size, void *alloc_data)
+{
+	allocCalled++;
+	return malloc(size);
+}
+
+static void
+countingRelease(void *ptr, void *alloc_data)
+{
+	releaseCalled++;
+	free(ptr);
+}
+
+static const struct pubnub_allocator countingAllocator = { countingAlloc, countingRelease };
+
+TEST_F(PubnubTest, Arena) {
+	ASSERT_TRUE(curlInit);
+	allocCalled = releaseCalled = 0;
+	pubnub_set_allocator(p, &countingAllocator, NULL);
+
+	pubnub_subscribe(p, "channel", -1, subCb, NULL);
+	EXPECT_EQ(1, allocCalled);
+	EXPECT_LT(0, p->arena_live);
+	char join[] = "[[],\"1\"]";
+	pubnub_http_inputcb(join, strlen(join), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_STREQ("subscribe", p->method);
+
+	/* Once the messages are dispatched, the arena is rewound. */
+	char resp[] = "[[1,2],\"2\"]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_TRUE(cbCalled);
+	EXPECT_EQ(PNR_OK, cbResult);
+	for (int i = 0; cbChannels[i]; i++)
+		free(cbChannels[i]);
+	free(cbChannels);
+	EXPECT_EQ(0, p->arena_live);
+	EXPECT_EQ(0, p->arena_used);
+
+	/* The next cycle reuses it. */
+	pubnub_subscribe(p, "channel", -1, subCb, NULL);
+	EXPECT_EQ(1, allocCalled);
+	pubnub_connection_cancel(p);
+	EXPECT_EQ(0, p->arena_live);
+
+	/* An allocation outliving its request does not keep the ones
+	 * after it from being rewound. */
+	void *straggler = pubnub_arena_alloc(p, 100);
+	size_t used = p->arena_used;
+	pubnub_subscribe(p, "channel", -1, subCb, NULL);
+	EXPECT_LT(used, p->arena_used);
+	pubnub_connection_cancel(p);
+	EXPECT_EQ(1, p->arena_live);
+	EXPECT_EQ(used, p->arena_used);
+	void *next = pubnub_arena_alloc(p, 100);
+	pubnub_free(p, straggler);
+	EXPECT_EQ(used + used, p->arena_used);
+	pubnub_free(p, next);
+	EXPECT_EQ(0, p->arena_live);
+	EXPECT_EQ(0, p->arena_used);
+	EXPECT_EQ(1, allocCalled);
+
+	pubnub_done(p);
+	EXPECT_EQ(1, releaseCalled);
+	p = pubnub_init("publish_key", "subscribe_key", &cb, NULL);
+}
+
+static std::vector<std::string> scanPages;
+static enum pubnub_res scanResult;
+static int scanEnded;
+
+static void
+scanCb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+	if (result == PNR_OK && response) {
+		for (int i = 0; i < (int) json_object_array_length(response); i++)
+			scanPages.push_back(json_object_get_string(json_object_object_get(json_object_array_get_idx(response, i), "message")));
+		return;
+	}
+	scanResult = result;
+	scanEnded++;
+}
+
+TEST_F(PubnubTest, HistoryScan) {
+	ASSERT_TRUE(curlInit);
+	scanPages.clear();
+	scanEnded = 0;
+	pubnub_history_scan(p, "ch", "1000", "3000", 2, -1, scanCb, NULL);
+	/* Both halves of the range are paged through at once. */
+	EXPECT_TRUE(p->method == NULL);
+	ASSERT_EQ(2, curlRequests.size());
+	EXPECT_STREQ("http://pubsub.pubnub.com/v2/history/sub-key/subscribe_key/channel/ch?pnsdk=c-generic/1.0&count=100&include_token=true&reverse=true&start=1000", curlRequests[0].c_str());
+	EXPECT_STREQ("http://pubsub.pubnub.com/v2/history/sub-key/subscribe_key/channel/ch?pnsdk=c-generic/1.0&count=100&include_token=true&reverse=true&start=2000", curlRequests[1].c_str());
+
+	/* The second half is held back until the first one is through. */
+	struct pubnub_req *req = p->reqs;
+	char resp[] = "[[{\"message\":\"c\",\"timetoken\":2500}],2500,2500]";
+	pubnub_req_inputcb(resp, strlen(resp), 1, req);
+	pubnub_req_finished(p, req->curl, CURLE_OK);
+	EXPECT_EQ(0, scanPages.size());
+	EXPECT_EQ(1, p->reqs_n);
+
+	/* A message past the first half ends it. */
+	req = p->reqs;
+	char resp2[] = "[[{\"message\":\"a\",\"timetoken\":1500},{\"message\":\"b\",\"timetoken\":2100}],1500,2100]";
+	pubnub_req_inputcb(resp2, strlen(resp2), 1, req);
+	pubnub_req_finished(p, req->curl, CURLE_OK);
+	ASSERT_EQ(2, scanPages.size());
+	EXPECT_EQ("a", scanPages[0]);
+	EXPECT_EQ("c", scanPages[1]);
+	EXPECT_EQ(1, scanEnded);
+	EXPECT_EQ(PNR_OK, scanResult);
+	EXPECT_EQ(0, p->reqs_n);
+
+	/* An error ends the scan, the other lane winds down. */
+	scanEnded = 0;
+	pubnub_history_scan(p, "ch", "1000", "3000", 2, -1, scanCb, NULL);
+	req = p->reqs;
+	pubnub_req_finished(p, req->curl, CURLE_OPERATION_TIMEDOUT);
+	EXPECT_EQ(1, scanEnded);
+	EXPECT_EQ(PNR_TIMEOUT, scanResult);
+	req = p->reqs;
+	char resp3[] = "[[],0,0]";
+	pubnub_req_inputcb(resp3, strlen(resp3), 1, req);
+	pubnub_req_finished(p, req->curl, CURLE_OK);
+	EXPECT_EQ(1, scanEnded);
+	EXPECT_EQ(0, p->reqs_n);
+	GetErr();
+}
+
+TEST_F(PubnubTest, PublishEnqueue) {
+	ASSERT_TRUE(curlInit);
+	pubnub_set_publish_concurrency(p, 2);
+	json_object *msg = json_object_new_int(1);
+	pubnub_publish_enqueue(p, "ch1", msg, -1, pubCb, NULL);
+	pubnub_publish_enqueue(p, "ch2", msg, -1, pubCb, NULL);
+	pubnub_publish_enqueue(p, "ch3", msg, -1, pubCb, NULL);
+	json_object_put(msg);
+	/* The context is not occupied by queued publishes. */
+	EXPECT_TRUE(p->method == NULL);
+	ASSERT_EQ(2, curlRequests.size());
+	EXPECT_STREQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/ch1/0/1?pnsdk=c-generic/1.0", curlRequests[0].c_str());
+	EXPECT_STREQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/ch2/0/1?pnsdk=c-generic/1.0", curlRequests[1].c_str());
+	EXPECT_EQ(2, p->reqs_n);
+
+	/* Complete the first one; the third one goes out. */
+	struct pubnub_req *req = p->reqs->next;
+	char resp[] = "[1,\"Sent\",\"1\"]";
+	pubnub_req_inputcb(resp, strlen(resp), 1, req);
+	pubnub_req_finished(p, req->curl, CURLE_OK);
+	EXPECT_EQ(1, pubCbCalled);
+	EXPECT_EQ(PNR_OK, pubCbResult);
+	ASSERT_EQ(3, curlRequests.size());
+	EXPECT_STREQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/ch3/0/1?pnsdk=c-generic/1.0", curlRequests[2].c_str());
+	EXPECT_EQ(2, p->reqs_n);
+
+	/* Queued publishes go alongside a regular request. */
+	pubnub_time(p, -1, NULL, NULL);
+	EXPECT_STREQ("time", p->method);
+	pubnub_connection_cancel(p);
+	p->method = NULL;
+
+	req = p->reqs;
+	pubnub_req_finished(p, req->curl, CURLE_OPERATION_TIMEDOUT);
+	EXPECT_EQ(2, pubCbCalled);
+	EXPECT_EQ(PNR_TIMEOUT, pubCbResult);
+	EXPECT_EQ(1, p->reqs_n);
+	GetErr();
+
+	/* The rest is cancelled by pubnub_done(). */
+	pubnub_done(p);
+	EXPECT_EQ(3, pubCbCalled);
+	EXPECT_EQ(PNR_CANCELLED, pubCbResult);
+	p = pubnub_init("publish_key", "subscribe_key", &cb, NULL);
+}
+
+struct submitArg {
+	struct pubnub *p;
+	pubnub_publish_cb cb;
+};
+
+static void *
+submitThread(void *arg)
+{
+	struct submitArg *a = (struct submitArg *)arg;
+	json_object *msg = json_object_new_int(1);
+	for (int i = 0; i < 100; i++)
+		pubnub_publish_submit(a->p, "ch", msg, -1, a->cb, NULL);
+	json_object_put(msg);
+	return NULL;
+}
+
+TEST_F(PubnubTest, PublishSubmit) {
+	ASSERT_TRUE(pubnub_submit_init(p));
+	EXPECT_EQ(p->submit_fd[0], addSock);
+	EXPECT_EQ(1, addSockMode);
+	pubnub_set_publish_concurrency(p, 1000);
+
+	struct submitArg arg = { p, pubCb };
+	pthread_t threads[4];
+	for (int i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, submitThread, &arg);
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+	/* Nothing goes out until the thread driving the context wakes up. */
+	EXPECT_EQ(0, curlRequests.size());
+	pubnub_submit_readcb(p, p->submit_fd[0], 1, NULL);
+	EXPECT_EQ(400, curlRequests.size());
+	EXPECT_EQ(400, p->reqs_n);
+	EXPECT_TRUE(p->submit_head == NULL);
+	EXPECT_STREQ("http://pubsub.pubnub.com/publish/publish_key/subscribe_key/0/ch/0/1?pnsdk=c-generic/1.0", curlRequests[0].c_str());
+
+	/* The wakeup was consumed. */
+	char buf[8];
+	EXPECT_EQ(-1, read(p->submit_fd[0], buf, sizeof(buf)));
+
+	/* Messages not sent yet are cancelled by pubnub_done(). */
+	json_object *msg = json_object_new_int(2);
+	pubnub_publish_submit(p, "ch", msg, -1, pubCb, NULL);
+	json_object_put(msg);
+	int fd = p->submit_fd[0];
+	pubnub_done(p);
+	EXPECT_EQ(fd, remSock);
+	EXPECT_EQ(401, pubCbCalled);
+	EXPECT_EQ(PNR_CANCELLED, pubCbResult);
+	p = pubnub_init("publish_key", "subscribe_key", &cb, NULL);
+}
+
+static int submitCalled, submitDropped;
+
+static void
+submitCallCb(struct pubnub *p, void *data)
+{
+	submitCalled++;
+}
+
+static void
+submitDropCb(void *data)
+{
+	submitDropped++;
+	free(data);
+}
+
+TEST_F(PubnubTest, SubmitCall) {
+	ASSERT_TRUE(pubnub_submit_init(p));
+	submitCalled = submitDropped = 0;
+	pubnub_submit_call(p, submitCallCb, submitDropCb, NULL);
+	pubnub_submit_readcb(p, p->submit_fd[0], 1, NULL);
+	EXPECT_EQ(1, submitCalled);
+	EXPECT_EQ(0, submitDropped);
+
+	/* Calls not made yet are dropped by pubnub_done(), with their
+	 * data handed back. */
+	pubnub_submit_call(p, submitCallCb, submitDropCb, malloc(16));
+	pubnub_submit_call(p, submitCallCb, NULL, NULL);
+	pubnub_done(p);
+	EXPECT_EQ(1, submitCalled);
+	EXPECT_EQ(1, submitDropped);
+	p = pubnub_init("publish_key", "subscribe_key", &cb, NULL);
+}
+
+static std::vector<std::pair<bool, int> > watermarks;
+
+static void
+watermarkCb(struct pubnub *p, bool high, int depth, void *ctx_data, void *call_data)
+{
+	watermarks.push_back(std::make_pair(high, depth));
+}
+
+TEST_F(PubnubTest, PublishRateLimit) {
+	ASSERT_TRUE(curlInit);
+	watermarks.clear();
+	pubnub_set_publish_watermark(p, 3, 1, watermarkCb, NULL);
+	pubnub_set_publish_rate(p, 10, 2);
+	timeoutCalled = 0;
+	json_object *msg = json_object_new_int(1);
+	for (int i = 0; i < 5; i++)
+		pubnub_publish_enqueue(p, "ch", msg, -1, pubCb, NULL);
+
+	/* The burst goes out, the rest waits for the bucket to refill. */
+	EXPECT_EQ(2, curlRequests.size());
+	EXPECT_EQ(2, p->reqs_n);
+	EXPECT_EQ(3, pubnub_publish_queue_depth(p));
+	EXPECT_LT(0, timeoutCalled);
+	EXPECT_LT(0, timeoutMs);
+	EXPECT_GE(101, timeoutMs);
+	ASSERT_EQ(1, watermarks.size());
+	EXPECT_TRUE(watermarks[0].first);
+	EXPECT_EQ(3, watermarks[0].second);
+
+	/* A while later, the timer lets two more go. */
+	p->rate_at -= 200;
+	pubnub_event_timeoutcb(p, NULL);
+	EXPECT_EQ(4, curlRequests.size());
+	EXPECT_EQ(1, pubnub_publish_queue_depth(p));
+	ASSERT_EQ(2, watermarks.size());
+	EXPECT_FALSE(watermarks[1].first);
+	EXPECT_EQ(1, watermarks[1].second);
+
+	/* Throttling by the server empties the bucket. */
+	p->rate_at -= 1000;
+	struct pubnub_req *req = p->reqs;
+	curlResponseCode = 429;
+	pubnub_req_finished(p, req->curl, CURLE_OK);
+	curlResponseCode = 200;
+	EXPECT_EQ(1, pubCbCalled);
+	EXPECT_EQ(PNR_HTTP_ERROR, pubCbResult);
+	EXPECT_EQ(4, curlRequests.size());
+	EXPECT_EQ(1, pubnub_publish_queue_depth(p));
+
+	/* A full queue sheds new messages right away. */
+	pubnub_set_publish_queue_limit(p, 1);
+	pubnub_publish_enqueue(p, "ch", msg, -1, pubCb, NULL);
+	EXPECT_EQ(2, pubCbCalled);
+	EXPECT_EQ(PNR_OCCUPIED, pubCbResult);
+	EXPECT_EQ(1, pubnub_publish_queue_depth(p));
+	json_object_put(msg);
+	GetErr();
+
+	/* Without the limit, the queue drains at once. */
+	pubnub_set_publish_rate(p, 0, 0);
+	EXPECT_EQ(5, curlRequests.size());
+	EXPECT_EQ(0, pubnub_publish_queue_depth(p));
+	EXPECT_EQ(0, p->rate_wake);
+}
+
+TEST_F(PubnubTest, SharedSsl) {
+	struct pubnub *p2 = pubnub_init("demo", "demo", &cb, NULL);
+	const char pem1[] = "not really a certificate";
+	const char pem2[] = "another one";
+	pubnub_set_ssl_cacerts(p, pem1, strlen(pem1));
+	pubnub_set_ssl_cacerts(p2, pem1, strlen(pem1));
+	ASSERT_TRUE(p->ssl_cacerts != NULL);
+	EXPECT_TRUE(p->ssl_cacerts == p2->ssl_cacerts);
+	EXPECT_EQ(2, p->ssl_cacerts->refs);
+
+	pubnub_set_ssl_cacerts(p2, pem2, strlen(pem2));
+	EXPECT_TRUE(p->ssl_cacerts != p2->ssl_cacerts);
+	EXPECT_EQ(1, p->ssl_cacerts->refs);
+
+	/* Setting the same data again keeps the parsed certificates. */
+	struct pubnub_cacerts *c = p->ssl_cacerts;
+	pubnub_set_ssl_cacerts(p, pem1, strlen(pem1));
+	EXPECT_TRUE(c == p->ssl_cacerts);
+	EXPECT_EQ(1, c->refs);
+
+	ASSERT_TRUE(p->ssl_share != NULL);
+	EXPECT_TRUE(p->ssl_share == p2->ssl_share);
+
+	/* SSL sessions are only shared with the same CA certificates. */
+	pubnub_set_ssl_cacerts(p2, pem1, strlen(pem1));
+	ASSERT_TRUE(p->ssl_cacerts->share != NULL);
+	EXPECT_TRUE(p->ssl_cacerts->share == p2->ssl_cacerts->share);
+	EXPECT_TRUE(p->ssl_cacerts->share != p->ssl_share);
+	struct pubnub_cacerts *c2 = pubnub_cacerts_get(pem2, strlen(pem2));
+	ASSERT_TRUE(c2->share != NULL);
+	EXPECT_TRUE(c2->share != p->ssl_cacerts->share);
+	pubnub_cacerts_put(c2);
+	pubnub_done(p2);
+}
+
+TEST_F(PubnubTest, Pool) {
+	struct pubnub_pool *pool = pubnub_pool_init(&cb, NULL);
+	struct pubnub *p1 = pubnub_init_pooled(pool, "publish_key", "subscribe_key");
+	struct pubnub *p2 = pubnub_init_pooled(pool, "publish_key", "subscribe_key");
+	EXPECT_TRUE(p1->curlm == pool->curlm);
+	EXPECT_TRUE(p2->curlm == pool->curlm);
+	EXPECT_TRUE(pool->members == p2);
+
+	pubnub_time(p1, -1, NULL, NULL);
+	pubnub_time(p2, -1, NULL, NULL);
+	EXPECT_EQ(2, curlRequests.size());
+	EXPECT_EQ(2, waitCalled);
+
+	char resp[] = "[1]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p1);
+	pubnub_connection_finished(p1, CURLE_OK, true);
+	EXPECT_TRUE(p1->method == NULL);
+	EXPECT_STREQ("time", p2->method);
+
+	pubnub_done(p1);
+	EXPECT_TRUE(pool->members == p2);
+	EXPECT_TRUE(p2->pool_next == NULL);
+	/* Also cancels the request of p2. */
+	pubnub_pool_done(pool);
+}
+
+TEST_F(PubnubTest, PoolEmpty) {
+	struct pubnub_pool *pool = pubnub_pool_init(&cb, NULL);
+	struct pubnub *p1 = pubnub_init_pooled(pool, "publish_key", "subscribe_key");
+	pubnub_done(p1);
+
+	/* libcurl may still have a word about its connections, but there
+	 * is no context to tell the frontend about it through. */
+	timeoutCalled = 0;
+	addSock = remSock = 0;
+	pubnub_pool_sockcb(NULL, 42, CURL_POLL_IN, pool, NULL);
+	pubnub_pool_sockcb(NULL, 42, CURL_POLL_REMOVE, pool, (void *) pool);
+	pubnub_pool_timercb(pool->curlm, 100, pool);
+	EXPECT_EQ(0, addSock);
+	EXPECT_EQ(0, remSock);
+	EXPECT_EQ(0, timeoutCalled);
+	EXPECT_TRUE(pool->timer_p == NULL);
+	pubnub_pool_done(pool);
+}
+
+TEST_F(PubnubTest, PoolWake) {
+	struct pubnub_pool *pool = pubnub_pool_init(&cb, NULL);
+	struct pubnub *p1 = pubnub_init_pooled(pool, "publish_key", "subscribe_key");
+	struct pubnub *p2 = pubnub_init_pooled(pool, "publish_key", "subscribe_key");
+	struct pubnub *p3 = pubnub_init_pooled(pool, "publish_key", "subscribe_key");
+
+	/* Only the member waiting for its rate limiter is looked at. */
+	pubnub_set_publish_rate(p2, 10, 1);
+	json_object *msg = json_object_new_int(1);
+	pubnub_publish_enqueue(p2, "ch", msg, -1, NULL, NULL);
+	pubnub_publish_enqueue(p2, "ch", msg, -1, NULL, NULL);
+	EXPECT_EQ(1, pubnub_publish_queue_depth(p2));
+	EXPECT_TRUE(pool->wake == p2);
+	EXPECT_TRUE(p2->pool_wake_next == NULL);
+	EXPECT_FALSE(p1->pool_wake);
+	EXPECT_FALSE(p3->pool_wake);
+	pubnub_pool_timercb(pool->curlm, -1, pool);
+	EXPECT_LT(0, timeoutMs);
+	EXPECT_GE(101, timeoutMs);
+
+	/* Once it got its token, it is off the list. */
+	size_t n = curlRequests.size();
+	p2->rate_at -= 200;
+	p2->rate_wake = pubnub_now_ms();
+	pubnub_pool_event_timeoutcb(p1, pool);
+	EXPECT_EQ(n + 1, curlRequests.size());
+	EXPECT_EQ(0, pubnub_publish_queue_depth(p2));
+	EXPECT_TRUE(pool->wake == NULL);
+	EXPECT_FALSE(p2->pool_wake);
+
+	/* A member leaving unlinks itself. */
+	pubnub_publish_enqueue(p2, "ch", msg, -1, NULL, NULL);
+	EXPECT_TRUE(pool->wake == p2);
+	pubnub_done(p2);
+	EXPECT_TRUE(pool->wake == NULL);
+	json_object_put(msg);
+	pubnub_pool_done(pool);
+}
+
+TEST_F(PubnubTest, SharedConfig) {
+	struct pubnub_config *config = pubnub_config_new("publish_key", "subscribe_key");
+	const char pem[] = "not really a certificate";
+	pubnub_config_set_origin(config, "http://example.com");
+	pubnub_config_set_cipher_key(config, "enigma");
+	pubnub_config_set_ssl_cacerts(config, pem, strlen(pem));
+	struct pubnub_pool *pool = pubnub_pool_init(&cb, NULL);
+	struct pubnub *p1 = pubnub_init_config(config, pool, NULL, NULL);
+	struct pubnub *p2 = pubnub_init_config(config, NULL, &cb, NULL);
+	pubnub_config_done(config);
+	EXPECT_EQ(2, config->refs);
+	EXPECT_TRUE(p1->curlm == pool->curlm);
+	EXPECT_TRUE(p2->curlm != pool->curlm);
+
+	EXPECT_TRUE(p1->subscribe_key_enc == p2->subscribe_key_enc);
+	EXPECT_TRUE(p1->origin == p2->origin);
+	EXPECT_TRUE(p1->curl_headers == p2->curl_headers);
+	EXPECT_TRUE(p1->ssl_cacerts == p2->ssl_cacerts);
+	EXPECT_EQ(3, p1->ssl_cacerts->refs);
+	EXPECT_TRUE(p1->cipher != NULL);
+	EXPECT_TRUE(p1->cipher != p2->cipher);
+	EXPECT_TRUE(p1->url == NULL);
+
+	/* A setter gives the context its own copy. */
+	pubnub_set_origin(p2, "http://example.org");
+	EXPECT_STREQ("http://example.com", p1->origin);
+	EXPECT_STREQ("http://example.org", p2->origin);
+
+	pubnub_time(p1, -1, NULL, NULL);
+	ASSERT_TRUE(p1->url != NULL);
+	EXPECT_EQ(0, strncmp("http://example.com/time/0", p1->url->buf, 25));
+	char resp[] = "[1]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p1);
+	pubnub_connection_finished(p1, CURLE_OK, true);
+	EXPECT_TRUE(p1->url == NULL);
+
+	pubnub_done(p2);
+	EXPECT_EQ(1, config->refs);
+	pubnub_done(p1);
+	pubnub_pool_done(pool);
+}
+
 TEST_F(PubnubTest, Subscribe) {
 	ASSERT_TRUE(curlInit);
 	pubnub_subscribe(p, "channel", -1, NULL, NULL);
@@ -247,8 +1975,10 @@ TEST_F(PubnubTest, Unsubscribe) {
 	ASSERT_TRUE(curlInit);
 	const char *channel = "channel";
 	pubnub_subscribe(p, channel, -1, NULL, NULL);
+	/* Queued up for after the join. */
 	pubnub_unsubscribe(p, &channel, 1, -1, NULL, NULL);
-	EXPECT_EQ(1, p->channelset.n);
+	EXPECT_EQ(0, p->channelset.n);
+	EXPECT_STREQ("join", p->method);
 	pubnub_connection_cancel(p);
 	pubnub_subscribe(p, channel, -1, NULL, NULL);
 	pubnub_unsubscribe(p, &channel, 1, -1, NULL, NULL);
@@ -368,12 +2098,139 @@ TEST_F(PubnubTest, HereNow) {
 	EXPECT_STREQ("http://pubsub.pubnub.com/v2/presence/sub-key/subscribe_key/channel/channel?pnsdk=c-generic/1.0", curlRequests.back().c_str());
 }
 
+static struct json_object *presenceResponse;
+
+static void
+presenceCb(struct pubnub *p, enum pubnub_res result, struct json_object *response, void *ctx_data, void *call_data)
+{
+	if (presenceResponse)
+		json_object_put(presenceResponse);
+	presenceResponse = result == PNR_OK ? json_object_get(response) : NULL;
+}
+
+TEST_F(PubnubTest, PresenceCache) {
+	ASSERT_TRUE(curlInit);
+	pubnub_set_presence_cache(p, 60000);
+	pubnub_here_now(p, "ch", -1, presenceCb, NULL);
+	ASSERT_EQ(1u, curlRequests.size());
+	char resp[] = "{\"status\": 200, \"occupancy\": 2, \"uuids\": [\"a\", \"b\"]}";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	ASSERT_TRUE(presenceResponse != NULL);
+	EXPECT_EQ(2, json_object_get_int(json_object_object_get(presenceResponse, "occupancy")));
+
+	/* Served from the cache now. */
+	json_object_put(presenceResponse);
+	presenceResponse = NULL;
+	pubnub_here_now(p, "ch", -1, presenceCb, NULL);
+	EXPECT_EQ(1u, curlRequests.size());
+	ASSERT_TRUE(presenceResponse != NULL);
+	EXPECT_EQ(2, json_object_get_int(json_object_object_get(presenceResponse, "occupancy")));
+	EXPECT_EQ(2, json_object_array_length(json_object_object_get(presenceResponse, "uuids")));
+
+	/* Presence events keep it up to date. */
+	pubnub_subscribe(p, "ch-pnpres", -1, subCb, NULL);
+	char join[] = "[[],\"1\"]";
+	pubnub_http_inputcb(join, strlen(join), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	char events[] = "[[{\"action\": \"join\", \"uuid\": \"c\", \"occupancy\": 3},"
+		"{\"action\": \"leave\", \"uuid\": \"a\", \"occupancy\": 2},"
+		"{\"action\": \"join\", \"uuid\": \"d\", \"occupancy\": 3}],"
+		"\"2\",\"ch-pnpres,ch-pnpres,other-pnpres\"]";
+	pubnub_http_inputcb(events, strlen(events), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	ASSERT_TRUE(cbCalled);
+	for (int i = 0; cbChannels[i]; i++)
+		free(cbChannels[i]);
+	free(cbChannels);
+	pubnub_here_now(p, "ch", -1, presenceCb, NULL);
+	ASSERT_TRUE(presenceResponse != NULL);
+	EXPECT_EQ(2, json_object_get_int(json_object_object_get(presenceResponse, "occupancy")));
+	struct json_object *uuids = json_object_object_get(presenceResponse, "uuids");
+	ASSERT_EQ(2, json_object_array_length(uuids));
+	std::string u0 = json_object_get_string(json_object_array_get_idx(uuids, 0));
+	std::string u1 = json_object_get_string(json_object_array_get_idx(uuids, 1));
+	EXPECT_TRUE((u0 == "b" && u1 == "c") || (u0 == "c" && u1 == "b"));
+
+	/* Past the TTL, the channel is queried again. */
+	curlRequests.clear();
+	p->presence[0].fetched_at -= 60000;
+	pubnub_here_now(p, "ch", -1, presenceCb, NULL);
+	EXPECT_EQ(1u, curlRequests.size());
+	json_object_put(presenceResponse);
+	presenceResponse = NULL;
+}
+
 TEST_F(PubnubTest, Time) {
 	ASSERT_TRUE(curlInit);
 	pubnub_time(p, -1, NULL, NULL);
 	EXPECT_STREQ("http://pubsub.pubnub.com/time/0?pnsdk=c-generic/1.0", curlRequests.back().c_str());
 }
 
+TEST_F(PubnubTest, ClockOffset) {
+	const long long server_ns = 13983273523470477LL * 100;
+	ASSERT_TRUE(curlInit);
+	EXPECT_EQ(0, pubnub_now(p));
+	EXPECT_TRUE(curlRequests.empty());
+
+	pubnub_time(p, -1, NULL, NULL);
+	char resp[] = "[13983273523470477]";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	long long now = pubnub_now(p);
+	EXPECT_LE(server_ns, now);
+	EXPECT_GT(server_ns + 1000000000LL, now);
+
+	/* A join is a sample too, but not a later subscribe, whose
+	 * timetoken may be that of an old message. */
+	pubnub_subscribe(p, "ch", -1, subCb, NULL);
+	char join[] = "[[],\"23983273523470477\"]";
+	pubnub_http_inputcb(join, strlen(join), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	const long long join_ns = 23983273523470477LL * 100;
+	EXPECT_LE(join_ns, pubnub_now(p));
+	char sub[] = "[[1],\"13983273523470477\",\"ch\"]";
+	pubnub_http_inputcb(sub, strlen(sub), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	EXPECT_LE(join_ns, pubnub_now(p));
+	ASSERT_TRUE(cbCalled);
+	free(cbChannels[0]);
+	free(cbChannels);
+	pubnub_unsubscribe(p, NULL, 0, -1, NULL, NULL);
+
+	/* Background sync through a side request, just one at a time. */
+	struct pubnub *q = pubnub_init("demo", "demo", p->cb, p->cb_data);
+	pubnub_set_clock_sync(q, 1000);
+	curlRequests.clear();
+	EXPECT_EQ(0, pubnub_now(q));
+	ASSERT_EQ(1u, curlRequests.size());
+	EXPECT_STREQ("http://pubsub.pubnub.com/time/0?pnsdk=c-generic/1.0", curlRequests.back().c_str());
+	EXPECT_EQ(0, pubnub_now(q));
+	EXPECT_EQ(1u, curlRequests.size());
+	struct pubnub_req *req = q->reqs;
+	ASSERT_TRUE(req != NULL);
+	pubnub_req_inputcb(resp, strlen(resp), 1, req);
+	pubnub_req_finished(q, req->curl, CURLE_OK);
+	EXPECT_LE(server_ns, pubnub_now(q));
+	EXPECT_EQ(1u, curlRequests.size());
+	pubnub_done(q);
+}
+
+TEST(UrlTest, Escape) {
+	struct printbuf *pb = printbuf_new();
+	const char *strs[] = { "", "abc-._~XYZ019", "a b", "{\"str\": \"t\u00e9st\"}/,?&=%+",
+		"\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9x" };
+	for (unsigned i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+		printbuf_reset(pb);
+		pubnub_url_escape(pb, strs[i]);
+		printbuf_memappend_fast(pb, "", 1);
+		char *exp = curl_easy_escape(NULL, strs[i], strlen(strs[i]));
+		EXPECT_STREQ(exp, pb->buf);
+		curl_free(exp);
+	}
+	printbuf_free(pb);
+}
+
 TEST(ChannelSetTest, AddRemove) {
 	struct channelset cs = {NULL, 0};
 	EXPECT_EQ(0, channelset_add(&cs, &cs));
@@ -395,6 +2252,60 @@ TEST(ChannelSetTest, AddRemove) {
 	channelset_done(&cs3);
 }
 
+TEST(ChannelSetTest, Hashed) {
+	char names[200][8];
+	const char *ch[200];
+	for (int i = 0; i < 200; i++) {
+		sprintf(names[i], "ch%d", i);
+		ch[i] = names[i];
+	}
+	struct channelset cs = {NULL, 0};
+	struct channelset csa = {ch, 100};
+	EXPECT_EQ(100, channelset_add(&cs, &csa));
+	EXPECT_TRUE(cs.hash != NULL);
+	struct channelset csb = {ch + 50, 150};
+	EXPECT_EQ(100, channelset_add(&cs, &csb));
+	EXPECT_EQ(200, cs.n);
+
+	/* Remove every third channel and check the rest is still found. */
+	const char *rm[67];
+	int rm_n = 0;
+	for (int i = 0; i < 200; i += 3)
+		rm[rm_n++] = ch[i];
+	struct channelset csr = {rm, rm_n};
+	EXPECT_EQ(rm_n, channelset_rm(&cs, &csr));
+	EXPECT_EQ(0, channelset_rm(&cs, &csr));
+	EXPECT_EQ(200 - rm_n, cs.n);
+	for (int i = 0; i < 200; i++) {
+		int idx = channelset_find(&cs, ch[i]);
+		if (i % 3 == 0) {
+			EXPECT_EQ(-1, idx);
+		} else {
+			ASSERT_LE(0, idx);
+			EXPECT_STREQ(ch[i], cs.set[idx]);
+		}
+	}
+	channelset_done(&cs);
+}
+
+TEST(ChannelSetTest, CachedString) {
+	const char *ch[] = {"a b", "c"};
+	struct channelset cs = {NULL, 0};
+	struct channelset cs1 = {ch, 2};
+	channelset_add(&cs, &cs1);
+	const char *enc;
+	const char *str = channelset_str(&cs, &enc);
+	EXPECT_STREQ("a b,c", str);
+	EXPECT_STREQ("a%20b%2Cc", enc);
+	const char *enc2;
+	EXPECT_EQ(str, channelset_str(&cs, &enc2));
+	EXPECT_EQ(enc, enc2);
+	struct channelset cs2 = {ch, 1};
+	channelset_rm(&cs, &cs2);
+	EXPECT_STREQ("c", channelset_str(&cs, &enc));
+	channelset_done(&cs);
+}
+
 TEST_F(PubnubTest, SubscribeHttpCbWithError) {
 	struct pubnub_subscribe_cb_http_data *http_data = (struct pubnub_subscribe_cb_http_data *)calloc(1, sizeof(*http_data));
 	http_data->cb = subCb;
@@ -570,5 +2481,55 @@ TEST_F(PubnubTest, Serialization) {
 	EXPECT_STREQ(uuid, ps->uuid);
 }
 
+TEST_F(PubnubTest, Checkpoint) {
+	pubnub_set_secret_key(p, "secret_key");
+	pubnub_set_uuid(p, "uuid");
+	pubnub_set_origin(p, "https://test.origin");
+
+	ASSERT_TRUE(curlInit);
+	const char *channels[] = {"ch_1", "ch_2"};
+	pubnub_subscribe_multi(p, channels, 2, -1, NULL, NULL);
+	curlRequests.pop_back();
+	char resp[] = "[[],'SAVED_TIMETOKEN']";
+	pubnub_http_inputcb(resp, strlen(resp), 1, p);
+	pubnub_connection_finished(p, CURLE_OK, false);
+	curlRequests.clear();
+
+	struct pubnub *q = pubnub_init("other_pub", "other_sub", p->cb, p->cb_data);
+	char path[] = "/tmp/pubnubtest-checkpoint-XXXXXX";
+	close(mkstemp(path));
+	struct pubnub *const ctxs[] = { p, q };
+	ASSERT_TRUE(pubnub_checkpoint_write(path, ctxs, 2));
+	pubnub_done(q);
+
+	struct pubnub_checkpoint *cp = pubnub_checkpoint_open(path);
+	ASSERT_TRUE(cp != NULL);
+	EXPECT_EQ(2, pubnub_checkpoint_count(cp));
+	EXPECT_TRUE(pubnub_init_checkpoint(cp, 2, NULL, p->cb, p->cb_data, true) == NULL);
+
+	/* A resumed context sends nothing until the next subscribe,
+	 * which goes right on at the saved timetoken. */
+	struct pubnub *ps = pubnub_init_checkpoint(cp, 0, NULL, p->cb, p->cb_data, true);
+	ASSERT_TRUE(ps != NULL);
+	EXPECT_TRUE(curlRequests.empty());
+	q = pubnub_init_checkpoint(cp, 1, NULL, p->cb, p->cb_data, false);
+	pubnub_checkpoint_close(cp);
+	EXPECT_STREQ("secret_key", ps->secret_key);
+	EXPECT_STREQ("uuid", ps->uuid);
+	EXPECT_STREQ("other_sub", q->subscribe_key);
+	pubnub_subscribe(ps, NULL, -1, NULL, NULL);
+	char *s = GetSubUrl();
+	EXPECT_STREQ("https://test.origin/subscribe/subscribe_key/ch_1%2Cch_2/0/SAVED_TIMETOKEN", s);
+	free(s);
+	pubnub_done(ps);
+	pubnub_done(q);
+
+	/* A truncated checkpoint is refused. */
+	ASSERT_EQ(0, truncate(path, 12));
+	EXPECT_TRUE(pubnub_checkpoint_open(path) == NULL);
+	EXPECT_EQ(EINVAL, errno);
+	unlink(path);
+}
+
 }
 
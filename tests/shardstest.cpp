@@ -0,0 +1,153 @@
+
+#include "gtest.h"
+
+#include <atomic>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <vector>
+
+namespace Test {
+
+#include "../libpubnub/pubnub.h"
+#include "../libpubnub/pubnub-priv.h"
+#include "../libpubnub/pubnub-epoll.h"
+
+#undef PUBNUB_API
+#define PUBNUB_API
+
+#include "../libpubnub/pubnub-shards.c"
+
+#define SHARDS 4
+
+class ShardsTest : public ::testing::Test
+{
+public:
+	struct pubnub_shards *s;
+
+	static pthread_t threads[SHARDS];
+	static std::atomic<int> calls, works, dones, misplaced;
+	static struct pubnub *ctx;
+
+	static void threadCb(struct pubnub_shards *s, int i, void *data)
+	{
+		threads[i] = pthread_self();
+		calls++;
+	}
+
+	static void initCb(struct pubnub_shards *s, int i, void *data)
+	{
+		ctx = pubnub_init_pooled(pubnub_shards_pool(s, i), "demo", "demo");
+		calls++;
+	}
+
+	static void workCb(void *data)
+	{
+		/* Something CPU-heavy. */
+		volatile long x = 0;
+		for (int i = 0; i < 100000; i++)
+			x += i;
+		works++;
+	}
+
+	static void doneCb(struct pubnub_shards *s, int i, void *data)
+	{
+		if (!pthread_equal(threads[i], pthread_self()))
+			misplaced++;
+		dones++;
+	}
+
+	static void submitCb(struct pubnub_shards *s, int i, void *data)
+	{
+		for (int k = 0; k < 100; k++)
+			pubnub_shards_work(s, i, workCb, doneCb, NULL);
+	}
+
+	static bool waitFor(std::atomic<int> &v, int n)
+	{
+		for (int i = 0; i < 5000 && v < n; i++)
+			usleep(1000);
+		return v == n;
+	}
+
+	virtual void SetUp() {
+		s = pubnub_shards_init(SHARDS, false);
+		calls = works = dones = misplaced = 0;
+		ctx = NULL;
+	}
+	virtual void TearDown() {
+		pubnub_shards_done(s);
+	}
+};
+
+pthread_t ShardsTest::threads[SHARDS];
+std::atomic<int> ShardsTest::calls, ShardsTest::works, ShardsTest::dones, ShardsTest::misplaced;
+struct pubnub *ShardsTest::ctx;
+
+TEST_F(ShardsTest, Pick) {
+	ASSERT_TRUE(s != NULL);
+	EXPECT_EQ(SHARDS, pubnub_shards_count(s));
+
+	int counts[SHARDS] = { 0 };
+	std::vector<int> picks;
+	for (int k = 0; k < 1000; k++) {
+		char key[16];
+		snprintf(key, sizeof(key), "ch%d", k);
+		int i = pubnub_shards_pick(s, key);
+		ASSERT_TRUE(i >= 0 && i < SHARDS);
+		EXPECT_EQ(i, pubnub_shards_pick(s, key));
+		counts[i]++;
+		picks.push_back(i);
+	}
+	for (int i = 0; i < SHARDS; i++)
+		EXPECT_LT(150, counts[i]);
+
+	/* One more shard takes its share of keys from the others, and
+	 * nothing moves between them. */
+	struct pubnub_shards more = *s;
+	more.n = SHARDS + 1;
+	int moved = 0;
+	for (int k = 0; k < 1000; k++) {
+		char key[16];
+		snprintf(key, sizeof(key), "ch%d", k);
+		int i = pubnub_shards_pick(&more, key);
+		if (i != picks[k]) {
+			EXPECT_EQ(SHARDS, i);
+			moved++;
+		}
+	}
+	EXPECT_LT(100, moved);
+	EXPECT_GT(300, moved);
+}
+
+TEST_F(ShardsTest, Call) {
+	for (int i = 0; i < SHARDS; i++)
+		pubnub_shards_call(s, i, threadCb, NULL);
+	ASSERT_TRUE(waitFor(calls, SHARDS));
+	for (int i = 0; i < SHARDS; i++) {
+		EXPECT_FALSE(pthread_equal(threads[i], pthread_self()));
+		for (int j = 0; j < i; j++)
+			EXPECT_FALSE(pthread_equal(threads[i], threads[j]));
+	}
+
+	/* Contexts are created on the shard and go away with it. */
+	pubnub_shards_call(s, 2, initCb, NULL);
+	ASSERT_TRUE(waitFor(calls, SHARDS + 1));
+	ASSERT_TRUE(ctx != NULL);
+	EXPECT_TRUE(ctx->pool == pubnub_shards_pool(s, 2));
+}
+
+TEST_F(ShardsTest, Work) {
+	for (int i = 0; i < SHARDS; i++)
+		pubnub_shards_call(s, i, threadCb, NULL);
+	ASSERT_TRUE(waitFor(calls, SHARDS));
+
+	/* The work is spread, the results come back home. */
+	pubnub_shards_call(s, 1, submitCb, NULL);
+	ASSERT_TRUE(waitFor(dones, 100));
+	EXPECT_EQ(100, works);
+	EXPECT_EQ(0, misplaced);
+}
+
+}
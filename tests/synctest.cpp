@@ -4,6 +4,8 @@
 
 #include "gtest.h"
 
+#include <poll.h>
+
 namespace Test {
 
 #include "../libpubnub/pubnub.h"
@@ -20,6 +22,8 @@ public:
 	pubnub *p;
 	static struct pubnub_sync *sync;
 	static int _nfds;
+	/* Poll for real instead of stopping the wait. */
+	static bool _realPoll;
 	static int poll(struct pollfd *ufds, unsigned int nfds, int timeout);
 	virtual void SetUp();
 	virtual void TearDown();
@@ -38,17 +42,29 @@ int poll(struct pollfd *ufds, int nfds, int timeout)
 
 struct pubnub_sync *SyncTest::sync;
 int SyncTest::_nfds;
+bool SyncTest::_realPoll;
 
 int SyncTest::poll(struct pollfd *ufds, unsigned int nfds, int timeout) {
-	sync->stop = true;
 	_nfds = nfds;
+	if (_realPoll)
+		return ::poll(ufds, nfds, timeout);
+	sync->stop = true;
 	return -1;
 }
 
+static int _timerCalled;
+
+static void
+timerCb(struct pubnub *p, void *cb_data)
+{
+	_timerCalled++;
+}
+
 void SyncTest::SetUp() {
 	sync = pubnub_sync_init();
 	p = pubnub_init("demo", "demo", &pubnub_sync_callbacks, sync);
 	_nfds = 0;
+	_realPoll = false;
 }
 void SyncTest::TearDown() {
 	pubnub_done(p);
@@ -67,6 +83,55 @@ TEST_F(SyncTest, WaitTwoSockets) {
 	EXPECT_EQ(2, _nfds);
 }
 
+TEST_F(SyncTest, NextMessage) {
+	_realPoll = true;
+
+	/* Pretend we have joined and the subscribe has brought
+	 * two messages. */
+	p->channelset.set = (const char **)malloc(sizeof(char *));
+	p->channelset.set[0] = strdup("ch");
+	p->channelset.n = p->channelset.alloc = 1;
+	strcpy(p->time_token, "123");
+	sync->result = PNR_OK;
+	sync->response = json_tokener_parse("[\"a\",\"b\"]");
+	sync->channels = (char **)malloc(3 * sizeof(char *));
+	sync->channels[0] = strdup("ch");
+	sync->channels[1] = strdup("ch2");
+	sync->channels[2] = NULL;
+	sync->batch_new = true;
+
+	const char *channel, *time_token;
+	struct json_object *msg;
+	ASSERT_EQ(PNR_OK, pubnub_sync_next_message(p, sync, -1, &channel, &msg, &time_token));
+	EXPECT_STREQ("a", json_object_get_string(msg));
+	EXPECT_STREQ("ch", channel);
+	EXPECT_STREQ("123", time_token);
+	/* The next subscribe is already underway, without blocking. */
+	EXPECT_TRUE(sync->iter_pending);
+	EXPECT_STREQ("subscribe", p->method);
+	EXPECT_EQ(NULL, sync->response);
+
+	/* Taking the next message drives it.  libcurl asks to be
+	 * called back at once to start a new transfer (our mocks do
+	 * not, so stand in for it), and gets to without waiting. */
+	struct timespec ts = { 0, 1000000 };
+	_timerCalled = 0;
+	pubnub_sync_timeout(p, sync, &ts, timerCb, NULL);
+	ASSERT_EQ(PNR_OK, pubnub_sync_next_message(p, sync, -1, &channel, &msg, NULL));
+	EXPECT_STREQ("b", json_object_get_string(msg));
+	EXPECT_STREQ("ch2", channel);
+	EXPECT_EQ(1, _timerCalled);
+	EXPECT_TRUE(sync->timeout_cb == NULL);
+	EXPECT_TRUE(sync->iter_pending);
+	EXPECT_FALSE(sync->stop);
+
+	/* Cancelling it does not leave the next wait stopped. */
+	pubnub_reset_subscribe(p, false);
+	EXPECT_FALSE(sync->iter_pending);
+	EXPECT_FALSE(sync->stop);
+	EXPECT_EQ(PNR_CANCELLED, sync->result);
+}
+
 TEST_F(SyncTest, StopWait) {
 	sync->stop = false;
 	pubnub_sync_stop_wait(p, p->cb_data);
@@ -0,0 +1,41 @@
+#include "gtest.h"
+
+#include <functional>
+#include <future>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Test {
+
+#include "../libpubnub/pubnub.h"
+#include "../libpubnub/pubnub-priv.h"
+#include "../libpubnub/pubnub-epoll.h"
+#include "../libpubnub/pubnub-sync.h"
+
+#undef PUBNUB_API
+#define PUBNUB_API
+
+#include "../libpubnub-cpp/pubnub-sync.cpp"
+#include "../libpubnub-cpp/pubnub-thread.cpp"
+
+/* No request gets through the curl mocks, so everything is still in
+ * flight or queued when the object goes away. */
+TEST(ThreadTest, Teardown) {
+	PubNub_thread *t = new PubNub_thread("demo", "demo");
+	std::vector<std::future<PubNub_sync_reply> > replies;
+	for (int i = 0; i < 10; i++) {
+		replies.push_back(t->time());
+		replies.push_back(t->history("ch", 10));
+	}
+	t->subscribe("ch", [](enum pubnub_res result, const std::string &channel, json_object *message) { });
+	delete t;
+
+	for (size_t i = 0; i < replies.size(); i++) {
+		ASSERT_EQ(std::future_status::ready, replies[i].wait_for(std::chrono::seconds(0)));
+		EXPECT_EQ(PNR_CANCELLED, replies[i].get().result());
+	}
+}
+
+}